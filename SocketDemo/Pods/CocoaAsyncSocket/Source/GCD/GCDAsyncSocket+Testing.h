@@ -0,0 +1,56 @@
+//  
+//  GCDAsyncSocket+Testing.h
+//  
+//  This file is in the public domain.
+//  
+//  https://github.com/robbiehanson/CocoaAsyncSocket
+//
+
+#import "GCDAsyncSocket.h"
+
+/**
+ * Internal state exposed for tests (and benchmarks) of the socket's behavior.
+ * 
+ * This header is private to the project. It isn't installed with the public headers,
+ * and nothing in it is meant to be relied upon by applications.
+**/
+@interface GCDAsyncSocket (Testing)
+
+/**
+ * Returns the number of bytes the socket currently expects to receive per readable event.
+ * 
+ * This is a moving average of the amount of data available each time the socket became readable.
+ * It starts out at 32 KB, and adapts to the traffic on the connection.
+ * For example, it settles low on a chatty control connection, and high on a bulk transfer.
+ * 
+ * On secure sockets, where the data is still encrypted (and buffered by the SSL/TLS layer),
+ * it sizes the reads, since the socket can't tell how many bytes are available.
+ * Regular sockets always read exactly what the kernel reports as available,
+ * and the estimate sizes the prebuffer segments they read into instead:
+ * with zero-copy reads enabled, slabs are only used while the estimate exceeds a standard segment.
+**/
+@property (atomic, readonly) NSUInteger readSizeEstimate;
+
+/**
+ * Returns the number of heap allocations the socket has made for its read and write packets.
+ * This covers the packets themselves, the buffers they read into (unless you pass one of your own),
+ * their term matchers (and the arrays of them for readDataToAnyOfData:), and the storage of the queues holding them.
+ * 
+ * Completed packets are recycled, along with their term matchers, and the queues only grow when they're full.
+ * A recycled packet reads into its buffer again once you've released the data last read into it.
+ * So once a connection reaches a steady state, this count stops increasing.
+ * 
+ * Nothing else is counted. Reads and writes still allocate, e.g. the data objects handed to the delegate,
+ * the copies of the terms passed to readDataToAnyOfData:, and the blocks dispatched to the delegateQueue.
+**/
+@property (atomic, readonly) NSUInteger packetAllocationCount;
+
+/**
+ * The load of each queue in the listening socket's pool, as NSNumbers:
+ * the number of accepted sockets using that queue that haven't been closed (disconnected) yet.
+ * 
+ * Empty if the socket hasn't created a pool (yet).
+**/
+- (NSArray *)socketQueuePoolLoads;
+
+@end
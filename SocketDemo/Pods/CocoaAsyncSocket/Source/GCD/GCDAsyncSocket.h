@@ -19,6 +19,7 @@
 @class GCDAsyncReadPacket;
 @class GCDAsyncWritePacket;
 @class GCDAsyncSocketPreBuffer;
+@class GCDAsyncSocketTimingWheel;
 
 extern NSString *const GCDAsyncSocketException;
 extern NSString *const GCDAsyncSocketErrorDomain;
@@ -46,6 +47,22 @@ extern NSString *const GCDAsyncSocketSSLDiffieHellmanParameters;
 #define GCDAsyncSocketLoggingContext 65535
 
 
+typedef NS_ENUM(NSInteger, GCDAsyncSocketWritePriority) {
+	GCDAsyncSocketWritePriorityNormal = 0,  // Written in the order they were queued
+	GCDAsyncSocketWritePriorityHigh,        // Written ahead of any normal priority writes that haven't started yet
+};
+
+typedef NS_ENUM(NSInteger, GCDAsyncSocketEventBackend) {
+	GCDAsyncSocketEventBackendDispatchSources = 0,  // A read and a write dispatch source per socket
+	GCDAsyncSocketEventBackendEventLoop,            // Shared kqueue event loop threads
+};
+
+typedef NS_ENUM(NSInteger, GCDAsyncSocketQueuePoolAssignment) {
+	GCDAsyncSocketQueuePoolAssignmentNone = 0,     // Every accepted socket creates its own socketQueue
+	GCDAsyncSocketQueuePoolAssignmentRoundRobin,   // Accepted sockets take turns on the pool's queues
+	GCDAsyncSocketQueuePoolAssignmentLeastLoaded,  // Accepted sockets go to the pool queue with the fewest sockets
+};
+
 typedef NS_ENUM(NSInteger, GCDAsyncSocketError) {
 	GCDAsyncSocketNoError = 0,           // Never used
 	GCDAsyncSocketBadConfigError,        // Invalid configuration
@@ -123,6 +140,38 @@ typedef NS_ENUM(NSInteger, GCDAsyncSocketError) {
 
 @property (atomic, assign, readwrite, getter=isIPv4PreferredOverIPv6) BOOL IPv4PreferredOverIPv6;
 
+/**
+ * Disables Nagle's algorithm (the TCP_NODELAY socket option) when set.
+ * 
+ * With Nagle's algorithm, small writes may be held back until previously sent data is acknowledged,
+ * which combined with delayed acknowledgements on the remote end can stall a request/response protocol.
+ * With noDelay set, data is sent as soon as it's written.
+ * Use beginWriteBatch / endWriteBatch to make sure related writes still go out in as few segments as possible.
+ * 
+ * May be set at any time. The default value is NO.
+ * Sockets accepted by a listening socket start out with its value.
+**/
+@property (atomic, assign, readwrite) BOOL noDelay;
+
+/**
+ * Normally every delegate method is invoked asynchronously on the delegateQueue,
+ * which costs a block copy and a trip through the queue per callback.
+ * 
+ * If the delegateQueue is the socketQueue (as passed to initWithDelegate:delegateQueue:socketQueue:),
+ * delegate methods are instead invoked directly, on the socketQueue, as soon as the socket has something to report.
+ * Setting directDelegateDispatch does the same regardless of the delegateQueue,
+ * meaning the delegate methods are then invoked on the socketQueue instead of the delegateQueue.
+ * Sockets accepted by a listening socket inherit the setting.
+ * 
+ * It's safe to read, write and disconnect from within such a delegate method:
+ * reads and writes are queued up (as always), and a disconnect (or stopStandingRead) takes effect
+ * as soon as the socket is done with whatever it was in the middle of.
+ * Delegate methods invoked directly must not block, as they hold up the socket.
+ * 
+ * The default value is NO.
+**/
+@property (atomic, assign, readwrite) BOOL directDelegateDispatch;
+
 /**
  * User data allows you to associate arbitrary information with the socket.
  * This data is not used internally by socket in any way.
@@ -465,6 +514,30 @@ typedef NS_ENUM(NSInteger, GCDAsyncSocketError) {
             bufferOffset:(NSUInteger)offset
                      tag:(long)tag;
 
+/**
+ * Reads a length-prefixed frame.
+ * That is, a length header of the given size, followed by the number of bytes the header specifies.
+ * The header is an unsigned integer, in either big-endian (network byte order) or little-endian byte order.
+ * 
+ * The delegate is called once, with just the payload of the frame (the header is not included).
+ * A header of zero results in an empty payload.
+ * 
+ * If the timeout value is negative, the read operation will not use a timeout.
+ * 
+ * The buffer for the payload is allocated as soon as the header arrives, based on the length the peer sent.
+ * So if maxLength is zero, frames are limited to 16 MB. Pass a maxLength to allow larger (or smaller) frames.
+ * If the header specifies a frame longer than that, the socket is disconnected with a
+ * GCDAsyncSocketReadMaxedOutError, without any of the payload being read.
+ * 
+ * The headerSize must be 2, 4 or 8.
+ * Otherwise this method does nothing (except maybe print a warning), and the delegate will not be called.
+**/
+- (void)readDataWithLengthHeaderOfSize:(NSUInteger)headerSize
+                             bigEndian:(BOOL)bigEndian
+                             maxLength:(NSUInteger)maxLength
+                           withTimeout:(NSTimeInterval)timeout
+                                   tag:(long)tag;
+
 /**
  * Reads bytes until (and including) the passed "data" parameter, which acts as a separator.
  * 
@@ -596,6 +669,94 @@ typedef NS_ENUM(NSInteger, GCDAsyncSocketError) {
              maxLength:(NSUInteger)length
                    tag:(long)tag;
 
+/**
+ * Reads bytes until (and including) any one of the passed separators.
+ * This is useful for protocols that accept several line endings (e.g. either LF or CRLF).
+ * 
+ * The read ends with whichever separator occurs first in the data.
+ * If several separators end at the same position (e.g. LF and CRLF), the longest one wins.
+ * If the delegate implements socket:didReadData:toTerminatorAtIndex:withTag:,
+ * it's called with the index (within the given array) of the separator that ended the read.
+ * Otherwise socket:didReadData:withTag: is called as usual.
+ * 
+ * If the timeout value is negative, the read operation will not use a timeout.
+ * 
+ * If you pass nil or an empty array, or any of the separators is zero-length,
+ * the method will do nothing (except maybe print a warning), and the delegate will not be called.
+ * 
+ * The same considerations as for readDataToData:withTimeout:tag: apply to each of the separators.
+**/
+- (void)readDataToAnyOfData:(NSArray *)terms withTimeout:(NSTimeInterval)timeout tag:(long)tag;
+
+/**
+ * Reads bytes until (and including) any one of the passed separators.
+ * See readDataToAnyOfData:withTimeout:tag: for how the separator ending the read is picked.
+ * 
+ * If maxLength is zero, no length restriction is enforced.
+ * Otherwise if maxLength bytes are read without completing the read,
+ * it is treated similarly to a timeout - the socket is closed with a GCDAsyncSocketReadMaxedOutError.
+ * 
+ * If you pass a maxLength parameter that is less than the length of any of the separators,
+ * the method will do nothing (except maybe print a warning), and the delegate will not be called.
+**/
+- (void)readDataToAnyOfData:(NSArray *)terms withTimeout:(NSTimeInterval)timeout maxLength:(NSUInteger)length tag:(long)tag;
+
+/**
+ * Reads bytes until (and including) any one of the passed separators.
+ * The bytes will be appended to the given byte buffer starting at the given offset.
+ * The given buffer will automatically be increased in size if needed.
+ * 
+ * See readDataToAnyOfData:withTimeout:maxLength:tag: for the details,
+ * and readDataToData:withTimeout:buffer:bufferOffset:maxLength:tag: for the use of the buffer.
+**/
+- (void)readDataToAnyOfData:(NSArray *)terms
+                withTimeout:(NSTimeInterval)timeout
+                     buffer:(NSMutableData *)buffer
+               bufferOffset:(NSUInteger)offset
+                  maxLength:(NSUInteger)length
+                        tag:(long)tag;
+
+/**
+ * Starts a standing read, which reads one frame after another with the same description,
+ * until stopStandingRead is called (or the socket is closed).
+ * 
+ * A standing read is queued like any other read. Once it becomes the current read,
+ * it calls socket:didReadData:withTag: with the given tag for each frame it reads,
+ * and immediately re-arms itself for the next frame.
+ * So there's no need to issue another read from within the delegate method,
+ * and frames that have already arrived are handed off back to back, without waiting on the delegate.
+ * 
+ * The timeout (if not negative) applies to each frame separately, and restarts after each one.
+ * 
+ * Reads queued behind a standing read won't start until the standing read is stopped.
+ * 
+ * These work just like readDataToData:withTimeout:maxLength:tag:, readDataToLength:withTimeout:tag:
+ * and readDataWithLengthHeaderOfSize:bigEndian:maxLength:withTimeout:tag: respectively.
+**/
+- (void)startStandingReadToData:(NSData *)data
+                    withTimeout:(NSTimeInterval)timeout
+                      maxLength:(NSUInteger)length
+                            tag:(long)tag;
+
+- (void)startStandingReadToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout tag:(long)tag;
+
+- (void)startStandingReadWithLengthHeaderOfSize:(NSUInteger)headerSize
+                                      bigEndian:(BOOL)bigEndian
+                                      maxLength:(NSUInteger)maxLength
+                                    withTimeout:(NSTimeInterval)timeout
+                                            tag:(long)tag;
+
+/**
+ * Stops the standing read (if any) from re-arming itself.
+ * 
+ * If nothing has been read for the next frame yet, the standing read ends right away,
+ * and any reads queued behind it start. Otherwise the frame in progress completes as an ordinary read first.
+ * 
+ * This method may be called from within socket:didReadData:withTag:.
+ * Frames that were read before it takes effect are still delivered to the delegate.
+**/
+- (void)stopStandingRead;
+
 /**
  * Returns progress of the current read, from 0.0 to 1.0, or NaN if no current read (use isnan() to check).
  * The parameters "tag", "done" and "total" will be filled in if they aren't NULL.
@@ -623,6 +784,155 @@ typedef NS_ENUM(NSInteger, GCDAsyncSocketError) {
 **/
 - (void)writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag;
 
+/**
+ * Writes data to the socket with the given priority, and calls the delegate when finished.
+ * 
+ * High priority writes are meant for small, urgent messages (such as heartbeats or cancellations).
+ * They're written in the order they were queued, but ahead of any normal priority writes that haven't started yet.
+ * A normal priority write that's already in progress is finished first,
+ * unless writeSplitLength is set, in which case it makes way at the next split point.
+ * 
+ * Writes queued after startTLS are never written before the TLS upgrade, whatever their priority.
+ * 
+ * Otherwise this method works exactly like writeData:withTimeout:tag:.
+**/
+- (void)writeData:(NSData *)data
+      withTimeout:(NSTimeInterval)timeout
+              tag:(long)tag
+         priority:(GCDAsyncSocketWritePriority)priority;
+
+/**
+ * Allows large normal priority writes to be interrupted by high priority writes.
+ * 
+ * If set, a normal priority write is split at every multiple of this many bytes (counting from its start),
+ * and when high priority writes are waiting, they're written at the next split point.
+ * The interrupted write then picks up where it left off (and its timeout starts over).
+ * 
+ * This interleaves the bytes of different writes on the wire,
+ * so only use it if your protocol sends its bulk data in frames of (a multiple of) this length.
+ * 
+ * The default value is zero, which means writes are never interrupted.
+**/
+@property (atomic, assign, readwrite) NSUInteger writeSplitLength;
+
+/**
+ * Writes the same data to each of the given sockets, and invokes the completion handler once all of them are done.
+ * 
+ * This is meant for fanning out a message to many connections (e.g. publish/subscribe).
+ * The data is copied at most once (if it's mutable), and the resulting buffer is shared by all the sockets.
+ * Sockets that share a socketQueue are handed their writes together, with a single dispatch to that queue.
+ * 
+ * Each socket queues the write just as if writeData:withTimeout:tag: had been called on it,
+ * so each socket's delegate is still notified via socket:didWriteDataWithTag: (if implemented).
+ * 
+ * The completion handler is invoked on the given queue (or the main queue if NULL),
+ * once every socket has either written the data, or failed to
+ * (because it wasn't connected, or was disconnected before the write completed).
+ * It's passed the number of sockets in each case.
+ * 
+ * If you pass in nil or zero-length data, this method does nothing and the completion handler will not be invoked.
+**/
++ (void)writeData:(NSData *)data
+        toSockets:(NSArray *)sockets
+      withTimeout:(NSTimeInterval)timeout
+              tag:(long)tag
+  completionQueue:(dispatch_queue_t)completionQueue
+completionHandler:(void (^)(NSUInteger writtenCount, NSUInteger failedCount))completionHandler;
+
+/**
+ * Writes the given segments to the socket as a single write, and calls the delegate when finished.
+ * 
+ * Use this for messages that are made up of several pieces of data, such as a header, a body and a trailer.
+ * The segments are handed to the kernel together with writev(), so they never have to be concatenated,
+ * and they go out in a single system call. (On a secure (TLS) socket they are concatenated before being encrypted.)
+ * 
+ * The segments array must contain NSData objects. Empty segments are ignored.
+ * If the segments are all empty (or there are none), this method does nothing and the delegate will not be called.
+ * If the timeout value is negative, the write operation will not use a timeout.
+ * 
+ * The write is reported as a whole: the tag identifies all the segments together,
+ * progressOfWriteReturningTag:bytesDone:total: counts the bytes of all the segments,
+ * and socket:didWritePartialDataOfLength:tag: is called as the write progresses across segment boundaries.
+ * 
+ * As with writeData:withTimeout:tag:, the segments are retained, not copied,
+ * so don't alter them while the write is in progress.
+**/
+- (void)writeDataSegments:(NSArray *)segments withTimeout:(NSTimeInterval)timeout tag:(long)tag;
+
+/**
+ * Writes (a range of) the file at the given path to the socket, and calls the delegate when finished.
+ * 
+ * The file is sent with sendfile(), straight from the file system cache,
+ * without its contents being copied into (or mapped into) the application's memory.
+ * On a secure (TLS) socket, the data has to be encrypted first,
+ * so the range of the file is memory mapped when the write begins, and written like any other data.
+ * 
+ * The write starts at the given offset within the file, and includes the given number of bytes.
+ * If the length is zero, everything from the offset to the end of the file is written.
+ * 
+ * If the file can't be opened, or the range doesn't lie within the file (or is empty),
+ * this method returns NO and sets errPtr (if given), and nothing is queued.
+ * If the timeout value is negative, the write operation will not use a timeout.
+ * 
+ * The file is opened when this method is called, and closed once the write is finished.
+ * Progress and completion are reported exactly as they are for writeData:withTimeout:tag:.
+ * 
+ * The file must not shrink while it is being written.
+ * If the socket finds the file to be shorter than the range when it gets to the write,
+ * it disconnects with an error. But on a secure socket, if the file shrinks after the range has been mapped,
+ * reading the missing part of the mapping raises SIGBUS, which terminates the application.
+**/
+- (BOOL)writeFileAtPath:(NSString *)path
+                 offset:(unsigned long long)offset
+                 length:(NSUInteger)length
+            withTimeout:(NSTimeInterval)timeout
+                    tag:(long)tag
+                  error:(NSError **)errPtr;
+
+/**
+ * Groups the writes that follow, up to the matching endWriteBatch, into a batch.
+ * 
+ * Writes issued during a batch are held back (after any write already in progress),
+ * and sent together once the batch ends, with as few system calls as possible.
+ * Combined with noDelay this sends, for example, a response header and body as full-sized segments,
+ * with no delay on the last segment.
+ * 
+ * Batches may be nested, in which case the writes are sent when the outermost batch ends.
+ * Every call to beginWriteBatch must be balanced by a call to endWriteBatch.
+ * Once disconnectAfterWriting (or disconnectAfterReadingAndWriting) is called, writes are no longer held,
+ * even if a batch is still open. So the held writes are sent, and the socket closes.
+ * 
+ * Note: Darwin doesn't flush corked (TCP_NOPUSH) data when the option is cleared,
+ * which is why the writes are held back by the socket itself rather than by the kernel.
+**/
+- (void)beginWriteBatch;
+- (void)endWriteBatch;
+
+/**
+ * Returns the number of bytes that have been queued for writing, but not yet handed to the socket.
+ * That is, the unwritten remainder of the current write, plus the full length of every queued write.
+**/
+@property (atomic, readonly) NSUInteger queuedWriteBytes;
+
+/**
+ * Watermarks for the number of queued write bytes (see queuedWriteBytes), to apply backpressure to producers.
+ * 
+ * When the queued write bytes exceed the high watermark,
+ * the delegate is notified via socket:writeQueueDidExceedHighWatermark:.
+ * Once they drop to (or below) the low watermark,
+ * the delegate is notified via socketWriteQueueDidDrainBelowLowWatermark:.
+ * The notifications alternate, so each crossing is reported exactly once.
+ * 
+ * The low watermark must not exceed the (nonzero) high watermark.
+ * If it's set higher, or the high watermark is set below it, the low watermark is lowered to the high watermark.
+ * 
+ * The default value of both is zero. A high watermark of zero disables the notifications.
+ * If the queue is above the high watermark when they're disabled,
+ * the delegate is notified via socketWriteQueueDidDrainBelowLowWatermark:, so a paused producer resumes.
+**/
+@property (atomic, assign, readwrite) NSUInteger writeQueueHighWatermark;
+@property (atomic, assign, readwrite) NSUInteger writeQueueLowWatermark;
+
 /**
  * Returns progress of the current write, from 0.0 to 1.0, or NaN if no current write (use isnan() to check).
  * The parameters "tag", "done" and "total" will be filled in if they aren't NULL.
@@ -798,6 +1108,105 @@ typedef NS_ENUM(NSInteger, GCDAsyncSocketError) {
 **/
 @property (atomic, assign, readwrite) BOOL autoDisconnectOnClosedReadStream;
 
+/**
+ * Normally, data that arrives ahead of a read request is buffered internally (in the "prebuffer"),
+ * and copied into the read's buffer once the read request is processed.
+ * 
+ * If zero-copy reads are enabled, the socket instead reads into large reference-counted slabs of memory.
+ * When the entire result of a read arrives in one piece, the NSData passed to socket:didReadData:withTag:
+ * is an immutable slice of the slab, and the data is never copied after it leaves the kernel.
+ * This is most useful for large reads, e.g. a 64 KB response that arrives via a single recv.
+ * 
+ * Zero-copy only applies to reads that don't specify their own buffer.
+ * If the result of a read arrives in several pieces, it's assembled in a regular buffer as usual.
+ * 
+ * Keep in mind that a slice keeps its entire slab (256 KB) alive until the slice is deallocated.
+ * If you intend to hold on to the data for a long time, especially small pieces of it, make a copy.
+ * (A connection that typically receives only a few KB at a time, e.g. small control messages,
+ * reads into small pooled segments instead of slabs, and its reads are only zero-copy if they fit in one.)
+ * 
+ * Secure (TLS) sockets decrypt directly into the read's buffer whenever possible,
+ * so zero-copy reads make little difference for them.
+ * 
+ * The default value is NO.
+**/
+@property (atomic, assign, readwrite, getter=isZeroCopyReadsEnabled) BOOL zeroCopyReadsEnabled;
+
+/**
+ * Normally, when there's no read request queued, the socket stops reading,
+ * and incoming data waits in the kernel until the next read request is issued.
+ * The next read then has to wait for the socket to become readable (again) before anything can be delivered.
+ * 
+ * If a read-ahead limit is set, the socket keeps reading while there's no read request queued,
+ * buffering up to the given number of bytes internally.
+ * A request/response client can then complete its next read straight from memory.
+ * Once the limit is reached, the socket stops reading until the next read request is issued.
+ * (The limit may be exceeded by data that arrived ahead of an earlier read, which is buffered as usual.)
+ * 
+ * Read-ahead applies to regular (non-TLS) sockets only.
+ * Secure sockets already decrypt whatever data is available ahead of the next read request.
+ * 
+ * The default value is zero, which disables read-ahead.
+**/
+@property (atomic, assign, readwrite) NSUInteger readAheadLimit;
+
+/**
+ * The timing wheel the connect, read and write timeouts of the socket are registered with.
+ * 
+ * The default is the shared timing wheel (see GCDAsyncSocketTimingWheel).
+ * A wheel with a coarser granularity saves work for servers with very many connections doing timed operations,
+ * at the cost of less precise timeouts.
+ * 
+ * A timeout that is already armed when this changes stays on the previous wheel until it's done.
+**/
+@property (atomic, strong, readwrite) GCDAsyncSocketTimingWheel *timingWheel;
+
+/**
+ * How the socket is notified that it's readable or writable, once connected.
+ * 
+ * By default (GCDAsyncSocketEventBackendDispatchSources), each connected socket gets a read and a write dispatch source,
+ * which are suspended and resumed as the socket's reads and writes come and go.
+ * 
+ * With GCDAsyncSocketEventBackendEventLoop, the socket is instead registered (edge triggered)
+ * with the kqueue of one of a fixed number of event loop threads, each of which looks after its own share of the sockets.
+ * Suspending and resuming then don't involve the kernel at all.
+ * Registrations are batched into the event loop's own kevent() calls,
+ * and the events of sockets that share a socketQueue are handed to that queue together.
+ * This saves a lot of overhead for servers with very many connections.
+ * If the socket can't be registered with an event loop, it falls back to dispatch sources.
+ * 
+ * Either way, all the socket's work, and the delegate callbacks, happen on the usual queues.
+ * 
+ * The backend applies to the next connection. Sockets accepted by a listening socket use its backend.
+**/
+@property (atomic, assign, readwrite) GCDAsyncSocketEventBackend eventBackend;
+
+/**
+ * The number of event loop threads used by GCDAsyncSocketEventBackendEventLoop.
+ * The default is the number of active processors.
+ * 
+ * The threads are started when the first socket uses the event loop backend,
+ * so this must be set before then to take effect.
+**/
++ (void)setEventLoopThreadCount:(NSUInteger)count;
+
+/**
+ * By default, every socket accepted by a listening socket creates its own socketQueue.
+ * With many thousands of connections, that's many thousands of queues.
+ * 
+ * Setting an assignment other than GCDAsyncSocketQueuePoolAssignmentNone on the listening socket
+ * makes it hand out the queues of a fixed pool instead, so many accepted sockets share each queue.
+ * Sockets are assigned to the pool's queues either round-robin, or to the queue with the fewest sockets.
+ * 
+ * The socketQueuePoolSize is the number of queues in the pool. The default (zero) means the number of active processors.
+ * Changing it only affects sockets accepted afterwards.
+ * 
+ * If the delegate implements newSocketQueueForConnectionFromAddress:onSocket:,
+ * the queue it returns takes precedence over the pool.
+**/
+@property (atomic, assign, readwrite) GCDAsyncSocketQueuePoolAssignment socketQueuePoolAssignment;
+@property (atomic, assign, readwrite) NSUInteger socketQueuePoolSize;
+
 /**
  * GCDAsyncSocket maintains thread safety by using an internal serial dispatch_queue.
  * In most cases, the instance creates this queue itself.
@@ -1070,6 +1479,30 @@ typedef NS_ENUM(NSInteger, GCDAsyncSocketError) {
 //Socket开始读取数据的时候调用这个方法：比如ReadData相关的方法
 - (void)socket:(GCDAsyncSocket *)sock didReadData:(NSData *)data withTag:(long)tag;
 
+/**
+ * Called when a socket has completed a readDataToAnyOfData: read.
+ * The index is the position, within the array passed to the read method, of the separator that ended the read.
+ * 
+ * If this method isn't implemented, socket:didReadData:withTag: is called instead.
+**/
+- (void)socket:(GCDAsyncSocket *)sock didReadData:(NSData *)data toTerminatorAtIndex:(NSUInteger)index withTag:(long)tag;
+
+/**
+ * Called when a socket has completed one or more reads, in place of socket:didReadData:withTag:.
+ * The data and tags arrays are in the order the reads were completed (and issued),
+ * with the tags wrapped in NSNumber objects.
+ * 
+ * If this method is implemented, all the reads completed in one pass on the socket's queue
+ * are delivered in a single call, rather than with one call (and one dispatch to the delegateQueue) per read.
+ * This reduces the overhead considerably when a single chunk of received data completes many small reads.
+ * A batch is cut short by any other delegate callback (e.g. socket:didReadPartialDataOfLength:tag:),
+ * so callbacks are still delivered in the order their events happened.
+ * 
+ * Reads issued via readDataToAnyOfData: still go to socket:didReadData:toTerminatorAtIndex:withTag:,
+ * if the delegate implements it.
+**/
+- (void)socket:(GCDAsyncSocket *)sock didReadDataBatch:(NSArray *)dataArray withTags:(NSArray *)tags;
+
 /**
  * Called when a socket has read in data, but has not yet completed the read.
  * This would occur if using readToData: or readToLength: methods.
@@ -1083,6 +1516,28 @@ typedef NS_ENUM(NSInteger, GCDAsyncSocketError) {
 //Socket开始写入数据的时候调用这个方法
 - (void)socket:(GCDAsyncSocket *)sock didWriteDataWithTag:(long)tag;
 
+/**
+ * Called when a socket has completed one or more writes, in place of socket:didWriteDataWithTag:.
+ * The tags are wrapped in NSNumber objects, in the order the writes were completed (and issued).
+ * 
+ * If this method is implemented, all the writes completed in one pass on the socket's queue
+ * are delivered in a single call, rather than with one call (and one dispatch to the delegateQueue) per write.
+**/
+- (void)socket:(GCDAsyncSocket *)sock didWriteDataWithTags:(NSArray *)tags;
+
+/**
+ * Called when the number of bytes queued for writing exceeds the socket's writeQueueHighWatermark.
+ * Producers should stop (or slow down) writing to the socket,
+ * until socketWriteQueueDidDrainBelowLowWatermark: is called.
+**/
+- (void)socket:(GCDAsyncSocket *)sock writeQueueDidExceedHighWatermark:(NSUInteger)queuedBytes;
+
+/**
+ * Called when the number of bytes queued for writing drops to (or below) the socket's writeQueueLowWatermark,
+ * after having exceeded the writeQueueHighWatermark.
+**/
+- (void)socketWriteQueueDidDrainBelowLowWatermark:(GCDAsyncSocket *)sock;
+
 /**
  * Called when a socket has written some data, but has not yet completed the entire write.
  * It may be used to for things such as updating progress bars.
@@ -1183,3 +1638,68 @@ typedef NS_ENUM(NSInteger, GCDAsyncSocketError) {
                                     completionHandler:(void (^)(BOOL shouldTrustPeer))completionHandler;
 
 @end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@class GCDAsyncSocketTimeout;
+
+/**
+ * A GCDAsyncSocketTimingWheel runs the timeouts of any number of sockets off a single dispatch timer.
+ * 
+ * The connect, read and write timeouts of GCDAsyncSocket (and the send timeouts of GCDAsyncUdpSocket)
+ * are all registered with a timing wheel, rather than each getting a dispatch timer of their own.
+ * Arming and disarming a timeout are constant time operations,
+ * and while no timeouts are armed, the wheel doesn't run at all.
+ * 
+ * Timeouts are rounded up to a multiple of the wheel's granularity,
+ * so a timeout fires no earlier than requested, and at most one tick (plus scheduling latency) later.
+ * A coarser granularity means the wheel ticks less often, and more timeouts are coalesced into each tick.
+**/
+@interface GCDAsyncSocketTimingWheel : NSObject
+
+/**
+ * The wheel used by all sockets, unless configured otherwise.
+ * Its granularity is 10 milliseconds.
+**/
++ (GCDAsyncSocketTimingWheel *)sharedTimingWheel;
+
+/**
+ * Creates a wheel with the given granularity, which is rounded up to at least a millisecond.
+**/
+- (instancetype)initWithGranularity:(NSTimeInterval)granularity;
+
+@property (nonatomic, readonly) NSTimeInterval granularity;
+
+/**
+ * Creates a timeout, which invokes the handler on the given (serial) queue whenever it fires.
+ * The timeout starts out disarmed.
+**/
+- (GCDAsyncSocketTimeout *)timeoutWithQueue:(dispatch_queue_t)queue handler:(dispatch_block_t)handler;
+
+@end
+
+/**
+ * A single timeout, registered with a timing wheel.
+ * It may be armed and disarmed any number of times.
+ * 
+ * All of these methods must be invoked on the timeout's queue.
+ * Once disarmed (or re-armed), the timeout is guaranteed not to fire for the previous arming,
+ * even if it had already expired.
+**/
+@interface GCDAsyncSocketTimeout : NSObject
+
+/**
+ * Arms the timeout to fire after the given interval, replacing any previous arming.
+**/
+- (void)armWithInterval:(NSTimeInterval)interval;
+
+- (void)disarm;
+
+/**
+ * Whether the timeout is armed and hasn't fired yet.
+**/
+@property (nonatomic, readonly) BOOL isArmed;
+
+@end
@@ -9,6 +9,7 @@
 //
 
 #import "GCDAsyncSocket.h"
+#import "GCDAsyncSocket+Testing.h"
 
 #if TARGET_OS_IPHONE
 #import <CFNetwork/CFNetwork.h>
@@ -18,16 +19,31 @@
 #import <arpa/inet.h>
 #import <fcntl.h>
 #import <ifaddrs.h>
+#import <mach/mach_time.h>
 #import <netdb.h>
 #import <netinet/in.h>
+#import <netinet/tcp.h>
 #import <net/if.h>
+#import <pthread.h>
+#import <stdatomic.h>
 #import <sys/socket.h>
 #import <sys/types.h>
+#import <sys/event.h>
 #import <sys/ioctl.h>
+#import <sys/mman.h>
 #import <sys/poll.h>
+#import <sys/stat.h>
 #import <sys/uio.h>
 #import <unistd.h>
 
+#if defined(__AVX2__)
+#import <immintrin.h>
+#elif defined(__SSE2__)
+#import <emmintrin.h>
+#elif defined(__ARM_NEON)
+#import <arm_neon.h>
+#endif
+
 #if ! __has_feature(objc_arc)
 #warning This file must be compiled with ARC. Use -fobjc-arc flag (or convert project to ARC).
 // For more information see: https://github.com/robbiehanson/CocoaAsyncSocket/wiki/ARC
@@ -152,6 +168,7 @@ enum GCDAsyncSocketFlags
 	kUsingCFStreamForTLS           = 1 << 18,  // If set, we're forced to use CFStream instead of SecureTransport
 	kSecureSocketHasBytesAvailable = 1 << 19,  // If set, CFReadStream has notified us of bytes available
 #endif
+	kWriteQueueAboveHighWatermark  = 1 << 20,  // If set, queued write bytes exceeded the high watermark
 };
 
 enum GCDAsyncSocketConfig
@@ -160,8 +177,33 @@ enum GCDAsyncSocketConfig
 	kIPv6Disabled              = 1 << 1,  // If set, IPv6 is disabled
 	kPreferIPv6                = 1 << 2,  // If set, IPv6 is preferred over IPv4
 	kAllowHalfDuplexConnection = 1 << 3,  // If set, the socket will stay open even if the read stream closes
+	kZeroCopyReads             = 1 << 4,  // If set, completed reads may be slices of the prebuffer
+	kNoDelay                   = 1 << 5,  // If set, Nagle's algorithm is disabled (TCP_NODELAY)
+	kDirectDelegateDispatch    = 1 << 6,  // If set, delegate methods are invoked directly on the socketQueue
 };
 
+/**
+ * Reads of unknown length are sized using a moving average of the number of bytes
+ * that were available each time the readSource fired.
+ * Each new sample moves the estimate 1/(2^shift) of the way towards it.
+**/
+#define GCDAsyncSocketReadSizeEstimateInitial  (1024 * 32)
+#define GCDAsyncSocketReadSizeEstimateMin      (1024 * 1)
+#define GCDAsyncSocketReadSizeEstimateMax      (1024 * 1024)
+#define GCDAsyncSocketReadSizeEstimateShift    3
+
+/**
+ * The payload buffer of a framed read is sized as soon as the length header (which comes from the peer) arrives.
+ * So framed reads without a maxLength of their own are held to this one.
+**/
+#define GCDAsyncSocketFrameLengthDefaultMax  (1024 * 1024 * 16)
+
+/**
+ * A recycled read packet keeps the buffer it allocated for its last read, to read into again.
+ * Unless the read left it larger than this, in which case it's let go.
+**/
+#define GCDAsyncSocketPacketBufferReuseLimit  (1024 * 64)
+
 #if TARGET_OS_IPHONE
   static NSThread *cfstreamThread;  // Used for CFStreams
 
@@ -183,646 +225,863 @@ enum GCDAsyncSocketConfig
  * In other words, a large chunk of data is written is written to the prebuffer.
  * The prebuffer is then drained via a series of one or more reads (for subsequent read request(s)).
  * 
- * A ring buffer was once used for this purpose.
- * But a ring buffer takes up twice as much memory as needed (double the size for mirroring).
- * In fact, it generally takes up more than twice the needed size as everything has to be rounded up to vm_page_size.
- * And since the prebuffer is always completely drained after being written to, a full ring buffer isn't needed.
+ * The prebuffer used to be a single buffer that was grown via realloc as needed.
+ * But it never shrank, so a single large burst of data would pin that memory for the life of the socket.
+ * 
+ * Instead, the data is now stored in a list of segments.
+ * Segments are normally a fixed size (4 KB), and are recycled via a pool shared by all sockets.
+ * Larger segments are only used when a single contiguous write requires it (e.g. SSLRead),
+ * and these are freed as soon as they're drained.
+ * 
+ * The shrink policy is simple:
+ * - When the prebuffer is drained, it hands all but one of its segments back to the pool.
+ * - When the socket is idle (no read in progress), the prebuffer hands back its last segment too.
+ * - The pool itself holds at most a fixed number of segments (its high-water mark), and frees the rest.
+ * 
+ * So after a burst, memory usage quickly returns to a small steady state.
+ * 
+ * Segments are reference counted, so completed reads can be handed out as slices of a segment,
+ * rather than copied (see zeroCopyReadsEnabled). A segment isn't reused until every slice of it is released.
+ * When zero-copy reads are enabled, the prebuffer uses large slabs instead of standard size segments,
+ * so that whatever a single socket read returns ends up in one contiguous piece of memory.
+ * Slabs are recycled via a (smaller) pool of their own. A drained prebuffer never keeps a slab,
+ * since the slices handed out usually still reference it, and otherwise another socket can use it.
+**/
+
+typedef struct GCDAsyncSocketPreBufferSegment
+{
+	struct GCDAsyncSocketPreBufferSegment *next;
+	
+	atomic_int refCount;
+	
+	size_t capacity;
+	size_t readOffset;
+	size_t writeOffset;
+	
+	uint8_t bytes[];
+	
+} GCDAsyncSocketPreBufferSegment;
+
+#define GCDAsyncSocketPreBufferSegmentSize     (1024 * 4)  // Size of pooled segments, including the header
+#define GCDAsyncSocketPreBufferPoolHighWater   256         // Max number of segments kept in the pool (1 MB)
+#define GCDAsyncSocketPreBufferMaxReadVectors  32          // Max number of segments filled by a single readv()
+#define GCDAsyncSocketPreBufferSlabCapacity    (1024 * 256)  // Capacity of segments used for zero-copy reads
+#define GCDAsyncSocketPreBufferSlabPoolHighWater 16          // Max number of slabs kept in the slab pool (4 MB)
+
+#define GCDAsyncSocketPreBufferSegmentCapacity (GCDAsyncSocketPreBufferSegmentSize - sizeof(GCDAsyncSocketPreBufferSegment))
+
+static pthread_mutex_t preBufferPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static GCDAsyncSocketPreBufferSegment *preBufferPool;
+static NSUInteger preBufferPoolCount;
+static GCDAsyncSocketPreBufferSegment *preBufferSlabPool;
+static NSUInteger preBufferSlabPoolCount;
+
+/**
+ * Returns an empty segment with at least the given capacity, and a reference count of one.
+ * Segments of the standard capacity, and slabs, come from their pools when possible.
+ * Returns NULL if the memory couldn't be allocated.
+**/
+static GCDAsyncSocketPreBufferSegment * GCDAsyncSocketPreBufferSegmentCreate(size_t capacity)
+{
+	GCDAsyncSocketPreBufferSegment *segment = NULL;
+	
+	if (capacity <= GCDAsyncSocketPreBufferSegmentCapacity)
+	{
+		capacity = GCDAsyncSocketPreBufferSegmentCapacity;
+		
+		pthread_mutex_lock(&preBufferPoolMutex);
+		
+		segment = preBufferPool;
+		if (segment)
+		{
+			preBufferPool = segment->next;
+			preBufferPoolCount--;
+		}
+		
+		pthread_mutex_unlock(&preBufferPoolMutex);
+	}
+	else if (capacity == GCDAsyncSocketPreBufferSlabCapacity)
+	{
+		pthread_mutex_lock(&preBufferPoolMutex);
+		
+		segment = preBufferSlabPool;
+		if (segment)
+		{
+			preBufferSlabPool = segment->next;
+			preBufferSlabPoolCount--;
+		}
+		
+		pthread_mutex_unlock(&preBufferPoolMutex);
+	}
+	
+	if (segment == NULL)
+	{
+		segment = malloc(sizeof(GCDAsyncSocketPreBufferSegment) + capacity);
+		if (segment == NULL) return NULL;
+		
+		segment->capacity = capacity;
+	}
+	
+	segment->next = NULL;
+	segment->readOffset = 0;
+	segment->writeOffset = 0;
+	
+	atomic_init(&segment->refCount, 1);
+	
+	return segment;
+}
+
+static void GCDAsyncSocketPreBufferSegmentRetain(GCDAsyncSocketPreBufferSegment *segment)
+{
+	atomic_fetch_add_explicit(&segment->refCount, 1, memory_order_relaxed);
+}
+
+/**
+ * Once the last reference is released,
+ * returns the segment (or slab) to its pool, or frees it if it's oversized or the pool is full.
  * 
- * The current design is very simple and straight-forward, while also keeping memory requirements lower.
+ * This method may be called from any thread (slices are released wherever the delegate releases them).
 **/
+static void GCDAsyncSocketPreBufferSegmentRelease(GCDAsyncSocketPreBufferSegment *segment)
+{
+	if (atomic_fetch_sub_explicit(&segment->refCount, 1, memory_order_acq_rel) != 1)
+	{
+		return;
+	}
+	
+	if (segment->capacity == GCDAsyncSocketPreBufferSegmentCapacity)
+	{
+		pthread_mutex_lock(&preBufferPoolMutex);
+		
+		if (preBufferPoolCount < GCDAsyncSocketPreBufferPoolHighWater)
+		{
+			segment->next = preBufferPool;
+			preBufferPool = segment;
+			preBufferPoolCount++;
+			
+			segment = NULL;
+		}
+		
+		pthread_mutex_unlock(&preBufferPoolMutex);
+	}
+	else if (segment->capacity == GCDAsyncSocketPreBufferSlabCapacity)
+	{
+		pthread_mutex_lock(&preBufferPoolMutex);
+		
+		if (preBufferSlabPoolCount < GCDAsyncSocketPreBufferSlabPoolHighWater)
+		{
+			segment->next = preBufferSlabPool;
+			preBufferSlabPool = segment;
+			preBufferSlabPoolCount++;
+			
+			segment = NULL;
+		}
+		
+		pthread_mutex_unlock(&preBufferPoolMutex);
+	}
+	
+	if (segment)
+	{
+		free(segment);
+	}
+}
 
 @interface GCDAsyncSocketPreBuffer : NSObject
 {
-	uint8_t *preBuffer;
-	size_t preBufferSize;
+	GCDAsyncSocketPreBufferSegment *head;         // Contains the next bytes to be read
+	GCDAsyncSocketPreBufferSegment *writeSegment; // Contains the next space to be written to
+	GCDAsyncSocketPreBufferSegment *tail;         // Segments after the writeSegment are always empty
 	
-	uint8_t *readPointer;
-	uint8_t *writePointer;
+	size_t availableBytes;
+	size_t segmentCapacity;
 }
 
-- (id)initWithCapacity:(size_t)numBytes;
+- (size_t)segmentCapacity;
+- (void)setSegmentCapacity:(size_t)capacity;
 
-- (void)ensureCapacityForWrite:(size_t)numBytes;
+- (BOOL)ensureCapacityForWrite:(size_t)numBytes;
 
 - (size_t)availableBytes;
-- (uint8_t *)readBuffer;
 
 - (void)getReadBuffer:(uint8_t **)bufferPtr availableBytes:(size_t *)availableBytesPtr;
+- (void)enumerateReadBuffersUsingBlock:(void (^)(const uint8_t *buffer, size_t length, BOOL *stop))block;
+
+- (void)readBytes:(uint8_t *)buffer length:(size_t)length;
+- (NSData *)sliceWithLength:(size_t)length;
 
-- (size_t)availableSpace;
 - (uint8_t *)writeBuffer;
 
-- (void)getWriteBuffer:(uint8_t **)bufferPtr availableSpace:(size_t *)availableSpacePtr;
+- (int)getWriteVectors:(struct iovec *)iov count:(int)iovcnt length:(size_t *)lengthPtr;
+
+- (BOOL)prependBytes:(const uint8_t *)bytes length:(size_t)length;
 
 - (void)didRead:(size_t)bytesRead;
 - (void)didWrite:(size_t)bytesWritten;
 
+- (void)shrink;
 - (void)reset;
 
 @end
 
 @implementation GCDAsyncSocketPreBuffer
 
-- (id)initWithCapacity:(size_t)numBytes
+- (id)init
 {
 	if ((self = [super init]))
 	{
-		preBufferSize = numBytes;
-		preBuffer = malloc(preBufferSize);
-		
-		readPointer = preBuffer;
-		writePointer = preBuffer;
+		segmentCapacity = GCDAsyncSocketPreBufferSegmentCapacity;
 	}
 	return self;
 }
 
 - (void)dealloc
 {
-	if (preBuffer)
-		free(preBuffer);
+	[self releaseSegmentsKeepingOne:NO];
 }
 
-- (void)ensureCapacityForWrite:(size_t)numBytes
+/**
+ * Hands segments back to the pool.
+ * This method is only called when the prebuffer is empty.
+**/
+- (void)releaseSegmentsKeepingOne:(BOOL)keepOne
 {
-	size_t availableSpace = [self availableSpace];
+	GCDAsyncSocketPreBufferSegment *segment = head;
+	GCDAsyncSocketPreBufferSegment *kept = NULL;
+	
+	// A segment can only be reused if nobody else holds a slice of it.
+	// Slabs aren't kept, but go back to the slab pool where any socket can pick them up.
 	
-	if (numBytes > availableSpace)
+	if (keepOne && segment && (segment->capacity == GCDAsyncSocketPreBufferSegmentCapacity) &&
+	    (segmentCapacity == GCDAsyncSocketPreBufferSegmentCapacity) &&
+	    (atomic_load_explicit(&segment->refCount, memory_order_acquire) == 1))
 	{
-		size_t additionalBytes = numBytes - availableSpace;
-		
-		size_t newPreBufferSize = preBufferSize + additionalBytes;
-		uint8_t *newPreBuffer = realloc(preBuffer, newPreBufferSize);
-		
-		size_t readPointerOffset = readPointer - preBuffer;
-		size_t writePointerOffset = writePointer - preBuffer;
+		kept = segment;
+		segment = segment->next;
 		
-		preBuffer = newPreBuffer;
-		preBufferSize = newPreBufferSize;
-		
-		readPointer = preBuffer + readPointerOffset;
-		writePointer = preBuffer + writePointerOffset;
+		kept->next = NULL;
+		kept->readOffset = 0;
+		kept->writeOffset = 0;
 	}
+	
+	while (segment)
+	{
+		GCDAsyncSocketPreBufferSegment *next = segment->next;
+		GCDAsyncSocketPreBufferSegmentRelease(segment);
+		segment = next;
+	}
+	
+	head = kept;
+	writeSegment = kept;
+	tail = kept;
+	
+	availableBytes = 0;
 }
 
-- (size_t)availableBytes
-{
-	return writePointer - readPointer;
-}
-
-- (uint8_t *)readBuffer
+- (size_t)segmentCapacity
 {
-	return readPointer;
+	return segmentCapacity;
 }
 
-- (void)getReadBuffer:(uint8_t **)bufferPtr availableBytes:(size_t *)availableBytesPtr
+/**
+ * Sets the capacity of segments added to the prebuffer.
+ * This is either the standard (pooled) capacity, or the slab capacity for zero-copy reads.
+**/
+- (void)setSegmentCapacity:(size_t)capacity
 {
-	if (bufferPtr) *bufferPtr = readPointer;
-	if (availableBytesPtr) *availableBytesPtr = [self availableBytes];
+	segmentCapacity = MAX(capacity, GCDAsyncSocketPreBufferSegmentCapacity);
 }
 
-- (void)didRead:(size_t)bytesRead
+/**
+ * Ensures there are at least numBytes of contiguous space available at the writeBuffer.
+ * Returns NO, leaving the prebuffer unchanged, if a segment couldn't be allocated.
+**/
+- (BOOL)ensureCapacityForWrite:(size_t)numBytes
 {
-	readPointer += bytesRead;
+	if (writeSegment == NULL)
+	{
+		GCDAsyncSocketPreBufferSegment *segment = GCDAsyncSocketPreBufferSegmentCreate(MAX(numBytes, segmentCapacity));
+		if (segment == NULL) return NO;
+		
+		writeSegment = segment;
+		head = writeSegment;
+		tail = writeSegment;
+		return YES;
+	}
+	
+	if ((writeSegment->capacity - writeSegment->writeOffset) >= numBytes)
+	{
+		return YES;
+	}
 	
-	if (readPointer == writePointer)
+	GCDAsyncSocketPreBufferSegment *next = writeSegment->next;
+	
+	if (next && (next->capacity >= numBytes))
 	{
-		// The prebuffer has been drained. Reset pointers.
-		readPointer  = preBuffer;
-		writePointer = preBuffer;
+		// The next segment is empty, and big enough.
+		writeSegment = next;
+		return YES;
 	}
+	
+	GCDAsyncSocketPreBufferSegment *segment = GCDAsyncSocketPreBufferSegmentCreate(MAX(numBytes, segmentCapacity));
+	if (segment == NULL) return NO;
+	
+	segment->next = next;
+	writeSegment->next = segment;
+	
+	if (tail == writeSegment)
+		tail = segment;
+	
+	writeSegment = segment;
+	return YES;
 }
 
-- (size_t)availableSpace
+- (size_t)availableBytes
 {
-	return preBufferSize - (writePointer - preBuffer);
+	return availableBytes;
 }
 
-- (uint8_t *)writeBuffer
+/**
+ * Returns the contiguous bytes available at the start of the prebuffer.
+ * These may be less than the total availableBytes.
+**/
+- (void)getReadBuffer:(uint8_t **)bufferPtr availableBytes:(size_t *)availableBytesPtr
 {
-	return writePointer;
+	GCDAsyncSocketPreBufferSegment *segment = head;
+	
+	while (segment && (segment->readOffset == segment->writeOffset) && (segment != writeSegment))
+	{
+		segment = segment->next;
+	}
+	
+	if (segment)
+	{
+		if (bufferPtr) *bufferPtr = segment->bytes + segment->readOffset;
+		if (availableBytesPtr) *availableBytesPtr = segment->writeOffset - segment->readOffset;
+	}
+	else
+	{
+		if (bufferPtr) *bufferPtr = NULL;
+		if (availableBytesPtr) *availableBytesPtr = 0;
+	}
 }
 
-- (void)getWriteBuffer:(uint8_t **)bufferPtr availableSpace:(size_t *)availableSpacePtr
+/**
+ * Enumerates the available bytes in order, one contiguous buffer at a time.
+**/
+- (void)enumerateReadBuffersUsingBlock:(void (^)(const uint8_t *buffer, size_t length, BOOL *stop))block
 {
-	if (bufferPtr) *bufferPtr = writePointer;
-	if (availableSpacePtr) *availableSpacePtr = [self availableSpace];
+	BOOL stop = NO;
+	size_t remaining = availableBytes;
+	
+	GCDAsyncSocketPreBufferSegment *segment = head;
+	
+	while (segment && (remaining > 0) && !stop)
+	{
+		size_t length = segment->writeOffset - segment->readOffset;
+		
+		if (length > 0)
+		{
+			block(segment->bytes + segment->readOffset, length, &stop);
+			remaining -= length;
+		}
+		
+		segment = segment->next;
+	}
 }
 
-- (void)didWrite:(size_t)bytesWritten
+/**
+ * Copies the given number of bytes out of the prebuffer, and removes them from the prebuffer.
+**/
+- (void)readBytes:(uint8_t *)buffer length:(size_t)length
 {
-	writePointer += bytesWritten;
+	NSAssert(length <= availableBytes, @"Attempting to read more bytes than are available");
+	
+	size_t bytesCopied = 0;
+	GCDAsyncSocketPreBufferSegment *segment = head;
+	
+	while (bytesCopied < length)
+	{
+		size_t segmentLength = MIN((segment->writeOffset - segment->readOffset), (length - bytesCopied));
+		
+		memcpy(buffer + bytesCopied, segment->bytes + segment->readOffset, segmentLength);
+		bytesCopied += segmentLength;
+		
+		segment = segment->next;
+	}
+	
+	[self didRead:length];
 }
 
-- (void)reset
+/**
+ * Removes the given number of bytes from the prebuffer, and returns them as an immutable NSData object,
+ * without copying them. The NSData object keeps the underlying segment alive until it's deallocated.
+ * 
+ * This is only possible if the bytes are contiguous in memory.
+ * If they're not, this method returns nil and leaves the prebuffer unchanged.
+**/
+- (NSData *)sliceWithLength:(size_t)length
 {
-	readPointer  = preBuffer;
-	writePointer = preBuffer;
+	uint8_t *buffer = NULL;
+	size_t bufferLength = 0;
+	
+	[self getReadBuffer:&buffer availableBytes:&bufferLength];
+	
+	if ((length == 0) || (length > bufferLength))
+	{
+		return nil;
+	}
+	
+	// The segment containing the bytes is the first non-empty one
+	
+	GCDAsyncSocketPreBufferSegment *segment = head;
+	while (segment->readOffset == segment->writeOffset)
+	{
+		segment = segment->next;
+	}
+	
+	GCDAsyncSocketPreBufferSegmentRetain(segment);
+	
+	NSData *slice = [[NSData alloc] initWithBytesNoCopy:buffer length:length deallocator:^(void *bytes, NSUInteger len) {
+		
+		GCDAsyncSocketPreBufferSegmentRelease(segment);
+	}];
+	
+	[self didRead:length];
+	
+	return slice;
 }
 
-@end
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark -
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
 /**
- * The GCDAsyncReadPacket encompasses the instructions for any given read.
- * The content of a read packet allows the code to determine if we're:
- *  - reading to a certain length
- *  - reading to a certain separator
- *  - or simply reading the first chunk of available data
+ * Returns a pointer to the next space to be written to.
+ * Use ensureCapacityForWrite: to make sure there's enough contiguous space available.
 **/
-@interface GCDAsyncReadPacket : NSObject
+- (uint8_t *)writeBuffer
 {
-  @public
-	NSMutableData *buffer;
-	NSUInteger startOffset;
-	NSUInteger bytesDone;
-	NSUInteger maxLength;
-	NSTimeInterval timeout;
-	NSUInteger readLength;
-	NSData *term;
-	BOOL bufferOwner;
-	NSUInteger originalBufferLength;
-	long tag;
+	return writeSegment->bytes + writeSegment->writeOffset;
 }
-- (id)initWithData:(NSMutableData *)d
-       startOffset:(NSUInteger)s
-         maxLength:(NSUInteger)m
-           timeout:(NSTimeInterval)t
-        readLength:(NSUInteger)l
-        terminator:(NSData *)e
-               tag:(long)i;
-
-- (void)ensureCapacityForAdditionalDataOfLength:(NSUInteger)bytesToRead;
-
-- (NSUInteger)optimalReadLengthWithDefault:(NSUInteger)defaultValue shouldPreBuffer:(BOOL *)shouldPreBufferPtr;
-
-- (NSUInteger)readLengthForNonTermWithHint:(NSUInteger)bytesAvailable;
-- (NSUInteger)readLengthForTermWithHint:(NSUInteger)bytesAvailable shouldPreBuffer:(BOOL *)shouldPreBufferPtr;
-- (NSUInteger)readLengthForTermWithPreBuffer:(GCDAsyncSocketPreBuffer *)preBuffer found:(BOOL *)foundPtr;
-
-- (NSInteger)searchForTermAfterPreBuffering:(ssize_t)numBytes;
-
-@end
-
-@implementation GCDAsyncReadPacket
 
-- (id)initWithData:(NSMutableData *)d
-       startOffset:(NSUInteger)s
-         maxLength:(NSUInteger)m
-           timeout:(NSTimeInterval)t
-        readLength:(NSUInteger)l
-        terminator:(NSData *)e
-               tag:(long)i
+/**
+ * Fills in the given iovec array with the space needed to write the given number of bytes,
+ * adding segments to the prebuffer as needed.
+ * 
+ * If the iovec array isn't large enough, the length is reduced to the amount of space it describes.
+ * Returns the number of iovec structures filled in, or -1 if a segment couldn't be allocated.
+**/
+- (int)getWriteVectors:(struct iovec *)iov count:(int)iovcnt length:(size_t *)lengthPtr
 {
-	if((self = [super init]))
+	if (writeSegment == NULL)
 	{
-		bytesDone = 0;
-		maxLength = m;
-		timeout = t;
-		readLength = l;
-		term = [e copy];
-		tag = i;
+		if (![self ensureCapacityForWrite:segmentCapacity]) return -1;
+	}
+	
+	size_t requested = *lengthPtr;
+	size_t total = 0;
+	int count = 0;
+	
+	GCDAsyncSocketPreBufferSegment *segment = writeSegment;
+	
+	while ((total < requested) && (count < iovcnt))
+	{
+		size_t space = segment->capacity - segment->writeOffset;
 		
-		if (d)
+		if (space > 0)
 		{
-			buffer = d;
-			startOffset = s;
-			bufferOwner = NO;
-			originalBufferLength = [d length];
+			size_t length = MIN(space, (requested - total));
+			
+			iov[count].iov_base = segment->bytes + segment->writeOffset;
+			iov[count].iov_len  = length;
+			
+			total += length;
+			count++;
 		}
-		else
+		
+		if ((total < requested) && (count < iovcnt))
 		{
-			if (readLength > 0)
-				buffer = [[NSMutableData alloc] initWithLength:readLength];
-			else
-				buffer = [[NSMutableData alloc] initWithLength:0];
+			if (segment->next == NULL)
+			{
+				segment->next = GCDAsyncSocketPreBufferSegmentCreate(segmentCapacity);
+				if (segment->next == NULL) return -1;
+				
+				tail = segment->next;
+			}
 			
-			startOffset = 0;
-			bufferOwner = YES;
-			originalBufferLength = 0;
+			segment = segment->next;
 		}
 	}
-	return self;
+	
+	*lengthPtr = total;
+	return count;
 }
 
 /**
- * Increases the length of the buffer (if needed) to ensure a read of the given size will fit.
+ * Inserts the given bytes at the start of the prebuffer, ahead of any bytes already available.
+ * Returns NO, leaving the prebuffer unchanged, if a segment couldn't be allocated.
 **/
-- (void)ensureCapacityForAdditionalDataOfLength:(NSUInteger)bytesToRead
+- (BOOL)prependBytes:(const uint8_t *)bytes length:(size_t)length
 {
-	NSUInteger buffSize = [buffer length];
-	NSUInteger buffUsed = startOffset + bytesDone;
+	if (length == 0) return YES;
 	
-	NSUInteger buffSpace = buffSize - buffUsed;
-	
-	if (bytesToRead > buffSpace)
+	if (availableBytes == 0)
 	{
-		NSUInteger buffInc = bytesToRead - buffSpace;
+		if (![self ensureCapacityForWrite:length]) return NO;
 		
-		[buffer increaseLengthBy:buffInc];
+		memcpy([self writeBuffer], bytes, length);
+		[self didWrite:length];
 	}
-}
-
-/**
- * This method is used when we do NOT know how much data is available to be read from the socket.
- * This method returns the default value unless it exceeds the specified readLength or maxLength.
- * 
- * Furthermore, the shouldPreBuffer decision is based upon the packet type,
- * and whether the returned value would fit in the current buffer without requiring a resize of the buffer.
-**/
-- (NSUInteger)optimalReadLengthWithDefault:(NSUInteger)defaultValue shouldPreBuffer:(BOOL *)shouldPreBufferPtr
-{
-	NSUInteger result;
-	
-	if (readLength > 0)
+	else if ((head->readOffset >= length) && (atomic_load_explicit(&head->refCount, memory_order_acquire) == 1))
 	{
-		// Read a specific length of data
+		// There's room at the start of the first segment
 		
-		result = MIN(defaultValue, (readLength - bytesDone));
-		
-		// There is no need to prebuffer since we know exactly how much data we need to read.
-		// Even if the buffer isn't currently big enough to fit this amount of data,
-		// it would have to be resized eventually anyway.
+		head->readOffset -= length;
+		memcpy(head->bytes + head->readOffset, bytes, length);
 		
-		if (shouldPreBufferPtr)
-			*shouldPreBufferPtr = NO;
+		availableBytes += length;
 	}
 	else
 	{
-		// Either reading until we find a specified terminator,
-		// or we're simply reading all available data.
-		// 
-		// In other words, one of:
-		// 
-		// - readDataToData packet
-		// - readDataWithTimeout packet
+		GCDAsyncSocketPreBufferSegment *segment = GCDAsyncSocketPreBufferSegmentCreate(length);
+		if (segment == NULL) return NO;
 		
-		if (maxLength > 0)
-			result =  MIN(defaultValue, (maxLength - bytesDone));
-		else
-			result = defaultValue;
+		memcpy(segment->bytes, bytes, length);
+		segment->writeOffset = length;
 		
-		// Since we don't know the size of the read in advance,
-		// the shouldPreBuffer decision is based upon whether the returned value would fit
-		// in the current buffer without requiring a resize of the buffer.
-		// 
-		// This is because, in all likelyhood, the amount read from the socket will be less than the default value.
-		// Thus we should avoid over-allocating the read buffer when we can simply use the pre-buffer instead.
+		segment->next = head;
+		head = segment;
 		
-		if (shouldPreBufferPtr)
-		{
-			NSUInteger buffSize = [buffer length];
-			NSUInteger buffUsed = startOffset + bytesDone;
-			
-			NSUInteger buffSpace = buffSize - buffUsed;
-			
-			if (buffSpace >= result)
-				*shouldPreBufferPtr = NO;
-			else
-				*shouldPreBufferPtr = YES;
-		}
+		availableBytes += length;
 	}
 	
-	return result;
+	return YES;
 }
 
-/**
- * For read packets without a set terminator, returns the amount of data
- * that can be read without exceeding the readLength or maxLength.
- * 
- * The given parameter indicates the number of bytes estimated to be available on the socket,
- * which is taken into consideration during the calculation.
- * 
- * The given hint MUST be greater than zero.
-**/
-- (NSUInteger)readLengthForNonTermWithHint:(NSUInteger)bytesAvailable
+- (void)didRead:(size_t)bytesRead
 {
-	NSAssert(term == nil, @"This method does not apply to term reads");
-	NSAssert(bytesAvailable > 0, @"Invalid parameter: bytesAvailable");
+	availableBytes -= bytesRead;
 	
-	if (readLength > 0)
+	if (availableBytes == 0)
 	{
-		// Read a specific length of data
-		
-		return MIN(bytesAvailable, (readLength - bytesDone));
+		// The prebuffer has been drained.
+		// Keep a single segment around for the next write, and hand the rest back to the pool.
 		
-		// No need to avoid resizing the buffer.
-		// If the user provided their own buffer,
-		// and told us to read a certain length of data that exceeds the size of the buffer,
-		// then it is clear that our code will resize the buffer during the read operation.
-		// 
-		// This method does not actually do any resizing.
-		// The resizing will happen elsewhere if needed.
+		[self releaseSegmentsKeepingOne:YES];
+		return;
 	}
-	else
+	
+	while (bytesRead > 0)
 	{
-		// Read all available data
+		size_t segmentLength = MIN((head->writeOffset - head->readOffset), bytesRead);
 		
-		NSUInteger result = bytesAvailable;
+		head->readOffset += segmentLength;
+		bytesRead -= segmentLength;
 		
-		if (maxLength > 0)
+		if ((head->readOffset == head->writeOffset) && (head != writeSegment))
 		{
-			result = MIN(result, (maxLength - bytesDone));
+			GCDAsyncSocketPreBufferSegment *next = head->next;
+			
+			GCDAsyncSocketPreBufferSegmentRelease(head);
+			head = next;
 		}
+	}
+}
+
+- (void)didWrite:(size_t)bytesWritten
+{
+	availableBytes += bytesWritten;
+	
+	while (bytesWritten > 0)
+	{
+		size_t space = writeSegment->capacity - writeSegment->writeOffset;
 		
-		// No need to avoid resizing the buffer.
-		// If the user provided their own buffer,
-		// and told us to read all available data without giving us a maxLength,
-		// then it is clear that our code might resize the buffer during the read operation.
-		// 
-		// This method does not actually do any resizing.
-		// The resizing will happen elsewhere if needed.
+		if (space == 0)
+		{
+			writeSegment = writeSegment->next;
+			continue;
+		}
 		
-		return result;
+		size_t segmentLength = MIN(space, bytesWritten);
+		
+		writeSegment->writeOffset += segmentLength;
+		bytesWritten -= segmentLength;
 	}
 }
 
 /**
- * For read packets with a set terminator, returns the amount of data
- * that can be read without exceeding the maxLength.
- * 
- * The given parameter indicates the number of bytes estimated to be available on the socket,
- * which is taken into consideration during the calculation.
- * 
- * To optimize memory allocations, mem copies, and mem moves
- * the shouldPreBuffer boolean value will indicate if the data should be read into a prebuffer first,
- * or if the data can be read directly into the read packet's buffer.
+ * Hands all memory back to the pool, if the prebuffer is empty.
 **/
-- (NSUInteger)readLengthForTermWithHint:(NSUInteger)bytesAvailable shouldPreBuffer:(BOOL *)shouldPreBufferPtr
+- (void)shrink
 {
-	NSAssert(term != nil, @"This method does not apply to non-term reads");
-	NSAssert(bytesAvailable > 0, @"Invalid parameter: bytesAvailable");
-	
-	
-	NSUInteger result = bytesAvailable;
-	
-	if (maxLength > 0)
-	{
-		result = MIN(result, (maxLength - bytesDone));
-	}
-	
-	// Should the data be read into the read packet's buffer, or into a pre-buffer first?
-	// 
-	// One would imagine the preferred option is the faster one.
-	// So which one is faster?
-	// 
-	// Reading directly into the packet's buffer requires:
-	// 1. Possibly resizing packet buffer (malloc/realloc)
-	// 2. Filling buffer (read)
-	// 3. Searching for term (memcmp)
-	// 4. Possibly copying overflow into prebuffer (malloc/realloc, memcpy)
-	// 
-	// Reading into prebuffer first:
-	// 1. Possibly resizing prebuffer (malloc/realloc)
-	// 2. Filling buffer (read)
-	// 3. Searching for term (memcmp)
-	// 4. Copying underflow into packet buffer (malloc/realloc, memcpy)
-	// 5. Removing underflow from prebuffer (memmove)
-	// 
-	// Comparing the performance of the two we can see that reading
-	// data into the prebuffer first is slower due to the extra memove.
-	// 
-	// However:
-	// The implementation of NSMutableData is open source via core foundation's CFMutableData.
-	// Decreasing the length of a mutable data object doesn't cause a realloc.
-	// In other words, the capacity of a mutable data object can grow, but doesn't shrink.
-	// 
-	// This means the prebuffer will rarely need a realloc.
-	// The packet buffer, on the other hand, may often need a realloc.
-	// This is especially true if we are the buffer owner.
-	// Furthermore, if we are constantly realloc'ing the packet buffer,
-	// and then moving the overflow into the prebuffer,
-	// then we're consistently over-allocating memory for each term read.
-	// And now we get into a bit of a tradeoff between speed and memory utilization.
-	// 
-	// The end result is that the two perform very similarly.
-	// And we can answer the original question very simply by another means.
-	// 
-	// If we can read all the data directly into the packet's buffer without resizing it first,
-	// then we do so. Otherwise we use the prebuffer.
-	
-	if (shouldPreBufferPtr)
+	if (availableBytes == 0)
 	{
-		NSUInteger buffSize = [buffer length];
-		NSUInteger buffUsed = startOffset + bytesDone;
-		
-		if ((buffSize - buffUsed) >= result)
-			*shouldPreBufferPtr = NO;
-		else
-			*shouldPreBufferPtr = YES;
+		[self releaseSegmentsKeepingOne:NO];
 	}
-	
-	return result;
 }
 
+- (void)reset
+{
+	[self releaseSegmentsKeepingOne:NO];
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 /**
- * For read packets with a set terminator,
- * returns the amount of data that can be read from the given preBuffer,
- * without going over a terminator or the maxLength.
+ * Returns a pointer to the first position within the given buffer at which the term could start,
+ * or NULL if the term can't start anywhere within the buffer.
  * 
- * It is assumed the terminator has not already been read.
+ * A position is a candidate if it matches both the first and last byte of the term.
+ * This filter is checked for many positions at a time, using SIMD where available,
+ * which allows a term search to quickly skip over data that can't possibly contain the term.
+ * The candidate itself still needs to be verified.
 **/
-- (NSUInteger)readLengthForTermWithPreBuffer:(GCDAsyncSocketPreBuffer *)preBuffer found:(BOOL *)foundPtr
+static const uint8_t * GCDAsyncSocketNextTermCandidate(const uint8_t *buf, size_t bufLength,
+                                                       const uint8_t *term, size_t termLength)
 {
-	NSAssert(term != nil, @"This method does not apply to non-term reads");
-	NSAssert([preBuffer availableBytes] > 0, @"Invoked with empty pre buffer!");
+	if ((termLength == 0) || (bufLength < termLength))
+	{
+		return NULL;
+	}
 	
-	// We know that the terminator, as a whole, doesn't exist in our own buffer.
-	// But it is possible that a _portion_ of it exists in our buffer.
-	// So we're going to look for the terminator starting with a portion of our own buffer.
-	// 
-	// Example:
-	// 
-	// term length      = 3 bytes
-	// bytesDone        = 5 bytes
-	// preBuffer length = 5 bytes
-	// 
-	// If we append the preBuffer to our buffer,
-	// it would look like this:
-	// 
-	// ---------------------
-	// |B|B|B|B|B|P|P|P|P|P|
-	// ---------------------
-	// 
-	// So we start our search here:
-	// 
-	// ---------------------
-	// |B|B|B|B|B|P|P|P|P|P|
-	// -------^-^-^---------
-	// 
-	// And move forwards...
-	// 
-	// ---------------------
-	// |B|B|B|B|B|P|P|P|P|P|
-	// ---------^-^-^-------
-	// 
-	// Until we find the terminator or reach the end.
-	// 
-	// ---------------------
-	// |B|B|B|B|B|P|P|P|P|P|
-	// ---------------^-^-^-
+	const uint8_t first = term[0];
+	const uint8_t last  = term[termLength - 1];
 	
-	BOOL found = NO;
+	// The number of positions at which the term may start
+	const size_t count = bufLength - termLength + 1;
 	
-	NSUInteger termLength = [term length];
-	NSUInteger preBufferLength = [preBuffer availableBytes];
+	size_t i = 0;
 	
-	if ((bytesDone + preBufferLength) < termLength)
-	{
-		// Not enough data for a full term sequence yet
-		return preBufferLength;
-	}
+#if defined(__AVX2__)
 	
-	NSUInteger maxPreBufferLength;
-	if (maxLength > 0) {
-		maxPreBufferLength = MIN(preBufferLength, (maxLength - bytesDone));
+	const __m256i firstVec = _mm256_set1_epi8((char)first);
+	const __m256i lastVec  = _mm256_set1_epi8((char)last);
+	
+	for (; (i + 32) <= count; i += 32)
+	{
+		__m256i firstBlock = _mm256_loadu_si256((const __m256i *)(buf + i));
+		__m256i lastBlock  = _mm256_loadu_si256((const __m256i *)(buf + i + termLength - 1));
 		
-		// Note: maxLength >= termLength
-	}
-	else {
-		maxPreBufferLength = preBufferLength;
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(firstBlock, firstVec),
+		                                                                  _mm256_cmpeq_epi8(lastBlock, lastVec)));
+		if (mask)
+		{
+			return buf + i + __builtin_ctz(mask);
+		}
 	}
 	
-	uint8_t seq[termLength];
-	const void *termBuf = [term bytes];
+#elif defined(__SSE2__)
 	
-	NSUInteger bufLen = MIN(bytesDone, (termLength - 1));
-	uint8_t *buf = (uint8_t *)[buffer mutableBytes] + startOffset + bytesDone - bufLen;
+	const __m128i firstVec = _mm_set1_epi8((char)first);
+	const __m128i lastVec  = _mm_set1_epi8((char)last);
 	
-	NSUInteger preLen = termLength - bufLen;
-	const uint8_t *pre = [preBuffer readBuffer];
+	for (; (i + 16) <= count; i += 16)
+	{
+		__m128i firstBlock = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i lastBlock  = _mm_loadu_si128((const __m128i *)(buf + i + termLength - 1));
+		
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(firstBlock, firstVec),
+		                                                            _mm_cmpeq_epi8(lastBlock, lastVec)));
+		if (mask)
+		{
+			return buf + i + __builtin_ctz(mask);
+		}
+	}
 	
-	NSUInteger loopCount = bufLen + maxPreBufferLength - termLength + 1; // Plus one. See example above.
+#elif defined(__ARM_NEON)
 	
-	NSUInteger result = maxPreBufferLength;
+	const uint8x16_t firstVec = vdupq_n_u8(first);
+	const uint8x16_t lastVec  = vdupq_n_u8(last);
 	
-	NSUInteger i;
-	for (i = 0; i < loopCount; i++)
+	for (; (i + 16) <= count; i += 16)
 	{
-		if (bufLen > 0)
-		{
-			// Combining bytes from buffer and preBuffer
-			
-			memcpy(seq, buf, bufLen);
-			memcpy(seq + bufLen, pre, preLen);
-			
-			if (memcmp(seq, termBuf, termLength) == 0)
-			{
-				result = preLen;
-				found = YES;
-				break;
-			}
-			
-			buf++;
-			bufLen--;
-			preLen++;
-		}
-		else
+		uint8x16_t firstBlock = vld1q_u8(buf + i);
+		uint8x16_t lastBlock  = vld1q_u8(buf + i + termLength - 1);
+		
+		uint8x16_t matches = vandq_u8(vceqq_u8(firstBlock, firstVec), vceqq_u8(lastBlock, lastVec));
+		
+		// NEON has no movemask, so narrow each 8-bit lane to 4 bits, giving a 64-bit mask.
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+		
+		if (mask)
 		{
-			// Comparing directly from preBuffer
-			
-			if (memcmp(pre, termBuf, termLength) == 0)
-			{
-				NSUInteger preOffset = pre - [preBuffer readBuffer]; // pointer arithmetic
-				
-				result = preOffset + termLength;
-				found = YES;
-				break;
-			}
-			
-			pre++;
+			return buf + i + (__builtin_ctzll(mask) >> 2);
 		}
 	}
 	
-	// There is no need to avoid resizing the buffer in this particular situation.
+#endif
 	
-	if (foundPtr) *foundPtr = found;
-	return result;
+	// Scalar filter, for the remaining positions (or all positions if SIMD isn't available)
+	
+	while (i < count)
+	{
+		const uint8_t *candidate = memchr(buf + i, first, count - i);
+		if (candidate == NULL) break;
+		
+		i = candidate - buf;
+		
+		if (buf[i + termLength - 1] == last) return candidate;
+		
+		i++;
+	}
+	
+	return NULL;
 }
 
+
 /**
- * For read packets with a set terminator, scans the packet buffer for the term.
- * It is assumed the terminator had not been fully read prior to the new bytes.
- * 
- * If the term is found, the number of excess bytes after the term are returned.
- * If the term is not found, this method will return -1.
- * 
- * Note: A return value of zero means the term was found at the very end.
+ * A GCDAsyncSocketTermMatcher searches a stream of data for a terminator,
+ * where the data may arrive in arbitrarily sized pieces.
  * 
- * Prerequisites:
- * The given number of bytes have been added to the end of our buffer.
- * Our bytesDone variable has NOT been changed due to the prebuffered bytes.
+ * It is based on the Knuth-Morris-Pratt algorithm.
+ * The matcher remembers how much of the term was matched at the end of the previously scanned data,
+ * so the search simply picks up where it left off when more data arrives,
+ * no matter how the term is fragmented across socket reads.
+ * Each byte is only ever scanned once, and examined a bounded number of times.
 **/
-- (NSInteger)searchForTermAfterPreBuffering:(ssize_t)numBytes
+
+@interface GCDAsyncSocketTermMatcher : NSObject
 {
-	NSAssert(term != nil, @"This method does not apply to non-term reads");
-	
-	// The implementation of this method is very similar to the above method.
-	// See the above method for a discussion of the algorithm used here.
-	
-	uint8_t *buff = [buffer mutableBytes];
-	NSUInteger buffLength = bytesDone + numBytes;
-	
-	const void *termBuff = [term bytes];
-	NSUInteger termLength = [term length];
-	
-	// Note: We are dealing with unsigned integers,
-	// so make sure the math doesn't go below zero.
-	
-	NSUInteger i = ((buffLength - numBytes) >= termLength) ? (buffLength - numBytes - termLength + 1) : 0;
+	NSData *term;
+	const uint8_t *termBytes;
+	NSUInteger termLength;
 	
-	while (i + termLength <= buffLength)
+	NSUInteger *prefixTable;
+	NSUInteger matchLength;
+}
+
+- (id)initWithTerm:(NSData *)term;
+
+- (NSData *)term;
+- (NSUInteger)termLength;
+- (NSUInteger)matchLength;
+
+- (NSUInteger)scanBytes:(const uint8_t *)bytes length:(NSUInteger)length found:(BOOL *)foundPtr;
+
+- (void)reset;
+
+@end
+
+@implementation GCDAsyncSocketTermMatcher
+
+- (id)initWithTerm:(NSData *)aTerm
+{
+	if ((self = [super init]))
 	{
-		uint8_t *subBuffer = buff + startOffset + i;
+		term = aTerm;
+		termBytes = [term bytes];
+		termLength = [term length];
+		
+		// prefixTable[i] is the length of the longest proper prefix of term[0...i] that is also a suffix of it.
+		// When a mismatch occurs after matching (i + 1) bytes, the search continues from this length.
 		
-		if (memcmp(subBuffer, termBuff, termLength) == 0)
+		prefixTable = malloc(sizeof(NSUInteger) * termLength);
+		prefixTable[0] = 0;
+		
+		NSUInteger k = 0;
+		for (NSUInteger i = 1; i < termLength; i++)
 		{
-			return buffLength - (i + termLength);
+			while ((k > 0) && (termBytes[i] != termBytes[k]))
+			{
+				k = prefixTable[k - 1];
+			}
+			
+			if (termBytes[i] == termBytes[k])
+			{
+				k++;
+			}
+			
+			prefixTable[i] = k;
 		}
 		
-		i++;
+		matchLength = 0;
 	}
-	
-	return -1;
+	return self;
 }
 
+- (void)dealloc
+{
+	if (prefixTable)
+		free(prefixTable);
+}
 
-@end
+- (NSData *)term
+{
+	return term;
+}
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark -
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+- (NSUInteger)termLength
+{
+	return termLength;
+}
 
 /**
- * The GCDAsyncWritePacket encompasses the instructions for any given write.
+ * Returns the number of bytes of the term matched at the end of all data scanned so far.
 **/
-@interface GCDAsyncWritePacket : NSObject
+- (NSUInteger)matchLength
 {
-  @public
-	NSData *buffer;
-	NSUInteger bytesDone;
-	long tag;
-	NSTimeInterval timeout;
+	return matchLength;
 }
-- (id)initWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i;
-@end
-
-@implementation GCDAsyncWritePacket
 
-- (id)initWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i
+/**
+ * Continues the search with the given bytes, which directly follow the previously scanned bytes in the stream.
+ * 
+ * If the term is found, returns the number of bytes up to and including the end of the term.
+ * Otherwise returns the given length, as all the bytes were scanned.
+**/
+- (NSUInteger)scanBytes:(const uint8_t *)bytes length:(NSUInteger)length found:(BOOL *)foundPtr
 {
-	if((self = [super init]))
+	NSUInteger state = matchLength;
+	NSUInteger i = 0;
+	
+	while (i < length)
 	{
-		buffer = d; // Retain not copy. For performance as documented in header file.
-		bytesDone = 0;
-		timeout = t;
-		tag = i;
+		if (state == 0)
+		{
+			// Nothing is partially matched, so the term can't start before the next candidate position.
+			// Skip straight to it. If there isn't one, the term doesn't occur in full within the remaining bytes,
+			// and only the last (termLength - 1) bytes could still begin a partial match.
+			
+			const uint8_t *candidate = GCDAsyncSocketNextTermCandidate(bytes + i, length - i, termBytes, termLength);
+			if (candidate)
+				i = candidate - bytes; // pointer arithmetic
+			else if ((length - i) >= termLength)
+				i = length - termLength + 1;
+			
+			if (i >= length) break;
+		}
+		
+		uint8_t byte = bytes[i++];
+		
+		while ((state > 0) && (termBytes[state] != byte))
+		{
+			state = prefixTable[state - 1];
+		}
+		
+		if (termBytes[state] == byte)
+		{
+			state++;
+			
+			if (state == termLength)
+			{
+				matchLength = state;
+				
+				if (foundPtr) *foundPtr = YES;
+				return i;
+			}
+		}
 	}
-	return self;
+	
+	matchLength = state;
+	
+	if (foundPtr) *foundPtr = NO;
+	return length;
 }
 
+- (void)reset
+{
+	matchLength = 0;
+}
 
 @end
 
@@ -831,4333 +1090,8678 @@ enum GCDAsyncSocketConfig
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
- * The GCDAsyncSpecialPacket encompasses special instructions for interruptions in the read/write queues.
- * This class my be altered to support more than just TLS in the future.
+ * The GCDAsyncReadPacket encompasses the instructions for any given read.
+ * The content of a read packet allows the code to determine if we're:
+ *  - reading to a certain length
+ *  - reading to a certain separator
+ *  - or simply reading the first chunk of available data
 **/
-@interface GCDAsyncSpecialPacket : NSObject
+@interface GCDAsyncReadPacket : NSObject
 {
   @public
-	NSDictionary *tlsSettings;
+	NSMutableData *buffer;
+	NSUInteger startOffset;
+	NSUInteger bytesDone;
+	NSUInteger maxLength;
+	NSTimeInterval timeout;
+	NSUInteger readLength;
+	NSData *term;
+	GCDAsyncSocketTermMatcher *termMatcher;
+	NSArray *termMatchers;
+	NSArray *recycledTermMatchers;
+	NSUInteger matchedTermIndex;
+	NSData *slice;
+	NSUInteger headerLength;
+	BOOL headerBigEndian;
+	BOOL headerParsed;
+	BOOL bufferOwner;
+	NSMutableData *ownedBuffer;       // Kept across recycling, and read into again once its data is released
+	__weak NSData *ownedBufferResult; // The data last read into the owned buffer, while still in use
+	NSUInteger originalBufferLength;
+	NSUInteger allocationCount;       // Objects allocated since the socket last collected the count
+	long tag;
+	BOOL standing; // Re-arms itself after each completed read (see startStandingRead...)
+	NSTimeInterval standingTimeout;
 }
-- (id)initWithTLSSettings:(NSDictionary *)settings;
+- (id)initWithData:(NSMutableData *)d
+       startOffset:(NSUInteger)s
+         maxLength:(NSUInteger)m
+           timeout:(NSTimeInterval)t
+        readLength:(NSUInteger)l
+        terminator:(NSData *)e
+               tag:(long)i;
+
+- (void)setupWithData:(NSMutableData *)d
+          startOffset:(NSUInteger)s
+            maxLength:(NSUInteger)m
+              timeout:(NSTimeInterval)t
+           readLength:(NSUInteger)l
+           terminator:(NSData *)e
+                  tag:(long)i;
+- (void)setupWithTerminators:(NSArray *)terms;
+- (void)clear;
+- (void)rearm;
+
+- (void)ensureCapacityForAdditionalDataOfLength:(NSUInteger)bytesToRead;
+
+- (NSUInteger)optimalReadLengthWithDefault:(NSUInteger)defaultValue shouldPreBuffer:(BOOL *)shouldPreBufferPtr;
+
+- (NSUInteger)readLengthForNonTermWithHint:(NSUInteger)bytesAvailable;
+- (NSUInteger)readLengthForTermWithHint:(NSUInteger)bytesAvailable shouldPreBuffer:(BOOL *)shouldPreBufferPtr;
+- (NSUInteger)readLengthForTermWithPreBuffer:(GCDAsyncSocketPreBuffer *)preBuffer found:(BOOL *)foundPtr;
+- (NSUInteger)readLengthForScatterWithHint:(NSUInteger)bytesAvailable;
+
+- (NSUInteger)scanTermBytes:(const uint8_t *)bytes length:(NSUInteger)length found:(BOOL *)foundPtr;
+- (NSInteger)searchForTermAfterPreBuffering:(ssize_t)numBytes;
+
+- (BOOL)getFrameLength:(NSUInteger *)frameLengthPtr fromHeader:(const uint8_t *)header;
+- (void)beginFrameOfLength:(NSUInteger)frameLength;
+
 @end
 
-@implementation GCDAsyncSpecialPacket
+@implementation GCDAsyncReadPacket
 
-- (id)initWithTLSSettings:(NSDictionary *)settings
+- (id)initWithData:(NSMutableData *)d
+       startOffset:(NSUInteger)s
+         maxLength:(NSUInteger)m
+           timeout:(NSTimeInterval)t
+        readLength:(NSUInteger)l
+        terminator:(NSData *)e
+               tag:(long)i
 {
 	if((self = [super init]))
 	{
-		tlsSettings = [settings copy];
+		[self setupWithData:d startOffset:s maxLength:m timeout:t readLength:l terminator:e tag:i];
 	}
 	return self;
 }
 
+/**
+ * Sets up the packet for a new read.
+ * 
+ * This is also used to recycle a packet that has completed a previous read.
+ * A recycled packet keeps its term matcher if it's reading to the same term again,
+ * and reads into its own buffer again if the data previously read into it has been released.
+**/
+- (void)setupWithData:(NSMutableData *)d
+          startOffset:(NSUInteger)s
+            maxLength:(NSUInteger)m
+              timeout:(NSTimeInterval)t
+           readLength:(NSUInteger)l
+           terminator:(NSData *)e
+                  tag:(long)i
+{
+	bytesDone = 0;
+	maxLength = m;
+	timeout = t;
+	readLength = l;
+	tag = i;
+	
+	termMatchers = nil;
+	matchedTermIndex = 0;
+	slice = nil;
+	headerLength = 0;
+	headerBigEndian = NO;
+	headerParsed = NO;
+	standing = NO;
+	standingTimeout = t;
+	
+	if (e && termMatcher && [term isEqualToData:e])
+	{
+		[termMatcher reset];
+	}
+	else
+	{
+		term = [e copy];
+		
+		if (term)
+		{
+			termMatcher = [[GCDAsyncSocketTermMatcher alloc] initWithTerm:term];
+			allocationCount++;
+		}
+		else
+		{
+			termMatcher = nil;
+		}
+	}
+	
+	if (d)
+	{
+		buffer = d;
+		startOffset = s;
+		bufferOwner = NO;
+		originalBufferLength = [d length];
+	}
+	else
+	{
+		if (ownedBuffer && (ownedBufferResult == nil))
+		{
+			[ownedBuffer setLength:0];
+			[ownedBuffer setLength:readLength];
+		}
+		else
+		{
+			if (readLength > 0)
+				ownedBuffer = [[NSMutableData alloc] initWithLength:readLength];
+			else
+				ownedBuffer = [[NSMutableData alloc] initWithLength:0];
+			
+			ownedBufferResult = nil;
+			allocationCount++;
+		}
+		
+		buffer = ownedBuffer;
+		startOffset = 0;
+		bufferOwner = YES;
+		originalBufferLength = 0;
+	}
+}
 
-@end
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark -
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-@implementation GCDAsyncSocket
+/**
+ * Turns a term read into a read up to (and including) whichever of the given terms occurs first.
+ * 
+ * The packet looks like any other term read (read type #3), with the first of the terms as its term.
+ * But each of the terms gets its own matcher, and all of them search the data together.
+ * 
+ * The terms must not be mutable, as the matchers reference them directly.
+ * A recycled packet keeps its matchers if it's reading to the same terms again.
+**/
+- (void)setupWithTerminators:(NSArray *)terms
 {
-	uint32_t flags;
-	uint16_t config;
-	
-	__weak id delegate;
-	dispatch_queue_t delegateQueue;
+	NSUInteger termCount = [terms count];
 	
-	int socket4FD;
-	int socket6FD;
-	int stateIndex;
-	NSData * connectInterface4;
-	NSData * connectInterface6;
+	BOOL sameTerms = ([recycledTermMatchers count] == termCount);
 	
-	dispatch_queue_t socketQueue;
+	for (NSUInteger i = 0; sameTerms && (i < termCount); i++)
+	{
+		GCDAsyncSocketTermMatcher *matcher = [recycledTermMatchers objectAtIndex:i];
+		
+		sameTerms = [[matcher term] isEqualToData:[terms objectAtIndex:i]];
+	}
 	
-	dispatch_source_t accept4Source;
-	dispatch_source_t accept6Source;
-	dispatch_source_t connectTimer;
-	dispatch_source_t readSource;
-	dispatch_source_t writeSource;
-	dispatch_source_t readTimer;
-	dispatch_source_t writeTimer;
+	if (sameTerms)
+	{
+		for (GCDAsyncSocketTermMatcher *matcher in recycledTermMatchers)
+		{
+			[matcher reset];
+		}
+		
+		termMatchers = recycledTermMatchers;
+	}
+	else
+	{
+		// The first term is the packet's own term, which already has a (reset) matcher
+		
+		NSMutableArray *matchers = [NSMutableArray arrayWithCapacity:termCount];
+		[matchers addObject:termMatcher];
+		
+		for (NSUInteger i = 1; i < termCount; i++)
+		{
+			[matchers addObject:[[GCDAsyncSocketTermMatcher alloc] initWithTerm:[terms objectAtIndex:i]]];
+		}
+		
+		termMatchers = matchers;
+		recycledTermMatchers = matchers;
+		
+		allocationCount += termCount; // The array, and a matcher for each of the other terms
+	}
+}
+
+/**
+ * Drops the references to the data of a completed read,
+ * so the packet doesn't keep it alive while waiting to be recycled.
+ * 
+ * The packet holds on to its own buffer (unless it grew large), as it reads into it again once the data is released.
+**/
+- (void)clear
+{
+	if ([ownedBuffer length] > GCDAsyncSocketPacketBufferReuseLimit)
+	{
+		ownedBuffer = nil;
+	}
 	
-	NSMutableArray *readQueue;
-	NSMutableArray *writeQueue;
+	buffer = nil;
+	slice = nil;
+	termMatchers = nil;
+}
+
+/**
+ * Sets up a standing read for its next read, with the same description as the one it just completed.
+ * The data of the completed read has been handed off (along with the buffer), so the packet gets a fresh buffer.
+**/
+- (void)rearm
+{
+	bytesDone = 0;
+	timeout = standingTimeout;
+	matchedTermIndex = 0;
+	slice = nil;
 	
-	GCDAsyncReadPacket *currentRead;
-	GCDAsyncWritePacket *currentWrite;
+	if (headerLength > 0)
+	{
+		// Back to reading the length header
+		readLength = headerLength;
+		headerParsed = NO;
+	}
 	
-	unsigned long socketFDBytesAvailable;
+	[termMatcher reset];
 	
-	GCDAsyncSocketPreBuffer *preBuffer;
-		
-#if TARGET_OS_IPHONE
-	CFStreamClientContext streamContext;
-	CFReadStreamRef readStream;
-	CFWriteStreamRef writeStream;
-#endif
-	SSLContextRef sslContext;
-	GCDAsyncSocketPreBuffer *sslPreBuffer;
-	size_t sslWriteCachedLength;
-	OSStatus sslErrCode;
-    OSStatus lastSSLHandshakeError;
+	for (GCDAsyncSocketTermMatcher *matcher in termMatchers)
+	{
+		[matcher reset];
+	}
 	
-	void *IsOnSocketQueueOrTargetQueueKey;
+	if (readLength > 0)
+		ownedBuffer = [[NSMutableData alloc] initWithLength:readLength];
+	else
+		ownedBuffer = [[NSMutableData alloc] initWithLength:0];
 	
-	id userData;
+	buffer = ownedBuffer;
+	ownedBufferResult = nil;
+	allocationCount++;
 }
 
-- (id)init
-{
-	return [self initWithDelegate:nil delegateQueue:NULL socketQueue:NULL];
-}
-
-- (id)initWithSocketQueue:(dispatch_queue_t)sq
-{
-	return [self initWithDelegate:nil delegateQueue:NULL socketQueue:sq];
-}
-
-- (id)initWithDelegate:(id)aDelegate delegateQueue:(dispatch_queue_t)dq
-{
-	return [self initWithDelegate:aDelegate delegateQueue:dq socketQueue:NULL];
-}
-
-- (id)initWithDelegate:(id)aDelegate delegateQueue:(dispatch_queue_t)dq socketQueue:(dispatch_queue_t)sq
+/**
+ * Increases the length of the buffer (if needed) to ensure a read of the given size will fit.
+**/
+- (void)ensureCapacityForAdditionalDataOfLength:(NSUInteger)bytesToRead
 {
-	if((self = [super init]))
+	NSUInteger buffSize = [buffer length];
+	NSUInteger buffUsed = startOffset + bytesDone;
+	
+	NSUInteger buffSpace = buffSize - buffUsed;
+	
+	if (bytesToRead > buffSpace)
 	{
-		delegate = aDelegate;
-		delegateQueue = dq;
-		
-		#if !OS_OBJECT_USE_OBJC
-		if (dq) dispatch_retain(dq);
-		#endif
-		
-		socket4FD = SOCKET_NULL;
-		socket6FD = SOCKET_NULL;
-		stateIndex = 0;
-		
-		if (sq)
-		{
-			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0),
-			         @"The given socketQueue parameter must not be a concurrent queue.");
-			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0),
-			         @"The given socketQueue parameter must not be a concurrent queue.");
-			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
-			         @"The given socketQueue parameter must not be a concurrent queue.");
-			
-			socketQueue = sq;
-			#if !OS_OBJECT_USE_OBJC
-			dispatch_retain(sq);
-			#endif
-		}
-		else
-		{
-			socketQueue = dispatch_queue_create([GCDAsyncSocketQueueName UTF8String], NULL);
-		}
-		
-		// The dispatch_queue_set_specific() and dispatch_get_specific() functions take a "void *key" parameter.
-		// From the documentation:
-		//
-		// > Keys are only compared as pointers and are never dereferenced.
-		// > Thus, you can use a pointer to a static variable for a specific subsystem or
-		// > any other value that allows you to identify the value uniquely.
-		//
-		// We're just going to use the memory address of an ivar.
-		// Specifically an ivar that is explicitly named for our purpose to make the code more readable.
-		//
-		// However, it feels tedious (and less readable) to include the "&" all the time:
-		// dispatch_get_specific(&IsOnSocketQueueOrTargetQueueKey)
-		//
-		// So we're going to make it so it doesn't matter if we use the '&' or not,
-		// by assigning the value of the ivar to the address of the ivar.
-		// Thus: IsOnSocketQueueOrTargetQueueKey == &IsOnSocketQueueOrTargetQueueKey;
-		
-		IsOnSocketQueueOrTargetQueueKey = &IsOnSocketQueueOrTargetQueueKey;
-		
-		void *nonNullUnusedPointer = (__bridge void *)self;
-		dispatch_queue_set_specific(socketQueue, IsOnSocketQueueOrTargetQueueKey, nonNullUnusedPointer, NULL);
-		
-		readQueue = [[NSMutableArray alloc] initWithCapacity:5];
-		currentRead = nil;
-		
-		writeQueue = [[NSMutableArray alloc] initWithCapacity:5];
-		currentWrite = nil;
+		NSUInteger buffInc = bytesToRead - buffSpace;
 		
-		preBuffer = [[GCDAsyncSocketPreBuffer alloc] initWithCapacity:(1024 * 4)];
+		[buffer increaseLengthBy:buffInc];
 	}
-	return self;
 }
 
-- (void)dealloc
+/**
+ * This method is used when we do NOT know how much data is available to be read from the socket.
+ * This method returns the default value unless it exceeds the specified readLength or maxLength.
+ * 
+ * Furthermore, the shouldPreBuffer decision is based upon the packet type,
+ * and whether the returned value would fit in the current buffer without requiring a resize of the buffer.
+**/
+- (NSUInteger)optimalReadLengthWithDefault:(NSUInteger)defaultValue shouldPreBuffer:(BOOL *)shouldPreBufferPtr
 {
-	LogInfo(@"%@ - %@ (start)", THIS_METHOD, self);
-	
-	// Set dealloc flag.
-	// This is used by closeWithError to ensure we don't accidentally retain ourself.
-	flags |= kDealloc;
+	NSUInteger result;
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	if (readLength > 0)
 	{
-		[self closeWithError:nil];
+		// Read a specific length of data
+		
+		result = MIN(defaultValue, (readLength - bytesDone));
+		
+		// There is no need to prebuffer since we know exactly how much data we need to read.
+		// Even if the buffer isn't currently big enough to fit this amount of data,
+		// it would have to be resized eventually anyway.
+		
+		if (shouldPreBufferPtr)
+			*shouldPreBufferPtr = NO;
 	}
 	else
 	{
-		dispatch_sync(socketQueue, ^{
-			[self closeWithError:nil];
-		});
+		// Either reading until we find a specified terminator,
+		// or we're simply reading all available data.
+		// 
+		// In other words, one of:
+		// 
+		// - readDataToData packet
+		// - readDataWithTimeout packet
+		
+		if (maxLength > 0)
+			result =  MIN(defaultValue, (maxLength - bytesDone));
+		else
+			result = defaultValue;
+		
+		// Since we don't know the size of the read in advance,
+		// the shouldPreBuffer decision is based upon whether the returned value would fit
+		// in the current buffer without requiring a resize of the buffer.
+		// 
+		// This is because, in all likelyhood, the amount read from the socket will be less than the default value.
+		// Thus we should avoid over-allocating the read buffer when we can simply use the pre-buffer instead.
+		
+		if (shouldPreBufferPtr)
+		{
+			NSUInteger buffSize = [buffer length];
+			NSUInteger buffUsed = startOffset + bytesDone;
+			
+			NSUInteger buffSpace = buffSize - buffUsed;
+			
+			if (buffSpace >= result)
+				*shouldPreBufferPtr = NO;
+			else
+				*shouldPreBufferPtr = YES;
+		}
 	}
 	
-	delegate = nil;
-	
-	#if !OS_OBJECT_USE_OBJC
-	if (delegateQueue) dispatch_release(delegateQueue);
-	#endif
-	delegateQueue = NULL;
-	
-	#if !OS_OBJECT_USE_OBJC
-	if (socketQueue) dispatch_release(socketQueue);
-	#endif
-	socketQueue = NULL;
-	
-	LogInfo(@"%@ - %@ (finish)", THIS_METHOD, self);
+	return result;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Configuration
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-- (id)delegate
+/**
+ * For read packets without a set terminator, returns the amount of data
+ * that can be read without exceeding the readLength or maxLength.
+ * 
+ * The given parameter indicates the number of bytes estimated to be available on the socket,
+ * which is taken into consideration during the calculation.
+ * 
+ * The given hint MUST be greater than zero.
+**/
+- (NSUInteger)readLengthForNonTermWithHint:(NSUInteger)bytesAvailable
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	NSAssert(term == nil, @"This method does not apply to term reads");
+	NSAssert(bytesAvailable > 0, @"Invalid parameter: bytesAvailable");
+	
+	if (readLength > 0)
 	{
-		return delegate;
+		// Read a specific length of data
+		
+		return MIN(bytesAvailable, (readLength - bytesDone));
+		
+		// No need to avoid resizing the buffer.
+		// If the user provided their own buffer,
+		// and told us to read a certain length of data that exceeds the size of the buffer,
+		// then it is clear that our code will resize the buffer during the read operation.
+		// 
+		// This method does not actually do any resizing.
+		// The resizing will happen elsewhere if needed.
 	}
 	else
 	{
-		__block id result;
+		// Read all available data
 		
-		dispatch_sync(socketQueue, ^{
-			result = delegate;
-		});
+		NSUInteger result = bytesAvailable;
+		
+		if (maxLength > 0)
+		{
+			result = MIN(result, (maxLength - bytesDone));
+		}
+		
+		// No need to avoid resizing the buffer.
+		// If the user provided their own buffer,
+		// and told us to read all available data without giving us a maxLength,
+		// then it is clear that our code might resize the buffer during the read operation.
+		// 
+		// This method does not actually do any resizing.
+		// The resizing will happen elsewhere if needed.
 		
 		return result;
 	}
 }
 
-- (void)setDelegate:(id)newDelegate synchronously:(BOOL)synchronously
+/**
+ * For read packets with a set terminator, returns the amount of data
+ * that can be read without exceeding the maxLength.
+ * 
+ * The given parameter indicates the number of bytes estimated to be available on the socket,
+ * which is taken into consideration during the calculation.
+ * 
+ * To optimize memory allocations, mem copies, and mem moves
+ * the shouldPreBuffer boolean value will indicate if the data should be read into a prebuffer first,
+ * or if the data can be read directly into the read packet's buffer.
+**/
+- (NSUInteger)readLengthForTermWithHint:(NSUInteger)bytesAvailable shouldPreBuffer:(BOOL *)shouldPreBufferPtr
 {
-	dispatch_block_t block = ^{
-		delegate = newDelegate;
-	};
+	NSAssert(term != nil, @"This method does not apply to non-term reads");
+	NSAssert(bytesAvailable > 0, @"Invalid parameter: bytesAvailable");
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
-		block();
-	}
-	else {
-		if (synchronously)
-			dispatch_sync(socketQueue, block);
-		else
-			dispatch_async(socketQueue, block);
-	}
-}
-
-- (void)setDelegate:(id)newDelegate
-{
-	[self setDelegate:newDelegate synchronously:NO];
-}
-
-- (void)synchronouslySetDelegate:(id)newDelegate
-{
-	[self setDelegate:newDelegate synchronously:YES];
-}
-
-- (dispatch_queue_t)delegateQueue
-{
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	
+	NSUInteger result = bytesAvailable;
+	
+	if (maxLength > 0)
 	{
-		return delegateQueue;
+		result = MIN(result, (maxLength - bytesDone));
 	}
-	else
+	
+	// Should the data be read into the read packet's buffer, or into a pre-buffer first?
+	// 
+	// One would imagine the preferred option is the faster one.
+	// So which one is faster?
+	// 
+	// Reading directly into the packet's buffer requires:
+	// 1. Possibly resizing packet buffer (malloc/realloc)
+	// 2. Filling buffer (read)
+	// 3. Searching for term (memcmp)
+	// 4. Possibly copying overflow into prebuffer (malloc/realloc, memcpy)
+	// 
+	// Reading into prebuffer first:
+	// 1. Possibly resizing prebuffer (malloc/realloc)
+	// 2. Filling buffer (read)
+	// 3. Searching for term (memcmp)
+	// 4. Copying underflow into packet buffer (malloc/realloc, memcpy)
+	// 5. Removing underflow from prebuffer (memmove)
+	// 
+	// Comparing the performance of the two we can see that reading
+	// data into the prebuffer first is slower due to the extra memove.
+	// 
+	// However:
+	// The implementation of NSMutableData is open source via core foundation's CFMutableData.
+	// Decreasing the length of a mutable data object doesn't cause a realloc.
+	// In other words, the capacity of a mutable data object can grow, but doesn't shrink.
+	// 
+	// This means the prebuffer will rarely need a realloc.
+	// The packet buffer, on the other hand, may often need a realloc.
+	// This is especially true if we are the buffer owner.
+	// Furthermore, if we are constantly realloc'ing the packet buffer,
+	// and then moving the overflow into the prebuffer,
+	// then we're consistently over-allocating memory for each term read.
+	// And now we get into a bit of a tradeoff between speed and memory utilization.
+	// 
+	// The end result is that the two perform very similarly.
+	// And we can answer the original question very simply by another means.
+	// 
+	// If we can read all the data directly into the packet's buffer without resizing it first,
+	// then we do so. Otherwise we use the prebuffer.
+	
+	if (shouldPreBufferPtr)
 	{
-		__block dispatch_queue_t result;
-		
-		dispatch_sync(socketQueue, ^{
-			result = delegateQueue;
-		});
+		NSUInteger buffSize = [buffer length];
+		NSUInteger buffUsed = startOffset + bytesDone;
 		
-		return result;
+		if ((buffSize - buffUsed) >= result)
+			*shouldPreBufferPtr = NO;
+		else
+			*shouldPreBufferPtr = YES;
 	}
+	
+	return result;
 }
 
-- (void)setDelegateQueue:(dispatch_queue_t)newDelegateQueue synchronously:(BOOL)synchronously
+/**
+ * For read packets with a set terminator,
+ * returns the amount of data that can be read from the given preBuffer,
+ * without going over a terminator or the maxLength.
+ * 
+ * It is assumed the terminator has not already been read.
+ * 
+ * The term matcher scans the bytes as part of this call,
+ * so the returned amount of data MUST be moved from the preBuffer into the packet's buffer.
+**/
+- (NSUInteger)readLengthForTermWithPreBuffer:(GCDAsyncSocketPreBuffer *)preBuffer found:(BOOL *)foundPtr
 {
-	dispatch_block_t block = ^{
-		
-		#if !OS_OBJECT_USE_OBJC
-		if (delegateQueue) dispatch_release(delegateQueue);
-		if (newDelegateQueue) dispatch_retain(newDelegateQueue);
-		#endif
-		
-		delegateQueue = newDelegateQueue;
-	};
+	NSAssert(term != nil, @"This method does not apply to non-term reads");
+	NSAssert([preBuffer availableBytes] > 0, @"Invoked with empty pre buffer!");
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
-		block();
+	// We know that the terminator, as a whole, doesn't exist in our own buffer.
+	// But it is possible that a _portion_ of it exists at the end of our buffer.
+	// The term matcher remembers how much of it was matched,
+	// so we simply continue the search with the bytes in the preBuffer.
+	
+	NSUInteger preBufferLength = [preBuffer availableBytes];
+	
+	NSUInteger maxPreBufferLength;
+	if (maxLength > 0) {
+		maxPreBufferLength = MIN(preBufferLength, (maxLength - bytesDone));
+		
+		// Note: maxLength >= termLength
 	}
 	else {
-		if (synchronously)
-			dispatch_sync(socketQueue, block);
-		else
-			dispatch_async(socketQueue, block);
+		maxPreBufferLength = preBufferLength;
 	}
+	
+	// The preBuffer may be split across several segments,
+	// so we scan each of them in turn until we find the term or reach the maxPreBufferLength.
+	
+	__block NSUInteger result = 0;
+	__block BOOL found = NO;
+	
+	[preBuffer enumerateReadBuffersUsingBlock:^(const uint8_t *bytes, size_t length, BOOL *stop) {
+		
+		NSUInteger scanLength = MIN(length, (maxPreBufferLength - result));
+		
+		result += [self scanTermBytes:bytes length:scanLength found:&found];
+		
+		if (found || (result == maxPreBufferLength))
+		{
+			*stop = YES;
+		}
+	}];
+	
+	// There is no need to avoid resizing the buffer in this particular situation.
+	
+	if (foundPtr) *foundPtr = found;
+	return result;
 }
 
-- (void)setDelegateQueue:(dispatch_queue_t)newDelegateQueue
+/**
+ * For reads from a raw (non-secure) socket, where a single readv() call can fill both
+ * the read packet's buffer and the prebuffer.
+ *
+ * Returns the amount of data that should be read directly into the read packet's buffer.
+ * Any remaining bytes (bytesAvailable - result) should be read into the prebuffer during the same call.
+ *
+ * Reads of a specific length get exactly what they still need (or whatever is available),
+ * and reads of all available data get everything up to the maxLength.
+ * Term reads only use the space already available in the buffer,
+ * since there's no way to know in advance how much of the data belongs to this read.
+ *
+ * The given hint MUST be greater than zero.
+**/
+- (NSUInteger)readLengthForScatterWithHint:(NSUInteger)bytesAvailable
 {
-	[self setDelegateQueue:newDelegateQueue synchronously:NO];
-}
+	NSAssert(bytesAvailable > 0, @"Invalid parameter: bytesAvailable");
 
-- (void)synchronouslySetDelegateQueue:(dispatch_queue_t)newDelegateQueue
-{
-	[self setDelegateQueue:newDelegateQueue synchronously:YES];
+	if (term == nil)
+	{
+		return [self readLengthForNonTermWithHint:bytesAvailable];
+	}
+
+	NSUInteger buffSize = [buffer length];
+	NSUInteger buffUsed = startOffset + bytesDone;
+
+	NSUInteger result = MIN(bytesAvailable, (buffSize - buffUsed));
+
+	if (maxLength > 0)
+	{
+		result = MIN(result, (maxLength - bytesDone));
+	}
+
+	// This method does not actually do any resizing.
+	// For term reads, there is no need to do any resizing at all.
+
+	return result;
 }
 
-- (void)getDelegate:(id *)delegatePtr delegateQueue:(dispatch_queue_t *)delegateQueuePtr
+/**
+ * For read packets with a set terminator,
+ * continues the search for the term with the given bytes (see GCDAsyncSocketTermMatcher).
+ * 
+ * If the term is found, returns the number of bytes up to and including the end of the term.
+ * Otherwise returns the given length, as all the bytes were scanned.
+ * 
+ * For reads to any of several terms, every term's matcher scans the bytes.
+ * The term that ends first wins, and if several end at the same position, the longest one wins.
+ * (E.g. CRLF wins over LF.) Its index is stored in matchedTermIndex.
+**/
+- (NSUInteger)scanTermBytes:(const uint8_t *)bytes length:(NSUInteger)length found:(BOOL *)foundPtr
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	if (termMatchers == nil)
 	{
-		if (delegatePtr) *delegatePtr = delegate;
-		if (delegateQueuePtr) *delegateQueuePtr = delegateQueue;
+		return [termMatcher scanBytes:bytes length:length found:foundPtr];
 	}
-	else
+	
+	// Once any of the terms is found the read is done, and the matchers are never used again.
+	// So it doesn't matter that some matchers may have scanned past the end of the winning term.
+	
+	NSUInteger result = length;
+	NSUInteger resultTermLength = 0;
+	BOOL found = NO;
+	
+	NSUInteger index = 0;
+	for (GCDAsyncSocketTermMatcher *matcher in termMatchers)
 	{
-		__block id dPtr = NULL;
-		__block dispatch_queue_t dqPtr = NULL;
+		BOOL matcherFound = NO;
+		NSUInteger scanned = [matcher scanBytes:bytes length:length found:&matcherFound];
 		
-		dispatch_sync(socketQueue, ^{
-			dPtr = delegate;
-			dqPtr = delegateQueue;
-		});
+		if (matcherFound)
+		{
+			if (!found || (scanned < result) || ((scanned == result) && ([matcher termLength] > resultTermLength)))
+			{
+				found = YES;
+				result = scanned;
+				resultTermLength = [matcher termLength];
+				matchedTermIndex = index;
+			}
+		}
 		
-		if (delegatePtr) *delegatePtr = dPtr;
-		if (delegateQueuePtr) *delegateQueuePtr = dqPtr;
+		index++;
 	}
+	
+	if (foundPtr) *foundPtr = found;
+	return result;
 }
 
-- (void)setDelegate:(id)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue synchronously:(BOOL)synchronously
+/**
+ * For read packets with a set terminator, scans the packet buffer for the term.
+ * It is assumed the terminator had not been fully read prior to the new bytes.
+ * 
+ * If the term is found, the number of excess bytes after the term are returned.
+ * If the term is not found, this method will return -1.
+ * 
+ * Note: A return value of zero means the term was found at the very end.
+ * 
+ * Prerequisites:
+ * The given number of bytes have been added to the end of our buffer.
+ * Our bytesDone variable has NOT been changed due to the prebuffered bytes.
+**/
+- (NSInteger)searchForTermAfterPreBuffering:(ssize_t)numBytes
 {
-	dispatch_block_t block = ^{
-		
-		delegate = newDelegate;
-		
-		#if !OS_OBJECT_USE_OBJC
-		if (delegateQueue) dispatch_release(delegateQueue);
-		if (newDelegateQueue) dispatch_retain(newDelegateQueue);
-		#endif
-		
-		delegateQueue = newDelegateQueue;
-	};
+	NSAssert(term != nil, @"This method does not apply to non-term reads");
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
-		block();
-	}
-	else {
-		if (synchronously)
-			dispatch_sync(socketQueue, block);
-		else
-			dispatch_async(socketQueue, block);
+	// The term matcher already scanned everything up to bytesDone,
+	// so we only need to continue the search with the new bytes.
+	
+	const uint8_t *newBytes = (uint8_t *)[buffer mutableBytes] + startOffset + bytesDone;
+	
+	BOOL found = NO;
+	NSUInteger scanned = [self scanTermBytes:newBytes length:numBytes found:&found];
+	
+	if (found)
+	{
+		return numBytes - scanned;
 	}
+	
+	return -1;
 }
 
-- (void)setDelegate:(id)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue
-{
-	[self setDelegate:newDelegate delegateQueue:newDelegateQueue synchronously:NO];
-}
-
-- (void)synchronouslySetDelegate:(id)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue
-{
-	[self setDelegate:newDelegate delegateQueue:newDelegateQueue synchronously:YES];
-}
-
-- (BOOL)isIPv4Enabled
+/**
+ * For framed reads (reads prefixed with a length header).
+ * 
+ * Decodes the given header (which is headerLength bytes long) into the length of the frame's payload.
+ * Returns NO if the frame is longer than the maxLength of the read
+ * (or GCDAsyncSocketFrameLengthDefaultMax if the read has none), or wouldn't fit in the buffer.
+**/
+- (BOOL)getFrameLength:(NSUInteger *)frameLengthPtr fromHeader:(const uint8_t *)header
 {
-	// Note: YES means kIPv4Disabled is OFF
+	NSAssert(headerLength > 0, @"This method does not apply to non-framed reads");
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	uint64_t frameLength = 0;
+	
+	NSUInteger i;
+	for (i = 0; i < headerLength; i++)
 	{
-		return ((config & kIPv4Disabled) == 0);
+		if (headerBigEndian)
+			frameLength = (frameLength << 8) | header[i];
+		else
+			frameLength |= ((uint64_t)header[i] << (8 * i));
 	}
-	else
+	
+	NSUInteger limit = (maxLength > 0) ? maxLength : GCDAsyncSocketFrameLengthDefaultMax;
+	
+	// The payload goes into the buffer after the startOffset
+	limit = MIN(limit, (NSUIntegerMax - startOffset));
+	
+	if (frameLength > limit)
 	{
-		__block BOOL result;
-		
-		dispatch_sync(socketQueue, ^{
-			result = ((config & kIPv4Disabled) == 0);
-		});
-		
-		return result;
+		return NO;
 	}
+	
+	if (frameLengthPtr) *frameLengthPtr = (NSUInteger)frameLength;
+	return YES;
 }
 
-- (void)setIPv4Enabled:(BOOL)flag
+/**
+ * For framed reads (reads prefixed with a length header).
+ * 
+ * Called once the header has been parsed.
+ * From here on the packet is simply a read of the given length (the frame's payload).
+ * The header is not part of the data that gets delivered.
+**/
+- (void)beginFrameOfLength:(NSUInteger)frameLength
 {
-	// Note: YES means kIPv4Disabled is OFF
+	headerParsed = YES;
 	
-	dispatch_block_t block = ^{
-		
-		if (flag)
-			config &= ~kIPv4Disabled;
-		else
-			config |= kIPv4Disabled;
-	};
+	readLength = frameLength;
+	bytesDone = 0;
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_async(socketQueue, block);
+	[buffer setLength:(startOffset + frameLength)];
 }
 
-- (BOOL)isIPv6Enabled
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@class GCDAsyncSocketBroadcast;
+
+/**
+ * The GCDAsyncWritePacket encompasses the instructions for any given write.
+**/
+@interface GCDAsyncWritePacket : NSObject
 {
-	// Note: YES means kIPv6Disabled is OFF
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		return ((config & kIPv6Disabled) == 0);
-	}
-	else
+  @public
+	NSData *buffer;
+	NSUInteger bytesDone;
+	long tag;
+	NSTimeInterval timeout;
+	BOOL highPriority;
+	GCDAsyncSocketBroadcast *broadcast; // If set, the write is part of a broadcast
+}
+- (id)initWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i;
+
+- (void)setupWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i;
+- (void)clear;
+
+- (NSUInteger)length;
+- (NSUInteger)getVectors:(struct iovec *)iov
+                   count:(int *)countPtr
+                maxCount:(int)maxCount
+              fromOffset:(NSUInteger)offset
+               maxLength:(NSUInteger)maxLength;
+@end
+
+@implementation GCDAsyncWritePacket
+
+- (id)initWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i
+{
+	if((self = [super init]))
 	{
-		__block BOOL result;
-		
-		dispatch_sync(socketQueue, ^{
-			result = ((config & kIPv6Disabled) == 0);
-		});
-		
-		return result;
+		[self setupWithData:d timeout:t tag:i];
 	}
+	return self;
 }
 
-- (void)setIPv6Enabled:(BOOL)flag
+/**
+ * Sets up the packet for a new write.
+ * This is also used to recycle a packet that has completed a previous write.
+**/
+- (void)setupWithData:(NSData *)d timeout:(NSTimeInterval)t tag:(long)i
 {
-	// Note: YES means kIPv6Disabled is OFF
-	
-	dispatch_block_t block = ^{
-		
-		if (flag)
-			config &= ~kIPv6Disabled;
-		else
-			config |= kIPv6Disabled;
-	};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_async(socketQueue, block);
+	buffer = d; // Retain not copy. For performance as documented in header file.
+	bytesDone = 0;
+	timeout = t;
+	tag = i;
+	highPriority = NO;
+	broadcast = nil;
 }
 
-- (BOOL)isIPv4PreferredOverIPv6
+/**
+ * Drops the reference to the data of a completed write,
+ * so the packet doesn't keep it alive while waiting to be recycled.
+**/
+- (void)clear
 {
-	// Note: YES means kPreferIPv6 is OFF
+	buffer = nil;
+	broadcast = nil;
+}
+
+/**
+ * Returns the total number of bytes to be written.
+**/
+- (NSUInteger)length
+{
+	return [buffer length];
+}
+
+/**
+ * Fills in (at most maxCount) iovec structures describing the bytes of the packet,
+ * starting at the given offset and covering no more than maxLength bytes.
+ * 
+ * Returns the number of bytes described, and sets countPtr to the number of iovec structures used.
+**/
+- (NSUInteger)getVectors:(struct iovec *)iov
+                   count:(int *)countPtr
+                maxCount:(int)maxCount
+              fromOffset:(NSUInteger)offset
+               maxLength:(NSUInteger)maxLength
+{
+	NSUInteger bytesToWrite = MIN([buffer length] - offset, maxLength);
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	if ((maxCount < 1) || (bytesToWrite == 0))
 	{
-		return ((config & kPreferIPv6) == 0);
+		*countPtr = 0;
+		return 0;
 	}
-	else
+	
+	iov[0].iov_base = (void *)((const uint8_t *)[buffer bytes] + offset);
+	iov[0].iov_len  = (size_t)bytesToWrite;
+	
+	*countPtr = 1;
+	return bytesToWrite;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The GCDAsyncFileWritePacket writes (a range of) a file.
+ * 
+ * On regular sockets the file is sent with sendfile(), so its contents never pass through user space.
+ * The buffer is nil in that case.
+ * 
+ * Secure sockets need the data to pass through the SSL/TLS layer, so sendfile() is of no use there.
+ * Instead the range of the file is memory mapped into the buffer, and written like any other data.
+**/
+@interface GCDAsyncFileWritePacket : GCDAsyncWritePacket
+{
+  @public
+	int fileFD;
+	off_t fileOffset;
+	NSUInteger fileLength;
+}
+- (id)initWithFileDescriptor:(int)fd offset:(off_t)offset length:(NSUInteger)length timeout:(NSTimeInterval)t tag:(long)i;
+
+- (BOOL)fileCoversRange;
+- (BOOL)mapFile;
+@end
+
+@implementation GCDAsyncFileWritePacket
+
+- (id)initWithFileDescriptor:(int)fd offset:(off_t)offset length:(NSUInteger)length timeout:(NSTimeInterval)t tag:(long)i
+{
+	if((self = [super initWithData:nil timeout:t tag:i]))
 	{
-		__block BOOL result;
-		
-		dispatch_sync(socketQueue, ^{
-			result = ((config & kPreferIPv6) == 0);
-		});
-		
-		return result;
+		fileFD = fd;
+		fileOffset = offset;
+		fileLength = length;
 	}
+	return self;
 }
 
-- (void)setIPv4PreferredOverIPv6:(BOOL)flag
+- (void)dealloc
 {
-	// Note: YES means kPreferIPv6 is OFF
-	
-	dispatch_block_t block = ^{
-		
-		if (flag)
-			config &= ~kPreferIPv6;
-		else
-			config |= kPreferIPv6;
-	};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_async(socketQueue, block);
+	// The buffer (if any) has its own mapping, so the file can be closed without affecting it
+	close(fileFD);
 }
 
-- (id)userData
+- (NSUInteger)length
 {
-	__block id result = nil;
-	
-	dispatch_block_t block = ^{
-		
-		result = userData;
-	};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
+	return fileLength;
+}
+
+/**
+ * Returns NO if the file has been truncated since the write was queued,
+ * so that it no longer holds the entire range (or if the file can't be stat'ed at all).
+**/
+- (BOOL)fileCoversRange
+{
+	struct stat st;
+	if (fstat(fileFD, &st) < 0)
+	{
+		return NO;
+	}
 	
-	return result;
+	return (st.st_size >= fileOffset) && ((unsigned long long)(st.st_size - fileOffset) >= fileLength);
 }
 
-- (void)setUserData:(id)arbitraryUserData
+/**
+ * Maps the range of the file into the buffer.
+ * Returns NO if the file couldn't be mapped, in which case errno is set.
+ * 
+ * Touching a page of the mapping that lies beyond the end of the file raises SIGBUS,
+ * so check fileCoversRange first. Nothing can guard against the file shrinking after it's mapped.
+**/
+- (BOOL)mapFile
 {
-	dispatch_block_t block = ^{
+	// The offset of a mapping must be a multiple of the page size
+	
+	off_t pageSize = (off_t)getpagesize();
+	off_t mapOffset = fileOffset - (fileOffset % pageSize);
+	
+	size_t delta = (size_t)(fileOffset - mapOffset);
+	size_t mapLength = delta + fileLength;
+	
+	void *map = mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE, fileFD, mapOffset);
+	if (map == MAP_FAILED)
+	{
+		return NO;
+	}
+	
+	buffer = [[NSData alloc] initWithBytesNoCopy:((uint8_t *)map + delta)
+	                                      length:fileLength
+	                                 deallocator:^(void *bytes, NSUInteger len) {
 		
-		if (userData != arbitraryUserData)
-		{
-			userData = arbitraryUserData;
-		}
-	};
+		munmap(map, mapLength);
+	}];
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_async(socketQueue, block);
+	return YES;
 }
 
+@end
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Accepting
+#pragma mark -
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-- (BOOL)acceptOnPort:(uint16_t)port error:(NSError **)errPtr
+/**
+ * The GCDAsyncSegmentedWritePacket writes several pieces of data as a single logical packet.
+ * 
+ * On regular sockets the segments are handed to writev() as they are, so they never need to be concatenated.
+ * A partial write simply resumes at the segment (and offset within it) where the previous write stopped.
+ * 
+ * Secure sockets need a single buffer to hand to the SSL/TLS layer,
+ * so there the segments are flattened into the buffer before the first write.
+**/
+@interface GCDAsyncSegmentedWritePacket : GCDAsyncWritePacket
 {
-	return [self acceptOnInterface:nil port:port error:errPtr];
+  @public
+	NSArray *segments;
+	NSUInteger segmentsLength;
 }
+- (id)initWithSegments:(NSArray *)s length:(NSUInteger)length timeout:(NSTimeInterval)t tag:(long)i;
 
-- (BOOL)acceptOnInterface:(NSString *)inInterface port:(uint16_t)port error:(NSError **)errPtr
+- (void)flatten;
+@end
+
+@implementation GCDAsyncSegmentedWritePacket
+
+- (id)initWithSegments:(NSArray *)s length:(NSUInteger)length timeout:(NSTimeInterval)t tag:(long)i
 {
-	LogTrace();
-	
-	// Just in-case interface parameter is immutable.
-	NSString *interface = [inInterface copy];
-	
-	__block BOOL result = NO;
-	__block NSError *err = nil;
+	if((self = [super initWithData:nil timeout:t tag:i]))
+	{
+		segments = s;
+		segmentsLength = length;
+	}
+	return self;
+}
+
+- (NSUInteger)length
+{
+	return segmentsLength;
+}
+
+- (NSUInteger)getVectors:(struct iovec *)iov
+                   count:(int *)countPtr
+                maxCount:(int)maxCount
+              fromOffset:(NSUInteger)offset
+               maxLength:(NSUInteger)maxLength
+{
+	if (buffer)
+	{
+		return [super getVectors:iov count:countPtr maxCount:maxCount fromOffset:offset maxLength:maxLength];
+	}
 	
-	// CreateSocket Block
-	// This block will be invoked within the dispatch block below.
+	int count = 0;
+	NSUInteger bytesToWrite = 0;
 	
-	int(^createSocket)(int, NSData*) = ^int (int domain, NSData *interfaceAddr) {
-		
-		int socketFD = socket(domain, SOCK_STREAM, 0);
-		
-		if (socketFD == SOCKET_NULL)
-		{
-			NSString *reason = @"Error in socket() function";
-			err = [self errnoErrorWithReason:reason];
-			
-			return SOCKET_NULL;
-		}
-		
-		int status;
-		
-		// Set socket options
-		
-		status = fcntl(socketFD, F_SETFL, O_NONBLOCK);
-		if (status == -1)
-		{
-			NSString *reason = @"Error enabling non-blocking IO on socket (fcntl)";
-			err = [self errnoErrorWithReason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
-		}
+	for (NSData *segment in segments)
+	{
+		NSUInteger segmentLength = [segment length];
 		
-		int reuseOn = 1;
-		status = setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
-		if (status == -1)
+		if (offset >= segmentLength)
 		{
-			NSString *reason = @"Error enabling address reuse (setsockopt)";
-			err = [self errnoErrorWithReason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
+			// Segment was already written
+			offset -= segmentLength;
+			continue;
 		}
 		
-		// Bind socket
+		if ((count == maxCount) || (bytesToWrite == maxLength))
+			break;
 		
-		status = bind(socketFD, (const struct sockaddr *)[interfaceAddr bytes], (socklen_t)[interfaceAddr length]);
-		if (status == -1)
-		{
-			NSString *reason = @"Error in bind() function";
-			err = [self errnoErrorWithReason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
-		}
+		NSUInteger vectorLength = MIN(segmentLength - offset, maxLength - bytesToWrite);
 		
-		// Listen
+		iov[count].iov_base = (void *)((const uint8_t *)[segment bytes] + offset);
+		iov[count].iov_len  = (size_t)vectorLength;
 		
-		status = listen(socketFD, 1024);
-		if (status == -1)
-		{
-			NSString *reason = @"Error in listen() function";
-			err = [self errnoErrorWithReason:reason];
-			
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
-			return SOCKET_NULL;
-		}
+		count++;
+		bytesToWrite += vectorLength;
+		offset = 0;
+	}
+	
+	*countPtr = count;
+	return bytesToWrite;
+}
+
+/**
+ * Concatenates the segments into the buffer.
+**/
+- (void)flatten
+{
+	NSMutableData *data = [[NSMutableData alloc] initWithCapacity:segmentsLength];
+	
+	for (NSData *segment in segments)
+	{
+		[data appendData:segment];
+	}
+	
+	buffer = data;
+	segments = nil;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The GCDAsyncSpecialPacket encompasses special instructions for interruptions in the read/write queues.
+ * This class my be altered to support more than just TLS in the future.
+**/
+@interface GCDAsyncSpecialPacket : NSObject
+{
+  @public
+	NSDictionary *tlsSettings;
+}
+- (id)initWithTLSSettings:(NSDictionary *)settings;
+@end
+
+@implementation GCDAsyncSpecialPacket
+
+- (id)initWithTLSSettings:(NSDictionary *)settings
+{
+	if((self = [super init]))
+	{
+		tlsSettings = [settings copy];
+	}
+	return self;
+}
+
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The GCDAsyncSocketBroadcast tracks a write of the same data to many sockets
+ * (see writeData:toSockets:withTimeout:tag:completionQueue:completionHandler:).
+ * 
+ * Each socket writes the data with a packet of its own (as the progress of each write is different),
+ * but the packets all reference the same data, and this object.
+ * Once every socket has either written the data or failed to, the completion handler is invoked.
+**/
+@interface GCDAsyncSocketBroadcast : NSObject
+{
+	_Atomic(NSUInteger) remainingCount;
+	_Atomic(NSUInteger) writtenCount;
+	_Atomic(NSUInteger) failedCount;
+	
+	dispatch_queue_t completionQueue;
+	void (^completionHandler)(NSUInteger writtenCount, NSUInteger failedCount);
+}
+- (id)initWithCount:(NSUInteger)count
+    completionQueue:(dispatch_queue_t)queue
+  completionHandler:(void (^)(NSUInteger writtenCount, NSUInteger failedCount))handler;
+
+- (void)completeWithSuccess:(BOOL)success;
+@end
+
+@implementation GCDAsyncSocketBroadcast
+
+- (id)initWithCount:(NSUInteger)count
+    completionQueue:(dispatch_queue_t)queue
+  completionHandler:(void (^)(NSUInteger writtenCount, NSUInteger failedCount))handler
+{
+	if ((self = [super init]))
+	{
+		atomic_init(&remainingCount, count);
+		atomic_init(&writtenCount, 0);
+		atomic_init(&failedCount, 0);
 		
-		return socketFD;
-	};
+		completionQueue = queue ? queue : dispatch_get_main_queue();
+		#if !OS_OBJECT_USE_OBJC
+		dispatch_retain(completionQueue);
+		#endif
+		
+		completionHandler = [handler copy];
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	#if !OS_OBJECT_USE_OBJC
+	dispatch_release(completionQueue);
+	#endif
+}
+
+/**
+ * Called (once per socket) when a socket has written the data, or failed to.
+ * May be called on any of the socket queues.
+**/
+- (void)completeWithSuccess:(BOOL)success
+{
+	if (success)
+		atomic_fetch_add_explicit(&writtenCount, 1, memory_order_relaxed);
+	else
+		atomic_fetch_add_explicit(&failedCount, 1, memory_order_relaxed);
 	
-	// Create dispatch block and run on socketQueue
+	if (atomic_fetch_sub_explicit(&remainingCount, 1, memory_order_acq_rel) != 1)
+	{
+		return;
+	}
 	
-	dispatch_block_t block = ^{ @autoreleasepool {
+	if (completionHandler)
+	{
+		NSUInteger written = atomic_load_explicit(&writtenCount, memory_order_relaxed);
+		NSUInteger failed = atomic_load_explicit(&failedCount, memory_order_relaxed);
 		
-		if (delegate == nil) // Must have delegate set
-		{
-			NSString *msg = @"Attempting to accept without a delegate. Set a delegate first.";
-			err = [self badConfigError:msg];
-			
-			return_from_block;
-		}
+		void (^handler)(NSUInteger, NSUInteger) = completionHandler;
 		
-		if (delegateQueue == NULL) // Must have delegate queue set
-		{
-			NSString *msg = @"Attempting to accept without a delegate queue. Set a delegate queue first.";
-			err = [self badConfigError:msg];
+		dispatch_async(completionQueue, ^{ @autoreleasepool {
 			
-			return_from_block;
+			handler(written, failed);
+		}});
+	}
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Completed packets are kept around for reuse, up to this many per socket (and packet type).
+**/
+#define GCDAsyncSocketPacketPoolLimit  16
+
+/**
+ * The GCDAsyncSocketPacketQueue is a FIFO queue of packets, stored in a ring buffer.
+ * 
+ * Unlike with an NSMutableArray, removing the packet at the head is O(1) and never touches the heap.
+ * The storage only grows (doubling in size) when the queue is full.
+ * So once a socket's queues have grown to the depth its traffic needs,
+ * packets are queued and dequeued without any allocations.
+**/
+@interface GCDAsyncSocketPacketQueue : NSObject
+{
+	__strong id *slots;
+	NSUInteger capacity; // Always a power of 2
+	NSUInteger head;
+	NSUInteger count;
+	
+	NSUInteger allocationCount;
+}
+- (id)initWithCapacity:(NSUInteger)numSlots;
+
+- (NSUInteger)count;
+- (id)objectAtIndex:(NSUInteger)index;
+
+- (void)addObject:(id)object;
+- (void)addObjectToFront:(id)object;
+- (id)removeFirstObject;
+- (void)removeAllObjects;
+
+- (NSUInteger)allocationCount;
+@end
+
+@implementation GCDAsyncSocketPacketQueue
+
+- (id)initWithCapacity:(NSUInteger)numSlots
+{
+	if ((self = [super init]))
+	{
+		capacity = 1;
+		while (capacity < numSlots)
+		{
+			capacity <<= 1;
 		}
 		
-		BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
-		BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+		slots = (__strong id *)calloc(capacity, sizeof(id));
+		allocationCount = 1;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[self removeAllObjects];
+	free(slots);
+}
+
+- (NSUInteger)count
+{
+	return count;
+}
+
+- (id)objectAtIndex:(NSUInteger)index
+{
+	NSAssert(index < count, @"Index beyond end of queue");
+	
+	return slots[(head + index) & (capacity - 1)];
+}
+
+- (void)addObject:(id)object
+{
+	[self ensureCapacityForAdditionalObject];
+	
+	slots[(head + count) & (capacity - 1)] = object;
+	count++;
+}
+
+/**
+ * Adds the object at the head of the queue, so it's the next to be removed.
+**/
+- (void)addObjectToFront:(id)object
+{
+	[self ensureCapacityForAdditionalObject];
+	
+	head = (head - 1) & (capacity - 1);
+	slots[head] = object;
+	count++;
+}
+
+- (void)ensureCapacityForAdditionalObject
+{
+	if (count == capacity)
+	{
+		NSUInteger newCapacity = capacity * 2;
+		__strong id *newSlots = (__strong id *)calloc(newCapacity, sizeof(id));
 		
-		if (isIPv4Disabled && isIPv6Disabled) // Must have IPv4 or IPv6 enabled
+		for (NSUInteger i = 0; i < count; i++)
 		{
-			NSString *msg = @"Both IPv4 and IPv6 have been disabled. Must enable at least one protocol first.";
-			err = [self badConfigError:msg];
+			NSUInteger slot = (head + i) & (capacity - 1);
 			
-			return_from_block;
+			newSlots[i] = slots[slot];
+			slots[slot] = nil;
 		}
 		
-		if (![self isDisconnected]) // Must be disconnected
-		{
-			NSString *msg = @"Attempting to accept while connected or accepting connections. Disconnect first.";
-			err = [self badConfigError:msg];
-			
-			return_from_block;
-		}
+		free(slots);
 		
-		// Clear queues (spurious read/write requests post disconnect)
-		[readQueue removeAllObjects];
-		[writeQueue removeAllObjects];
+		slots = newSlots;
+		capacity = newCapacity;
+		head = 0;
 		
-		// Resolve interface from description
+		allocationCount++;
+	}
+}
+
+/**
+ * Removes and returns the packet at the head of the queue, or nil if the queue is empty.
+**/
+- (id)removeFirstObject
+{
+	if (count == 0) return nil;
+	
+	id object = slots[head];
+	slots[head] = nil;
+	
+	head = (head + 1) & (capacity - 1);
+	count--;
+	
+	return object;
+}
+
+- (void)removeAllObjects
+{
+	while (count > 0)
+	{
+		[self removeFirstObject];
+	}
+	
+	head = 0;
+}
+
+/**
+ * Returns the number of times the storage was allocated (initially, and each time it grew).
+**/
+- (NSUInteger)allocationCount
+{
+	return allocationCount;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The timing wheel has 4 levels of 256 slots each.
+ * Level 0 holds the timeouts due within the next 256 ticks, one slot per tick.
+ * Each level above covers 256 times the span of the one below it,
+ * and its slots are cascaded down into the lower levels as their time approaches.
+ * 
+ * At the default granularity, the wheel spans about 500 days.
+ * A timeout beyond that parks at the top, and is simply placed again when its slot comes up.
+**/
+#define GCDAsyncSocketTimingWheelLevels     4
+#define GCDAsyncSocketTimingWheelSlotBits   8
+#define GCDAsyncSocketTimingWheelSlots      (1 << GCDAsyncSocketTimingWheelSlotBits)
+#define GCDAsyncSocketTimingWheelSlotMask   (GCDAsyncSocketTimingWheelSlots - 1)
+
+#define GCDAsyncSocketTimingWheelDefaultGranularity  0.01 // 10 ms
+
+/**
+ * Returns the current (monotonic) time in nanoseconds.
+**/
+static uint64_t GCDAsyncSocketTimingWheelNow(void)
+{
+	static mach_timebase_info_data_t timebase;
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		mach_timebase_info(&timebase);
+	});
+	
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
+@interface GCDAsyncSocketTimeout ()
+{
+  @public
+	GCDAsyncSocketTimingWheel *wheel;
+	dispatch_queue_t queue;
+	dispatch_block_t handler;
+	
+	// Only accessed on the queue
+	BOOL armed;
+	
+	// Protected by the wheel's mutex (but only ever changed on the queue)
+	uint64_t generation;
+	
+	// Protected by the wheel's mutex
+	uint64_t expiryTick;
+	NSUInteger slotIndex;
+	BOOL linked;
+	GCDAsyncSocketTimeout *next;
+	__unsafe_unretained GCDAsyncSocketTimeout *prev;
+}
+- (id)initWithWheel:(GCDAsyncSocketTimingWheel *)aWheel queue:(dispatch_queue_t)aQueue handler:(dispatch_block_t)aHandler;
+
+- (void)fireWithGeneration:(uint64_t)aGeneration;
+@end
+
+@interface GCDAsyncSocketTimingWheel ()
+{
+	uint64_t granularityNanos;
+	
+	pthread_mutex_t mutex;
+	
+	__strong GCDAsyncSocketTimeout **slots; // Levels * Slots lists
+	NSUInteger linkedCount;
+	
+	uint64_t currentTick;
+	uint64_t baseTick; // Tick that corresponds to baseTime
+	uint64_t baseTime;
+	
+	dispatch_queue_t tickQueue;
+	dispatch_source_t tickTimer;
+	BOOL ticking;
+}
+- (void)armTimeout:(GCDAsyncSocketTimeout *)timeout interval:(NSTimeInterval)interval;
+- (void)disarmTimeout:(GCDAsyncSocketTimeout *)timeout;
+@end
+
+@implementation GCDAsyncSocketTimingWheel
+
++ (GCDAsyncSocketTimingWheel *)sharedTimingWheel
+{
+	static GCDAsyncSocketTimingWheel *sharedTimingWheel;
+	static dispatch_once_t onceToken;
+	
+	dispatch_once(&onceToken, ^{
+		sharedTimingWheel = [[GCDAsyncSocketTimingWheel alloc] initWithGranularity:GCDAsyncSocketTimingWheelDefaultGranularity];
+	});
+	
+	return sharedTimingWheel;
+}
+
+- (id)init
+{
+	return [self initWithGranularity:GCDAsyncSocketTimingWheelDefaultGranularity];
+}
+
+- (id)initWithGranularity:(NSTimeInterval)granularity
+{
+	if ((self = [super init]))
+	{
+		granularityNanos = (uint64_t)(granularity * NSEC_PER_SEC);
+		if (granularityNanos < NSEC_PER_MSEC)
+			granularityNanos = NSEC_PER_MSEC;
 		
-		NSMutableData *interface4 = nil;
-		NSMutableData *interface6 = nil;
+		pthread_mutex_init(&mutex, NULL);
 		
-		[self getInterfaceAddress4:&interface4 address6:&interface6 fromDescription:interface port:port];
+		slots = (__strong GCDAsyncSocketTimeout **)calloc(GCDAsyncSocketTimingWheelLevels * GCDAsyncSocketTimingWheelSlots,
+		                                                  sizeof(GCDAsyncSocketTimeout *));
 		
-		if ((interface4 == nil) && (interface6 == nil))
-		{
-			NSString *msg = @"Unknown interface. Specify valid interface by name (e.g. \"en1\") or IP address.";
-			err = [self badParamError:msg];
-			
-			return_from_block;
-		}
+		tickQueue = dispatch_queue_create("GCDAsyncSocketTimingWheel", DISPATCH_QUEUE_SERIAL);
+		tickTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, tickQueue);
 		
-		if (isIPv4Disabled && (interface6 == nil))
-		{
-			NSString *msg = @"IPv4 has been disabled and specified interface doesn't support IPv6.";
-			err = [self badParamError:msg];
-			
-			return_from_block;
-		}
+		__weak GCDAsyncSocketTimingWheel *weakSelf = self;
 		
-		if (isIPv6Disabled && (interface4 == nil))
-		{
-			NSString *msg = @"IPv6 has been disabled and specified interface doesn't support IPv4.";
-			err = [self badParamError:msg];
+		dispatch_source_set_event_handler(tickTimer, ^{ @autoreleasepool {
+		#pragma clang diagnostic push
+		#pragma clang diagnostic warning "-Wimplicit-retain-self"
 			
-			return_from_block;
-		}
+			__strong GCDAsyncSocketTimingWheel *strongSelf = weakSelf;
+			if (strongSelf == nil) return_from_block;
+			
+			[strongSelf tick];
+			
+		#pragma clang diagnostic pop
+		}});
 		
-		BOOL enableIPv4 = !isIPv4Disabled && (interface4 != nil);
-		BOOL enableIPv6 = !isIPv6Disabled && (interface6 != nil);
+		// The timer stays suspended until a timeout is armed
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	// Every linked timeout retains the wheel, so there's nothing left in the slots here
+	
+	if (!ticking)
+	{
+		// A suspended source can't be released
+		dispatch_resume(tickTimer);
+	}
+	dispatch_source_cancel(tickTimer);
+	
+	#if !OS_OBJECT_USE_OBJC
+	dispatch_release(tickTimer);
+	dispatch_release(tickQueue);
+	#endif
+	
+	free(slots);
+	pthread_mutex_destroy(&mutex);
+}
+
+- (NSTimeInterval)granularity
+{
+	return (NSTimeInterval)granularityNanos / NSEC_PER_SEC;
+}
+
+- (GCDAsyncSocketTimeout *)timeoutWithQueue:(dispatch_queue_t)queue handler:(dispatch_block_t)handler
+{
+	return [[GCDAsyncSocketTimeout alloc] initWithWheel:self queue:queue handler:handler];
+}
+
+/**
+ * Adds the timeout to the slot for its expiry tick, on the lowest level that reaches that far.
+ * Must be called with the mutex held.
+**/
+- (void)linkTimeout:(GCDAsyncSocketTimeout *)timeout
+{
+	const uint64_t horizon = ((uint64_t)1 << (GCDAsyncSocketTimingWheelSlotBits * GCDAsyncSocketTimingWheelLevels)) - 1;
+	
+	uint64_t expiry = MAX(timeout->expiryTick, currentTick);
+	uint64_t delta = expiry - currentTick;
+	
+	if (delta > horizon)
+	{
+		// Park it as far out as the wheel goes. It's placed again once it gets there.
+		delta = horizon;
+		expiry = currentTick + horizon;
+	}
+	
+	NSUInteger level = 0;
+	while ((delta >> (GCDAsyncSocketTimingWheelSlotBits * (level + 1))) != 0)
+	{
+		level++;
+	}
+	
+	NSUInteger slot = (NSUInteger)((expiry >> (GCDAsyncSocketTimingWheelSlotBits * level)) & GCDAsyncSocketTimingWheelSlotMask);
+	NSUInteger index = (level * GCDAsyncSocketTimingWheelSlots) + slot;
+	
+	timeout->slotIndex = index;
+	timeout->prev = nil;
+	timeout->next = slots[index];
+	
+	if (slots[index])
+	{
+		slots[index]->prev = timeout;
+	}
+	slots[index] = timeout;
+	
+	timeout->linked = YES;
+	linkedCount++;
+}
+
+/**
+ * Removes the timeout from its slot.
+ * Must be called with the mutex held.
+**/
+- (void)unlinkTimeout:(GCDAsyncSocketTimeout *)timeout
+{
+	// The slot (or previous timeout) may hold the last strong reference
+	GCDAsyncSocketTimeout *strongTimeout = timeout;
+	
+	if (strongTimeout->next)
+	{
+		strongTimeout->next->prev = strongTimeout->prev;
+	}
+	
+	if (strongTimeout->prev)
+	{
+		strongTimeout->prev->next = strongTimeout->next;
+	}
+	else
+	{
+		slots[strongTimeout->slotIndex] = strongTimeout->next;
+	}
+	
+	strongTimeout->next = nil;
+	strongTimeout->prev = nil;
+	strongTimeout->linked = NO;
+	linkedCount--;
+}
+
+- (void)armTimeout:(GCDAsyncSocketTimeout *)timeout interval:(NSTimeInterval)interval
+{
+	// Round up, so the timeout never fires early
+	double ticks = ceil((interval * NSEC_PER_SEC) / (double)granularityNanos);
+	
+	uint64_t delta;
+	if (ticks < 1.0)
+		delta = 1;
+	else if (ticks > (double)(UINT64_MAX >> 2))
+		delta = (UINT64_MAX >> 2);
+	else
+		delta = (uint64_t)ticks;
+	
+	pthread_mutex_lock(&mutex);
+	
+	uint64_t now = GCDAsyncSocketTimingWheelNow();
+	
+	if (!ticking)
+	{
+		// The wheel was idle, so the ticks pick up from here
 		
-		// Create sockets, configure, bind, and listen
+		baseTick = currentTick;
+		baseTime = now;
 		
-		if (enableIPv4)
-		{
-			LogVerbose(@"Creating IPv4 socket");
-			socket4FD = createSocket(AF_INET, interface4);
-			
-			if (socket4FD == SOCKET_NULL)
-			{
-				return_from_block;
-			}
-		}
+		dispatch_time_t start = dispatch_time(DISPATCH_TIME_NOW, (int64_t)granularityNanos);
+		dispatch_source_set_timer(tickTimer, start, granularityNanos, (granularityNanos / 4));
+		dispatch_resume(tickTimer);
 		
-		if (enableIPv6)
-		{
-			LogVerbose(@"Creating IPv6 socket");
-			
-			if (enableIPv4 && (port == 0))
-			{
-				// No specific port was specified, so we allowed the OS to pick an available port for us.
-				// Now we need to make sure the IPv6 socket listens on the same port as the IPv4 socket.
-				
-				struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)[interface6 mutableBytes];
-				addr6->sin6_port = htons([self localPort4]);
-			}
-			
-			socket6FD = createSocket(AF_INET6, interface6);
-			
-			if (socket6FD == SOCKET_NULL)
-			{
-				if (socket4FD != SOCKET_NULL)
-				{
-					LogVerbose(@"close(socket4FD)");
-					close(socket4FD);
-				}
-				
-				return_from_block;
-			}
-		}
+		ticking = YES;
+	}
+	
+	if (timeout->linked)
+	{
+		[self unlinkTimeout:timeout];
+	}
+	
+	uint64_t nowTick = baseTick + ((now - baseTime) / granularityNanos);
+	
+	timeout->generation++;
+	timeout->expiryTick = MAX(nowTick, currentTick) + delta;
+	
+	[self linkTimeout:timeout];
+	
+	pthread_mutex_unlock(&mutex);
+}
+
+- (void)disarmTimeout:(GCDAsyncSocketTimeout *)timeout
+{
+	pthread_mutex_lock(&mutex);
+	
+	// Also invalidates the timeout if it already expired, but hasn't been delivered yet
+	timeout->generation++;
+	
+	if (timeout->linked)
+	{
+		[self unlinkTimeout:timeout];
+	}
+	
+	pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Advances the wheel up to the current time, and fires every timeout that expired along the way.
+**/
+- (void)tick
+{
+	pthread_mutex_lock(&mutex);
+	
+	uint64_t targetTick = baseTick + ((GCDAsyncSocketTimingWheelNow() - baseTime) / granularityNanos);
+	
+	while ((currentTick < targetTick) && (linkedCount > 0))
+	{
+		currentTick++;
 		
-		// Create accept sources
+		// Whenever the slots of a level wrap around, cascade the next slot of the level above it
 		
-		if (enableIPv4)
+		for (NSUInteger level = 1; level < GCDAsyncSocketTimingWheelLevels; level++)
 		{
-			accept4Source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, socket4FD, 0, socketQueue);
-			
-			int socketFD = socket4FD;
-			dispatch_source_t acceptSource = accept4Source;
+			uint64_t levelMask = ((uint64_t)1 << (GCDAsyncSocketTimingWheelSlotBits * level)) - 1;
 			
-			__weak GCDAsyncSocket *weakSelf = self;
-			
-			dispatch_source_set_event_handler(accept4Source, ^{ @autoreleasepool {
-			#pragma clang diagnostic push
-			#pragma clang diagnostic warning "-Wimplicit-retain-self"
-				
-				__strong GCDAsyncSocket *strongSelf = weakSelf;
-				if (strongSelf == nil) return_from_block;
-				
-				LogVerbose(@"event4Block");
-				
-				unsigned long i = 0;
-				unsigned long numPendingConnections = dispatch_source_get_data(acceptSource);
-				
-				LogVerbose(@"numPendingConnections: %lu", numPendingConnections);
-				
-				while ([strongSelf doAccept:socketFD] && (++i < numPendingConnections));
-				
-			#pragma clang diagnostic pop
-			}});
+			if ((currentTick & levelMask) != 0) break;
 			
+			NSUInteger slot = (NSUInteger)((currentTick >> (GCDAsyncSocketTimingWheelSlotBits * level)) & GCDAsyncSocketTimingWheelSlotMask);
+			NSUInteger index = (level * GCDAsyncSocketTimingWheelSlots) + slot;
 			
-			dispatch_source_set_cancel_handler(accept4Source, ^{
-			#pragma clang diagnostic push
-			#pragma clang diagnostic warning "-Wimplicit-retain-self"
+			GCDAsyncSocketTimeout *timeout = slots[index];
+			while (timeout)
+			{
+				GCDAsyncSocketTimeout *nextTimeout = timeout->next;
 				
-				#if !OS_OBJECT_USE_OBJC
-				LogVerbose(@"dispatch_release(accept4Source)");
-				dispatch_release(acceptSource);
-				#endif
+				[self unlinkTimeout:timeout];
+				[self linkTimeout:timeout];
 				
-				LogVerbose(@"close(socket4FD)");
-				close(socketFD);
-			
-			#pragma clang diagnostic pop
-			});
-			
-			LogVerbose(@"dispatch_resume(accept4Source)");
-			dispatch_resume(accept4Source);
+				timeout = nextTimeout;
+			}
 		}
 		
-		if (enableIPv6)
+		NSUInteger index = (NSUInteger)(currentTick & GCDAsyncSocketTimingWheelSlotMask);
+		
+		GCDAsyncSocketTimeout *timeout = slots[index];
+		while (timeout)
 		{
-			accept6Source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, socket6FD, 0, socketQueue);
+			GCDAsyncSocketTimeout *nextTimeout = timeout->next;
 			
-			int socketFD = socket6FD;
-			dispatch_source_t acceptSource = accept6Source;
-			
-			__weak GCDAsyncSocket *weakSelf = self;
-			
-			dispatch_source_set_event_handler(accept6Source, ^{ @autoreleasepool {
-			#pragma clang diagnostic push
-			#pragma clang diagnostic warning "-Wimplicit-retain-self"
-				
-				__strong GCDAsyncSocket *strongSelf = weakSelf;
-				if (strongSelf == nil) return_from_block;
-				
-				LogVerbose(@"event6Block");
-				
-				unsigned long i = 0;
-				unsigned long numPendingConnections = dispatch_source_get_data(acceptSource);
-				
-				LogVerbose(@"numPendingConnections: %lu", numPendingConnections);
-				
-				while ([strongSelf doAccept:socketFD] && (++i < numPendingConnections));
-				
-			#pragma clang diagnostic pop
-			}});
+			[self unlinkTimeout:timeout];
 			
-			dispatch_source_set_cancel_handler(accept6Source, ^{
-			#pragma clang diagnostic push
-			#pragma clang diagnostic warning "-Wimplicit-retain-self"
-				
-				#if !OS_OBJECT_USE_OBJC
-				LogVerbose(@"dispatch_release(accept6Source)");
-				dispatch_release(acceptSource);
-				#endif
-				
-				LogVerbose(@"close(socket6FD)");
-				close(socketFD);
+			if (timeout->expiryTick <= currentTick)
+			{
+				GCDAsyncSocketTimeout *expiredTimeout = timeout;
+				uint64_t expiredGeneration = timeout->generation;
 				
-			#pragma clang diagnostic pop
-			});
+				dispatch_async(timeout->queue, ^{ @autoreleasepool {
+					
+					[expiredTimeout fireWithGeneration:expiredGeneration];
+				}});
+			}
+			else
+			{
+				// Parked beyond the span of the wheel
+				[self linkTimeout:timeout];
+			}
 			
-			LogVerbose(@"dispatch_resume(accept6Source)");
-			dispatch_resume(accept6Source);
+			timeout = nextTimeout;
 		}
-		
-		flags |= kSocketStarted;
-		
-		result = YES;
-	}};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
+	}
 	
-	if (result == NO)
+	if (linkedCount == 0)
 	{
-		LogInfo(@"Error in accept: %@", err);
+		// Nothing left to time, so stop ticking until the next timeout is armed
 		
-		if (errPtr)
-			*errPtr = err;
+		dispatch_suspend(tickTimer);
+		ticking = NO;
 	}
 	
-	return result;
+	pthread_mutex_unlock(&mutex);
 }
 
-- (BOOL)doAccept:(int)parentSocketFD
-{
-	LogTrace();
+@end
+
+@implementation GCDAsyncSocketTimeout
+
+- (id)initWithWheel:(GCDAsyncSocketTimingWheel *)aWheel queue:(dispatch_queue_t)aQueue handler:(dispatch_block_t)aHandler
+{
+	if ((self = [super init]))
+	{
+		wheel = aWheel;
+		
+		queue = aQueue;
+		#if !OS_OBJECT_USE_OBJC
+		dispatch_retain(queue);
+		#endif
+		
+		handler = [aHandler copy];
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	#if !OS_OBJECT_USE_OBJC
+	dispatch_release(queue);
+	#endif
+}
+
+- (BOOL)isArmed
+{
+	return armed;
+}
+
+- (void)armWithInterval:(NSTimeInterval)interval
+{
+	armed = YES;
+	[wheel armTimeout:self interval:interval];
+}
+
+- (void)disarm
+{
+	if (armed)
+	{
+		armed = NO;
+		[wheel disarmTimeout:self];
+	}
+}
+
+- (void)fireWithGeneration:(uint64_t)aGeneration
+{
+	// The generation changes whenever the timeout is armed or disarmed.
+	// So this is stale if it was re-armed (or disarmed) after it expired.
 	
-	BOOL isIPv4;
-	int childSocketFD;
-	NSData *childSocketAddress;
+	if (!armed || (generation != aGeneration)) return;
 	
-	if (parentSocketFD == socket4FD)
-	{
-		isIPv4 = YES;
+	armed = NO;
+	handler();
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The maximum number of events an event loop thread takes from its kqueue at a time.
+**/
+#define GCDAsyncSocketEventLoopMaxEvents  256
+
+@class GCDAsyncSocketEventLoop;
+
+/**
+ * The GCDAsyncSocketEventSource stands in for the read and write dispatch sources of a socket,
+ * when the socket uses the event loop backend (GCDAsyncSocketEventBackendEventLoop).
+ * 
+ * The socket is registered with the kqueue of one of the event loop threads, using EV_CLEAR (edge triggered).
+ * Events are forwarded to the socketQueue, where they're handled just like the dispatch sources' events.
+ * 
+ * Suspending and resuming only flip a flag, instead of making a syscall.
+ * An edge that arrives while suspended is held until the source is resumed.
+ * And since the socket code expects level triggered sources (like the dispatch sources),
+ * the read side fires again as long as the socket is known to have data (or the EOF) left to read.
+ * 
+ * All methods, except those called by the event loop thread, must be invoked on the socketQueue.
+**/
+@interface GCDAsyncSocketEventSource : NSObject
+{
+  @public
+	int fd;
+	dispatch_queue_t queue;
+	GCDAsyncSocketEventLoop *loop;
+	uintptr_t sourceID; // Unique for the life of the process, and used as the udata of the source's events
+	
+	// The handler returns the number of bytes it believes are still available to read
+	unsigned long (^readHandler)(unsigned long bytesAvailable);
+	dispatch_block_t writeHandler;
+	void (^errorHandler)(int err);
+	
+	// Set by the event loop thread
+	_Atomic(unsigned long) readEventBytes;
+	_Atomic(BOOL) readEventEOF;
+	_Atomic(BOOL) readEventPending;
+	_Atomic(BOOL) writeEventPending;
+	_Atomic(int) eventError;
+	_Atomic(BOOL) eventsScheduled;
+	
+	// Only accessed on the queue
+	BOOL readSuspended;
+	BOOL writeSuspended;
+	BOOL readPending;
+	BOOL writePending;
+	BOOL readEOF;
+	unsigned long readBytes;
+	BOOL cancelled;
+}
+- (id)initWithFD:(int)socketFD
+           queue:(dispatch_queue_t)socketQueue
+     readHandler:(unsigned long (^)(unsigned long bytesAvailable))aReadHandler
+    writeHandler:(dispatch_block_t)aWriteHandler
+    errorHandler:(void (^)(int err))anErrorHandler;
+
+- (BOOL)activate;
+- (void)suspendRead;
+- (void)resumeReadWithBytesAvailable:(unsigned long)bytesAvailable;
+- (void)suspendWrite;
+- (void)resumeWrite;
+- (void)cancel;
+
+- (BOOL)eventLoopDidReadEventWithBytes:(unsigned long)bytes eof:(BOOL)eof;
+- (BOOL)eventLoopDidWriteEvent;
+- (BOOL)eventLoopDidFailWithError:(int)err;
+- (void)deliverEvents;
+@end
+
+/**
+ * The GCDAsyncSocketEventLoop is a thread that waits on a kqueue, on behalf of a shard of the sockets.
+ * There's a fixed number of them (see +[GCDAsyncSocket setEventLoopThreadCount:]),
+ * and sockets are spread across them round-robin.
+ * 
+ * Kernel crossings are batched in both directions:
+ * registrations are queued up and submitted along with the thread's next kevent() call,
+ * and the events taken from the kqueue are handed to each socketQueue with a single dispatch_async.
+ * 
+ * If waiting on the kqueue fails (for any reason other than being interrupted), the thread stops.
+ * Every registered socket is closed with the error, and the event loop turns away new sockets,
+ * which fall back to dispatch sources.
+**/
+@interface GCDAsyncSocketEventLoop : NSObject
+{
+	int kq;
+	BOOL batchesChanges; // NO if the kqueue doesn't support EVFILT_USER, in which case changes are submitted right away
+	
+	pthread_mutex_t mutex;
+	CFMutableDictionaryRef sources; // Registered sources, by sourceID
+	int failure; // The errno of the kevent() call that stopped the thread, if it stopped
+	
+	struct kevent *pendingChanges;
+	int pendingChangesCount;
+	int pendingChangesCapacity;
+	
+	// Batches of pending changes the thread has taken, and the ones it has submitted to the kqueue
+	uint64_t changeBatchesTaken;
+	uint64_t changeBatchesSubmitted;
+	pthread_cond_t changesSubmitted;
+	
+	NSThread *thread;
+}
++ (GCDAsyncSocketEventLoop *)nextEventLoop;
+
+- (BOOL)registerSource:(GCDAsyncSocketEventSource *)source;
+- (void)unregisterSource:(GCDAsyncSocketEventSource *)source;
+@end
+
+static NSUInteger GCDAsyncSocketEventLoopThreadCount = 0; // Zero means the number of active processors
+
+#if OS_OBJECT_USE_OBJC
+  #define GCDAsyncSocketQueueKey(queue)  ((__bridge const void *)(queue))
+#else
+  #define GCDAsyncSocketQueueKey(queue)  ((const void *)(queue))
+#endif
+
+@implementation GCDAsyncSocketEventLoop
+
++ (GCDAsyncSocketEventLoop *)nextEventLoop
+{
+	static NSArray *eventLoops;
+	static _Atomic(NSUInteger) nextIndex;
+	static dispatch_once_t onceToken;
+	
+	dispatch_once(&onceToken, ^{
 		
-		struct sockaddr_in addr;
-		socklen_t addrLen = sizeof(addr);
+		NSUInteger count = GCDAsyncSocketEventLoopThreadCount;
+		if (count == 0)
+			count = [[NSProcessInfo processInfo] activeProcessorCount];
 		
-		childSocketFD = accept(parentSocketFD, (struct sockaddr *)&addr, &addrLen);
+		NSMutableArray *loops = [NSMutableArray arrayWithCapacity:count];
+		for (NSUInteger i = 0; i < count; i++)
+		{
+			[loops addObject:[[GCDAsyncSocketEventLoop alloc] init]];
+		}
 		
-		if (childSocketFD == -1)
+		eventLoops = [loops copy];
+	});
+	
+	NSUInteger index = atomic_fetch_add(&nextIndex, 1);
+	return [eventLoops objectAtIndex:(index % [eventLoops count])];
+}
+
+- (id)init
+{
+	if ((self = [super init]))
+	{
+		kq = kqueue();
+		
+		if (kq >= 0)
 		{
-			LogWarn(@"Accept failed with error: %@", [self errnoError]);
-			return NO;
+			// The thread is woken up (with EVFILT_USER) when there are changes for it to submit.
+			// If that's not supported, changes are submitted by whoever makes them.
+			
+			struct kevent wakeup;
+			EV_SET(&wakeup, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+			
+			batchesChanges = (kevent(kq, &wakeup, 1, NULL, 0, NULL) == 0);
 		}
 		
-		childSocketAddress = [NSData dataWithBytes:&addr length:addrLen];
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&changesSubmitted, NULL);
+		sources = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+		
+		// The event loops live for the life of the process
+		
+		thread = [[NSThread alloc] initWithTarget:self selector:@selector(run) object:nil];
+		[thread setName:@"GCDAsyncSocketEventLoop"];
+		[thread start];
 	}
-	else // if (parentSocketFD == socket6FD)
+	return self;
+}
+
+- (BOOL)registerSource:(GCDAsyncSocketEventSource *)source
+{
+	if (kq < 0) return NO;
+	
+	// Registered before the events are added, so the very first edge isn't dropped
+	
+	pthread_mutex_lock(&mutex);
+	
+	if (failure != 0)
 	{
-		isIPv4 = NO;
+		pthread_mutex_unlock(&mutex);
 		
-		struct sockaddr_in6 addr;
-		socklen_t addrLen = sizeof(addr);
+		errno = failure;
+		return NO;
+	}
+	
+	CFDictionarySetValue(sources, (const void *)source->sourceID, (__bridge const void *)source);
+	
+	pthread_mutex_unlock(&mutex);
+	
+	struct kevent changes[2];
+	EV_SET(&changes[0], source->fd, EVFILT_READ,  EV_ADD | EV_CLEAR, 0, 0, (void *)source->sourceID);
+	EV_SET(&changes[1], source->fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, (void *)source->sourceID);
+	
+	if (!batchesChanges)
+	{
+		if (kevent(kq, changes, 2, NULL, 0, NULL) < 0)
+		{
+			[self unregisterSource:source];
+			return NO;
+		}
 		
-		childSocketFD = accept(parentSocketFD, (struct sockaddr *)&addr, &addrLen);
+		return YES;
+	}
+	
+	// Queue up the changes, to be submitted with the event loop thread's next kevent() call.
+	// So a burst of new connections costs a single wakeup, rather than a syscall per connection.
+	// If a change fails, the source finds out through an EV_ERROR event.
+	
+	BOOL needsWakeup = NO;
+	
+	pthread_mutex_lock(&mutex);
+	
+	if ((pendingChangesCount + 2) > pendingChangesCapacity)
+	{
+		int newCapacity = MAX(64, (pendingChangesCapacity * 2));
+		struct kevent *newChanges = realloc(pendingChanges, (newCapacity * sizeof(struct kevent)));
 		
-		if (childSocketFD == -1)
+		if (newChanges == NULL)
 		{
-			LogWarn(@"Accept failed with error: %@", [self errnoError]);
+			pthread_mutex_unlock(&mutex);
+			
+			[self unregisterSource:source];
 			return NO;
 		}
 		
-		childSocketAddress = [NSData dataWithBytes:&addr length:addrLen];
+		pendingChanges = newChanges;
+		pendingChangesCapacity = newCapacity;
 	}
 	
-	// Enable non-blocking IO on the socket
+	memcpy(pendingChanges + pendingChangesCount, changes, sizeof(changes));
+	pendingChangesCount += 2;
 	
-	int result = fcntl(childSocketFD, F_SETFL, O_NONBLOCK);
-	if (result == -1)
+	// If there were changes pending already, the thread has been woken up for them
+	needsWakeup = (pendingChangesCount == 2);
+	
+	pthread_mutex_unlock(&mutex);
+	
+	if (needsWakeup)
 	{
-		LogWarn(@"Error enabling non-blocking IO on accepted socket (fcntl)");
-		return NO;
+		struct kevent wakeup;
+		EV_SET(&wakeup, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+		
+		kevent(kq, &wakeup, 1, NULL, 0, NULL);
 	}
 	
-	// Prevent SIGPIPE signals
+	return YES;
+}
+
+- (void)unregisterSource:(GCDAsyncSocketEventSource *)source
+{
+	// Closing the socket removes its events from the kqueue.
+	// Events already taken from the kqueue are dropped, as the source is no longer registered.
+	// And since source IDs aren't reused, neither are events for a closed socket whose descriptor was reused.
 	
-	int nosigpipe = 1;
-	setsockopt(childSocketFD, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+	pthread_mutex_lock(&mutex);
 	
-	// Notify delegate
+	CFDictionaryRemoveValue(sources, (const void *)source->sourceID);
 	
-	if (delegateQueue)
+	// Drop changes that were never submitted
+	
+	int count = 0;
+	for (int i = 0; i < pendingChangesCount; i++)
 	{
-		__strong id theDelegate = delegate;
+		if ((uintptr_t)pendingChanges[i].udata != source->sourceID)
+		{
+			pendingChanges[count++] = pendingChanges[i];
+		}
+	}
+	pendingChangesCount = count;
+	
+	// The source's changes may have been taken by the thread already, on their way into the kqueue.
+	// Wait for them to get there, while the socket is still open, so closing it removes them.
+	// Otherwise they could be added after the close, to whatever socket reuses the descriptor,
+	// and stay in the kqueue for good.
+	
+	uint64_t batchInFlight = changeBatchesTaken;
+	
+	while (changeBatchesSubmitted < batchInFlight)
+	{
+		pthread_cond_wait(&changesSubmitted, &mutex);
+	}
+	
+	pthread_mutex_unlock(&mutex);
+}
+
+- (void)run
+{
+	struct kevent changes[GCDAsyncSocketEventLoopMaxEvents];
+	struct kevent events[GCDAsyncSocketEventLoopMaxEvents];
+	
+	// Events for sources that share a socketQueue are delivered together, by queue
+	CFMutableDictionaryRef batches = CFDictionaryCreateMutable(NULL, 0, NULL, &kCFTypeDictionaryValueCallBacks);
+	const void *batchValues[GCDAsyncSocketEventLoopMaxEvents];
+	
+	BOOL running = YES;
+	
+	while (running) { @autoreleasepool {
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
-			
-			// Query delegate for custom socket queue
+		// Submit the queued changes along with the wait.
+		// No more changes than there are events, so the event list always has room for their errors.
+		
+		int changeCount = 0;
+		
+		if (batchesChanges)
+		{
+			pthread_mutex_lock(&mutex);
 			
-			dispatch_queue_t childSocketQueue = NULL;
+			changeCount = MIN(pendingChangesCount, GCDAsyncSocketEventLoopMaxEvents);
+			if (changeCount > 0)
+			{
+				memcpy(changes, pendingChanges, (changeCount * sizeof(struct kevent)));
+				memmove(pendingChanges, pendingChanges + changeCount,
+				        ((pendingChangesCount - changeCount) * sizeof(struct kevent)));
+				
+				pendingChangesCount -= changeCount;
+				changeBatchesTaken++;
+			}
 			
-			if ([theDelegate respondsToSelector:@selector(newSocketQueueForConnectionFromAddress:onSocket:)])
+			pthread_mutex_unlock(&mutex);
+		}
+		
+		// If there are changes, unregisterSource: may be waiting for them to be submitted (see there).
+		// So they're submitted without blocking, and the thread only waits for events once there are none left.
+		
+		static const struct timespec noWait = { 0, 0 };
+		
+		int count = kevent(kq, changes, changeCount, events, GCDAsyncSocketEventLoopMaxEvents,
+		                   ((changeCount > 0) ? &noWait : NULL));
+		int eventErrno = errno;
+		
+		pthread_mutex_lock(&mutex);
+		
+		if (changeCount > 0)
+		{
+			changeBatchesSubmitted++;
+			pthread_cond_broadcast(&changesSubmitted);
+		}
+		
+		if (count < 0)
+		{
+			if (eventErrno == EINTR)
 			{
-				childSocketQueue = [theDelegate newSocketQueueForConnectionFromAddress:childSocketAddress
-				                                                              onSocket:self];
+				pthread_mutex_unlock(&mutex);
+				continue;
 			}
 			
-			// Create GCDAsyncSocket instance for accepted socket
+			LogError(@"Error in kevent() function: %s", strerror(eventErrno));
 			
-			GCDAsyncSocket *acceptedSocket = [[GCDAsyncSocket alloc] initWithDelegate:theDelegate
-			                                                            delegateQueue:delegateQueue
-			                                                              socketQueue:childSocketQueue];
+			// The thread can't wait for events anymore, and would otherwise leave its sockets hanging.
+			// So each of them gets the error, which closes it.
 			
-			if (isIPv4)
-				acceptedSocket->socket4FD = childSocketFD;
-			else
-				acceptedSocket->socket6FD = childSocketFD;
+			[self failSourcesWithError:eventErrno];
 			
-			acceptedSocket->flags = (kSocketStarted | kConnected);
+			running = NO;
+			count = 0;
+		}
+		
+		for (int i = 0; i < count; i++)
+		{
+			if (events[i].filter == EVFILT_USER) continue;
 			
-			// Setup read and write sources for accepted socket
+			// Only touch the source if it's still registered (in which case the table is keeping it alive)
 			
-			dispatch_async(acceptedSocket->socketQueue, ^{ @autoreleasepool {
-				
-				[acceptedSocket setupReadAndWriteSourcesForNewlyConnectedSocket:childSocketFD];
-			}});
+			GCDAsyncSocketEventSource *source =
+			    (__bridge GCDAsyncSocketEventSource *)CFDictionaryGetValue(sources, events[i].udata);
 			
-			// Notify delegate
+			if (source == nil) continue;
 			
-			if ([theDelegate respondsToSelector:@selector(socket:didAcceptNewSocket:)])
+			BOOL needsDelivery;
+			
+			if (events[i].flags & EV_ERROR)
 			{
-				[theDelegate socket:self didAcceptNewSocket:acceptedSocket];
+				needsDelivery = [source eventLoopDidFailWithError:(int)events[i].data];
+			}
+			else if (events[i].filter == EVFILT_READ)
+			{
+				needsDelivery = [source eventLoopDidReadEventWithBytes:(unsigned long)events[i].data
+				                                                   eof:((events[i].flags & EV_EOF) != 0)];
+			}
+			else if (events[i].filter == EVFILT_WRITE)
+			{
+				needsDelivery = [source eventLoopDidWriteEvent];
+			}
+			else
+			{
+				needsDelivery = NO;
 			}
 			
-			// Release the socket queue returned from the delegate (it was retained by acceptedSocket)
-			#if !OS_OBJECT_USE_OBJC
-			if (childSocketQueue) dispatch_release(childSocketQueue);
-			#endif
+			if (needsDelivery)
+			{
+				const void *key = GCDAsyncSocketQueueKey(source->queue);
+				NSMutableArray *batch = (__bridge NSMutableArray *)CFDictionaryGetValue(batches, key);
+				
+				if (batch == nil)
+				{
+					batch = [[NSMutableArray alloc] initWithCapacity:1];
+					CFDictionarySetValue(batches, key, (__bridge const void *)batch);
+				}
+				
+				[batch addObject:source];
+			}
+		}
+		
+		pthread_mutex_unlock(&mutex);
+		
+		CFIndex batchCount = CFDictionaryGetCount(batches);
+		CFDictionaryGetKeysAndValues(batches, NULL, batchValues);
+		
+		for (CFIndex i = 0; i < batchCount; i++)
+		{
+			NSArray *batch = (__bridge NSArray *)batchValues[i];
+			GCDAsyncSocketEventSource *firstSource = [batch objectAtIndex:0];
 			
-			// The accepted socket should have been retained by the delegate.
-			// Otherwise it gets properly released when exiting the block.
-		}});
-	}
+			dispatch_async(firstSource->queue, ^{
+				
+				for (GCDAsyncSocketEventSource *source in batch)
+				{
+					@autoreleasepool {
+						[source deliverEvents];
+					}
+				}
+			});
+		}
+		
+		CFDictionaryRemoveAllValues(batches);
+	}}
 	
-	return YES;
+	CFRelease(batches);
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Connecting
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
 /**
- * This method runs through the various checks required prior to a connection attempt.
- * It is shared between the connectToHost and connectToAddress methods.
+ * Reports the error to every registered source, and turns away any sources registered from here on.
+ * Changes that were never submitted are dropped.
  * 
+ * There may be more sources (and queues) than fit in a batch, so each one gets a delivery of its own.
+ * It stays registered until its socket closes (in response to the error) and unregisters it.
+ * 
+ * Must be called with the mutex held.
 **/
-- (BOOL)preConnectWithInterface:(NSString *)interface error:(NSError **)errPtr
+- (void)failSourcesWithError:(int)err
 {
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	failure = err;
+	pendingChangesCount = 0;
 	
-	if (delegate == nil) // Must have delegate set
-	{
-		if (errPtr)
-		{
-			NSString *msg = @"Attempting to connect without a delegate. Set a delegate first.";
-			*errPtr = [self badConfigError:msg];
-		}
-		return NO;
-	}
-	
-	if (delegateQueue == NULL) // Must have delegate queue set
-	{
-		if (errPtr)
-		{
-			NSString *msg = @"Attempting to connect without a delegate queue. Set a delegate queue first.";
-			*errPtr = [self badConfigError:msg];
-		}
-		return NO;
-	}
+	CFIndex sourceCount = CFDictionaryGetCount(sources);
+	if (sourceCount == 0) return;
 	
-	if (![self isDisconnected]) // Must be disconnected
-	{
-		if (errPtr)
-		{
-			NSString *msg = @"Attempting to connect while connected or accepting connections. Disconnect first.";
-			*errPtr = [self badConfigError:msg];
-		}
-		return NO;
-	}
+	const void **sourceValues = malloc(sourceCount * sizeof(const void *));
+	if (sourceValues == NULL) return;
 	
-	BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
-	BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+	CFDictionaryGetKeysAndValues(sources, NULL, sourceValues);
 	
-	if (isIPv4Disabled && isIPv6Disabled) // Must have IPv4 or IPv6 enabled
+	for (CFIndex i = 0; i < sourceCount; i++)
 	{
-		if (errPtr)
+		GCDAsyncSocketEventSource *source = (__bridge GCDAsyncSocketEventSource *)sourceValues[i];
+		
+		if ([source eventLoopDidFailWithError:err])
 		{
-			NSString *msg = @"Both IPv4 and IPv6 have been disabled. Must enable at least one protocol first.";
-			*errPtr = [self badConfigError:msg];
+			dispatch_async(source->queue, ^{ @autoreleasepool {
+				
+				[source deliverEvents];
+			}});
 		}
-		return NO;
 	}
 	
-	if (interface)
+	free(sourceValues);
+}
+
+@end
+
+@implementation GCDAsyncSocketEventSource
+
+- (id)initWithFD:(int)socketFD
+           queue:(dispatch_queue_t)socketQueue
+     readHandler:(unsigned long (^)(unsigned long bytesAvailable))aReadHandler
+    writeHandler:(dispatch_block_t)aWriteHandler
+    errorHandler:(void (^)(int err))anErrorHandler
+{
+	static _Atomic(uintptr_t) lastSourceID;
+	
+	if ((self = [super init]))
 	{
-		NSMutableData *interface4 = nil;
-		NSMutableData *interface6 = nil;
-		
-		[self getInterfaceAddress4:&interface4 address6:&interface6 fromDescription:interface port:0];
+		fd = socketFD;
+		sourceID = atomic_fetch_add(&lastSourceID, 1) + 1;
 		
-		if ((interface4 == nil) && (interface6 == nil))
-		{
-			if (errPtr)
-			{
-				NSString *msg = @"Unknown interface. Specify valid interface by name (e.g. \"en1\") or IP address.";
-				*errPtr = [self badParamError:msg];
-			}
-			return NO;
-		}
+		queue = socketQueue;
+		#if !OS_OBJECT_USE_OBJC
+		dispatch_retain(queue);
+		#endif
 		
-		if (isIPv4Disabled && (interface6 == nil))
-		{
-			if (errPtr)
-			{
-				NSString *msg = @"IPv4 has been disabled and specified interface doesn't support IPv6.";
-				*errPtr = [self badParamError:msg];
-			}
-			return NO;
-		}
+		readHandler = [aReadHandler copy];
+		writeHandler = [aWriteHandler copy];
+		errorHandler = [anErrorHandler copy];
 		
-		if (isIPv6Disabled && (interface4 == nil))
-		{
-			if (errPtr)
-			{
-				NSString *msg = @"IPv6 has been disabled and specified interface doesn't support IPv4.";
-				*errPtr = [self badParamError:msg];
-			}
-			return NO;
-		}
+		// Like a new dispatch source, it starts out suspended
+		readSuspended = YES;
+		writeSuspended = YES;
 		
-		connectInterface4 = interface4;
-		connectInterface6 = interface6;
+		loop = [GCDAsyncSocketEventLoop nextEventLoop];
 	}
+	return self;
+}
+
+- (void)dealloc
+{
+	#if !OS_OBJECT_USE_OBJC
+	dispatch_release(queue);
+	#endif
+}
+
+/**
+ * Invoked on the event loop thread.
+ * Several events that arrive before the socketQueue gets to them are delivered as one.
+ * Returns YES if the source needs to be scheduled for delivery (see deliverEvents).
+**/
+- (BOOL)eventLoopDidReadEventWithBytes:(unsigned long)bytes eof:(BOOL)eof
+{
+	atomic_store(&readEventBytes, bytes);
+	if (eof) atomic_store(&readEventEOF, YES);
 	
-	// Clear queues (spurious read/write requests post disconnect)
-	[readQueue removeAllObjects];
-	[writeQueue removeAllObjects];
+	atomic_store(&readEventPending, YES);
 	
-	return YES;
+	return !atomic_exchange(&eventsScheduled, YES);
 }
 
-- (BOOL)connectToHost:(NSString*)host onPort:(uint16_t)port error:(NSError **)errPtr
+- (BOOL)eventLoopDidWriteEvent
 {
-	return [self connectToHost:host onPort:port withTimeout:-1 error:errPtr];
+	atomic_store(&writeEventPending, YES);
+	
+	return !atomic_exchange(&eventsScheduled, YES);
 }
 
-- (BOOL)connectToHost:(NSString *)host
-               onPort:(uint16_t)port
-          withTimeout:(NSTimeInterval)timeout
-                error:(NSError **)errPtr
+/**
+ * Invoked on the event loop thread, if the source's events couldn't be added to the kqueue.
+**/
+- (BOOL)eventLoopDidFailWithError:(int)err
 {
-	return [self connectToHost:host onPort:port viaInterface:nil withTimeout:timeout error:errPtr];
+	atomic_store(&eventError, err);
+	
+	return !atomic_exchange(&eventsScheduled, YES);
 }
 
-- (BOOL)connectToHost:(NSString *)inHost
-               onPort:(uint16_t)port
-         viaInterface:(NSString *)inInterface
-          withTimeout:(NSTimeInterval)timeout
-                error:(NSError **)errPtr
+/**
+ * Invoked on the queue, to handle the events the event loop thread took for the source.
+**/
+- (void)deliverEvents
 {
-	LogTrace();
+	// Cleared first, so events that arrive from here on schedule another delivery
+	atomic_store(&eventsScheduled, NO);
 	
-	// Just in case immutable objects were passed
-	NSString *host = [inHost copy];
-	NSString *interface = [inInterface copy];
+	int err = atomic_exchange(&eventError, 0);
+	if (err != 0)
+	{
+		if (!cancelled)
+			errorHandler(err);
+		
+		return;
+	}
 	
-	__block BOOL result = NO;
-	__block NSError *preConnectErr = nil;
+	if (atomic_exchange(&readEventPending, NO))
+	{
+		readPending = YES;
+		readBytes = atomic_load(&readEventBytes);
+		if (atomic_load(&readEventEOF)) readEOF = YES;
+	}
 	
-	dispatch_block_t block = ^{ @autoreleasepool {
-		
-		// Check for problems with host parameter
-		
-		if ([host length] == 0)
-		{
-			NSString *msg = @"Invalid host parameter (nil or \"\"). Should be a domain name or IP address string.";
-			preConnectErr = [self badParamError:msg];
-			
-			return_from_block;
-		}
-		
-		// Run through standard pre-connect checks
-		
-		if (![self preConnectWithInterface:interface error:&preConnectErr])
-		{
-			return_from_block;
-		}
-		
-		// We've made it past all the checks.
-		// It's time to start the connection process.
-		
-		flags |= kSocketStarted;
-		
-		LogVerbose(@"Dispatching DNS lookup...");
-		
-		// It's possible that the given host parameter is actually a NSMutableString.
-		// So we want to copy it now, within this block that will be executed synchronously.
-		// This way the asynchronous lookup block below doesn't have to worry about it changing.
-		
-		NSString *hostCpy = [host copy];
+	if (atomic_exchange(&writeEventPending, NO))
+	{
+		writePending = YES;
+	}
+	
+	[self fireRead];
+	[self fireWrite];
+}
+
+- (void)fireRead
+{
+	if (cancelled || readSuspended || !readPending) return;
+	
+	readPending = NO;
+	
+	unsigned long bytesLeft = readHandler(readBytes);
+	
+	if (!cancelled && !readSuspended && !readPending && ((bytesLeft > 0) || readEOF))
+	{
+		// The socket still has data (or the EOF) waiting, which a level triggered source would fire for again.
+		// But there won't be another edge for it, so fire again explicitly.
 		
-		int aStateIndex = stateIndex;
-		__weak GCDAsyncSocket *weakSelf = self;
+		readPending = YES;
+		readBytes = bytesLeft;
 		
-		dispatch_queue_t globalConcurrentQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
-		dispatch_async(globalConcurrentQueue, ^{ @autoreleasepool {
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
-			
-			NSError *lookupErr = nil;
-			NSMutableArray *addresses = [GCDAsyncSocket lookupHost:hostCpy port:port error:&lookupErr];
-			
-			__strong GCDAsyncSocket *strongSelf = weakSelf;
-			if (strongSelf == nil) return_from_block;
-			
-			if (lookupErr)
-			{
-				dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
-					
-					[strongSelf lookup:aStateIndex didFail:lookupErr];
-				}});
-			}
-			else
-			{
-				NSData *address4 = nil;
-				NSData *address6 = nil;
-				
-				for (NSData *address in addresses)
-				{
-					if (!address4 && [GCDAsyncSocket isIPv4Address:address])
-					{
-						address4 = address;
-					}
-					else if (!address6 && [GCDAsyncSocket isIPv6Address:address])
-					{
-						address6 = address;
-					}
-				}
-				
-				dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
-					
-					[strongSelf lookup:aStateIndex didSucceedWithAddress4:address4 address6:address6];
-				}});
-			}
+		dispatch_async(queue, ^{ @autoreleasepool {
 			
-		#pragma clang diagnostic pop
+			[self fireRead];
 		}});
-		
-		[self startConnectTimeout:timeout];
-		
-		result = YES;
-	}};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
-	
-	
-	if (errPtr) *errPtr = preConnectErr;
-	return result;
+	}
 }
 
-- (BOOL)connectToAddress:(NSData *)remoteAddr error:(NSError **)errPtr
+- (void)fireWrite
 {
-	return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:-1 error:errPtr];
+	if (cancelled || writeSuspended || !writePending) return;
+	
+	writePending = NO;
+	
+	writeHandler();
 }
 
-- (BOOL)connectToAddress:(NSData *)remoteAddr withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr
+- (void)suspendRead
 {
-	return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:timeout error:errPtr];
+	readSuspended = YES;
 }
 
-- (BOOL)connectToAddress:(NSData *)inRemoteAddr
-            viaInterface:(NSString *)inInterface
-             withTimeout:(NSTimeInterval)timeout
-                   error:(NSError **)errPtr
+/**
+ * The socket passes in the number of bytes it believes are still available to read.
+ * If there are any (or the EOF was reached), the source fires right away, just like a level triggered source would.
+**/
+- (void)resumeReadWithBytesAvailable:(unsigned long)bytesAvailable
 {
-	LogTrace();
-	
-	// Just in case immutable objects were passed
-	NSData *remoteAddr = [inRemoteAddr copy];
-	NSString *interface = [inInterface copy];
+	readSuspended = NO;
 	
-	__block BOOL result = NO;
-	__block NSError *err = nil;
+	if (!readPending && ((bytesAvailable > 0) || readEOF))
+	{
+		readPending = YES;
+		readBytes = bytesAvailable;
+	}
 	
-	dispatch_block_t block = ^{ @autoreleasepool {
-		
-		// Check for problems with remoteAddr parameter
-		
-		NSData *address4 = nil;
-		NSData *address6 = nil;
-		
-		if ([remoteAddr length] >= sizeof(struct sockaddr))
-		{
-			const struct sockaddr *sockaddr = (const struct sockaddr *)[remoteAddr bytes];
+	if (readPending)
+	{
+		dispatch_async(queue, ^{ @autoreleasepool {
 			
-			if (sockaddr->sa_family == AF_INET)
-			{
-				if ([remoteAddr length] == sizeof(struct sockaddr_in))
-				{
-					address4 = remoteAddr;
-				}
-			}
-			else if (sockaddr->sa_family == AF_INET6)
-			{
-				if ([remoteAddr length] == sizeof(struct sockaddr_in6))
-				{
-					address6 = remoteAddr;
-				}
-			}
-		}
-		
-		if ((address4 == nil) && (address6 == nil))
-		{
-			NSString *msg = @"A valid IPv4 or IPv6 address was not given";
-			err = [self badParamError:msg];
+			[self fireRead];
+		}});
+	}
+}
+
+- (void)suspendWrite
+{
+	writeSuspended = YES;
+}
+
+- (void)resumeWrite
+{
+	writeSuspended = NO;
+	
+	if (writePending)
+	{
+		dispatch_async(queue, ^{ @autoreleasepool {
 			
-			return_from_block;
-		}
+			[self fireWrite];
+		}});
+	}
+}
+
+/**
+ * Registers the socket with the event loop.
+ * Returns NO if that failed right away, in which case errno is set.
+ * Otherwise any failure is reported to the errorHandler later on.
+**/
+- (BOOL)activate
+{
+	return [loop registerSource:self];
+}
+
+/**
+ * Stops delivering events, and unregisters from the event loop.
+ * The caller closes the socket afterwards.
+**/
+- (void)cancel
+{
+	if (cancelled) return;
+	
+	cancelled = YES;
+	[loop unregisterSource:self];
+	
+	// Break the retain cycles through the handlers
+	readHandler = nil;
+	writeHandler = nil;
+	errorHandler = nil;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * A fixed set of serial queues that a listening socket hands out to the sockets it accepts,
+ * instead of every accepted socket creating a queue of its own.
+ * 
+ * Each queue keeps count of the sockets using it (its load),
+ * which the least-loaded assignment picks by, and which is exposed via -[GCDAsyncSocket socketQueuePoolLoads].
+ * 
+ * Sockets sharing a queue also share its queue-specific key (see queueKeyAtIndex:),
+ * so the queue doesn't pile up a key for each and every socket.
+**/
+@interface GCDAsyncSocketQueuePool : NSObject
+{
+  @public
+	NSUInteger count;
+#if OS_OBJECT_USE_OBJC
+	__strong dispatch_queue_t *queues;
+#else
+	dispatch_queue_t *queues;
+#endif
+	_Atomic(NSUInteger) *loads; // The address of each queue's load also serves as its queue-specific key
+	_Atomic(NSUInteger) nextIndex;
+}
+- (id)initWithCount:(NSUInteger)count;
+
+- (NSUInteger)acquireQueueIndexWithAssignment:(GCDAsyncSocketQueuePoolAssignment)assignment;
+- (void)releaseQueueAtIndex:(NSUInteger)index;
+
+- (void *)queueKeyAtIndex:(NSUInteger)index;
+- (NSArray *)loads;
+@end
+
+@implementation GCDAsyncSocketQueuePool
+
+- (id)initWithCount:(NSUInteger)aCount
+{
+	if ((self = [super init]))
+	{
+		count = MAX(aCount, 1);
 		
-		BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
-		BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+		queues = calloc(count, sizeof(dispatch_queue_t));
+		loads = calloc(count, sizeof(_Atomic(NSUInteger)));
 		
-		if (isIPv4Disabled && (address4 != nil))
+		for (NSUInteger i = 0; i < count; i++)
 		{
-			NSString *msg = @"IPv4 has been disabled and an IPv4 address was passed.";
-			err = [self badParamError:msg];
+			// Darwin doesn't have per-core root queues, so these all target the default priority root queue.
+			// The fixed number of queues is what keeps the sockets' work from spreading across tons of them.
 			
-			return_from_block;
-		}
-		
-		if (isIPv6Disabled && (address6 != nil))
-		{
-			NSString *msg = @"IPv6 has been disabled and an IPv6 address was passed.";
-			err = [self badParamError:msg];
+			queues[i] = dispatch_queue_create([GCDAsyncSocketQueueName UTF8String], NULL);
 			
-			return_from_block;
-		}
-		
-		// Run through standard pre-connect checks
-		
-		if (![self preConnectWithInterface:interface error:&err])
-		{
-			return_from_block;
-		}
-		
-		// We've made it past all the checks.
-		// It's time to start the connection process.
-		
-		if (![self connectWithAddress4:address4 address6:address6 error:&err])
-		{
-			return_from_block;
+			void *nonNullUnusedPointer = (__bridge void *)self;
+			dispatch_queue_set_specific(queues[i], [self queueKeyAtIndex:i], nonNullUnusedPointer, NULL);
 		}
-		
-		flags |= kSocketStarted;
-		
-		[self startConnectTimeout:timeout];
-		
-		result = YES;
-	}};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
-	
-	if (result == NO)
-	{
-		if (errPtr)
-			*errPtr = err;
 	}
-	
-	return result;
+	return self;
 }
 
-- (void)lookup:(int)aStateIndex didSucceedWithAddress4:(NSData *)address4 address6:(NSData *)address6
+- (void)dealloc
 {
-	LogTrace();
-	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	NSAssert(address4 || address6, @"Expected at least one valid address");
-	
-	if (aStateIndex != stateIndex)
+	for (NSUInteger i = 0; i < count; i++)
 	{
-		LogInfo(@"Ignoring lookupDidSucceed, already disconnected");
+		dispatch_queue_set_specific(queues[i], [self queueKeyAtIndex:i], NULL, NULL);
 		
-		// The connect operation has been cancelled.
-		// That is, socket was disconnected, or connection has already timed out.
-		return;
+		#if !OS_OBJECT_USE_OBJC
+		dispatch_release(queues[i]);
+		#else
+		queues[i] = nil;
+		#endif
 	}
 	
-	// Check for problems
-	
-	BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
-	BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+	free(queues);
+	free(loads);
+}
+
+/**
+ * Picks a queue for a newly accepted socket, and counts the socket towards its load.
+ * The socket stops counting towards the load (via releaseQueueAtIndex:) when it closes.
+**/
+- (NSUInteger)acquireQueueIndexWithAssignment:(GCDAsyncSocketQueuePoolAssignment)assignment
+{
+	NSUInteger index;
 	
-	if (isIPv4Disabled && (address6 == nil))
+	if (assignment == GCDAsyncSocketQueuePoolAssignmentLeastLoaded)
 	{
-		NSString *msg = @"IPv4 has been disabled and DNS lookup found no IPv6 address.";
+		// The loads may be changing under us, but close enough is good enough here
 		
-		[self closeWithError:[self otherError:msg]];
-		return;
-	}
-	
-	if (isIPv6Disabled && (address4 == nil))
-	{
-		NSString *msg = @"IPv6 has been disabled and DNS lookup found no IPv4 address.";
+		index = 0;
+		NSUInteger minLoad = atomic_load(&loads[0]);
 		
-		[self closeWithError:[self otherError:msg]];
-		return;
+		for (NSUInteger i = 1; i < count && minLoad > 0; i++)
+		{
+			NSUInteger load = atomic_load(&loads[i]);
+			if (load < minLoad)
+			{
+				index = i;
+				minLoad = load;
+			}
+		}
 	}
-	
-	// Start the normal connection process
-	
-	NSError *err = nil;
-	if (![self connectWithAddress4:address4 address6:address6 error:&err])
+	else
 	{
-		[self closeWithError:err];
+		index = atomic_fetch_add(&nextIndex, 1) % count;
 	}
+	
+	atomic_fetch_add(&loads[index], 1);
+	return index;
 }
 
-/**
- * This method is called if the DNS lookup fails.
- * This method is executed on the socketQueue.
- * 
- * Since the DNS lookup executed synchronously on a global concurrent queue,
- * the original connection request may have already been cancelled or timed-out by the time this method is invoked.
- * The lookupIndex tells us whether the lookup is still valid or not.
-**/
-- (void)lookup:(int)aStateIndex didFail:(NSError *)error
+- (void)releaseQueueAtIndex:(NSUInteger)index
 {
-	LogTrace();
-	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	
+	atomic_fetch_sub(&loads[index], 1);
+}
+
+- (void *)queueKeyAtIndex:(NSUInteger)index
+{
+	return (void *)&loads[index];
+}
+
+- (NSArray *)loads
+{
+	NSMutableArray *result = [NSMutableArray arrayWithCapacity:count];
 	
-	if (aStateIndex != stateIndex)
+	for (NSUInteger i = 0; i < count; i++)
 	{
-		LogInfo(@"Ignoring lookup:didFail: - already disconnected");
-		
-		// The connect operation has been cancelled.
-		// That is, socket was disconnected, or connection has already timed out.
-		return;
+		[result addObject:@(atomic_load(&loads[i]))];
 	}
 	
-	[self endConnectTimeout];
-	[self closeWithError:error];
+	return result;
 }
 
-- (BOOL)connectWithAddress4:(NSData *)address4 address6:(NSData *)address6 error:(NSError **)errPtr
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@implementation GCDAsyncSocket
 {
-	LogTrace();
-	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	uint32_t flags;
+	uint16_t config;
 	
-	LogVerbose(@"IPv4: %@:%hu", [[self class] hostFromAddress:address4], [[self class] portFromAddress:address4]);
-	LogVerbose(@"IPv6: %@:%hu", [[self class] hostFromAddress:address6], [[self class] portFromAddress:address6]);
+	__weak id delegate;
+	dispatch_queue_t delegateQueue;
 	
-	// Determine socket type
+	int socket4FD;
+	int socket6FD;
+	int stateIndex;
+	NSData * connectInterface4;
+	NSData * connectInterface6;
 	
-	BOOL preferIPv6 = (config & kPreferIPv6) ? YES : NO;
+	dispatch_queue_t socketQueue;
 	
-	BOOL useIPv6 = ((preferIPv6 && address6) || (address4 == nil));
+	dispatch_source_t accept4Source;
+	dispatch_source_t accept6Source;
+	dispatch_source_t readSource;
+	dispatch_source_t writeSource;
 	
-	// Create the socket
+	GCDAsyncSocketEventBackend eventBackend;
+	GCDAsyncSocketEventSource *eventSource; // Stands in for readSource and writeSource with the event loop backend
 	
-	int socketFD;
-	NSData *address;
-	NSData *connectInterface;
+	GCDAsyncSocketQueuePoolAssignment socketQueuePoolAssignment;
+	NSUInteger socketQueuePoolSize;
+	GCDAsyncSocketQueuePool *socketQueuePool; // Listening socket: the pool it hands out. Accepted socket: the pool it came from.
+	NSUInteger socketQueuePoolIndex;
+	BOOL holdsSocketQueuePoolLoad; // Accepted socket: counted towards its queue's load until it closes
 	
-	if (useIPv6)
-	{
-		LogVerbose(@"Creating IPv6 socket");
-		
-		socket6FD = socket(AF_INET6, SOCK_STREAM, 0);
-		
-		socketFD = socket6FD;
-		address = address6;
-		connectInterface = connectInterface6;
-	}
-	else
-	{
-		LogVerbose(@"Creating IPv4 socket");
-		
-		socket4FD = socket(AF_INET, SOCK_STREAM, 0);
-		
-		socketFD = socket4FD;
-		address = address4;
-		connectInterface = connectInterface4;
-	}
+	GCDAsyncSocketTimingWheel *timingWheel;
+	GCDAsyncSocketTimeout *connectTimer;
+	GCDAsyncSocketTimeout *readTimer;
+	GCDAsyncSocketTimeout *writeTimer;
 	
-	if (socketFD == SOCKET_NULL)
-	{
-		if (errPtr)
-			*errPtr = [self errnoErrorWithReason:@"Error in socket() function"];
-		
-		return NO;
-	}
+	GCDAsyncSocketPacketQueue *readQueue;
+	GCDAsyncSocketPacketQueue *writeQueue;
+	GCDAsyncSocketPacketQueue *priorityWriteQueue;
+	NSUInteger writeSplitLength;
 	
-	// Bind the socket to the desired interface (if needed)
+	GCDAsyncSocketPacketQueue *freeReadPackets;
+	GCDAsyncSocketPacketQueue *freeWritePackets;
+	NSUInteger packetAllocationCount;
 	
-	if (connectInterface)
-	{
-		LogVerbose(@"Binding socket...");
-		
-		if ([[self class] portFromAddress:connectInterface] > 0)
-		{
-			// Since we're going to be binding to a specific port,
-			// we should turn on reuseaddr to allow us to override sockets in time_wait.
-			
-			int reuseOn = 1;
-			setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
-		}
-		
-		const struct sockaddr *interfaceAddr = (const struct sockaddr *)[connectInterface bytes];
-		
-		int result = bind(socketFD, interfaceAddr, (socklen_t)[connectInterface length]);
-		if (result != 0)
-		{
-			if (errPtr)
-				*errPtr = [self errnoErrorWithReason:@"Error in bind() function"];
-			
-			return NO;
-		}
-	}
-	
-	// Prevent SIGPIPE signals
-	
-	int nosigpipe = 1;
-	setsockopt(socketFD, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+	GCDAsyncReadPacket *currentRead;
+	GCDAsyncWritePacket *currentWrite;
 	
-	// Start the connection process in a background queue
+	NSUInteger writeBatchDepth;
+	NSUInteger queuedWriteBytes;
+	NSUInteger writeQueueHighWatermark;
+	NSUInteger writeQueueLowWatermark;
 	
-	int aStateIndex = stateIndex;
-	__weak GCDAsyncSocket *weakSelf = self;
+	NSMutableArray *completedReadTags;
+	NSMutableArray *completedReadResults;
+	NSMutableArray *completedWriteTags;
 	
-	dispatch_queue_t globalConcurrentQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
-	dispatch_async(globalConcurrentQueue, ^{
-	#pragma clang diagnostic push
-	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+	unsigned long socketFDBytesAvailable;
+	NSUInteger readSizeEstimate;
+	NSUInteger readAheadLimit;
 	
-		int result = connect(socketFD, (const struct sockaddr *)[address bytes], (socklen_t)[address length]);
-		
-		__strong GCDAsyncSocket *strongSelf = weakSelf;
-		if (strongSelf == nil) return_from_block;
-		
-		if (result == 0)
-		{
-			dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
-				
-				[strongSelf didConnect:aStateIndex];
-			}});
-		}
-		else
-		{
-			NSError *error = [strongSelf errnoErrorWithReason:@"Error in connect() function"];
-			
-			dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
-				
-				[strongSelf didNotConnect:aStateIndex error:error];
-			}});
-		}
+	GCDAsyncSocketPreBuffer *preBuffer;
 		
-	#pragma clang diagnostic pop
-	});
+#if TARGET_OS_IPHONE
+	CFStreamClientContext streamContext;
+	CFReadStreamRef readStream;
+	CFWriteStreamRef writeStream;
+#endif
+	SSLContextRef sslContext;
+	GCDAsyncSocketPreBuffer *sslPreBuffer;
+	size_t sslWriteCachedLength;
+	OSStatus sslErrCode;
+    OSStatus lastSSLHandshakeError;
 	
-	LogVerbose(@"Connecting...");
+	void *IsOnSocketQueueOrTargetQueueKey;
 	
-	return YES;
+	NSUInteger directDelegateDepth; // Number of delegate methods being invoked directly on the socketQueue right now
+	
+	id userData;
 }
 
-- (void)didConnect:(int)aStateIndex
+- (id)init
 {
-	LogTrace();
-	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	
-	
-	if (aStateIndex != stateIndex)
+	return [self initWithDelegate:nil delegateQueue:NULL socketQueue:NULL];
+}
+
+- (id)initWithSocketQueue:(dispatch_queue_t)sq
+{
+	return [self initWithDelegate:nil delegateQueue:NULL socketQueue:sq];
+}
+
+- (id)initWithDelegate:(id)aDelegate delegateQueue:(dispatch_queue_t)dq
+{
+	return [self initWithDelegate:aDelegate delegateQueue:dq socketQueue:NULL];
+}
+
+- (id)initWithDelegate:(id)aDelegate delegateQueue:(dispatch_queue_t)dq socketQueue:(dispatch_queue_t)sq
+{
+	if((self = [super init]))
 	{
-		LogInfo(@"Ignoring didConnect, already disconnected");
+		delegate = aDelegate;
+		delegateQueue = dq;
 		
-		// The connect operation has been cancelled.
-		// That is, socket was disconnected, or connection has already timed out.
-		return;
-	}
-	
-	flags |= kConnected;
-	
-	[self endConnectTimeout];
-	
-	#if TARGET_OS_IPHONE
-	// The endConnectTimeout method executed above incremented the stateIndex.
-	aStateIndex = stateIndex;
-	#endif
-	
-	// Setup read/write streams (as workaround for specific shortcomings in the iOS platform)
-	// 
-	// Note:
-	// There may be configuration options that must be set by the delegate before opening the streams.
-	// The primary example is the kCFStreamNetworkServiceTypeVoIP flag, which only works on an unopened stream.
-	// 
-	// Thus we wait until after the socket:didConnectToHost:port: delegate method has completed.
-	// This gives the delegate time to properly configure the streams if needed.
-	
-	dispatch_block_t SetupStreamsPart1 = ^{
-		#if TARGET_OS_IPHONE
+		#if !OS_OBJECT_USE_OBJC
+		if (dq) dispatch_retain(dq);
+		#endif
 		
-		if (![self createReadAndWriteStream])
+		socket4FD = SOCKET_NULL;
+		socket6FD = SOCKET_NULL;
+		stateIndex = 0;
+		
+		if (sq)
 		{
-			[self closeWithError:[self otherError:@"Error creating CFStreams"]];
-			return;
+			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0),
+			         @"The given socketQueue parameter must not be a concurrent queue.");
+			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0),
+			         @"The given socketQueue parameter must not be a concurrent queue.");
+			NSAssert(sq != dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+			         @"The given socketQueue parameter must not be a concurrent queue.");
+			
+			socketQueue = sq;
+			#if !OS_OBJECT_USE_OBJC
+			dispatch_retain(sq);
+			#endif
 		}
-		
-		if (![self registerForStreamCallbacksIncludingReadWrite:NO])
+		else
 		{
-			[self closeWithError:[self otherError:@"Error in CFStreamSetClient"]];
-			return;
+			socketQueue = dispatch_queue_create([GCDAsyncSocketQueueName UTF8String], NULL);
 		}
 		
-		#endif
-	};
-	dispatch_block_t SetupStreamsPart2 = ^{
-		#if TARGET_OS_IPHONE
+		// The dispatch_queue_set_specific() and dispatch_get_specific() functions take a "void *key" parameter.
+		// From the documentation:
+		//
+		// > Keys are only compared as pointers and are never dereferenced.
+		// > Thus, you can use a pointer to a static variable for a specific subsystem or
+		// > any other value that allows you to identify the value uniquely.
+		//
+		// We're just going to use the memory address of an ivar.
+		// Specifically an ivar that is explicitly named for our purpose to make the code more readable.
+		//
+		// However, it feels tedious (and less readable) to include the "&" all the time:
+		// dispatch_get_specific(&IsOnSocketQueueOrTargetQueueKey)
+		//
+		// So we're going to make it so it doesn't matter if we use the '&' or not,
+		// by assigning the value of the ivar to the address of the ivar.
+		// Thus: IsOnSocketQueueOrTargetQueueKey == &IsOnSocketQueueOrTargetQueueKey;
 		
-		if (aStateIndex != stateIndex)
-		{
-			// The socket has been disconnected.
-			return;
-		}
+		IsOnSocketQueueOrTargetQueueKey = &IsOnSocketQueueOrTargetQueueKey;
 		
-		if (![self addStreamsToRunLoop])
-		{
-			[self closeWithError:[self otherError:@"Error in CFStreamScheduleWithRunLoop"]];
-			return;
-		}
+		void *nonNullUnusedPointer = (__bridge void *)self;
+		dispatch_queue_set_specific(socketQueue, IsOnSocketQueueOrTargetQueueKey, nonNullUnusedPointer, NULL);
 		
-		if (![self openStreams])
-		{
-			[self closeWithError:[self otherError:@"Error creating CFStreams"]];
-			return;
-		}
+		readQueue = [[GCDAsyncSocketPacketQueue alloc] initWithCapacity:8];
+		currentRead = nil;
 		
-		#endif
-	};
-	
-	// Notify delegate
+		writeQueue = [[GCDAsyncSocketPacketQueue alloc] initWithCapacity:8];
+		priorityWriteQueue = [[GCDAsyncSocketPacketQueue alloc] initWithCapacity:8];
+		currentWrite = nil;
+		
+		freeReadPackets = [[GCDAsyncSocketPacketQueue alloc] initWithCapacity:GCDAsyncSocketPacketPoolLimit];
+		freeWritePackets = [[GCDAsyncSocketPacketQueue alloc] initWithCapacity:GCDAsyncSocketPacketPoolLimit];
+		
+		preBuffer = [[GCDAsyncSocketPreBuffer alloc] init];
+		
+		readSizeEstimate = GCDAsyncSocketReadSizeEstimateInitial;
+		timingWheel = [GCDAsyncSocketTimingWheel sharedTimingWheel];
+		
+		socketQueuePoolIndex = NSNotFound;
+	}
+	return self;
+}
+
+/**
+ * Moves a newly accepted socket (which was initialized with the pool's queue as its socketQueue)
+ * over to the key the pool set on the queue, in place of its own.
+**/
+- (void)adoptSocketQueuePool:(GCDAsyncSocketQueuePool *)pool index:(NSUInteger)index
+{
+	dispatch_queue_set_specific(socketQueue, IsOnSocketQueueOrTargetQueueKey, NULL, NULL);
 	
-	NSString *host = [self connectedHost];
-	uint16_t port = [self connectedPort];
+	IsOnSocketQueueOrTargetQueueKey = [pool queueKeyAtIndex:index];
 	
-	__strong id theDelegate = delegate;
+	socketQueuePool = pool;
+	socketQueuePoolIndex = index;
+	holdsSocketQueuePoolLoad = YES;
+}
 
-	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didConnectToHost:port:)])
+- (void)dealloc
+{
+	LogInfo(@"%@ - %@ (start)", THIS_METHOD, self);
+	
+	// Set dealloc flag.
+	// This is used by closeWithError to ensure we don't accidentally retain ourself.
+	flags |= kDealloc;
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		SetupStreamsPart1();
-		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
-			
-			[theDelegate socket:self didConnectToHost:host port:port];
-			
-			dispatch_async(socketQueue, ^{ @autoreleasepool {
-				
-				SetupStreamsPart2();
-			}});
-		}});
+		[self closeWithError:nil];
 	}
 	else
 	{
-		SetupStreamsPart1();
-		SetupStreamsPart2();
+		dispatch_sync(socketQueue, ^{
+			[self closeWithError:nil];
+		});
 	}
-		
-	// Get the connected socket
 	
-	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : socket6FD;
+	delegate = nil;
 	
-	// Enable non-blocking IO on the socket
+	#if !OS_OBJECT_USE_OBJC
+	if (delegateQueue) dispatch_release(delegateQueue);
+	#endif
+	delegateQueue = NULL;
 	
-	int result = fcntl(socketFD, F_SETFL, O_NONBLOCK);
-	if (result == -1)
-	{
-		NSString *errMsg = @"Error enabling non-blocking IO on socket (fcntl)";
-		[self closeWithError:[self otherError:errMsg]];
+	#if !OS_OBJECT_USE_OBJC
+	if (socketQueue) dispatch_release(socketQueue);
+	#endif
+	socketQueue = NULL;
+	
+	LogInfo(@"%@ - %@ (finish)", THIS_METHOD, self);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Configuration
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (id)delegate
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return delegate;
+	}
+	else
+	{
+		__block id result;
 		
-		return;
+		dispatch_sync(socketQueue, ^{
+			result = delegate;
+		});
+		
+		return result;
 	}
-	
-	// Setup our read/write sources
-	
-	[self setupReadAndWriteSourcesForNewlyConnectedSocket:socketFD];
-	
-	// Dequeue any pending read/write requests
-	
-	[self maybeDequeueRead];
-	[self maybeDequeueWrite];
 }
 
-- (void)didNotConnect:(int)aStateIndex error:(NSError *)error
+- (void)setDelegate:(id)newDelegate synchronously:(BOOL)synchronously
 {
-	LogTrace();
-	
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	
+	dispatch_block_t block = ^{
+		delegate = newDelegate;
+	};
 	
-	if (aStateIndex != stateIndex)
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
+		block();
+	}
+	else {
+		if (synchronously)
+			dispatch_sync(socketQueue, block);
+		else
+			dispatch_async(socketQueue, block);
+	}
+}
+
+- (void)setDelegate:(id)newDelegate
+{
+	[self setDelegate:newDelegate synchronously:NO];
+}
+
+- (void)synchronouslySetDelegate:(id)newDelegate
+{
+	[self setDelegate:newDelegate synchronously:YES];
+}
+
+- (dispatch_queue_t)delegateQueue
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		LogInfo(@"Ignoring didNotConnect, already disconnected");
+		return delegateQueue;
+	}
+	else
+	{
+		__block dispatch_queue_t result;
 		
-		// The connect operation has been cancelled.
-		// That is, socket was disconnected, or connection has already timed out.
-		return;
+		dispatch_sync(socketQueue, ^{
+			result = delegateQueue;
+		});
+		
+		return result;
 	}
+}
+
+- (void)setDelegateQueue:(dispatch_queue_t)newDelegateQueue synchronously:(BOOL)synchronously
+{
+	dispatch_block_t block = ^{
+		
+		#if !OS_OBJECT_USE_OBJC
+		if (delegateQueue) dispatch_release(delegateQueue);
+		if (newDelegateQueue) dispatch_retain(newDelegateQueue);
+		#endif
+		
+		delegateQueue = newDelegateQueue;
+	};
 	
-	[self closeWithError:error];
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
+		block();
+	}
+	else {
+		if (synchronously)
+			dispatch_sync(socketQueue, block);
+		else
+			dispatch_async(socketQueue, block);
+	}
 }
 
-- (void)startConnectTimeout:(NSTimeInterval)timeout
+- (void)setDelegateQueue:(dispatch_queue_t)newDelegateQueue
 {
-	if (timeout >= 0.0)
+	[self setDelegateQueue:newDelegateQueue synchronously:NO];
+}
+
+- (void)synchronouslySetDelegateQueue:(dispatch_queue_t)newDelegateQueue
+{
+	[self setDelegateQueue:newDelegateQueue synchronously:YES];
+}
+
+- (void)getDelegate:(id *)delegatePtr delegateQueue:(dispatch_queue_t *)delegateQueuePtr
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (delegatePtr) *delegatePtr = delegate;
+		if (delegateQueuePtr) *delegateQueuePtr = delegateQueue;
+	}
+	else
 	{
-		connectTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, socketQueue);
+		__block id dPtr = NULL;
+		__block dispatch_queue_t dqPtr = NULL;
 		
-		__weak GCDAsyncSocket *weakSelf = self;
+		dispatch_sync(socketQueue, ^{
+			dPtr = delegate;
+			dqPtr = delegateQueue;
+		});
 		
-		dispatch_source_set_event_handler(connectTimer, ^{ @autoreleasepool {
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		if (delegatePtr) *delegatePtr = dPtr;
+		if (delegateQueuePtr) *delegateQueuePtr = dqPtr;
+	}
+}
+
+- (void)setDelegate:(id)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue synchronously:(BOOL)synchronously
+{
+	dispatch_block_t block = ^{
 		
-			__strong GCDAsyncSocket *strongSelf = weakSelf;
-			if (strongSelf == nil) return_from_block;
-			
-			[strongSelf doConnectTimeout];
-			
-		#pragma clang diagnostic pop
-		}});
+		delegate = newDelegate;
 		
 		#if !OS_OBJECT_USE_OBJC
-		dispatch_source_t theConnectTimer = connectTimer;
-		dispatch_source_set_cancel_handler(connectTimer, ^{
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
-			
-			LogVerbose(@"dispatch_release(connectTimer)");
-			dispatch_release(theConnectTimer);
-			
-		#pragma clang diagnostic pop
-		});
+		if (delegateQueue) dispatch_release(delegateQueue);
+		if (newDelegateQueue) dispatch_retain(newDelegateQueue);
 		#endif
 		
-		dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
-		dispatch_source_set_timer(connectTimer, tt, DISPATCH_TIME_FOREVER, 0);
-		
-		dispatch_resume(connectTimer);
+		delegateQueue = newDelegateQueue;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey)) {
+		block();
+	}
+	else {
+		if (synchronously)
+			dispatch_sync(socketQueue, block);
+		else
+			dispatch_async(socketQueue, block);
 	}
 }
 
-- (void)endConnectTimeout
+- (void)setDelegate:(id)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue
 {
-	LogTrace();
+	[self setDelegate:newDelegate delegateQueue:newDelegateQueue synchronously:NO];
+}
+
+- (void)synchronouslySetDelegate:(id)newDelegate delegateQueue:(dispatch_queue_t)newDelegateQueue
+{
+	[self setDelegate:newDelegate delegateQueue:newDelegateQueue synchronously:YES];
+}
+
+- (BOOL)isIPv4Enabled
+{
+	// Note: YES means kIPv4Disabled is OFF
 	
-	if (connectTimer)
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return ((config & kIPv4Disabled) == 0);
+	}
+	else
 	{
-		dispatch_source_cancel(connectTimer);
-		connectTimer = NULL;
+		__block BOOL result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = ((config & kIPv4Disabled) == 0);
+		});
+		
+		return result;
 	}
+}
+
+- (void)setIPv4Enabled:(BOOL)flag
+{
+	// Note: YES means kIPv4Disabled is OFF
 	
-	// Increment stateIndex.
-	// This will prevent us from processing results from any related background asynchronous operations.
-	// 
-	// Note: This should be called from close method even if connectTimer is NULL.
-	// This is because one might disconnect a socket prior to a successful connection which had no timeout.
+	dispatch_block_t block = ^{
+		
+		if (flag)
+			config &= ~kIPv4Disabled;
+		else
+			config |= kIPv4Disabled;
+	};
 	
-	stateIndex++;
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (BOOL)isIPv6Enabled
+{
+	// Note: YES means kIPv6Disabled is OFF
 	
-	if (connectInterface4)
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		connectInterface4 = nil;
+		return ((config & kIPv6Disabled) == 0);
 	}
-	if (connectInterface6)
+	else
 	{
-		connectInterface6 = nil;
+		__block BOOL result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = ((config & kIPv6Disabled) == 0);
+		});
+		
+		return result;
 	}
 }
 
-- (void)doConnectTimeout
+- (void)setIPv6Enabled:(BOOL)flag
 {
-	LogTrace();
+	// Note: YES means kIPv6Disabled is OFF
 	
-	[self endConnectTimeout];
-	[self closeWithError:[self connectTimeoutError]];
+	dispatch_block_t block = ^{
+		
+		if (flag)
+			config &= ~kIPv6Disabled;
+		else
+			config |= kIPv6Disabled;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Disconnecting
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-- (void)closeWithError:(NSError *)error
+- (BOOL)isIPv4PreferredOverIPv6
 {
-	LogTrace();
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	
-	[self endConnectTimeout];
-	
-	if (currentRead != nil)  [self endCurrentRead];
-	if (currentWrite != nil) [self endCurrentWrite];
-	
-	[readQueue removeAllObjects];
-	[writeQueue removeAllObjects];
-	
-	[preBuffer reset];
+	// Note: YES means kPreferIPv6 is OFF
 	
-	#if TARGET_OS_IPHONE
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		if (readStream || writeStream)
-		{
-			[self removeStreamsFromRunLoop];
-			
-			if (readStream)
-			{
-				CFReadStreamSetClient(readStream, kCFStreamEventNone, NULL, NULL);
-				CFReadStreamClose(readStream);
-				CFRelease(readStream);
-				readStream = NULL;
-			}
-			if (writeStream)
-			{
-				CFWriteStreamSetClient(writeStream, kCFStreamEventNone, NULL, NULL);
-				CFWriteStreamClose(writeStream);
-				CFRelease(writeStream);
-				writeStream = NULL;
-			}
-		}
+		return ((config & kPreferIPv6) == 0);
 	}
-	#endif
-	
-	[sslPreBuffer reset];
-	sslErrCode = lastSSLHandshakeError = noErr;
-	
-	if (sslContext)
+	else
 	{
-		// Getting a linker error here about the SSLx() functions?
-		// You need to add the Security Framework to your application.
-		
-		SSLClose(sslContext);
+		__block BOOL result;
 		
-		#if TARGET_OS_IPHONE || (__MAC_OS_X_VERSION_MIN_REQUIRED >= 1080)
-		CFRelease(sslContext);
-		#else
-		SSLDisposeContext(sslContext);
-		#endif
+		dispatch_sync(socketQueue, ^{
+			result = ((config & kPreferIPv6) == 0);
+		});
 		
-		sslContext = NULL;
+		return result;
 	}
+}
+
+- (void)setIPv4PreferredOverIPv6:(BOOL)flag
+{
+	// Note: YES means kPreferIPv6 is OFF
 	
-	// For some crazy reason (in my opinion), cancelling a dispatch source doesn't
-	// invoke the cancel handler if the dispatch source is paused.
-	// So we have to unpause the source if needed.
-	// This allows the cancel handler to be run, which in turn releases the source and closes the socket.
+	dispatch_block_t block = ^{
+		
+		if (flag)
+			config &= ~kPreferIPv6;
+		else
+			config |= kPreferIPv6;
+	};
 	
-	if (!accept4Source && !accept6Source && !readSource && !writeSource)
-	{
-		LogVerbose(@"manually closing close");
-
-		if (socket4FD != SOCKET_NULL)
-		{
-			LogVerbose(@"close(socket4FD)");
-			close(socket4FD);
-			socket4FD = SOCKET_NULL;
-		}
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
 
-		if (socket6FD != SOCKET_NULL)
-		{
-			LogVerbose(@"close(socket6FD)");
-			close(socket6FD);
-			socket6FD = SOCKET_NULL;
-		}
+- (BOOL)noDelay
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return ((config & kNoDelay) != 0);
 	}
 	else
 	{
-		if (accept4Source)
-		{
-			LogVerbose(@"dispatch_source_cancel(accept4Source)");
-			dispatch_source_cancel(accept4Source);
-			
-			// We never suspend accept4Source
-			
-			accept4Source = NULL;
-		}
+		__block BOOL result;
 		
-		if (accept6Source)
-		{
-			LogVerbose(@"dispatch_source_cancel(accept6Source)");
-			dispatch_source_cancel(accept6Source);
-			
-			// We never suspend accept6Source
-			
-			accept6Source = NULL;
-		}
+		dispatch_sync(socketQueue, ^{
+			result = ((config & kNoDelay) != 0);
+		});
+		
+		return result;
+	}
+}
+
+- (void)setNoDelay:(BOOL)flag
+{
+	dispatch_block_t block = ^{
+		
+		if (flag)
+			config |= kNoDelay;
+		else
+			config &= ~kNoDelay;
+		
+		if (socket4FD != SOCKET_NULL) [self applyNoDelayToSocket:socket4FD];
+		if (socket6FD != SOCKET_NULL) [self applyNoDelayToSocket:socket6FD];
+	};
 	
-		if (readSource)
-		{
-			LogVerbose(@"dispatch_source_cancel(readSource)");
-			dispatch_source_cancel(readSource);
-			
-			[self resumeReadSource];
-			
-			readSource = NULL;
-		}
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (BOOL)directDelegateDispatch
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return ((config & kDirectDelegateDispatch) != 0);
+	}
+	else
+	{
+		__block BOOL result;
 		
-		if (writeSource)
-		{
-			LogVerbose(@"dispatch_source_cancel(writeSource)");
-			dispatch_source_cancel(writeSource);
-			
-			[self resumeWriteSource];
-			
-			writeSource = NULL;
-		}
+		dispatch_sync(socketQueue, ^{
+			result = ((config & kDirectDelegateDispatch) != 0);
+		});
 		
-		// The sockets will be closed by the cancel handlers of the corresponding source
+		return result;
+	}
+}
+
+- (void)setDirectDelegateDispatch:(BOOL)flag
+{
+	dispatch_block_t block = ^{
 		
-		socket4FD = SOCKET_NULL;
-		socket6FD = SOCKET_NULL;
+		if (flag)
+			config |= kDirectDelegateDispatch;
+		else
+			config &= ~kDirectDelegateDispatch;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+/**
+ * Invokes the given block, which calls a delegate method, on the delegateQueue.
+ * 
+ * If the delegateQueue is the socketQueue, or directDelegateDispatch is set,
+ * the block is invoked right here on the socketQueue instead.
+ * That saves copying the block, and a trip through the queue.
+**/
+- (void)notifyDelegateWithBlock:(dispatch_block_t)block
+{
+	BOOL onSocketQueue = (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey) != NULL);
+	
+	if (onSocketQueue && (completedReadTags || completedWriteTags))
+	{
+		// The batched completions happened first, so they can't wait for the scheduled flush
+		[self flushCompletionBatches];
 	}
 	
-	// If the client has passed the connect/accept method, then the connection has at least begun.
-	// Notify delegate that it is now ending.
-	BOOL shouldCallDelegate = (flags & kSocketStarted) ? YES : NO;
-	BOOL isDeallocating = (flags & kDealloc) ? YES : NO;
+	BOOL direct = ((config & kDirectDelegateDispatch) || (delegateQueue == socketQueue)) && onSocketQueue;
 	
-	// Clear stored socket info and all flags (config remains as is)
-	socketFDBytesAvailable = 0;
-	flags = 0;
-	sslWriteCachedLength = 0;
+	if (!direct)
+	{
+		dispatch_async(delegateQueue, block);
+		return;
+	}
 	
-	if (shouldCallDelegate)
+	if (!(flags & kDealloc))
 	{
-		__strong id theDelegate = delegate;
-		__strong id theSelf = isDeallocating ? nil : self;
-		
-		if (delegateQueue && [theDelegate respondsToSelector: @selector(socketDidDisconnect:withError:)])
-		{
-			dispatch_async(delegateQueue, ^{ @autoreleasepool {
-				
-				[theDelegate socketDidDisconnect:theSelf withError:error];
-			}});
-		}	
+		// The delegate may let go of its last reference to us,
+		// but we're in the middle of something, so stick around until the socketQueue is done with it.
+		__autoreleasing GCDAsyncSocket *keepAlive = self;
+		(void)keepAlive;
 	}
+	
+	directDelegateDepth++;
+	block();
+	directDelegateDepth--;
 }
 
-- (void)disconnect
+- (id)userData
 {
-	dispatch_block_t block = ^{ @autoreleasepool {
-		
-		if (flags & kSocketStarted)
-		{
-			[self closeWithError:nil];
-		}
-	}};
+	__block id result = nil;
 	
-	// Synchronous disconnection, as documented in the header file
+	dispatch_block_t block = ^{
+		
+		result = userData;
+	};
 	
 	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 		block();
 	else
 		dispatch_sync(socketQueue, block);
+	
+	return result;
 }
 
-- (void)disconnectAfterReading
+- (void)setUserData:(id)arbitraryUserData
 {
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
+	dispatch_block_t block = ^{
 		
-		if (flags & kSocketStarted)
+		if (userData != arbitraryUserData)
 		{
-			flags |= (kForbidReadsWrites | kDisconnectAfterReads);
-			[self maybeClose];
+			userData = arbitraryUserData;
 		}
-	}});
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
 }
 
-- (void)disconnectAfterWriting
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Accepting
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)acceptOnPort:(uint16_t)port error:(NSError **)errPtr
 {
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
-		
-		if (flags & kSocketStarted)
+	return [self acceptOnInterface:nil port:port error:errPtr];
+}
+
+- (BOOL)acceptOnInterface:(NSString *)inInterface port:(uint16_t)port error:(NSError **)errPtr
+{
+	LogTrace();
+	
+	// Just in-case interface parameter is immutable.
+	NSString *interface = [inInterface copy];
+	
+	__block BOOL result = NO;
+	__block NSError *err = nil;
+	
+	// CreateSocket Block
+	// This block will be invoked within the dispatch block below.
+	
+	int(^createSocket)(int, NSData*) = ^int (int domain, NSData *interfaceAddr) {
+		
+		int socketFD = socket(domain, SOCK_STREAM, 0);
+		
+		if (socketFD == SOCKET_NULL)
+		{
+			NSString *reason = @"Error in socket() function";
+			err = [self errnoErrorWithReason:reason];
+			
+			return SOCKET_NULL;
+		}
+		
+		int status;
+		
+		// Set socket options
+		
+		status = fcntl(socketFD, F_SETFL, O_NONBLOCK);
+		if (status == -1)
+		{
+			NSString *reason = @"Error enabling non-blocking IO on socket (fcntl)";
+			err = [self errnoErrorWithReason:reason];
+			
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
+		}
+		
+		int reuseOn = 1;
+		status = setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
+		if (status == -1)
+		{
+			NSString *reason = @"Error enabling address reuse (setsockopt)";
+			err = [self errnoErrorWithReason:reason];
+			
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
+		}
+		
+		// Bind socket
+		
+		status = bind(socketFD, (const struct sockaddr *)[interfaceAddr bytes], (socklen_t)[interfaceAddr length]);
+		if (status == -1)
+		{
+			NSString *reason = @"Error in bind() function";
+			err = [self errnoErrorWithReason:reason];
+			
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
+		}
+		
+		// Listen
+		
+		status = listen(socketFD, 1024);
+		if (status == -1)
+		{
+			NSString *reason = @"Error in listen() function";
+			err = [self errnoErrorWithReason:reason];
+			
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+			return SOCKET_NULL;
+		}
+		
+		return socketFD;
+	};
+	
+	// Create dispatch block and run on socketQueue
+	
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		if (delegate == nil) // Must have delegate set
+		{
+			NSString *msg = @"Attempting to accept without a delegate. Set a delegate first.";
+			err = [self badConfigError:msg];
+			
+			return_from_block;
+		}
+		
+		if (delegateQueue == NULL) // Must have delegate queue set
+		{
+			NSString *msg = @"Attempting to accept without a delegate queue. Set a delegate queue first.";
+			err = [self badConfigError:msg];
+			
+			return_from_block;
+		}
+		
+		BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
+		BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+		
+		if (isIPv4Disabled && isIPv6Disabled) // Must have IPv4 or IPv6 enabled
+		{
+			NSString *msg = @"Both IPv4 and IPv6 have been disabled. Must enable at least one protocol first.";
+			err = [self badConfigError:msg];
+			
+			return_from_block;
+		}
+		
+		if (![self isDisconnected]) // Must be disconnected
+		{
+			NSString *msg = @"Attempting to accept while connected or accepting connections. Disconnect first.";
+			err = [self badConfigError:msg];
+			
+			return_from_block;
+		}
+		
+		// Clear queues (spurious read/write requests post disconnect)
+		[readQueue removeAllObjects];
+		[writeQueue removeAllObjects];
+	[priorityWriteQueue removeAllObjects];
+		[priorityWriteQueue removeAllObjects];
+		
+		// Resolve interface from description
+		
+		NSMutableData *interface4 = nil;
+		NSMutableData *interface6 = nil;
+		
+		[self getInterfaceAddress4:&interface4 address6:&interface6 fromDescription:interface port:port];
+		
+		if ((interface4 == nil) && (interface6 == nil))
+		{
+			NSString *msg = @"Unknown interface. Specify valid interface by name (e.g. \"en1\") or IP address.";
+			err = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		if (isIPv4Disabled && (interface6 == nil))
+		{
+			NSString *msg = @"IPv4 has been disabled and specified interface doesn't support IPv6.";
+			err = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		if (isIPv6Disabled && (interface4 == nil))
+		{
+			NSString *msg = @"IPv6 has been disabled and specified interface doesn't support IPv4.";
+			err = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		BOOL enableIPv4 = !isIPv4Disabled && (interface4 != nil);
+		BOOL enableIPv6 = !isIPv6Disabled && (interface6 != nil);
+		
+		// Create sockets, configure, bind, and listen
+		
+		if (enableIPv4)
+		{
+			LogVerbose(@"Creating IPv4 socket");
+			socket4FD = createSocket(AF_INET, interface4);
+			
+			if (socket4FD == SOCKET_NULL)
+			{
+				return_from_block;
+			}
+		}
+		
+		if (enableIPv6)
+		{
+			LogVerbose(@"Creating IPv6 socket");
+			
+			if (enableIPv4 && (port == 0))
+			{
+				// No specific port was specified, so we allowed the OS to pick an available port for us.
+				// Now we need to make sure the IPv6 socket listens on the same port as the IPv4 socket.
+				
+				struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)[interface6 mutableBytes];
+				addr6->sin6_port = htons([self localPort4]);
+			}
+			
+			socket6FD = createSocket(AF_INET6, interface6);
+			
+			if (socket6FD == SOCKET_NULL)
+			{
+				if (socket4FD != SOCKET_NULL)
+				{
+					LogVerbose(@"close(socket4FD)");
+					close(socket4FD);
+				}
+				
+				return_from_block;
+			}
+		}
+		
+		// Create accept sources
+		
+		if (enableIPv4)
+		{
+			accept4Source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, socket4FD, 0, socketQueue);
+			
+			int socketFD = socket4FD;
+			dispatch_source_t acceptSource = accept4Source;
+			
+			__weak GCDAsyncSocket *weakSelf = self;
+			
+			dispatch_source_set_event_handler(accept4Source, ^{ @autoreleasepool {
+			#pragma clang diagnostic push
+			#pragma clang diagnostic warning "-Wimplicit-retain-self"
+				
+				__strong GCDAsyncSocket *strongSelf = weakSelf;
+				if (strongSelf == nil) return_from_block;
+				
+				LogVerbose(@"event4Block");
+				
+				unsigned long i = 0;
+				unsigned long numPendingConnections = dispatch_source_get_data(acceptSource);
+				
+				LogVerbose(@"numPendingConnections: %lu", numPendingConnections);
+				
+				while ([strongSelf doAccept:socketFD] && (++i < numPendingConnections));
+				
+			#pragma clang diagnostic pop
+			}});
+			
+			
+			dispatch_source_set_cancel_handler(accept4Source, ^{
+			#pragma clang diagnostic push
+			#pragma clang diagnostic warning "-Wimplicit-retain-self"
+				
+				#if !OS_OBJECT_USE_OBJC
+				LogVerbose(@"dispatch_release(accept4Source)");
+				dispatch_release(acceptSource);
+				#endif
+				
+				LogVerbose(@"close(socket4FD)");
+				close(socketFD);
+			
+			#pragma clang diagnostic pop
+			});
+			
+			LogVerbose(@"dispatch_resume(accept4Source)");
+			dispatch_resume(accept4Source);
+		}
+		
+		if (enableIPv6)
+		{
+			accept6Source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, socket6FD, 0, socketQueue);
+			
+			int socketFD = socket6FD;
+			dispatch_source_t acceptSource = accept6Source;
+			
+			__weak GCDAsyncSocket *weakSelf = self;
+			
+			dispatch_source_set_event_handler(accept6Source, ^{ @autoreleasepool {
+			#pragma clang diagnostic push
+			#pragma clang diagnostic warning "-Wimplicit-retain-self"
+				
+				__strong GCDAsyncSocket *strongSelf = weakSelf;
+				if (strongSelf == nil) return_from_block;
+				
+				LogVerbose(@"event6Block");
+				
+				unsigned long i = 0;
+				unsigned long numPendingConnections = dispatch_source_get_data(acceptSource);
+				
+				LogVerbose(@"numPendingConnections: %lu", numPendingConnections);
+				
+				while ([strongSelf doAccept:socketFD] && (++i < numPendingConnections));
+				
+			#pragma clang diagnostic pop
+			}});
+			
+			dispatch_source_set_cancel_handler(accept6Source, ^{
+			#pragma clang diagnostic push
+			#pragma clang diagnostic warning "-Wimplicit-retain-self"
+				
+				#if !OS_OBJECT_USE_OBJC
+				LogVerbose(@"dispatch_release(accept6Source)");
+				dispatch_release(acceptSource);
+				#endif
+				
+				LogVerbose(@"close(socket6FD)");
+				close(socketFD);
+				
+			#pragma clang diagnostic pop
+			});
+			
+			LogVerbose(@"dispatch_resume(accept6Source)");
+			dispatch_resume(accept6Source);
+		}
+		
+		flags |= kSocketStarted;
+		
+		result = YES;
+	}};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	if (result == NO)
+	{
+		LogInfo(@"Error in accept: %@", err);
+		
+		if (errPtr)
+			*errPtr = err;
+	}
+	
+	return result;
+}
+
+- (BOOL)doAccept:(int)parentSocketFD
+{
+	LogTrace();
+	
+	BOOL isIPv4;
+	int childSocketFD;
+	NSData *childSocketAddress;
+	
+	if (parentSocketFD == socket4FD)
+	{
+		isIPv4 = YES;
+		
+		struct sockaddr_in addr;
+		socklen_t addrLen = sizeof(addr);
+		
+		childSocketFD = accept(parentSocketFD, (struct sockaddr *)&addr, &addrLen);
+		
+		if (childSocketFD == -1)
+		{
+			LogWarn(@"Accept failed with error: %@", [self errnoError]);
+			return NO;
+		}
+		
+		childSocketAddress = [NSData dataWithBytes:&addr length:addrLen];
+	}
+	else // if (parentSocketFD == socket6FD)
+	{
+		isIPv4 = NO;
+		
+		struct sockaddr_in6 addr;
+		socklen_t addrLen = sizeof(addr);
+		
+		childSocketFD = accept(parentSocketFD, (struct sockaddr *)&addr, &addrLen);
+		
+		if (childSocketFD == -1)
+		{
+			LogWarn(@"Accept failed with error: %@", [self errnoError]);
+			return NO;
+		}
+		
+		childSocketAddress = [NSData dataWithBytes:&addr length:addrLen];
+	}
+	
+	// Enable non-blocking IO on the socket
+	
+	int result = fcntl(childSocketFD, F_SETFL, O_NONBLOCK);
+	if (result == -1)
+	{
+		LogWarn(@"Error enabling non-blocking IO on accepted socket (fcntl)");
+		return NO;
+	}
+	
+	// Prevent SIGPIPE signals
+	
+	int nosigpipe = 1;
+	setsockopt(childSocketFD, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+	
+	// Disable Nagle's algorithm (if configured).
+	// TCP_NODELAY is not reliably inherited from the listening socket, so it's applied here.
+	
+	if (config & kNoDelay)
+	{
+		[self applyNoDelayToSocket:childSocketFD];
+	}
+	
+	// Notify delegate
+	
+	if (delegateQueue)
+	{
+		__strong id theDelegate = delegate;
+		
+		// Accepted sockets use the same backend (and delegate dispatch, and noDelay) as the listening socket
+		GCDAsyncSocketEventBackend theEventBackend = eventBackend;
+		uint16_t theInheritedConfig = (config & (kDirectDelegateDispatch | kNoDelay));
+		
+		// And get their queue from its pool, if it has one
+		GCDAsyncSocketQueuePoolAssignment theAssignment = socketQueuePoolAssignment;
+		GCDAsyncSocketQueuePool *thePool = nil;
+		
+		if (theAssignment != GCDAsyncSocketQueuePoolAssignmentNone)
+		{
+			if (socketQueuePool == nil)
+			{
+				NSUInteger poolSize = socketQueuePoolSize;
+				if (poolSize == 0)
+					poolSize = [[NSProcessInfo processInfo] activeProcessorCount];
+				
+				socketQueuePool = [[GCDAsyncSocketQueuePool alloc] initWithCount:poolSize];
+			}
+			
+			thePool = socketQueuePool;
+		}
+		
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
+			
+			// Query delegate for custom socket queue
+			
+			dispatch_queue_t childSocketQueue = NULL;
+			
+			if ([theDelegate respondsToSelector:@selector(newSocketQueueForConnectionFromAddress:onSocket:)])
+			{
+				childSocketQueue = [theDelegate newSocketQueueForConnectionFromAddress:childSocketAddress
+				                                                              onSocket:self];
+			}
+			
+			// The delegate's queue takes precedence over the pool
+			
+			NSUInteger poolIndex = NSNotFound;
+			dispatch_queue_t poolQueue = NULL;
+			
+			if (childSocketQueue == NULL && thePool)
+			{
+				poolIndex = [thePool acquireQueueIndexWithAssignment:theAssignment];
+				poolQueue = thePool->queues[poolIndex];
+			}
+			
+			// Create GCDAsyncSocket instance for accepted socket
+			
+			GCDAsyncSocket *acceptedSocket = [[GCDAsyncSocket alloc] initWithDelegate:theDelegate
+			                                                            delegateQueue:delegateQueue
+			                                                              socketQueue:(childSocketQueue ?: poolQueue)];
+			
+			if (poolQueue)
+				[acceptedSocket adoptSocketQueuePool:thePool index:poolIndex];
+			
+			if (isIPv4)
+				acceptedSocket->socket4FD = childSocketFD;
+			else
+				acceptedSocket->socket6FD = childSocketFD;
+			
+			acceptedSocket->flags = (kSocketStarted | kConnected);
+			acceptedSocket->eventBackend = theEventBackend;
+			acceptedSocket->config |= theInheritedConfig;
+			
+			// Setup read and write sources for accepted socket
+			
+			dispatch_async(acceptedSocket->socketQueue, ^{ @autoreleasepool {
+				
+				[acceptedSocket setupReadAndWriteSourcesForNewlyConnectedSocket:childSocketFD];
+			}});
+			
+			// Notify delegate
+			
+			if ([theDelegate respondsToSelector:@selector(socket:didAcceptNewSocket:)])
+			{
+				[theDelegate socket:self didAcceptNewSocket:acceptedSocket];
+			}
+			
+			// Release the socket queue returned from the delegate (it was retained by acceptedSocket)
+			#if !OS_OBJECT_USE_OBJC
+			if (childSocketQueue) dispatch_release(childSocketQueue);
+			#endif
+			
+			// The accepted socket should have been retained by the delegate.
+			// Otherwise it gets properly released when exiting the block.
+		}}];
+	}
+	
+	return YES;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Connecting
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * This method runs through the various checks required prior to a connection attempt.
+ * It is shared between the connectToHost and connectToAddress methods.
+ * 
+**/
+- (BOOL)preConnectWithInterface:(NSString *)interface error:(NSError **)errPtr
+{
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	if (delegate == nil) // Must have delegate set
+	{
+		if (errPtr)
+		{
+			NSString *msg = @"Attempting to connect without a delegate. Set a delegate first.";
+			*errPtr = [self badConfigError:msg];
+		}
+		return NO;
+	}
+	
+	if (delegateQueue == NULL) // Must have delegate queue set
+	{
+		if (errPtr)
+		{
+			NSString *msg = @"Attempting to connect without a delegate queue. Set a delegate queue first.";
+			*errPtr = [self badConfigError:msg];
+		}
+		return NO;
+	}
+	
+	if (![self isDisconnected]) // Must be disconnected
+	{
+		if (errPtr)
+		{
+			NSString *msg = @"Attempting to connect while connected or accepting connections. Disconnect first.";
+			*errPtr = [self badConfigError:msg];
+		}
+		return NO;
+	}
+	
+	BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
+	BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+	
+	if (isIPv4Disabled && isIPv6Disabled) // Must have IPv4 or IPv6 enabled
+	{
+		if (errPtr)
+		{
+			NSString *msg = @"Both IPv4 and IPv6 have been disabled. Must enable at least one protocol first.";
+			*errPtr = [self badConfigError:msg];
+		}
+		return NO;
+	}
+	
+	if (interface)
+	{
+		NSMutableData *interface4 = nil;
+		NSMutableData *interface6 = nil;
+		
+		[self getInterfaceAddress4:&interface4 address6:&interface6 fromDescription:interface port:0];
+		
+		if ((interface4 == nil) && (interface6 == nil))
+		{
+			if (errPtr)
+			{
+				NSString *msg = @"Unknown interface. Specify valid interface by name (e.g. \"en1\") or IP address.";
+				*errPtr = [self badParamError:msg];
+			}
+			return NO;
+		}
+		
+		if (isIPv4Disabled && (interface6 == nil))
+		{
+			if (errPtr)
+			{
+				NSString *msg = @"IPv4 has been disabled and specified interface doesn't support IPv6.";
+				*errPtr = [self badParamError:msg];
+			}
+			return NO;
+		}
+		
+		if (isIPv6Disabled && (interface4 == nil))
+		{
+			if (errPtr)
+			{
+				NSString *msg = @"IPv6 has been disabled and specified interface doesn't support IPv4.";
+				*errPtr = [self badParamError:msg];
+			}
+			return NO;
+		}
+		
+		connectInterface4 = interface4;
+		connectInterface6 = interface6;
+	}
+	
+	// Clear queues (spurious read/write requests post disconnect)
+	[readQueue removeAllObjects];
+	[writeQueue removeAllObjects];
+	[priorityWriteQueue removeAllObjects];
+	
+	return YES;
+}
+
+- (BOOL)connectToHost:(NSString*)host onPort:(uint16_t)port error:(NSError **)errPtr
+{
+	return [self connectToHost:host onPort:port withTimeout:-1 error:errPtr];
+}
+
+- (BOOL)connectToHost:(NSString *)host
+               onPort:(uint16_t)port
+          withTimeout:(NSTimeInterval)timeout
+                error:(NSError **)errPtr
+{
+	return [self connectToHost:host onPort:port viaInterface:nil withTimeout:timeout error:errPtr];
+}
+
+- (BOOL)connectToHost:(NSString *)inHost
+               onPort:(uint16_t)port
+         viaInterface:(NSString *)inInterface
+          withTimeout:(NSTimeInterval)timeout
+                error:(NSError **)errPtr
+{
+	LogTrace();
+	
+	// Just in case immutable objects were passed
+	NSString *host = [inHost copy];
+	NSString *interface = [inInterface copy];
+	
+	__block BOOL result = NO;
+	__block NSError *preConnectErr = nil;
+	
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		// Check for problems with host parameter
+		
+		if ([host length] == 0)
+		{
+			NSString *msg = @"Invalid host parameter (nil or \"\"). Should be a domain name or IP address string.";
+			preConnectErr = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		// Run through standard pre-connect checks
+		
+		if (![self preConnectWithInterface:interface error:&preConnectErr])
+		{
+			return_from_block;
+		}
+		
+		// We've made it past all the checks.
+		// It's time to start the connection process.
+		
+		flags |= kSocketStarted;
+		
+		LogVerbose(@"Dispatching DNS lookup...");
+		
+		// It's possible that the given host parameter is actually a NSMutableString.
+		// So we want to copy it now, within this block that will be executed synchronously.
+		// This way the asynchronous lookup block below doesn't have to worry about it changing.
+		
+		NSString *hostCpy = [host copy];
+		
+		int aStateIndex = stateIndex;
+		__weak GCDAsyncSocket *weakSelf = self;
+		
+		dispatch_queue_t globalConcurrentQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+		dispatch_async(globalConcurrentQueue, ^{ @autoreleasepool {
+		#pragma clang diagnostic push
+		#pragma clang diagnostic warning "-Wimplicit-retain-self"
+			
+			NSError *lookupErr = nil;
+			NSMutableArray *addresses = [GCDAsyncSocket lookupHost:hostCpy port:port error:&lookupErr];
+			
+			__strong GCDAsyncSocket *strongSelf = weakSelf;
+			if (strongSelf == nil) return_from_block;
+			
+			if (lookupErr)
+			{
+				dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
+					
+					[strongSelf lookup:aStateIndex didFail:lookupErr];
+				}});
+			}
+			else
+			{
+				NSData *address4 = nil;
+				NSData *address6 = nil;
+				
+				for (NSData *address in addresses)
+				{
+					if (!address4 && [GCDAsyncSocket isIPv4Address:address])
+					{
+						address4 = address;
+					}
+					else if (!address6 && [GCDAsyncSocket isIPv6Address:address])
+					{
+						address6 = address;
+					}
+				}
+				
+				dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
+					
+					[strongSelf lookup:aStateIndex didSucceedWithAddress4:address4 address6:address6];
+				}});
+			}
+			
+		#pragma clang diagnostic pop
+		}});
+		
+		[self startConnectTimeout:timeout];
+		
+		result = YES;
+	}};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	
+	if (errPtr) *errPtr = preConnectErr;
+	return result;
+}
+
+- (BOOL)connectToAddress:(NSData *)remoteAddr error:(NSError **)errPtr
+{
+	return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:-1 error:errPtr];
+}
+
+- (BOOL)connectToAddress:(NSData *)remoteAddr withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr
+{
+	return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:timeout error:errPtr];
+}
+
+- (BOOL)connectToAddress:(NSData *)inRemoteAddr
+            viaInterface:(NSString *)inInterface
+             withTimeout:(NSTimeInterval)timeout
+                   error:(NSError **)errPtr
+{
+	LogTrace();
+	
+	// Just in case immutable objects were passed
+	NSData *remoteAddr = [inRemoteAddr copy];
+	NSString *interface = [inInterface copy];
+	
+	__block BOOL result = NO;
+	__block NSError *err = nil;
+	
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		// Check for problems with remoteAddr parameter
+		
+		NSData *address4 = nil;
+		NSData *address6 = nil;
+		
+		if ([remoteAddr length] >= sizeof(struct sockaddr))
+		{
+			const struct sockaddr *sockaddr = (const struct sockaddr *)[remoteAddr bytes];
+			
+			if (sockaddr->sa_family == AF_INET)
+			{
+				if ([remoteAddr length] == sizeof(struct sockaddr_in))
+				{
+					address4 = remoteAddr;
+				}
+			}
+			else if (sockaddr->sa_family == AF_INET6)
+			{
+				if ([remoteAddr length] == sizeof(struct sockaddr_in6))
+				{
+					address6 = remoteAddr;
+				}
+			}
+		}
+		
+		if ((address4 == nil) && (address6 == nil))
+		{
+			NSString *msg = @"A valid IPv4 or IPv6 address was not given";
+			err = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
+		BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+		
+		if (isIPv4Disabled && (address4 != nil))
+		{
+			NSString *msg = @"IPv4 has been disabled and an IPv4 address was passed.";
+			err = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		if (isIPv6Disabled && (address6 != nil))
+		{
+			NSString *msg = @"IPv6 has been disabled and an IPv6 address was passed.";
+			err = [self badParamError:msg];
+			
+			return_from_block;
+		}
+		
+		// Run through standard pre-connect checks
+		
+		if (![self preConnectWithInterface:interface error:&err])
+		{
+			return_from_block;
+		}
+		
+		// We've made it past all the checks.
+		// It's time to start the connection process.
+		
+		if (![self connectWithAddress4:address4 address6:address6 error:&err])
+		{
+			return_from_block;
+		}
+		
+		flags |= kSocketStarted;
+		
+		[self startConnectTimeout:timeout];
+		
+		result = YES;
+	}};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	if (result == NO)
+	{
+		if (errPtr)
+			*errPtr = err;
+	}
+	
+	return result;
+}
+
+- (void)lookup:(int)aStateIndex didSucceedWithAddress4:(NSData *)address4 address6:(NSData *)address6
+{
+	LogTrace();
+	
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	NSAssert(address4 || address6, @"Expected at least one valid address");
+	
+	if (aStateIndex != stateIndex)
+	{
+		LogInfo(@"Ignoring lookupDidSucceed, already disconnected");
+		
+		// The connect operation has been cancelled.
+		// That is, socket was disconnected, or connection has already timed out.
+		return;
+	}
+	
+	// Check for problems
+	
+	BOOL isIPv4Disabled = (config & kIPv4Disabled) ? YES : NO;
+	BOOL isIPv6Disabled = (config & kIPv6Disabled) ? YES : NO;
+	
+	if (isIPv4Disabled && (address6 == nil))
+	{
+		NSString *msg = @"IPv4 has been disabled and DNS lookup found no IPv6 address.";
+		
+		[self closeWithError:[self otherError:msg]];
+		return;
+	}
+	
+	if (isIPv6Disabled && (address4 == nil))
+	{
+		NSString *msg = @"IPv6 has been disabled and DNS lookup found no IPv4 address.";
+		
+		[self closeWithError:[self otherError:msg]];
+		return;
+	}
+	
+	// Start the normal connection process
+	
+	NSError *err = nil;
+	if (![self connectWithAddress4:address4 address6:address6 error:&err])
+	{
+		[self closeWithError:err];
+	}
+}
+
+/**
+ * This method is called if the DNS lookup fails.
+ * This method is executed on the socketQueue.
+ * 
+ * Since the DNS lookup executed synchronously on a global concurrent queue,
+ * the original connection request may have already been cancelled or timed-out by the time this method is invoked.
+ * The lookupIndex tells us whether the lookup is still valid or not.
+**/
+- (void)lookup:(int)aStateIndex didFail:(NSError *)error
+{
+	LogTrace();
+	
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	
+	if (aStateIndex != stateIndex)
+	{
+		LogInfo(@"Ignoring lookup:didFail: - already disconnected");
+		
+		// The connect operation has been cancelled.
+		// That is, socket was disconnected, or connection has already timed out.
+		return;
+	}
+	
+	[self endConnectTimeout];
+	[self closeWithError:error];
+}
+
+- (BOOL)connectWithAddress4:(NSData *)address4 address6:(NSData *)address6 error:(NSError **)errPtr
+{
+	LogTrace();
+	
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	LogVerbose(@"IPv4: %@:%hu", [[self class] hostFromAddress:address4], [[self class] portFromAddress:address4]);
+	LogVerbose(@"IPv6: %@:%hu", [[self class] hostFromAddress:address6], [[self class] portFromAddress:address6]);
+	
+	// Determine socket type
+	
+	BOOL preferIPv6 = (config & kPreferIPv6) ? YES : NO;
+	
+	BOOL useIPv6 = ((preferIPv6 && address6) || (address4 == nil));
+	
+	// Create the socket
+	
+	int socketFD;
+	NSData *address;
+	NSData *connectInterface;
+	
+	if (useIPv6)
+	{
+		LogVerbose(@"Creating IPv6 socket");
+		
+		socket6FD = socket(AF_INET6, SOCK_STREAM, 0);
+		
+		socketFD = socket6FD;
+		address = address6;
+		connectInterface = connectInterface6;
+	}
+	else
+	{
+		LogVerbose(@"Creating IPv4 socket");
+		
+		socket4FD = socket(AF_INET, SOCK_STREAM, 0);
+		
+		socketFD = socket4FD;
+		address = address4;
+		connectInterface = connectInterface4;
+	}
+	
+	if (socketFD == SOCKET_NULL)
+	{
+		if (errPtr)
+			*errPtr = [self errnoErrorWithReason:@"Error in socket() function"];
+		
+		return NO;
+	}
+	
+	// Bind the socket to the desired interface (if needed)
+	
+	if (connectInterface)
+	{
+		LogVerbose(@"Binding socket...");
+		
+		if ([[self class] portFromAddress:connectInterface] > 0)
+		{
+			// Since we're going to be binding to a specific port,
+			// we should turn on reuseaddr to allow us to override sockets in time_wait.
+			
+			int reuseOn = 1;
+			setsockopt(socketFD, SOL_SOCKET, SO_REUSEADDR, &reuseOn, sizeof(reuseOn));
+		}
+		
+		const struct sockaddr *interfaceAddr = (const struct sockaddr *)[connectInterface bytes];
+		
+		int result = bind(socketFD, interfaceAddr, (socklen_t)[connectInterface length]);
+		if (result != 0)
+		{
+			if (errPtr)
+				*errPtr = [self errnoErrorWithReason:@"Error in bind() function"];
+			
+			return NO;
+		}
+	}
+	
+	// Prevent SIGPIPE signals
+	
+	int nosigpipe = 1;
+	setsockopt(socketFD, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+	
+	// Disable Nagle's algorithm (if configured)
+	
+	if (config & kNoDelay)
+	{
+		[self applyNoDelayToSocket:socketFD];
+	}
+	
+	// Start the connection process in a background queue
+	
+	int aStateIndex = stateIndex;
+	__weak GCDAsyncSocket *weakSelf = self;
+	
+	dispatch_queue_t globalConcurrentQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+	dispatch_async(globalConcurrentQueue, ^{
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+	
+		int result = connect(socketFD, (const struct sockaddr *)[address bytes], (socklen_t)[address length]);
+		
+		__strong GCDAsyncSocket *strongSelf = weakSelf;
+		if (strongSelf == nil) return_from_block;
+		
+		if (result == 0)
+		{
+			dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
+				
+				[strongSelf didConnect:aStateIndex];
+			}});
+		}
+		else
+		{
+			NSError *error = [strongSelf errnoErrorWithReason:@"Error in connect() function"];
+			
+			dispatch_async(strongSelf->socketQueue, ^{ @autoreleasepool {
+				
+				[strongSelf didNotConnect:aStateIndex error:error];
+			}});
+		}
+		
+	#pragma clang diagnostic pop
+	});
+	
+	LogVerbose(@"Connecting...");
+	
+	return YES;
+}
+
+- (void)didConnect:(int)aStateIndex
+{
+	LogTrace();
+	
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	
+	if (aStateIndex != stateIndex)
+	{
+		LogInfo(@"Ignoring didConnect, already disconnected");
+		
+		// The connect operation has been cancelled.
+		// That is, socket was disconnected, or connection has already timed out.
+		return;
+	}
+	
+	flags |= kConnected;
+	
+	[self endConnectTimeout];
+	
+	#if TARGET_OS_IPHONE
+	// The endConnectTimeout method executed above incremented the stateIndex.
+	aStateIndex = stateIndex;
+	#endif
+	
+	// Setup read/write streams (as workaround for specific shortcomings in the iOS platform)
+	// 
+	// Note:
+	// There may be configuration options that must be set by the delegate before opening the streams.
+	// The primary example is the kCFStreamNetworkServiceTypeVoIP flag, which only works on an unopened stream.
+	// 
+	// Thus we wait until after the socket:didConnectToHost:port: delegate method has completed.
+	// This gives the delegate time to properly configure the streams if needed.
+	
+	dispatch_block_t SetupStreamsPart1 = ^{
+		#if TARGET_OS_IPHONE
+		
+		if (![self createReadAndWriteStream])
+		{
+			[self closeWithError:[self otherError:@"Error creating CFStreams"]];
+			return;
+		}
+		
+		if (![self registerForStreamCallbacksIncludingReadWrite:NO])
+		{
+			[self closeWithError:[self otherError:@"Error in CFStreamSetClient"]];
+			return;
+		}
+		
+		#endif
+	};
+	dispatch_block_t SetupStreamsPart2 = ^{
+		#if TARGET_OS_IPHONE
+		
+		if (aStateIndex != stateIndex)
+		{
+			// The socket has been disconnected.
+			return;
+		}
+		
+		if (![self addStreamsToRunLoop])
+		{
+			[self closeWithError:[self otherError:@"Error in CFStreamScheduleWithRunLoop"]];
+			return;
+		}
+		
+		if (![self openStreams])
+		{
+			[self closeWithError:[self otherError:@"Error creating CFStreams"]];
+			return;
+		}
+		
+		#endif
+	};
+	
+	// Notify delegate
+	
+	NSString *host = [self connectedHost];
+	uint16_t port = [self connectedPort];
+	
+	__strong id theDelegate = delegate;
+
+	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didConnectToHost:port:)])
+	{
+		SetupStreamsPart1();
+		
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
+			
+			[theDelegate socket:self didConnectToHost:host port:port];
+			
+			dispatch_async(socketQueue, ^{ @autoreleasepool {
+				
+				SetupStreamsPart2();
+			}});
+		}}];
+	}
+	else
+	{
+		SetupStreamsPart1();
+		SetupStreamsPart2();
+	}
+		
+	// Get the connected socket
+	
+	int socketFD = (socket4FD != SOCKET_NULL) ? socket4FD : socket6FD;
+	
+	// Enable non-blocking IO on the socket
+	
+	int result = fcntl(socketFD, F_SETFL, O_NONBLOCK);
+	if (result == -1)
+	{
+		NSString *errMsg = @"Error enabling non-blocking IO on socket (fcntl)";
+		[self closeWithError:[self otherError:errMsg]];
+		
+		return;
+	}
+	
+	// Setup our read/write sources
+	
+	[self setupReadAndWriteSourcesForNewlyConnectedSocket:socketFD];
+	
+	// Dequeue any pending read/write requests
+	
+	[self maybeDequeueRead];
+	[self maybeDequeueWrite];
+}
+
+- (void)didNotConnect:(int)aStateIndex error:(NSError *)error
+{
+	LogTrace();
+	
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	
+	if (aStateIndex != stateIndex)
+	{
+		LogInfo(@"Ignoring didNotConnect, already disconnected");
+		
+		// The connect operation has been cancelled.
+		// That is, socket was disconnected, or connection has already timed out.
+		return;
+	}
+	
+	[self closeWithError:error];
+}
+
+- (void)startConnectTimeout:(NSTimeInterval)timeout
+{
+	if (timeout >= 0.0)
+	{
+		if ((connectTimer == nil) || (connectTimer->wheel != timingWheel))
+		{
+			[connectTimer disarm];
+			
+			__weak GCDAsyncSocket *weakSelf = self;
+			
+			connectTimer = [timingWheel timeoutWithQueue:socketQueue handler:^{ @autoreleasepool {
+			#pragma clang diagnostic push
+			#pragma clang diagnostic warning "-Wimplicit-retain-self"
+			
+				__strong GCDAsyncSocket *strongSelf = weakSelf;
+				if (strongSelf == nil) return_from_block;
+				
+				[strongSelf doConnectTimeout];
+				
+			#pragma clang diagnostic pop
+			}}];
+		}
+		
+		[connectTimer armWithInterval:timeout];
+	}
+}
+
+- (void)endConnectTimeout
+{
+	LogTrace();
+	
+	[connectTimer disarm];
+	
+	// Increment stateIndex.
+	// This will prevent us from processing results from any related background asynchronous operations.
+	// 
+	// Note: This should be called from close method even if connectTimer isn't armed.
+	// This is because one might disconnect a socket prior to a successful connection which had no timeout.
+	
+	stateIndex++;
+	
+	if (connectInterface4)
+	{
+		connectInterface4 = nil;
+	}
+	if (connectInterface6)
+	{
+		connectInterface6 = nil;
+	}
+}
+
+- (void)doConnectTimeout
+{
+	LogTrace();
+	
+	[self endConnectTimeout];
+	[self closeWithError:[self connectTimeoutError]];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Disconnecting
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)failBroadcastWrite:(id)packet
+{
+	if ([packet isKindOfClass:[GCDAsyncWritePacket class]])
+	{
+		GCDAsyncWritePacket *write = (GCDAsyncWritePacket *)packet;
+		
+		[write->broadcast completeWithSuccess:NO];
+		write->broadcast = nil;
+	}
+}
+
+- (void)failBroadcastWritesInQueue:(GCDAsyncSocketPacketQueue *)queue
+{
+	NSUInteger count = [queue count];
+	
+	for (NSUInteger i = 0; i < count; i++)
+	{
+		[self failBroadcastWrite:[queue objectAtIndex:i]];
+	}
+}
+
+- (void)closeWithError:(NSError *)error
+{
+	LogTrace();
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	[self endConnectTimeout];
+	
+	// Deliver any batched completions before the delegate hears about the disconnection
+	[self flushCompletionBatches];
+	
+	// Broadcast writes that didn't make it count as failed
+	[self failBroadcastWrite:currentWrite];
+	[self failBroadcastWritesInQueue:writeQueue];
+	[self failBroadcastWritesInQueue:priorityWriteQueue];
+	
+	if (currentRead != nil)  [self endCurrentRead];
+	if (currentWrite != nil) [self endCurrentWrite];
+	
+	[readQueue removeAllObjects];
+	[writeQueue removeAllObjects];
+	[priorityWriteQueue removeAllObjects];
+	
+	[preBuffer reset];
+	
+	#if TARGET_OS_IPHONE
+	{
+		if (readStream || writeStream)
+		{
+			[self removeStreamsFromRunLoop];
+			
+			if (readStream)
+			{
+				CFReadStreamSetClient(readStream, kCFStreamEventNone, NULL, NULL);
+				CFReadStreamClose(readStream);
+				CFRelease(readStream);
+				readStream = NULL;
+			}
+			if (writeStream)
+			{
+				CFWriteStreamSetClient(writeStream, kCFStreamEventNone, NULL, NULL);
+				CFWriteStreamClose(writeStream);
+				CFRelease(writeStream);
+				writeStream = NULL;
+			}
+		}
+	}
+	#endif
+	
+	[sslPreBuffer reset];
+	sslErrCode = lastSSLHandshakeError = noErr;
+	
+	if (sslContext)
+	{
+		// Getting a linker error here about the SSLx() functions?
+		// You need to add the Security Framework to your application.
+		
+		SSLClose(sslContext);
+		
+		#if TARGET_OS_IPHONE || (__MAC_OS_X_VERSION_MIN_REQUIRED >= 1080)
+		CFRelease(sslContext);
+		#else
+		SSLDisposeContext(sslContext);
+		#endif
+		
+		sslContext = NULL;
+	}
+	
+	if (eventSource)
+	{
+		// Unregister from the event loop before the socket is closed (below)
+		
+		[eventSource cancel];
+		eventSource = nil;
+	}
+	
+	// For some crazy reason (in my opinion), cancelling a dispatch source doesn't
+	// invoke the cancel handler if the dispatch source is paused.
+	// So we have to unpause the source if needed.
+	// This allows the cancel handler to be run, which in turn releases the source and closes the socket.
+	
+	if (!accept4Source && !accept6Source && !readSource && !writeSource)
+	{
+		LogVerbose(@"manually closing close");
+
+		if (socket4FD != SOCKET_NULL)
+		{
+			LogVerbose(@"close(socket4FD)");
+			close(socket4FD);
+			socket4FD = SOCKET_NULL;
+		}
+
+		if (socket6FD != SOCKET_NULL)
+		{
+			LogVerbose(@"close(socket6FD)");
+			close(socket6FD);
+			socket6FD = SOCKET_NULL;
+		}
+	}
+	else
+	{
+		if (accept4Source)
+		{
+			LogVerbose(@"dispatch_source_cancel(accept4Source)");
+			dispatch_source_cancel(accept4Source);
+			
+			// We never suspend accept4Source
+			
+			accept4Source = NULL;
+		}
+		
+		if (accept6Source)
+		{
+			LogVerbose(@"dispatch_source_cancel(accept6Source)");
+			dispatch_source_cancel(accept6Source);
+			
+			// We never suspend accept6Source
+			
+			accept6Source = NULL;
+		}
+	
+		if (readSource)
+		{
+			LogVerbose(@"dispatch_source_cancel(readSource)");
+			dispatch_source_cancel(readSource);
+			
+			[self resumeReadSource];
+			
+			readSource = NULL;
+		}
+		
+		if (writeSource)
+		{
+			LogVerbose(@"dispatch_source_cancel(writeSource)");
+			dispatch_source_cancel(writeSource);
+			
+			[self resumeWriteSource];
+			
+			writeSource = NULL;
+		}
+		
+		// The sockets will be closed by the cancel handlers of the corresponding source
+		
+		socket4FD = SOCKET_NULL;
+		socket6FD = SOCKET_NULL;
+	}
+	
+	if (holdsSocketQueuePoolLoad)
+	{
+		// The loads count open connections.
+		// The socket keeps running on the pool's queue, but may not be deallocated for a while
+		// (e.g. until the socketDidDisconnect:withError: block below has run on the delegateQueue).
+		
+		[socketQueuePool releaseQueueAtIndex:socketQueuePoolIndex];
+		holdsSocketQueuePoolLoad = NO;
+	}
+	
+	// If the client has passed the connect/accept method, then the connection has at least begun.
+	// Notify delegate that it is now ending.
+	BOOL shouldCallDelegate = (flags & kSocketStarted) ? YES : NO;
+	BOOL isDeallocating = (flags & kDealloc) ? YES : NO;
+	
+	// Clear stored socket info and all flags (config remains as is)
+	socketFDBytesAvailable = 0;
+	writeBatchDepth = 0;
+	queuedWriteBytes = 0;
+	readSizeEstimate = GCDAsyncSocketReadSizeEstimateInitial;
+	[self updatePreBufferSegmentCapacity];
+	flags &= kDealloc; // Still needed by notifyDelegateWithBlock: below
+	sslWriteCachedLength = 0;
+	
+	if (shouldCallDelegate)
+	{
+		__strong id theDelegate = delegate;
+		__strong id theSelf = isDeallocating ? nil : self;
+		
+		if (delegateQueue && [theDelegate respondsToSelector: @selector(socketDidDisconnect:withError:)])
+		{
+			[self notifyDelegateWithBlock:^{ @autoreleasepool {
+				
+				[theDelegate socketDidDisconnect:theSelf withError:error];
+			}}];
+		}	
+	}
+}
+
+- (void)disconnect
+{
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		if (flags & kSocketStarted)
+		{
+			[self closeWithError:nil];
+		}
+	}};
+	
+	// Synchronous disconnection, as documented in the header file
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (directDelegateDepth > 0)
+		{
+			// Invoked from a delegate method that's being invoked directly (see directDelegateDispatch).
+			// The socket is in the middle of something, so disconnect as soon as that's done.
+			dispatch_async(socketQueue, block);
+		}
+		else
+		{
+			block();
+		}
+	}
+	else
+		dispatch_sync(socketQueue, block);
+}
+
+- (void)disconnectAfterReading
+{
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		if (flags & kSocketStarted)
+		{
+			flags |= (kForbidReadsWrites | kDisconnectAfterReads);
+			[self maybeClose];
+		}
+	}});
+}
+
+- (void)disconnectAfterWriting
+{
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		if (flags & kSocketStarted)
+		{
+			flags |= (kForbidReadsWrites | kDisconnectAfterWrites);
+			[self maybeClose];
+			
+			// Release any writes held for an unfinished write batch
+			[self maybeDequeueWrite];
+		}
+	}});
+}
+
+- (void)disconnectAfterReadingAndWriting
+{
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		if (flags & kSocketStarted)
+		{
+			flags |= (kForbidReadsWrites | kDisconnectAfterReads | kDisconnectAfterWrites);
+			[self maybeClose];
+			
+			// Release any writes held for an unfinished write batch
+			[self maybeDequeueWrite];
+		}
+	}});
+}
+
+/**
+ * Closes the socket if possible.
+ * That is, if all writes have completed, and we're set to disconnect after writing,
+ * or if all reads have completed, and we're set to disconnect after reading.
+**/
+- (void)maybeClose
+{
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	
+	BOOL shouldClose = NO;
+	
+	if (flags & kDisconnectAfterReads)
+	{
+		if (([readQueue count] == 0) && (currentRead == nil))
+		{
+			if (flags & kDisconnectAfterWrites)
+			{
+				if (([writeQueue count] == 0) && ([priorityWriteQueue count] == 0) && (currentWrite == nil))
+				{
+					shouldClose = YES;
+				}
+			}
+			else
+			{
+				shouldClose = YES;
+			}
+		}
+	}
+	else if (flags & kDisconnectAfterWrites)
+	{
+		if (([writeQueue count] == 0) && ([priorityWriteQueue count] == 0) && (currentWrite == nil))
+		{
+			shouldClose = YES;
+		}
+	}
+	
+	if (shouldClose)
+	{
+		[self closeWithError:nil];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Errors
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (NSError *)badConfigError:(NSString *)errMsg
+{
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketBadConfigError userInfo:userInfo];
+}
+
+- (NSError *)badParamError:(NSString *)errMsg
+{
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketBadParamError userInfo:userInfo];
+}
+
++ (NSError *)gaiError:(int)gai_error
+{
+	NSString *errMsg = [NSString stringWithCString:gai_strerror(gai_error) encoding:NSASCIIStringEncoding];
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	
+	return [NSError errorWithDomain:@"kCFStreamErrorDomainNetDB" code:gai_error userInfo:userInfo];
+}
+
+- (NSError *)errnoErrorWithReason:(NSString *)reason
+{
+	NSString *errMsg = [NSString stringWithUTF8String:strerror(errno)];
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObjectsAndKeys:errMsg, NSLocalizedDescriptionKey,
+	                                                                    reason, NSLocalizedFailureReasonErrorKey, nil];
+	
+	return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:userInfo];
+}
+
+- (NSError *)errnoError
+{
+	NSString *errMsg = [NSString stringWithUTF8String:strerror(errno)];
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	
+	return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:userInfo];
+}
+
+- (NSError *)sslError:(OSStatus)ssl_error
+{
+	NSString *msg = @"Error code definition can be found in Apple's SecureTransport.h";
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:msg forKey:NSLocalizedRecoverySuggestionErrorKey];
+	
+	return [NSError errorWithDomain:@"kCFStreamErrorDomainSSL" code:ssl_error userInfo:userInfo];
+}
+
+- (NSError *)connectTimeoutError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketConnectTimeoutError",
+	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
+	                                                     @"Attempt to connect to host timed out", nil);
+	
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketConnectTimeoutError userInfo:userInfo];
+}
+
+/**
+ * Returns a standard AsyncSocket maxed out error.
+**/
+- (NSError *)readMaxedOutError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketReadMaxedOutError",
+														 @"GCDAsyncSocket", [NSBundle mainBundle],
+														 @"Read operation reached set maximum length", nil);
+	
+	NSDictionary *info = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketReadMaxedOutError userInfo:info];
+}
+
+/**
+ * Returns the error a read fails with when the prebuffer can't allocate a segment.
+**/
+- (NSError *)preBufferAllocationError
+{
+	NSString *errMsg = [NSString stringWithUTF8String:strerror(ENOMEM)];
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObjectsAndKeys:errMsg, NSLocalizedDescriptionKey,
+	                          @"Unable to allocate memory for the read buffer", NSLocalizedFailureReasonErrorKey, nil];
+	
+	return [NSError errorWithDomain:NSPOSIXErrorDomain code:ENOMEM userInfo:userInfo];
+}
+
+/**
+ * Returns a standard AsyncSocket write timeout error.
+**/
+- (NSError *)readTimeoutError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketReadTimeoutError",
+	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
+	                                                     @"Read operation timed out", nil);
+	
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketReadTimeoutError userInfo:userInfo];
+}
+
+/**
+ * Returns a standard AsyncSocket write timeout error.
+**/
+- (NSError *)writeTimeoutError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketWriteTimeoutError",
+	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
+	                                                     @"Write operation timed out", nil);
+	
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketWriteTimeoutError userInfo:userInfo];
+}
+
+- (NSError *)connectionClosedError
+{
+	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketClosedError",
+	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
+	                                                     @"Socket closed by remote peer", nil);
+	
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketClosedError userInfo:userInfo];
+}
+
+- (NSError *)otherError:(NSString *)errMsg
+{
+	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	
+	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketOtherError userInfo:userInfo];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Diagnostics
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)isDisconnected
+{
+	__block BOOL result = NO;
+	
+	dispatch_block_t block = ^{
+		result = (flags & kSocketStarted) ? NO : YES;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (BOOL)isConnected
+{
+	__block BOOL result = NO;
+	
+	dispatch_block_t block = ^{
+		result = (flags & kConnected) ? YES : NO;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (NSString *)connectedHost
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (socket4FD != SOCKET_NULL)
+			return [self connectedHostFromSocket4:socket4FD];
+		if (socket6FD != SOCKET_NULL)
+			return [self connectedHostFromSocket6:socket6FD];
+		
+		return nil;
+	}
+	else
+	{
+		__block NSString *result = nil;
+		
+		dispatch_sync(socketQueue, ^{ @autoreleasepool {
+			
+			if (socket4FD != SOCKET_NULL)
+				result = [self connectedHostFromSocket4:socket4FD];
+			else if (socket6FD != SOCKET_NULL)
+				result = [self connectedHostFromSocket6:socket6FD];
+		}});
+		
+		return result;
+	}
+}
+
+- (uint16_t)connectedPort
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (socket4FD != SOCKET_NULL)
+			return [self connectedPortFromSocket4:socket4FD];
+		if (socket6FD != SOCKET_NULL)
+			return [self connectedPortFromSocket6:socket6FD];
+		
+		return 0;
+	}
+	else
+	{
+		__block uint16_t result = 0;
+		
+		dispatch_sync(socketQueue, ^{
+			// No need for autorelease pool
+			
+			if (socket4FD != SOCKET_NULL)
+				result = [self connectedPortFromSocket4:socket4FD];
+			else if (socket6FD != SOCKET_NULL)
+				result = [self connectedPortFromSocket6:socket6FD];
+		});
+		
+		return result;
+	}
+}
+
+- (NSString *)localHost
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (socket4FD != SOCKET_NULL)
+			return [self localHostFromSocket4:socket4FD];
+		if (socket6FD != SOCKET_NULL)
+			return [self localHostFromSocket6:socket6FD];
+		
+		return nil;
+	}
+	else
+	{
+		__block NSString *result = nil;
+		
+		dispatch_sync(socketQueue, ^{ @autoreleasepool {
+			
+			if (socket4FD != SOCKET_NULL)
+				result = [self localHostFromSocket4:socket4FD];
+			else if (socket6FD != SOCKET_NULL)
+				result = [self localHostFromSocket6:socket6FD];
+		}});
+		
+		return result;
+	}
+}
+
+- (uint16_t)localPort
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		if (socket4FD != SOCKET_NULL)
+			return [self localPortFromSocket4:socket4FD];
+		if (socket6FD != SOCKET_NULL)
+			return [self localPortFromSocket6:socket6FD];
+		
+		return 0;
+	}
+	else
+	{
+		__block uint16_t result = 0;
+		
+		dispatch_sync(socketQueue, ^{
+			// No need for autorelease pool
+			
+			if (socket4FD != SOCKET_NULL)
+				result = [self localPortFromSocket4:socket4FD];
+			else if (socket6FD != SOCKET_NULL)
+				result = [self localPortFromSocket6:socket6FD];
+		});
+		
+		return result;
+	}
+}
+
+- (NSString *)connectedHost4
+{
+	if (socket4FD != SOCKET_NULL)
+		return [self connectedHostFromSocket4:socket4FD];
+	
+	return nil;
+}
+
+- (NSString *)connectedHost6
+{
+	if (socket6FD != SOCKET_NULL)
+		return [self connectedHostFromSocket6:socket6FD];
+	
+	return nil;
+}
+
+- (uint16_t)connectedPort4
+{
+	if (socket4FD != SOCKET_NULL)
+		return [self connectedPortFromSocket4:socket4FD];
+	
+	return 0;
+}
+
+- (uint16_t)connectedPort6
+{
+	if (socket6FD != SOCKET_NULL)
+		return [self connectedPortFromSocket6:socket6FD];
+	
+	return 0;
+}
+
+- (NSString *)localHost4
+{
+	if (socket4FD != SOCKET_NULL)
+		return [self localHostFromSocket4:socket4FD];
+	
+	return nil;
+}
+
+- (NSString *)localHost6
+{
+	if (socket6FD != SOCKET_NULL)
+		return [self localHostFromSocket6:socket6FD];
+	
+	return nil;
+}
+
+- (uint16_t)localPort4
+{
+	if (socket4FD != SOCKET_NULL)
+		return [self localPortFromSocket4:socket4FD];
+	
+	return 0;
+}
+
+- (uint16_t)localPort6
+{
+	if (socket6FD != SOCKET_NULL)
+		return [self localPortFromSocket6:socket6FD];
+	
+	return 0;
+}
+
+- (NSString *)connectedHostFromSocket4:(int)socketFD
+{
+	struct sockaddr_in sockaddr4;
+	socklen_t sockaddr4len = sizeof(sockaddr4);
+	
+	if (getpeername(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	{
+		return nil;
+	}
+	return [[self class] hostFromSockaddr4:&sockaddr4];
+}
+
+- (NSString *)connectedHostFromSocket6:(int)socketFD
+{
+	struct sockaddr_in6 sockaddr6;
+	socklen_t sockaddr6len = sizeof(sockaddr6);
+	
+	if (getpeername(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	{
+		return nil;
+	}
+	return [[self class] hostFromSockaddr6:&sockaddr6];
+}
+
+- (uint16_t)connectedPortFromSocket4:(int)socketFD
+{
+	struct sockaddr_in sockaddr4;
+	socklen_t sockaddr4len = sizeof(sockaddr4);
+	
+	if (getpeername(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	{
+		return 0;
+	}
+	return [[self class] portFromSockaddr4:&sockaddr4];
+}
+
+- (uint16_t)connectedPortFromSocket6:(int)socketFD
+{
+	struct sockaddr_in6 sockaddr6;
+	socklen_t sockaddr6len = sizeof(sockaddr6);
+	
+	if (getpeername(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	{
+		return 0;
+	}
+	return [[self class] portFromSockaddr6:&sockaddr6];
+}
+
+- (NSString *)localHostFromSocket4:(int)socketFD
+{
+	struct sockaddr_in sockaddr4;
+	socklen_t sockaddr4len = sizeof(sockaddr4);
+	
+	if (getsockname(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	{
+		return nil;
+	}
+	return [[self class] hostFromSockaddr4:&sockaddr4];
+}
+
+- (NSString *)localHostFromSocket6:(int)socketFD
+{
+	struct sockaddr_in6 sockaddr6;
+	socklen_t sockaddr6len = sizeof(sockaddr6);
+	
+	if (getsockname(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	{
+		return nil;
+	}
+	return [[self class] hostFromSockaddr6:&sockaddr6];
+}
+
+- (uint16_t)localPortFromSocket4:(int)socketFD
+{
+	struct sockaddr_in sockaddr4;
+	socklen_t sockaddr4len = sizeof(sockaddr4);
+	
+	if (getsockname(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	{
+		return 0;
+	}
+	return [[self class] portFromSockaddr4:&sockaddr4];
+}
+
+- (uint16_t)localPortFromSocket6:(int)socketFD
+{
+	struct sockaddr_in6 sockaddr6;
+	socklen_t sockaddr6len = sizeof(sockaddr6);
+	
+	if (getsockname(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	{
+		return 0;
+	}
+	return [[self class] portFromSockaddr6:&sockaddr6];
+}
+
+- (NSData *)connectedAddress
+{
+	__block NSData *result = nil;
+	
+	dispatch_block_t block = ^{
+		if (socket4FD != SOCKET_NULL)
+		{
+			struct sockaddr_in sockaddr4;
+			socklen_t sockaddr4len = sizeof(sockaddr4);
+			
+			if (getpeername(socket4FD, (struct sockaddr *)&sockaddr4, &sockaddr4len) == 0)
+			{
+				result = [[NSData alloc] initWithBytes:&sockaddr4 length:sockaddr4len];
+			}
+		}
+		
+		if (socket6FD != SOCKET_NULL)
+		{
+			struct sockaddr_in6 sockaddr6;
+			socklen_t sockaddr6len = sizeof(sockaddr6);
+			
+			if (getpeername(socket6FD, (struct sockaddr *)&sockaddr6, &sockaddr6len) == 0)
+			{
+				result = [[NSData alloc] initWithBytes:&sockaddr6 length:sockaddr6len];
+			}
+		}
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (NSData *)localAddress
+{
+	__block NSData *result = nil;
+	
+	dispatch_block_t block = ^{
+		if (socket4FD != SOCKET_NULL)
+		{
+			struct sockaddr_in sockaddr4;
+			socklen_t sockaddr4len = sizeof(sockaddr4);
+			
+			if (getsockname(socket4FD, (struct sockaddr *)&sockaddr4, &sockaddr4len) == 0)
+			{
+				result = [[NSData alloc] initWithBytes:&sockaddr4 length:sockaddr4len];
+			}
+		}
+		
+		if (socket6FD != SOCKET_NULL)
+		{
+			struct sockaddr_in6 sockaddr6;
+			socklen_t sockaddr6len = sizeof(sockaddr6);
+			
+			if (getsockname(socket6FD, (struct sockaddr *)&sockaddr6, &sockaddr6len) == 0)
+			{
+				result = [[NSData alloc] initWithBytes:&sockaddr6 length:sockaddr6len];
+			}
+		}
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (BOOL)isIPv4
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return (socket4FD != SOCKET_NULL);
+	}
+	else
+	{
+		__block BOOL result = NO;
+		
+		dispatch_sync(socketQueue, ^{
+			result = (socket4FD != SOCKET_NULL);
+		});
+		
+		return result;
+	}
+}
+
+- (BOOL)isIPv6
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return (socket6FD != SOCKET_NULL);
+	}
+	else
+	{
+		__block BOOL result = NO;
+		
+		dispatch_sync(socketQueue, ^{
+			result = (socket6FD != SOCKET_NULL);
+		});
+		
+		return result;
+	}
+}
+
+- (BOOL)isSecure
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return (flags & kSocketSecure) ? YES : NO;
+	}
+	else
+	{
+		__block BOOL result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = (flags & kSocketSecure) ? YES : NO;
+		});
+		
+		return result;
+	}
+}
+
+- (NSUInteger)readSizeEstimate
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return readSizeEstimate;
+	}
+	else
+	{
+		__block NSUInteger result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = readSizeEstimate;
+		});
+		
+		return result;
+	}
+}
+
+- (NSUInteger)packetAllocationCount
+{
+	__block NSUInteger result = 0;
+	
+	dispatch_block_t block = ^{
+		
+		result = packetAllocationCount;
+		
+		result += [readQueue allocationCount] + [writeQueue allocationCount] + [priorityWriteQueue allocationCount];
+		result += [freeReadPackets allocationCount] + [freeWritePackets allocationCount];
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Utilities
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Applies the noDelay configuration to the given socket, via the TCP_NODELAY option.
+**/
+- (void)applyNoDelayToSocket:(int)socketFD
+{
+	int noDelay = (config & kNoDelay) ? 1 : 0;
+	
+	int status = setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+	if (status == -1)
+	{
+		LogWarn(@"Error setting TCP_NODELAY on socket (setsockopt): %s", strerror(errno));
+	}
+}
+
+/**
+ * Finds the address of an interface description.
+ * An inteface description may be an interface name (en0, en1, lo0) or corresponding IP (192.168.4.34).
+ * 
+ * The interface description may optionally contain a port number at the end, separated by a colon.
+ * If a non-zero port parameter is provided, any port number in the interface description is ignored.
+ * 
+ * The returned value is a 'struct sockaddr' wrapped in an NSMutableData object.
+**/
+- (void)getInterfaceAddress4:(NSMutableData **)interfaceAddr4Ptr
+                    address6:(NSMutableData **)interfaceAddr6Ptr
+             fromDescription:(NSString *)interfaceDescription
+                        port:(uint16_t)port
+{
+	NSMutableData *addr4 = nil;
+	NSMutableData *addr6 = nil;
+	
+	NSString *interface = nil;
+	
+	NSArray *components = [interfaceDescription componentsSeparatedByString:@":"];
+	if ([components count] > 0)
+	{
+		NSString *temp = [components objectAtIndex:0];
+		if ([temp length] > 0)
 		{
-			flags |= (kForbidReadsWrites | kDisconnectAfterWrites);
-			[self maybeClose];
+			interface = temp;
+		}
+	}
+	if ([components count] > 1 && port == 0)
+	{
+		long portL = strtol([[components objectAtIndex:1] UTF8String], NULL, 10);
+		
+		if (portL > 0 && portL <= UINT16_MAX)
+		{
+			port = (uint16_t)portL;
+		}
+	}
+	
+	if (interface == nil)
+	{
+		// ANY address
+		
+		struct sockaddr_in sockaddr4;
+		memset(&sockaddr4, 0, sizeof(sockaddr4));
+		
+		sockaddr4.sin_len         = sizeof(sockaddr4);
+		sockaddr4.sin_family      = AF_INET;
+		sockaddr4.sin_port        = htons(port);
+		sockaddr4.sin_addr.s_addr = htonl(INADDR_ANY);
+		
+		struct sockaddr_in6 sockaddr6;
+		memset(&sockaddr6, 0, sizeof(sockaddr6));
+		
+		sockaddr6.sin6_len       = sizeof(sockaddr6);
+		sockaddr6.sin6_family    = AF_INET6;
+		sockaddr6.sin6_port      = htons(port);
+		sockaddr6.sin6_addr      = in6addr_any;
+		
+		addr4 = [NSMutableData dataWithBytes:&sockaddr4 length:sizeof(sockaddr4)];
+		addr6 = [NSMutableData dataWithBytes:&sockaddr6 length:sizeof(sockaddr6)];
+	}
+	else if ([interface isEqualToString:@"localhost"] || [interface isEqualToString:@"loopback"])
+	{
+		// LOOPBACK address
+		
+		struct sockaddr_in sockaddr4;
+		memset(&sockaddr4, 0, sizeof(sockaddr4));
+		
+		sockaddr4.sin_len         = sizeof(sockaddr4);
+		sockaddr4.sin_family      = AF_INET;
+		sockaddr4.sin_port        = htons(port);
+		sockaddr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		
+		struct sockaddr_in6 sockaddr6;
+		memset(&sockaddr6, 0, sizeof(sockaddr6));
+		
+		sockaddr6.sin6_len       = sizeof(sockaddr6);
+		sockaddr6.sin6_family    = AF_INET6;
+		sockaddr6.sin6_port      = htons(port);
+		sockaddr6.sin6_addr      = in6addr_loopback;
+		
+		addr4 = [NSMutableData dataWithBytes:&sockaddr4 length:sizeof(sockaddr4)];
+		addr6 = [NSMutableData dataWithBytes:&sockaddr6 length:sizeof(sockaddr6)];
+	}
+	else
+	{
+		const char *iface = [interface UTF8String];
+		
+		struct ifaddrs *addrs;
+		const struct ifaddrs *cursor;
+		
+		if ((getifaddrs(&addrs) == 0))
+		{
+			cursor = addrs;
+			while (cursor != NULL)
+			{
+				if ((addr4 == nil) && (cursor->ifa_addr->sa_family == AF_INET))
+				{
+					// IPv4
+					
+					struct sockaddr_in nativeAddr4;
+					memcpy(&nativeAddr4, cursor->ifa_addr, sizeof(nativeAddr4));
+					
+					if (strcmp(cursor->ifa_name, iface) == 0)
+					{
+						// Name match
+						
+						nativeAddr4.sin_port = htons(port);
+						
+						addr4 = [NSMutableData dataWithBytes:&nativeAddr4 length:sizeof(nativeAddr4)];
+					}
+					else
+					{
+						char ip[INET_ADDRSTRLEN];
+						
+						const char *conversion = inet_ntop(AF_INET, &nativeAddr4.sin_addr, ip, sizeof(ip));
+						
+						if ((conversion != NULL) && (strcmp(ip, iface) == 0))
+						{
+							// IP match
+							
+							nativeAddr4.sin_port = htons(port);
+							
+							addr4 = [NSMutableData dataWithBytes:&nativeAddr4 length:sizeof(nativeAddr4)];
+						}
+					}
+				}
+				else if ((addr6 == nil) && (cursor->ifa_addr->sa_family == AF_INET6))
+				{
+					// IPv6
+					
+					struct sockaddr_in6 nativeAddr6;
+					memcpy(&nativeAddr6, cursor->ifa_addr, sizeof(nativeAddr6));
+					
+					if (strcmp(cursor->ifa_name, iface) == 0)
+					{
+						// Name match
+						
+						nativeAddr6.sin6_port = htons(port);
+						
+						addr6 = [NSMutableData dataWithBytes:&nativeAddr6 length:sizeof(nativeAddr6)];
+					}
+					else
+					{
+						char ip[INET6_ADDRSTRLEN];
+						
+						const char *conversion = inet_ntop(AF_INET6, &nativeAddr6.sin6_addr, ip, sizeof(ip));
+						
+						if ((conversion != NULL) && (strcmp(ip, iface) == 0))
+						{
+							// IP match
+							
+							nativeAddr6.sin6_port = htons(port);
+							
+							addr6 = [NSMutableData dataWithBytes:&nativeAddr6 length:sizeof(nativeAddr6)];
+						}
+					}
+				}
+				
+				cursor = cursor->ifa_next;
+			}
+			
+			freeifaddrs(addrs);
+		}
+	}
+	
+	if (interfaceAddr4Ptr) *interfaceAddr4Ptr = addr4;
+	if (interfaceAddr6Ptr) *interfaceAddr6Ptr = addr6;
+}
+
+- (void)setupReadAndWriteSourcesForNewlyConnectedSocket:(int)socketFD
+{
+	if (eventBackend == GCDAsyncSocketEventBackendEventLoop)
+	{
+		if ([self setupEventSourceForNewlyConnectedSocket:socketFD])
+		{
+			return;
 		}
+		
+		// Fall back to dispatch sources
+	}
+	
+	readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, socketFD, 0, socketQueue);
+	writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, socketFD, 0, socketQueue);
+	
+	// Setup event handlers
+	
+	__weak GCDAsyncSocket *weakSelf = self;
+	
+	dispatch_source_set_event_handler(readSource, ^{ @autoreleasepool {
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		__strong GCDAsyncSocket *strongSelf = weakSelf;
+		if (strongSelf == nil) return_from_block;
+		
+		[strongSelf doReadEventWithBytesAvailable:dispatch_source_get_data(strongSelf->readSource)];
+		
+	#pragma clang diagnostic pop
+	}});
+	
+	dispatch_source_set_event_handler(writeSource, ^{ @autoreleasepool {
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		__strong GCDAsyncSocket *strongSelf = weakSelf;
+		if (strongSelf == nil) return_from_block;
+		
+		[strongSelf doWriteEvent];
+		
+	#pragma clang diagnostic pop
 	}});
+	
+	// Setup cancel handlers
+	
+	__block int socketFDRefCount = 2;
+	
+	#if !OS_OBJECT_USE_OBJC
+	dispatch_source_t theReadSource = readSource;
+	dispatch_source_t theWriteSource = writeSource;
+	#endif
+	
+	dispatch_source_set_cancel_handler(readSource, ^{
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		LogVerbose(@"readCancelBlock");
+		
+		#if !OS_OBJECT_USE_OBJC
+		LogVerbose(@"dispatch_release(readSource)");
+		dispatch_release(theReadSource);
+		#endif
+		
+		if (--socketFDRefCount == 0)
+		{
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+		}
+		
+	#pragma clang diagnostic pop
+	});
+	
+	dispatch_source_set_cancel_handler(writeSource, ^{
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		LogVerbose(@"writeCancelBlock");
+		
+		#if !OS_OBJECT_USE_OBJC
+		LogVerbose(@"dispatch_release(writeSource)");
+		dispatch_release(theWriteSource);
+		#endif
+		
+		if (--socketFDRefCount == 0)
+		{
+			LogVerbose(@"close(socketFD)");
+			close(socketFD);
+		}
+		
+	#pragma clang diagnostic pop
+	});
+	
+	// We will not be able to read until data arrives.
+	// But we should be able to write immediately.
+	
+	socketFDBytesAvailable = 0;
+	flags &= ~kReadSourceSuspended;
+	
+	LogVerbose(@"dispatch_resume(readSource)");
+	dispatch_resume(readSource);
+	
+	flags |= kSocketCanAcceptBytes;
+	flags |= kWriteSourceSuspended;
 }
 
-- (void)disconnectAfterReadingAndWriting
+/**
+ * Registers the socket with one of the event loop threads, instead of creating dispatch sources for it.
+ * Returns NO if the socket couldn't be registered.
+**/
+- (BOOL)setupEventSourceForNewlyConnectedSocket:(int)socketFD
 {
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
+	__weak GCDAsyncSocket *weakSelf = self;
+	
+	eventSource = [[GCDAsyncSocketEventSource alloc] initWithFD:socketFD
+	                                                      queue:socketQueue
+	                                                readHandler:^unsigned long (unsigned long bytesAvailable) {
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
 		
-		if (flags & kSocketStarted)
-		{
-			flags |= (kForbidReadsWrites | kDisconnectAfterReads | kDisconnectAfterWrites);
-			[self maybeClose];
-		}
-	}});
+		__strong GCDAsyncSocket *strongSelf = weakSelf;
+		if (strongSelf == nil) return 0;
+		
+		[strongSelf doReadEventWithBytesAvailable:bytesAvailable];
+		
+		return strongSelf->socketFDBytesAvailable;
+		
+	#pragma clang diagnostic pop
+	}
+	                                               writeHandler:^{
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		__strong GCDAsyncSocket *strongSelf = weakSelf;
+		if (strongSelf == nil) return_from_block;
+		
+		[strongSelf doWriteEvent];
+		
+	#pragma clang diagnostic pop
+	}
+	                                               errorHandler:^(int err) {
+	#pragma clang diagnostic push
+	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		
+		__strong GCDAsyncSocket *strongSelf = weakSelf;
+		if (strongSelf == nil) return_from_block;
+		
+		errno = err;
+		[strongSelf closeWithError:[strongSelf errnoErrorWithReason:@"Error in kevent() function"]];
+		
+	#pragma clang diagnostic pop
+	}];
+	
+	if (![eventSource activate])
+	{
+		LogWarn(@"Unable to register socket with event loop: %s", strerror(errno));
+		
+		eventSource = nil;
+		return NO;
+	}
+	
+	// We will not be able to read until data arrives.
+	// But we should be able to write immediately.
+	
+	socketFDBytesAvailable = 0;
+	flags &= ~kReadSourceSuspended;
+	
+	[eventSource resumeReadWithBytesAvailable:0];
+	
+	flags |= kSocketCanAcceptBytes;
+	flags |= kWriteSourceSuspended;
+	
+	return YES;
 }
 
 /**
- * Closes the socket if possible.
- * That is, if all writes have completed, and we're set to disconnect after writing,
- * or if all reads have completed, and we're set to disconnect after reading.
+ * Handles the socket becoming readable (or reaching the EOF), as reported by the readSource (or eventSource).
 **/
-- (void)maybeClose
+- (void)doReadEventWithBytesAvailable:(unsigned long)bytesAvailable
 {
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
+	LogVerbose(@"readEventBlock");
 	
-	BOOL shouldClose = NO;
+	socketFDBytesAvailable = bytesAvailable;
+	LogVerbose(@"socketFDBytesAvailable: %lu", socketFDBytesAvailable);
 	
-	if (flags & kDisconnectAfterReads)
+	if (socketFDBytesAvailable > 0)
 	{
-		if (([readQueue count] == 0) && (currentRead == nil))
-		{
-			if (flags & kDisconnectAfterWrites)
-			{
-				if (([writeQueue count] == 0) && (currentWrite == nil))
-				{
-					shouldClose = YES;
-				}
-			}
-			else
-			{
-				shouldClose = YES;
-			}
-		}
+		[self updateReadSizeEstimate:socketFDBytesAvailable];
+		[self doReadData];
 	}
-	else if (flags & kDisconnectAfterWrites)
+	else
+		[self doReadEOF];
+}
+
+/**
+ * Handles the socket becoming writable, as reported by the writeSource (or eventSource).
+**/
+- (void)doWriteEvent
+{
+	LogVerbose(@"writeEventBlock");
+	
+	flags |= kSocketCanAcceptBytes;
+	[self doWriteData];
+}
+
+- (BOOL)usingCFStreamForTLS
+{
+	#if TARGET_OS_IPHONE
+	
+	if ((flags & kSocketSecure) && (flags & kUsingCFStreamForTLS))
 	{
-		if (([writeQueue count] == 0) && (currentWrite == nil))
-		{
-			shouldClose = YES;
-		}
+		// The startTLS method was given the GCDAsyncSocketUseCFStreamForTLS flag.
+		
+		return YES;
 	}
 	
-	if (shouldClose)
+	#endif
+	
+	return NO;
+}
+
+- (BOOL)usingSecureTransportForTLS
+{
+	// Invoking this method is equivalent to ![self usingCFStreamForTLS] (just more readable)
+	
+	#if TARGET_OS_IPHONE
+	
+	if ((flags & kSocketSecure) && (flags & kUsingCFStreamForTLS))
 	{
-		[self closeWithError:nil];
+		// The startTLS method was given the GCDAsyncSocketUseCFStreamForTLS flag.
+		
+		return NO;
 	}
+	
+	#endif
+	
+	return YES;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Errors
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+- (void)suspendReadSource
+{
+	if (!(flags & kReadSourceSuspended))
+	{
+		LogVerbose(@"dispatch_suspend(readSource)");
+		
+		if (eventSource)
+			[eventSource suspendRead];
+		else
+			dispatch_suspend(readSource);
+		
+		flags |= kReadSourceSuspended;
+	}
+}
 
-- (NSError *)badConfigError:(NSString *)errMsg
+- (void)resumeReadSource
 {
-	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
-	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketBadConfigError userInfo:userInfo];
+	if (flags & kReadSourceSuspended)
+	{
+		LogVerbose(@"dispatch_resume(readSource)");
+		
+		if (eventSource)
+			[eventSource resumeReadWithBytesAvailable:socketFDBytesAvailable];
+		else
+			dispatch_resume(readSource);
+		
+		flags &= ~kReadSourceSuspended;
+	}
 }
 
-- (NSError *)badParamError:(NSString *)errMsg
+- (void)suspendWriteSource
 {
-	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
-	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketBadParamError userInfo:userInfo];
+	if (!(flags & kWriteSourceSuspended))
+	{
+		LogVerbose(@"dispatch_suspend(writeSource)");
+		
+		if (eventSource)
+			[eventSource suspendWrite];
+		else
+			dispatch_suspend(writeSource);
+		
+		flags |= kWriteSourceSuspended;
+	}
 }
 
-+ (NSError *)gaiError:(int)gai_error
+- (void)resumeWriteSource
 {
-	NSString *errMsg = [NSString stringWithCString:gai_strerror(gai_error) encoding:NSASCIIStringEncoding];
-	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
-	
-	return [NSError errorWithDomain:@"kCFStreamErrorDomainNetDB" code:gai_error userInfo:userInfo];
+	if (flags & kWriteSourceSuspended)
+	{
+		LogVerbose(@"dispatch_resume(writeSource)");
+		
+		if (eventSource)
+			[eventSource resumeWrite];
+		else
+			dispatch_resume(writeSource);
+		
+		flags &= ~kWriteSourceSuspended;
+	}
 }
 
-- (NSError *)errnoErrorWithReason:(NSString *)reason
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Reading
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)readDataWithTimeout:(NSTimeInterval)timeout tag:(long)tag
 {
-	NSString *errMsg = [NSString stringWithUTF8String:strerror(errno)];
-	NSDictionary *userInfo = [NSDictionary dictionaryWithObjectsAndKeys:errMsg, NSLocalizedDescriptionKey,
-	                                                                    reason, NSLocalizedFailureReasonErrorKey, nil];
-	
-	return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:userInfo];
+	[self readDataWithTimeout:timeout buffer:nil bufferOffset:0 maxLength:0 tag:tag];
 }
 
-- (NSError *)errnoError
+- (void)readDataWithTimeout:(NSTimeInterval)timeout
+                     buffer:(NSMutableData *)buffer
+               bufferOffset:(NSUInteger)offset
+                        tag:(long)tag
 {
-	NSString *errMsg = [NSString stringWithUTF8String:strerror(errno)];
-	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
-	
-	return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:userInfo];
+	[self readDataWithTimeout:timeout buffer:buffer bufferOffset:offset maxLength:0 tag:tag];
 }
 
-- (NSError *)sslError:(OSStatus)ssl_error
+- (void)readDataWithTimeout:(NSTimeInterval)timeout
+                     buffer:(NSMutableData *)buffer
+               bufferOffset:(NSUInteger)offset
+                  maxLength:(NSUInteger)length
+                        tag:(long)tag
 {
-	NSString *msg = @"Error code definition can be found in Apple's SecureTransport.h";
-	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:msg forKey:NSLocalizedRecoverySuggestionErrorKey];
+	if (offset > [buffer length]) {
+		LogWarn(@"Cannot read: offset > [buffer length]");
+		return;
+	}
 	
-	return [NSError errorWithDomain:@"kCFStreamErrorDomainSSL" code:ssl_error userInfo:userInfo];
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		{
+			GCDAsyncReadPacket *packet = [self readPacketWithData:buffer
+			                                          startOffset:offset
+			                                            maxLength:length
+			                                              timeout:timeout
+			                                           readLength:0
+			                                           terminator:nil
+			                                                  tag:tag];
+			
+			[readQueue addObject:packet];
+			[self maybeDequeueRead];
+		}
+	}});
 }
 
-- (NSError *)connectTimeoutError
+- (void)readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout tag:(long)tag
 {
-	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketConnectTimeoutError",
-	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
-	                                                     @"Attempt to connect to host timed out", nil);
-	
-	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
-	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketConnectTimeoutError userInfo:userInfo];
+	[self readDataToLength:length withTimeout:timeout buffer:nil bufferOffset:0 tag:tag];
 }
 
-/**
- * Returns a standard AsyncSocket maxed out error.
-**/
-- (NSError *)readMaxedOutError
+- (void)readDataToLength:(NSUInteger)length
+             withTimeout:(NSTimeInterval)timeout
+                  buffer:(NSMutableData *)buffer
+            bufferOffset:(NSUInteger)offset
+                     tag:(long)tag
 {
-	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketReadMaxedOutError",
-														 @"GCDAsyncSocket", [NSBundle mainBundle],
-														 @"Read operation reached set maximum length", nil);
-	
-	NSDictionary *info = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	if (length == 0) {
+		LogWarn(@"Cannot read: length == 0");
+		return;
+	}
+	if (offset > [buffer length]) {
+		LogWarn(@"Cannot read: offset > [buffer length]");
+		return;
+	}
 	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketReadMaxedOutError userInfo:info];
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		{
+			GCDAsyncReadPacket *packet = [self readPacketWithData:buffer
+			                                          startOffset:offset
+			                                            maxLength:0
+			                                              timeout:timeout
+			                                           readLength:length
+			                                           terminator:nil
+			                                                  tag:tag];
+			
+			[readQueue addObject:packet];
+			[self maybeDequeueRead];
+		}
+	}});
 }
 
-/**
- * Returns a standard AsyncSocket write timeout error.
-**/
-- (NSError *)readTimeoutError
+- (void)readDataWithLengthHeaderOfSize:(NSUInteger)headerSize
+                             bigEndian:(BOOL)bigEndian
+                             maxLength:(NSUInteger)maxLength
+                           withTimeout:(NSTimeInterval)timeout
+                                   tag:(long)tag
 {
-	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketReadTimeoutError",
-	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
-	                                                     @"Read operation timed out", nil);
+	if ((headerSize != 2) && (headerSize != 4) && (headerSize != 8)) {
+		LogWarn(@"Cannot read: headerSize must be 2, 4 or 8");
+		return;
+	}
 	
-	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	// The packet starts out as a read of a specific length (the header).
+	// Once the header is read, the packet is switched over to the length of the payload.
 	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketReadTimeoutError userInfo:userInfo];
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		{
+			GCDAsyncReadPacket *packet = [self readPacketWithData:nil
+			                                          startOffset:0
+			                                            maxLength:maxLength
+			                                              timeout:timeout
+			                                           readLength:headerSize
+			                                           terminator:nil
+			                                                  tag:tag];
+			packet->headerLength = headerSize;
+			packet->headerBigEndian = bigEndian;
+			
+			[readQueue addObject:packet];
+			[self maybeDequeueRead];
+		}
+	}});
 }
 
-/**
- * Returns a standard AsyncSocket write timeout error.
-**/
-- (NSError *)writeTimeoutError
+- (void)readDataToData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag
 {
-	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketWriteTimeoutError",
-	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
-	                                                     @"Write operation timed out", nil);
-	
-	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
-	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketWriteTimeoutError userInfo:userInfo];
+	[self readDataToData:data withTimeout:timeout buffer:nil bufferOffset:0 maxLength:0 tag:tag];
 }
 
-- (NSError *)connectionClosedError
+- (void)readDataToData:(NSData *)data
+           withTimeout:(NSTimeInterval)timeout
+                buffer:(NSMutableData *)buffer
+          bufferOffset:(NSUInteger)offset
+                   tag:(long)tag
 {
-	NSString *errMsg = NSLocalizedStringWithDefaultValue(@"GCDAsyncSocketClosedError",
-	                                                     @"GCDAsyncSocket", [NSBundle mainBundle],
-	                                                     @"Socket closed by remote peer", nil);
-	
-	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
-	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketClosedError userInfo:userInfo];
+	[self readDataToData:data withTimeout:timeout buffer:buffer bufferOffset:offset maxLength:0 tag:tag];
 }
 
-- (NSError *)otherError:(NSString *)errMsg
+- (void)readDataToData:(NSData *)data withTimeout:(NSTimeInterval)timeout maxLength:(NSUInteger)length tag:(long)tag
 {
-	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
-	
-	return [NSError errorWithDomain:GCDAsyncSocketErrorDomain code:GCDAsyncSocketOtherError userInfo:userInfo];
+	[self readDataToData:data withTimeout:timeout buffer:nil bufferOffset:0 maxLength:length tag:tag];
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Diagnostics
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-- (BOOL)isDisconnected
+- (void)readDataToData:(NSData *)data
+           withTimeout:(NSTimeInterval)timeout
+                buffer:(NSMutableData *)buffer
+          bufferOffset:(NSUInteger)offset
+             maxLength:(NSUInteger)maxLength
+                   tag:(long)tag
 {
-	__block BOOL result = NO;
-	
-	dispatch_block_t block = ^{
-		result = (flags & kSocketStarted) ? NO : YES;
-	};
+	if ([data length] == 0) {
+		LogWarn(@"Cannot read: [data length] == 0");
+		return;
+	}
+	if (offset > [buffer length]) {
+		LogWarn(@"Cannot read: offset > [buffer length]");
+		return;
+	}
+	if (maxLength > 0 && maxLength < [data length]) {
+		LogWarn(@"Cannot read: maxLength > 0 && maxLength < [data length]");
+		return;
+	}
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
+	// Copy the term now, as the caller may mutate it once we return
+	NSData *termCopy = [data copy];
 	
-	return result;
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		{
+			GCDAsyncReadPacket *packet = [self readPacketWithData:buffer
+			                                          startOffset:offset
+			                                            maxLength:maxLength
+			                                              timeout:timeout
+			                                           readLength:0
+			                                           terminator:termCopy
+			                                                  tag:tag];
+			
+			[readQueue addObject:packet];
+			[self maybeDequeueRead];
+		}
+	}});
 }
 
-- (BOOL)isConnected
+- (void)readDataToAnyOfData:(NSArray *)terms withTimeout:(NSTimeInterval)timeout tag:(long)tag
 {
-	__block BOOL result = NO;
-	
-	dispatch_block_t block = ^{
-		result = (flags & kConnected) ? YES : NO;
-	};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
-	
-	return result;
+	[self readDataToAnyOfData:terms withTimeout:timeout buffer:nil bufferOffset:0 maxLength:0 tag:tag];
 }
 
-- (NSString *)connectedHost
+- (void)readDataToAnyOfData:(NSArray *)terms withTimeout:(NSTimeInterval)timeout maxLength:(NSUInteger)length tag:(long)tag
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		if (socket4FD != SOCKET_NULL)
-			return [self connectedHostFromSocket4:socket4FD];
-		if (socket6FD != SOCKET_NULL)
-			return [self connectedHostFromSocket6:socket6FD];
-		
-		return nil;
-	}
-	else
-	{
-		__block NSString *result = nil;
-		
-		dispatch_sync(socketQueue, ^{ @autoreleasepool {
-			
-			if (socket4FD != SOCKET_NULL)
-				result = [self connectedHostFromSocket4:socket4FD];
-			else if (socket6FD != SOCKET_NULL)
-				result = [self connectedHostFromSocket6:socket6FD];
-		}});
-		
-		return result;
-	}
+	[self readDataToAnyOfData:terms withTimeout:timeout buffer:nil bufferOffset:0 maxLength:length tag:tag];
 }
 
-- (uint16_t)connectedPort
+- (void)readDataToAnyOfData:(NSArray *)terms
+                withTimeout:(NSTimeInterval)timeout
+                     buffer:(NSMutableData *)buffer
+               bufferOffset:(NSUInteger)offset
+                  maxLength:(NSUInteger)maxLength
+                        tag:(long)tag
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		if (socket4FD != SOCKET_NULL)
-			return [self connectedPortFromSocket4:socket4FD];
-		if (socket6FD != SOCKET_NULL)
-			return [self connectedPortFromSocket6:socket6FD];
-		
-		return 0;
+	if ([terms count] == 0) {
+		LogWarn(@"Cannot read: [terms count] == 0");
+		return;
 	}
-	else
+	for (NSData *data in terms)
 	{
-		__block uint16_t result = 0;
-		
-		dispatch_sync(socketQueue, ^{
-			// No need for autorelease pool
-			
-			if (socket4FD != SOCKET_NULL)
-				result = [self connectedPortFromSocket4:socket4FD];
-			else if (socket6FD != SOCKET_NULL)
-				result = [self connectedPortFromSocket6:socket6FD];
-		});
-		
-		return result;
+		if ([data length] == 0) {
+			LogWarn(@"Cannot read: [data length] == 0");
+			return;
+		}
+		if (maxLength > 0 && maxLength < [data length]) {
+			LogWarn(@"Cannot read: maxLength > 0 && maxLength < [data length]");
+			return;
+		}
 	}
-}
-
-- (NSString *)localHost
-{
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		if (socket4FD != SOCKET_NULL)
-			return [self localHostFromSocket4:socket4FD];
-		if (socket6FD != SOCKET_NULL)
-			return [self localHostFromSocket6:socket6FD];
-		
-		return nil;
+	if (offset > [buffer length]) {
+		LogWarn(@"Cannot read: offset > [buffer length]");
+		return;
 	}
-	else
-	{
-		__block NSString *result = nil;
+	
+	// Copy the terms now, as the caller may mutate them once we return
+	NSArray *termsCopy = [[NSArray alloc] initWithArray:terms copyItems:YES];
+	
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
 		
-		dispatch_sync(socketQueue, ^{ @autoreleasepool {
-			
-			if (socket4FD != SOCKET_NULL)
-				result = [self localHostFromSocket4:socket4FD];
-			else if (socket6FD != SOCKET_NULL)
-				result = [self localHostFromSocket6:socket6FD];
-		}});
+		LogTrace();
 		
-		return result;
-	}
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		{
+			GCDAsyncReadPacket *packet = [self readPacketWithData:buffer
+			                                          startOffset:offset
+			                                            maxLength:maxLength
+			                                              timeout:timeout
+			                                          terminators:termsCopy
+			                                                  tag:tag];
+			
+			[readQueue addObject:packet];
+			[self maybeDequeueRead];
+		}
+	}});
 }
 
-- (uint16_t)localPort
+- (void)startStandingReadToData:(NSData *)data
+                    withTimeout:(NSTimeInterval)timeout
+                      maxLength:(NSUInteger)maxLength
+                            tag:(long)tag
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		if (socket4FD != SOCKET_NULL)
-			return [self localPortFromSocket4:socket4FD];
-		if (socket6FD != SOCKET_NULL)
-			return [self localPortFromSocket6:socket6FD];
-		
-		return 0;
+	if ([data length] == 0) {
+		LogWarn(@"Cannot read: [data length] == 0");
+		return;
 	}
-	else
-	{
-		__block uint16_t result = 0;
+	if (maxLength > 0 && maxLength < [data length]) {
+		LogWarn(@"Cannot read: maxLength > 0 && maxLength < [data length]");
+		return;
+	}
+	
+	// Copy the term now, as the caller may mutate it once we return
+	NSData *termCopy = [data copy];
+	
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
 		
-		dispatch_sync(socketQueue, ^{
-			// No need for autorelease pool
-			
-			if (socket4FD != SOCKET_NULL)
-				result = [self localPortFromSocket4:socket4FD];
-			else if (socket6FD != SOCKET_NULL)
-				result = [self localPortFromSocket6:socket6FD];
-		});
+		LogTrace();
 		
-		return result;
-	}
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		{
+			GCDAsyncReadPacket *packet = [self readPacketWithData:nil
+			                                          startOffset:0
+			                                            maxLength:maxLength
+			                                              timeout:timeout
+			                                           readLength:0
+			                                           terminator:termCopy
+			                                                  tag:tag];
+			
+			[self queueStandingRead:packet];
+		}
+	}});
 }
 
-- (NSString *)connectedHost4
+- (void)startStandingReadToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout tag:(long)tag
 {
-	if (socket4FD != SOCKET_NULL)
-		return [self connectedHostFromSocket4:socket4FD];
+	if (length == 0) {
+		LogWarn(@"Cannot read: length == 0");
+		return;
+	}
 	
-	return nil;
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		{
+			GCDAsyncReadPacket *packet = [self readPacketWithData:nil
+			                                          startOffset:0
+			                                            maxLength:0
+			                                              timeout:timeout
+			                                           readLength:length
+			                                           terminator:nil
+			                                                  tag:tag];
+			
+			[self queueStandingRead:packet];
+		}
+	}});
 }
 
-- (NSString *)connectedHost6
+- (void)startStandingReadWithLengthHeaderOfSize:(NSUInteger)headerSize
+                                      bigEndian:(BOOL)bigEndian
+                                      maxLength:(NSUInteger)maxLength
+                                    withTimeout:(NSTimeInterval)timeout
+                                            tag:(long)tag
 {
-	if (socket6FD != SOCKET_NULL)
-		return [self connectedHostFromSocket6:socket6FD];
+	if ((headerSize != 2) && (headerSize != 4) && (headerSize != 8)) {
+		LogWarn(@"Cannot read: headerSize must be 2, 4 or 8");
+		return;
+	}
 	
-	return nil;
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		{
+			GCDAsyncReadPacket *packet = [self readPacketWithData:nil
+			                                          startOffset:0
+			                                            maxLength:maxLength
+			                                              timeout:timeout
+			                                           readLength:headerSize
+			                                           terminator:nil
+			                                                  tag:tag];
+			packet->headerLength = headerSize;
+			packet->headerBigEndian = bigEndian;
+			
+			[self queueStandingRead:packet];
+		}
+	}});
 }
 
-- (uint16_t)connectedPort4
+- (void)queueStandingRead:(GCDAsyncReadPacket *)packet
 {
-	if (socket4FD != SOCKET_NULL)
-		return [self connectedPortFromSocket4:socket4FD];
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
 	
-	return 0;
-}
-
-- (uint16_t)connectedPort6
-{
-	if (socket6FD != SOCKET_NULL)
-		return [self connectedPortFromSocket6:socket6FD];
+	packet->standing = YES;
 	
-	return 0;
+	[readQueue addObject:packet];
+	[self maybeDequeueRead];
 }
 
-- (NSString *)localHost4
+- (void)stopStandingRead
 {
-	if (socket4FD != SOCKET_NULL)
-		return [self localHostFromSocket4:socket4FD];
+	dispatch_block_t block = ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+		NSUInteger queuedReadCount = [readQueue count];
+		
+		for (NSUInteger i = 0; i < queuedReadCount; i++)
+		{
+			GCDAsyncReadPacket *packet = [readQueue objectAtIndex:i];
+			
+			if ([packet isKindOfClass:[GCDAsyncReadPacket class]])
+			{
+				packet->standing = NO;
+			}
+		}
+		
+		if ([currentRead isKindOfClass:[GCDAsyncReadPacket class]] && currentRead->standing)
+		{
+			currentRead->standing = NO;
+			
+			if ((currentRead->bytesDone == 0) && !currentRead->headerParsed && !(flags & kReadsPaused))
+			{
+				// Nothing has been read for the next frame yet, so simply drop the read.
+				// Any buffered data stays in the prebuffer for whichever read comes next.
+				
+				[self recycleReadPacket:currentRead];
+				[self endCurrentRead];
+				[self maybeDequeueRead];
+			}
+			
+			// Otherwise the frame in progress completes as an ordinary read
+		}
+	}};
 	
-	return nil;
-}
-
-- (NSString *)localHost6
-{
-	if (socket6FD != SOCKET_NULL)
-		return [self localHostFromSocket6:socket6FD];
+	// If invoked from a delegate method that's being invoked directly (see directDelegateDispatch),
+	// the socket is in the middle of something, so wait for that to finish.
 	
-	return nil;
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey) && (directDelegateDepth == 0))
+		block();
+	else
+		dispatch_async(socketQueue, block);
 }
 
-- (uint16_t)localPort4
+- (float)progressOfReadReturningTag:(long *)tagPtr bytesDone:(NSUInteger *)donePtr total:(NSUInteger *)totalPtr
 {
-	if (socket4FD != SOCKET_NULL)
-		return [self localPortFromSocket4:socket4FD];
+	__block float result = 0.0F;
 	
-	return 0;
-}
-
-- (uint16_t)localPort6
-{
-	if (socket6FD != SOCKET_NULL)
-		return [self localPortFromSocket6:socket6FD];
+	dispatch_block_t block = ^{
+		
+		if (!currentRead || ![currentRead isKindOfClass:[GCDAsyncReadPacket class]])
+		{
+			// We're not reading anything right now.
+			
+			if (tagPtr != NULL)   *tagPtr = 0;
+			if (donePtr != NULL)  *donePtr = 0;
+			if (totalPtr != NULL) *totalPtr = 0;
+			
+			result = NAN;
+		}
+		else
+		{
+			// It's only possible to know the progress of our read if we're reading to a certain length.
+			// If we're reading to data, we of course have no idea when the data will arrive.
+			// If we're reading to timeout, then we have no idea when the next chunk of data will arrive.
+			
+			NSUInteger done = currentRead->bytesDone;
+			NSUInteger total = currentRead->readLength;
+			
+			if (tagPtr != NULL)   *tagPtr = currentRead->tag;
+			if (donePtr != NULL)  *donePtr = done;
+			if (totalPtr != NULL) *totalPtr = total;
+			
+			if (total > 0)
+				result = (float)done / (float)total;
+			else
+				result = 1.0F;
+		}
+	};
 	
-	return 0;
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
 }
 
-- (NSString *)connectedHostFromSocket4:(int)socketFD
+/**
+ * Returns a packet for a new read, recycling a completed one if possible.
+**/
+- (GCDAsyncReadPacket *)readPacketWithData:(NSMutableData *)buffer
+                               startOffset:(NSUInteger)offset
+                                 maxLength:(NSUInteger)maxLength
+                                   timeout:(NSTimeInterval)timeout
+                                readLength:(NSUInteger)length
+                                terminator:(NSData *)term
+                                       tag:(long)tag
 {
-	struct sockaddr_in sockaddr4;
-	socklen_t sockaddr4len = sizeof(sockaddr4);
+	GCDAsyncReadPacket *packet = [freeReadPackets removeFirstObject];
 	
-	if (getpeername(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	if (packet && (buffer == nil) && (packet->ownedBufferResult != nil))
 	{
-		return nil;
+		// The data last read into the packet's own buffer is still in use (typically by the delegate).
+		// Leave the packet for a later read, by which time the data has most likely been released.
+		
+		[freeReadPackets addObject:packet];
+		packet = nil;
 	}
-	return [[self class] hostFromSockaddr4:&sockaddr4];
-}
-
-- (NSString *)connectedHostFromSocket6:(int)socketFD
-{
-	struct sockaddr_in6 sockaddr6;
-	socklen_t sockaddr6len = sizeof(sockaddr6);
 	
-	if (getpeername(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	if (packet)
 	{
-		return nil;
+		[packet setupWithData:buffer
+		          startOffset:offset
+		            maxLength:maxLength
+		              timeout:timeout
+		           readLength:length
+		           terminator:term
+		                  tag:tag];
 	}
-	return [[self class] hostFromSockaddr6:&sockaddr6];
+	else
+	{
+		packet = [[GCDAsyncReadPacket alloc] initWithData:buffer
+		                                      startOffset:offset
+		                                        maxLength:maxLength
+		                                          timeout:timeout
+		                                       readLength:length
+		                                       terminator:term
+		                                              tag:tag];
+		
+		packetAllocationCount++;
+	}
+	
+	[self collectAllocationsOfReadPacket:packet];
+	
+	return packet;
 }
 
-- (uint16_t)connectedPortFromSocket4:(int)socketFD
+- (GCDAsyncReadPacket *)readPacketWithData:(NSMutableData *)buffer
+                               startOffset:(NSUInteger)offset
+                                 maxLength:(NSUInteger)maxLength
+                                   timeout:(NSTimeInterval)timeout
+                               terminators:(NSArray *)terms
+                                       tag:(long)tag
 {
-	struct sockaddr_in sockaddr4;
-	socklen_t sockaddr4len = sizeof(sockaddr4);
+	GCDAsyncReadPacket *packet = [self readPacketWithData:buffer
+	                                          startOffset:offset
+	                                            maxLength:maxLength
+	                                              timeout:timeout
+	                                           readLength:0
+	                                           terminator:[terms objectAtIndex:0]
+	                                                  tag:tag];
 	
-	if (getpeername(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
+	[packet setupWithTerminators:terms];
+	
+	[self collectAllocationsOfReadPacket:packet];
+	
+	return packet;
+}
+
+/**
+ * Adds whatever the packet allocated while being set up (term matchers, buffer) to the packetAllocationCount.
+**/
+- (void)collectAllocationsOfReadPacket:(GCDAsyncReadPacket *)packet
+{
+	packetAllocationCount += packet->allocationCount;
+	packet->allocationCount = 0;
+}
+
+/**
+ * Keeps a completed packet around for reuse by a future read.
+**/
+- (void)recycleReadPacket:(GCDAsyncReadPacket *)packet
+{
+	if ([freeReadPackets count] < GCDAsyncSocketPacketPoolLimit)
 	{
-		return 0;
+		[packet clear];
+		[freeReadPackets addObject:packet];
 	}
-	return [[self class] portFromSockaddr4:&sockaddr4];
 }
 
-- (uint16_t)connectedPortFromSocket6:(int)socketFD
+/**
+ * This method starts a new read, if needed.
+ * 
+ * It is called when:
+ * - a user requests a read
+ * - after a read request has finished (to handle the next request)
+ * - immediately after the socket opens to handle any pending requests
+ * 
+ * This method also handles auto-disconnect post read/write completion.
+**/
+- (void)maybeDequeueRead
 {
-	struct sockaddr_in6 sockaddr6;
-	socklen_t sockaddr6len = sizeof(sockaddr6);
+	LogTrace();
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
 	
-	if (getpeername(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	// If we're not currently processing a read AND we have an available read stream
+	if ((currentRead == nil) && (flags & kConnected))
 	{
-		return 0;
+		if ([readQueue count] > 0)
+		{
+			// Dequeue the next object in the write queue
+			currentRead = [readQueue removeFirstObject];
+			
+			
+			if ([currentRead isKindOfClass:[GCDAsyncSpecialPacket class]])
+			{
+				LogVerbose(@"Dequeued GCDAsyncSpecialPacket");
+				
+				// Attempt to start TLS
+				flags |= kStartingReadTLS;
+				
+				// This method won't do anything unless both kStartingReadTLS and kStartingWriteTLS are set
+				[self maybeStartTLS];
+			}
+			else
+			{
+				LogVerbose(@"Dequeued GCDAsyncReadPacket");
+				
+				// Setup read timer (if needed)
+				[self setupReadTimerWithTimeout:currentRead->timeout];
+				
+				// Immediately read, if possible
+				[self doReadData];
+			}
+		}
+		else if (flags & kDisconnectAfterReads)
+		{
+			if (flags & kDisconnectAfterWrites)
+			{
+				if (([writeQueue count] == 0) && ([priorityWriteQueue count] == 0) && (currentWrite == nil))
+				{
+					[self closeWithError:nil];
+				}
+			}
+			else
+			{
+				[self closeWithError:nil];
+			}
+		}
+		else if (flags & kSocketSecure)
+		{
+			[self flushSSLBuffers];
+			
+			// Edge case:
+			// 
+			// We just drained all data from the ssl buffers,
+			// and all known data from the socket (socketFDBytesAvailable).
+			// 
+			// If we didn't get any data from this process,
+			// then we may have reached the end of the TCP stream.
+			// 
+			// Be sure callbacks are enabled so we're notified about a disconnection.
+			
+			if ([preBuffer availableBytes] == 0)
+			{
+				if ([self usingCFStreamForTLS]) {
+					// Callbacks never disabled
+				}
+				else {
+					[self resumeReadSource];
+				}
+			}
+		}
+		else if ((readAheadLimit > 0) && ([preBuffer availableBytes] < readAheadLimit) && !(flags & kReadsPaused))
+		{
+			// Read-ahead is enabled, and the last read made room in the prebuffer.
+			// Continue reading ahead as soon as data is available.
+			
+			[self resumeReadSource];
+		}
+		
+		if ((currentRead == nil) && ([preBuffer availableBytes] == 0))
+		{
+			// We're idle, with no pending reads and no buffered data.
+			// Hand the prebuffer's memory back to the pool until it's needed again.
+			
+			[preBuffer shrink];
+		}
 	}
-	return [[self class] portFromSockaddr6:&sockaddr6];
 }
 
-- (NSString *)localHostFromSocket4:(int)socketFD
+- (void)flushSSLBuffers
 {
-	struct sockaddr_in sockaddr4;
-	socklen_t sockaddr4len = sizeof(sockaddr4);
+	LogTrace();
 	
-	if (getsockname(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
-	{
-		return nil;
-	}
-	return [[self class] hostFromSockaddr4:&sockaddr4];
-}
-
-- (NSString *)localHostFromSocket6:(int)socketFD
-{
-	struct sockaddr_in6 sockaddr6;
-	socklen_t sockaddr6len = sizeof(sockaddr6);
+	NSAssert((flags & kSocketSecure), @"Cannot flush ssl buffers on non-secure socket");
 	
-	if (getsockname(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	if ([preBuffer availableBytes] > 0)
 	{
-		return nil;
+		// Only flush the ssl buffers if the prebuffer is empty.
+		// This is to avoid growing the prebuffer inifinitely large.
+		
+		return;
 	}
-	return [[self class] hostFromSockaddr6:&sockaddr6];
-}
-
-- (uint16_t)localPortFromSocket4:(int)socketFD
-{
-	struct sockaddr_in sockaddr4;
-	socklen_t sockaddr4len = sizeof(sockaddr4);
 	
-	if (getsockname(socketFD, (struct sockaddr *)&sockaddr4, &sockaddr4len) < 0)
-	{
-		return 0;
-	}
-	return [[self class] portFromSockaddr4:&sockaddr4];
-}
-
-- (uint16_t)localPortFromSocket6:(int)socketFD
-{
-	struct sockaddr_in6 sockaddr6;
-	socklen_t sockaddr6len = sizeof(sockaddr6);
+	#if TARGET_OS_IPHONE
 	
-	if (getsockname(socketFD, (struct sockaddr *)&sockaddr6, &sockaddr6len) < 0)
+	if ([self usingCFStreamForTLS])
 	{
-		return 0;
-	}
-	return [[self class] portFromSockaddr6:&sockaddr6];
-}
-
-- (NSData *)connectedAddress
-{
-	__block NSData *result = nil;
-	
-	dispatch_block_t block = ^{
-		if (socket4FD != SOCKET_NULL)
+		if ((flags & kSecureSocketHasBytesAvailable) && CFReadStreamHasBytesAvailable(readStream))
 		{
-			struct sockaddr_in sockaddr4;
-			socklen_t sockaddr4len = sizeof(sockaddr4);
+			LogVerbose(@"%@ - Flushing ssl buffers into prebuffer...", THIS_METHOD);
 			
-			if (getpeername(socket4FD, (struct sockaddr *)&sockaddr4, &sockaddr4len) == 0)
-			{
-				result = [[NSData alloc] initWithBytes:&sockaddr4 length:sockaddr4len];
-			}
-		}
-		
-		if (socket6FD != SOCKET_NULL)
-		{
-			struct sockaddr_in6 sockaddr6;
-			socklen_t sockaddr6len = sizeof(sockaddr6);
+			CFIndex defaultBytesToRead = (CFIndex)readSizeEstimate;
 			
-			if (getpeername(socket6FD, (struct sockaddr *)&sockaddr6, &sockaddr6len) == 0)
+			// Flushing is best-effort.
+			// If there's no memory for the prebuffer, the data stays in the stream for the next read to report.
+			
+			if (![preBuffer ensureCapacityForWrite:defaultBytesToRead]) return;
+			
+			uint8_t *buffer = [preBuffer writeBuffer];
+			
+			CFIndex result = CFReadStreamRead(readStream, buffer, defaultBytesToRead);
+			LogVerbose(@"%@ - CFReadStreamRead(): result = %i", THIS_METHOD, (int)result);
+			
+			if (result > 0)
 			{
-				result = [[NSData alloc] initWithBytes:&sockaddr6 length:sockaddr6len];
+				[preBuffer didWrite:result];
 			}
+			
+			flags &= ~kSecureSocketHasBytesAvailable;
 		}
-	};
+		
+		return;
+	}
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
+	#endif
 	
-	return result;
-}
-
-- (NSData *)localAddress
-{
-	__block NSData *result = nil;
+	__block NSUInteger estimatedBytesAvailable = 0;
 	
-	dispatch_block_t block = ^{
-		if (socket4FD != SOCKET_NULL)
+	dispatch_block_t updateEstimatedBytesAvailable = ^{
+		
+		// Figure out if there is any data available to be read
+		// 
+		// socketFDBytesAvailable        <- Number of encrypted bytes we haven't read from the bsd socket
+		// [sslPreBuffer availableBytes] <- Number of encrypted bytes we've buffered from bsd socket
+		// sslInternalBufSize            <- Number of decrypted bytes SecureTransport has buffered
+		// 
+		// We call the variable "estimated" because we don't know how many decrypted bytes we'll get
+		// from the encrypted bytes in the sslPreBuffer.
+		// However, we do know this is an upper bound on the estimation.
+		
+		estimatedBytesAvailable = socketFDBytesAvailable + [sslPreBuffer availableBytes];
+		
+		size_t sslInternalBufSize = 0;
+		SSLGetBufferedReadSize(sslContext, &sslInternalBufSize);
+		
+		estimatedBytesAvailable += sslInternalBufSize;
+	};
+	
+	updateEstimatedBytesAvailable();
+	
+	if (estimatedBytesAvailable > 0)
+	{
+		LogVerbose(@"%@ - Flushing ssl buffers into prebuffer...", THIS_METHOD);
+		
+		BOOL done = NO;
+		do
 		{
-			struct sockaddr_in sockaddr4;
-			socklen_t sockaddr4len = sizeof(sockaddr4);
+			LogVerbose(@"%@ - estimatedBytesAvailable = %lu", THIS_METHOD, (unsigned long)estimatedBytesAvailable);
 			
-			if (getsockname(socket4FD, (struct sockaddr *)&sockaddr4, &sockaddr4len) == 0)
+			// Make sure there's enough room in the prebuffer.
+			// Flushing is best-effort, so if that fails the data is left for the next read to report.
+			
+			if (![preBuffer ensureCapacityForWrite:estimatedBytesAvailable]) break;
+			
+			// Read data into prebuffer
+			
+			uint8_t *buffer = [preBuffer writeBuffer];
+			size_t bytesRead = 0;
+			
+			OSStatus result = SSLRead(sslContext, buffer, (size_t)estimatedBytesAvailable, &bytesRead);
+			LogVerbose(@"%@ - read from secure socket = %u", THIS_METHOD, (unsigned)bytesRead);
+			
+			if (bytesRead > 0)
 			{
-				result = [[NSData alloc] initWithBytes:&sockaddr4 length:sockaddr4len];
+				[preBuffer didWrite:bytesRead];
 			}
-		}
-		
-		if (socket6FD != SOCKET_NULL)
-		{
-			struct sockaddr_in6 sockaddr6;
-			socklen_t sockaddr6len = sizeof(sockaddr6);
 			
-			if (getsockname(socket6FD, (struct sockaddr *)&sockaddr6, &sockaddr6len) == 0)
+			LogVerbose(@"%@ - prebuffer.length = %zu", THIS_METHOD, [preBuffer availableBytes]);
+			
+			if (result != noErr)
 			{
-				result = [[NSData alloc] initWithBytes:&sockaddr6 length:sockaddr6len];
+				done = YES;
 			}
-		}
-	};
+			else
+			{
+				updateEstimatedBytesAvailable();
+			}
+			
+		} while (!done && estimatedBytesAvailable > 0);
+	}
+}
+
+/**
+ * Folds the number of bytes available on a readable event into the moving estimate
+ * used to size reads of unknown length (see readSizeEstimate).
+ * 
+ * The estimate is an exponentially weighted moving average,
+ * so a single large burst on a chatty connection only nudges it,
+ * while a sustained bulk transfer quickly brings it up to speed.
+**/
+- (void)updateReadSizeEstimate:(unsigned long)bytesAvailable
+{
+	NSUInteger sample = (NSUInteger)MIN(bytesAvailable, GCDAsyncSocketReadSizeEstimateMax);
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
+	if (sample > readSizeEstimate)
+		readSizeEstimate += (sample - readSizeEstimate) >> GCDAsyncSocketReadSizeEstimateShift;
 	else
-		dispatch_sync(socketQueue, block);
+		readSizeEstimate -= (readSizeEstimate - sample) >> GCDAsyncSocketReadSizeEstimateShift;
 	
-	return result;
+	readSizeEstimate = MAX(readSizeEstimate, GCDAsyncSocketReadSizeEstimateMin);
+	
+	[self updatePreBufferSegmentCapacity];
 }
 
-- (BOOL)isIPv4
+/**
+ * Sizes the segments added to the prebuffer from here on.
+ * 
+ * Zero-copy reads go into slabs, so whatever a single socket read returns ends up in one contiguous piece.
+ * But a connection that typically receives no more than a standard segment's worth per readable event
+ * (e.g. small control messages) gets pooled standard segments instead of tying up a slab for a few bytes.
+ * Regular reads always use standard segments, as the data is copied out of the prebuffer anyway.
+**/
+- (void)updatePreBufferSegmentCapacity
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		return (socket4FD != SOCKET_NULL);
-	}
+	if ((config & kZeroCopyReads) && (readSizeEstimate > GCDAsyncSocketPreBufferSegmentCapacity))
+		[preBuffer setSegmentCapacity:GCDAsyncSocketPreBufferSlabCapacity];
 	else
-	{
-		__block BOOL result = NO;
-		
-		dispatch_sync(socketQueue, ^{
-			result = (socket4FD != SOCKET_NULL);
-		});
-		
-		return result;
-	}
+		[preBuffer setSegmentCapacity:GCDAsyncSocketPreBufferSegmentCapacity];
 }
 
-- (BOOL)isIPv6
+/**
+ * Parses the length header of the current (framed) read, and sets the read up for the frame's payload.
+ * 
+ * Returns YES if the frame is empty, which means the read is done.
+ * If the frame exceeds the maxLength of the read, the error parameter is set.
+**/
+- (BOOL)beginCurrentReadFrameWithHeader:(const uint8_t *)header error:(NSError **)errPtr
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-	{
-		return (socket6FD != SOCKET_NULL);
-	}
-	else
+	NSUInteger frameLength = 0;
+	
+	if (![currentRead getFrameLength:&frameLength fromHeader:header])
 	{
-		__block BOOL result = NO;
-		
-		dispatch_sync(socketQueue, ^{
-			result = (socket6FD != SOCKET_NULL);
-		});
-		
-		return result;
+		if (errPtr) *errPtr = [self readMaxedOutError];
+		return NO;
 	}
+	
+	LogVerbose(@"frameLength(%lu)", (unsigned long)frameLength);
+	
+	[currentRead beginFrameOfLength:frameLength];
+	
+	return (frameLength == 0);
 }
 
-- (BOOL)isSecure
+/**
+ * For reads of a specific length (read type #2), returns whether the current read is done.
+ * 
+ * Framed reads start out as reads of a specific length, reading the length header.
+ * When the header is complete it gets parsed, and the read continues with the payload.
+**/
+- (BOOL)isCurrentReadOfLengthDone:(NSError **)errPtr
 {
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	if (currentRead->bytesDone < currentRead->readLength)
 	{
-		return (flags & kSocketSecure) ? YES : NO;
+		return NO;
 	}
-	else
+	
+	if ((currentRead->headerLength == 0) || currentRead->headerParsed)
 	{
-		__block BOOL result;
-		
-		dispatch_sync(socketQueue, ^{
-			result = (flags & kSocketSecure) ? YES : NO;
-		});
-		
-		return result;
+		return YES;
 	}
+	
+	const uint8_t *header = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset;
+	
+	return [self beginCurrentReadFrameWithHeader:header error:errPtr];
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Utilities
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
 /**
- * Finds the address of an interface description.
- * An inteface description may be an interface name (en0, en1, lo0) or corresponding IP (192.168.4.34).
+ * Moves as much data as possible from the prebuffer into the current read,
+ * and returns the number of bytes that were moved.
  * 
- * The interface description may optionally contain a port number at the end, separated by a colon.
- * If a non-zero port parameter is provided, any port number in the interface description is ignored.
+ * The done parameter is set to YES if this completes the current read.
+ * The error parameter is set if the current read can't be completed (e.g. it reached its maxLength).
  * 
- * The returned value is a 'struct sockaddr' wrapped in an NSMutableData object.
-**/
-- (void)getInterfaceAddress4:(NSMutableData **)interfaceAddr4Ptr
-                    address6:(NSMutableData **)interfaceAddr6Ptr
-             fromDescription:(NSString *)interfaceDescription
-                        port:(uint16_t)port
+ * When zero-copy reads are enabled, and the prebuffer contains the entire result of the current read
+ * in one contiguous piece, the read takes a slice of the prebuffer instead of copying the data.
+**/
+- (NSUInteger)readFromPreBufferWithDone:(BOOL *)donePtr error:(NSError **)errPtr
 {
-	NSMutableData *addr4 = nil;
-	NSMutableData *addr6 = nil;
+	NSAssert([preBuffer availableBytes] > 0, @"Invoked with empty pre buffer!");
 	
-	NSString *interface = nil;
+	BOOL done = NO;
+	NSError *error = nil;
 	
-	NSArray *components = [interfaceDescription componentsSeparatedByString:@":"];
-	if ([components count] > 0)
-	{
-		NSString *temp = [components objectAtIndex:0];
-		if ([temp length] > 0)
-		{
-			interface = temp;
-		}
-	}
-	if ([components count] > 1 && port == 0)
+	NSUInteger headerBytes = 0;
+	
+	if ((currentRead->headerLength > 0) && !currentRead->headerParsed && (currentRead->bytesDone == 0) &&
+	    ([preBuffer availableBytes] >= currentRead->headerLength))
 	{
-		long portL = strtol([[components objectAtIndex:1] UTF8String], NULL, 10);
+		// Framed read, and the entire length header is sitting in the prebuffer.
+		// Parse it straight out of the prebuffer, so the payload can be handled in one go below.
 		
-		if (portL > 0 && portL <= UINT16_MAX)
+		uint8_t header[8];
+		[preBuffer readBytes:header length:currentRead->headerLength];
+		
+		headerBytes = currentRead->headerLength;
+		done = [self beginCurrentReadFrameWithHeader:header error:&error];
+		
+		if (done || error || ([preBuffer availableBytes] == 0))
 		{
-			port = (uint16_t)portL;
+			if (donePtr) *donePtr = done;
+			if (errPtr) *errPtr = error;
+			
+			return headerBytes;
 		}
 	}
 	
-	if (interface == nil)
+	// There are 3 types of read packets:
+	// 
+	// 1) Read all available data.
+	// 2) Read a specific length of data.
+	// 3) Read up to a particular terminator.
+	
+	NSUInteger bytesToCopy;
+	
+	if (currentRead->term != nil)
 	{
-		// ANY address
-		
-		struct sockaddr_in sockaddr4;
-		memset(&sockaddr4, 0, sizeof(sockaddr4));
+		// Read type #3 - read up to a terminator
 		
-		sockaddr4.sin_len         = sizeof(sockaddr4);
-		sockaddr4.sin_family      = AF_INET;
-		sockaddr4.sin_port        = htons(port);
-		sockaddr4.sin_addr.s_addr = htonl(INADDR_ANY);
-		
-		struct sockaddr_in6 sockaddr6;
-		memset(&sockaddr6, 0, sizeof(sockaddr6));
-		
-		sockaddr6.sin6_len       = sizeof(sockaddr6);
-		sockaddr6.sin6_family    = AF_INET6;
-		sockaddr6.sin6_port      = htons(port);
-		sockaddr6.sin6_addr      = in6addr_any;
-		
-		addr4 = [NSMutableData dataWithBytes:&sockaddr4 length:sizeof(sockaddr4)];
-		addr6 = [NSMutableData dataWithBytes:&sockaddr6 length:sizeof(sockaddr6)];
+		bytesToCopy = [currentRead readLengthForTermWithPreBuffer:preBuffer found:&done];
 	}
-	else if ([interface isEqualToString:@"localhost"] || [interface isEqualToString:@"loopback"])
+	else
 	{
-		// LOOPBACK address
-		
-		struct sockaddr_in sockaddr4;
-		memset(&sockaddr4, 0, sizeof(sockaddr4));
-		
-		sockaddr4.sin_len         = sizeof(sockaddr4);
-		sockaddr4.sin_family      = AF_INET;
-		sockaddr4.sin_port        = htons(port);
-		sockaddr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-		
-		struct sockaddr_in6 sockaddr6;
-		memset(&sockaddr6, 0, sizeof(sockaddr6));
-		
-		sockaddr6.sin6_len       = sizeof(sockaddr6);
-		sockaddr6.sin6_family    = AF_INET6;
-		sockaddr6.sin6_port      = htons(port);
-		sockaddr6.sin6_addr      = in6addr_loopback;
+		// Read type #1 or #2
 		
-		addr4 = [NSMutableData dataWithBytes:&sockaddr4 length:sizeof(sockaddr4)];
-		addr6 = [NSMutableData dataWithBytes:&sockaddr6 length:sizeof(sockaddr6)];
+		bytesToCopy = [currentRead readLengthForNonTermWithHint:[preBuffer availableBytes]];
 	}
-	else
+	
+	if ((config & kZeroCopyReads) && currentRead->bufferOwner && (currentRead->bytesDone == 0))
 	{
-		const char *iface = [interface UTF8String];
+		// We can only hand out a slice if it's the entire result of the read.
+		// Reads of all available data just deliver whatever is in the prebuffer.
 		
-		struct ifaddrs *addrs;
-		const struct ifaddrs *cursor;
+		BOOL isEntireResult;
 		
-		if ((getifaddrs(&addrs) == 0))
+		if (currentRead->readLength > 0)
+			isEntireResult = (bytesToCopy == currentRead->readLength);
+		else if (currentRead->term != nil)
+			isEntireResult = done;
+		else
+			isEntireResult = YES;
+		
+		if (isEntireResult)
 		{
-			cursor = addrs;
-			while (cursor != NULL)
-			{
-				if ((addr4 == nil) && (cursor->ifa_addr->sa_family == AF_INET))
-				{
-					// IPv4
-					
-					struct sockaddr_in nativeAddr4;
-					memcpy(&nativeAddr4, cursor->ifa_addr, sizeof(nativeAddr4));
-					
-					if (strcmp(cursor->ifa_name, iface) == 0)
-					{
-						// Name match
-						
-						nativeAddr4.sin_port = htons(port);
-						
-						addr4 = [NSMutableData dataWithBytes:&nativeAddr4 length:sizeof(nativeAddr4)];
-					}
-					else
-					{
-						char ip[INET_ADDRSTRLEN];
-						
-						const char *conversion = inet_ntop(AF_INET, &nativeAddr4.sin_addr, ip, sizeof(ip));
-						
-						if ((conversion != NULL) && (strcmp(ip, iface) == 0))
-						{
-							// IP match
-							
-							nativeAddr4.sin_port = htons(port);
-							
-							addr4 = [NSMutableData dataWithBytes:&nativeAddr4 length:sizeof(nativeAddr4)];
-						}
-					}
-				}
-				else if ((addr6 == nil) && (cursor->ifa_addr->sa_family == AF_INET6))
-				{
-					// IPv6
-					
-					struct sockaddr_in6 nativeAddr6;
-					memcpy(&nativeAddr6, cursor->ifa_addr, sizeof(nativeAddr6));
-					
-					if (strcmp(cursor->ifa_name, iface) == 0)
-					{
-						// Name match
-						
-						nativeAddr6.sin6_port = htons(port);
-						
-						addr6 = [NSMutableData dataWithBytes:&nativeAddr6 length:sizeof(nativeAddr6)];
-					}
-					else
-					{
-						char ip[INET6_ADDRSTRLEN];
-						
-						const char *conversion = inet_ntop(AF_INET6, &nativeAddr6.sin6_addr, ip, sizeof(ip));
-						
-						if ((conversion != NULL) && (strcmp(ip, iface) == 0))
-						{
-							// IP match
-							
-							nativeAddr6.sin6_port = htons(port);
-							
-							addr6 = [NSMutableData dataWithBytes:&nativeAddr6 length:sizeof(nativeAddr6)];
-						}
-					}
-				}
-				
-				cursor = cursor->ifa_next;
-			}
-			
-			freeifaddrs(addrs);
+			currentRead->slice = [preBuffer sliceWithLength:bytesToCopy];
 		}
 	}
 	
-	if (interfaceAddr4Ptr) *interfaceAddr4Ptr = addr4;
-	if (interfaceAddr6Ptr) *interfaceAddr6Ptr = addr6;
-}
-
-- (void)setupReadAndWriteSourcesForNewlyConnectedSocket:(int)socketFD
-{
-	readSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, socketFD, 0, socketQueue);
-	writeSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_WRITE, socketFD, 0, socketQueue);
-	
-	// Setup event handlers
-	
-	__weak GCDAsyncSocket *weakSelf = self;
-	
-	dispatch_source_set_event_handler(readSource, ^{ @autoreleasepool {
-	#pragma clang diagnostic push
-	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+	if (currentRead->slice == nil)
+	{
+		// Make sure we have enough room in the buffer for our read.
 		
-		__strong GCDAsyncSocket *strongSelf = weakSelf;
-		if (strongSelf == nil) return_from_block;
+		[currentRead ensureCapacityForAdditionalDataOfLength:bytesToCopy];
 		
-		LogVerbose(@"readEventBlock");
+		// Copy bytes from prebuffer into packet buffer
 		
-		strongSelf->socketFDBytesAvailable = dispatch_source_get_data(strongSelf->readSource);
-		LogVerbose(@"socketFDBytesAvailable: %lu", strongSelf->socketFDBytesAvailable);
+		uint8_t *buffer = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset +
+		                                                                  currentRead->bytesDone;
 		
-		if (strongSelf->socketFDBytesAvailable > 0)
-			[strongSelf doReadData];
-		else
-			[strongSelf doReadEOF];
+		// (This also removes the copied bytes from the preBuffer)
 		
-	#pragma clang diagnostic pop
-	}});
+		[preBuffer readBytes:buffer length:bytesToCopy];
+	}
 	
-	dispatch_source_set_event_handler(writeSource, ^{ @autoreleasepool {
-	#pragma clang diagnostic push
-	#pragma clang diagnostic warning "-Wimplicit-retain-self"
-		
-		__strong GCDAsyncSocket *strongSelf = weakSelf;
-		if (strongSelf == nil) return_from_block;
-		
-		LogVerbose(@"writeEventBlock");
-		
-		strongSelf->flags |= kSocketCanAcceptBytes;
-		[strongSelf doWriteData];
-		
-	#pragma clang diagnostic pop
-	}});
+	LogVerbose(@"copied(%lu) preBufferLength(%zu)", (unsigned long)bytesToCopy, [preBuffer availableBytes]);
 	
-	// Setup cancel handlers
+	// Update totals
 	
-	__block int socketFDRefCount = 2;
+	currentRead->bytesDone += bytesToCopy;
 	
-	#if !OS_OBJECT_USE_OBJC
-	dispatch_source_t theReadSource = readSource;
-	dispatch_source_t theWriteSource = writeSource;
-	#endif
+	// Check to see if the read operation is done
 	
-	dispatch_source_set_cancel_handler(readSource, ^{
-	#pragma clang diagnostic push
-	#pragma clang diagnostic warning "-Wimplicit-retain-self"
+	if (currentRead->readLength > 0)
+	{
+		// Read type #2 - read a specific length of data
 		
-		LogVerbose(@"readCancelBlock");
+		BOOL headerWasParsed = currentRead->headerParsed;
 		
-		#if !OS_OBJECT_USE_OBJC
-		LogVerbose(@"dispatch_release(readSource)");
-		dispatch_release(theReadSource);
-		#endif
+		done = [self isCurrentReadOfLengthDone:&error];
 		
-		if (--socketFDRefCount == 0)
+		if (!done && !error && (currentRead->headerParsed != headerWasParsed) && ([preBuffer availableBytes] > 0))
 		{
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
+			// We just completed the length header of a framed read.
+			// The payload may already be sitting in the prebuffer.
+			
+			bytesToCopy += [self readFromPreBufferWithDone:&done error:&error];
 		}
+	}
+	else if (currentRead->term != nil)
+	{
+		// Read type #3 - read up to a terminator
 		
-	#pragma clang diagnostic pop
-	});
-	
-	dispatch_source_set_cancel_handler(writeSource, ^{
-	#pragma clang diagnostic push
-	#pragma clang diagnostic warning "-Wimplicit-retain-self"
-		
-		LogVerbose(@"writeCancelBlock");
-		
-		#if !OS_OBJECT_USE_OBJC
-		LogVerbose(@"dispatch_release(writeSource)");
-		dispatch_release(theWriteSource);
-		#endif
+		// Our 'done' variable was updated via the readLengthForTermWithPreBuffer:found: method
 		
-		if (--socketFDRefCount == 0)
+		if (!done && currentRead->maxLength > 0)
 		{
-			LogVerbose(@"close(socketFD)");
-			close(socketFD);
+			// We're not done and there's a set maxLength.
+			// Have we reached that maxLength yet?
+			
+			if (currentRead->bytesDone >= currentRead->maxLength)
+			{
+				error = [self readMaxedOutError];
+			}
 		}
-		
-	#pragma clang diagnostic pop
-	});
-	
-	// We will not be able to read until data arrives.
-	// But we should be able to write immediately.
-	
-	socketFDBytesAvailable = 0;
-	flags &= ~kReadSourceSuspended;
-	
-	LogVerbose(@"dispatch_resume(readSource)");
-	dispatch_resume(readSource);
-	
-	flags |= kSocketCanAcceptBytes;
-	flags |= kWriteSourceSuspended;
-}
-
-- (BOOL)usingCFStreamForTLS
-{
-	#if TARGET_OS_IPHONE
-	
-	if ((flags & kSocketSecure) && (flags & kUsingCFStreamForTLS))
+	}
+	else
 	{
-		// The startTLS method was given the GCDAsyncSocketUseCFStreamForTLS flag.
+		// Read type #1 - read all available data
+		// 
+		// We're done as soon as
+		// - we've read all available data (in prebuffer and socket)
+		// - we've read the maxLength of read packet.
+		// - we've handed out a slice of the prebuffer (zero-copy reads)
 		
-		return YES;
+		done = ((currentRead->maxLength > 0) && (currentRead->bytesDone == currentRead->maxLength));
+		
+		if (currentRead->slice)
+		{
+			done = YES;
+		}
 	}
 	
-	#endif
+	if (donePtr) *donePtr = done;
+	if (errPtr) *errPtr = error;
 	
-	return NO;
+	return headerBytes + bytesToCopy;
 }
 
-- (BOOL)usingSecureTransportForTLS
+/**
+ * Reads available data into the prebuffer while there's no read to put it in.
+ * 
+ * Once the prebuffer holds readAheadLimit bytes, the readSource is suspended,
+ * leaving any further data in the kernel until the next read is issued.
+ * Until then, the readSource stays resumed and keeps draining the socket as data arrives.
+**/
+- (void)doReadAhead
 {
-	// Invoking this method is equivalent to ![self usingCFStreamForTLS] (just more readable)
+	LogTrace();
 	
-	#if TARGET_OS_IPHONE
+	NSAssert(!(flags & kSocketSecure), @"Read-ahead is not supported on secure sockets");
 	
-	if ((flags & kSocketSecure) && (flags & kUsingCFStreamForTLS))
+	size_t preBufferLength = [preBuffer availableBytes];
+	
+	if (preBufferLength < readAheadLimit)
 	{
-		// The startTLS method was given the GCDAsyncSocketUseCFStreamForTLS flag.
+		size_t bytesToRead = MIN((size_t)socketFDBytesAvailable, (readAheadLimit - preBufferLength));
 		
-		return NO;
+		if (bytesToRead > SSIZE_MAX) {
+			bytesToRead = SSIZE_MAX;
+		}
+		
+		struct iovec iov[GCDAsyncSocketPreBufferMaxReadVectors];
+		int iovcnt = [preBuffer getWriteVectors:iov count:GCDAsyncSocketPreBufferMaxReadVectors length:&bytesToRead];
+		
+		if (iovcnt < 0)
+		{
+			[self closeWithError:[self preBufferAllocationError]];
+			return;
+		}
+		
+		int socketFD = (socket4FD == SOCKET_NULL) ? socket6FD : socket4FD;
+		
+		ssize_t result = readv(socketFD, iov, iovcnt);
+		LogVerbose(@"read ahead from socket = %i", (int)result);
+		
+		if (result < 0)
+		{
+			socketFDBytesAvailable = 0;
+			
+			if (errno != EWOULDBLOCK)
+			{
+				[self closeWithError:[self errnoErrorWithReason:@"Error in readv() function"]];
+				return;
+			}
+		}
+		else if (result == 0)
+		{
+			// The readSource will fire again, and report the EOF.
+			socketFDBytesAvailable = 0;
+		}
+		else
+		{
+			[preBuffer didWrite:(size_t)result];
+			
+			if (socketFDBytesAvailable <= (unsigned long)result)
+				socketFDBytesAvailable = 0;
+			else
+				socketFDBytesAvailable -= result;
+		}
 	}
 	
-	#endif
-	
-	return YES;
-}
-
-- (void)suspendReadSource
-{
-	if (!(flags & kReadSourceSuspended))
+	if ([preBuffer availableBytes] >= readAheadLimit)
 	{
-		LogVerbose(@"dispatch_suspend(readSource)");
+		LogVerbose(@"read ahead limit reached - preBuffer.length = %zu", [preBuffer availableBytes]);
 		
-		dispatch_suspend(readSource);
-		flags |= kReadSourceSuspended;
+		// The next read will resume the readSource, once it has drained the prebuffer.
+		
+		[self suspendReadSource];
 	}
 }
 
-- (void)resumeReadSource
+- (void)doReadData
 {
-	if (flags & kReadSourceSuspended)
-	{
-		LogVerbose(@"dispatch_resume(readSource)");
-		
-		dispatch_resume(readSource);
-		flags &= ~kReadSourceSuspended;
-	}
+	LogTrace();
+	
+	// This method is called on the socketQueue.
+	// It might be called directly, or via the readSource when data is available to be read.
+	// 
+	// A standing read re-arms itself each time it completes.
+	// So keep going for as long as that happens, which drains every complete frame from the prebuffer
+	// without going back through the read queue (or the delegate) in between.
+	
+	while ([self doReadDataPass]) {}
 }
 
-- (void)suspendWriteSource
+/**
+ * Makes as much progress on the current read as possible.
+ * Returns YES if there's more to do right away, in which case it should be called again.
+**/
+- (BOOL)doReadDataPass
 {
-	if (!(flags & kWriteSourceSuspended))
+	
+	if ((currentRead == nil) || (flags & kReadsPaused))
 	{
-		LogVerbose(@"dispatch_suspend(writeSource)");
+		LogVerbose(@"No currentRead or kReadsPaused");
 		
-		dispatch_suspend(writeSource);
-		flags |= kWriteSourceSuspended;
+		// Unable to read at this time
+		
+		if (flags & kSocketSecure)
+		{
+			// Here's the situation:
+			// 
+			// We have an established secure connection.
+			// There may not be a currentRead, but there might be encrypted data sitting around for us.
+			// When the user does get around to issuing a read, that encrypted data will need to be decrypted.
+			// 
+			// So why make the user wait?
+			// We might as well get a head start on decrypting some data now.
+			// 
+			// The other reason we do this has to do with detecting a socket disconnection.
+			// The SSL/TLS protocol has it's own disconnection handshake.
+			// So when a secure socket is closed, a "goodbye" packet comes across the wire.
+			// We want to make sure we read the "goodbye" packet so we can properly detect the TCP disconnection.
+			
+			[self flushSSLBuffers];
+		}
+		
+		if ([self usingCFStreamForTLS])
+		{
+			// CFReadStream only fires once when there is available data.
+			// It won't fire again until we've invoked CFReadStreamRead.
+		}
+		else if ((readAheadLimit > 0) && (currentRead == nil) && !(flags & (kSocketSecure | kReadsPaused)))
+		{
+			// Read-ahead is enabled.
+			// Drain the socket into the prebuffer, so the next read can be completed straight from memory.
+			
+			if (socketFDBytesAvailable > 0)
+			{
+				[self doReadAhead];
+			}
+		}
+		else
+		{
+			// If the readSource is firing, we need to pause it
+			// or else it will continue to fire over and over again.
+			// 
+			// If the readSource is not firing,
+			// we want it to continue monitoring the socket.
+			
+			if (socketFDBytesAvailable > 0)
+			{
+				[self suspendReadSource];
+			}
+		}
+		return NO;
 	}
-}
-
-- (void)resumeWriteSource
-{
-	if (flags & kWriteSourceSuspended)
+	
+	BOOL hasBytesAvailable = NO;
+	unsigned long estimatedBytesAvailable = 0;
+	
+	if ([self usingCFStreamForTLS])
 	{
-		LogVerbose(@"dispatch_resume(writeSource)");
+		#if TARGET_OS_IPHONE
 		
-		dispatch_resume(writeSource);
-		flags &= ~kWriteSourceSuspended;
+		// Requested CFStream, rather than SecureTransport, for TLS (via GCDAsyncSocketUseCFStreamForTLS)
+		
+		estimatedBytesAvailable = 0;
+		if ((flags & kSecureSocketHasBytesAvailable) && CFReadStreamHasBytesAvailable(readStream))
+			hasBytesAvailable = YES;
+		else
+			hasBytesAvailable = NO;
+		
+		#endif
 	}
-}
-
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Reading
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-- (void)readDataWithTimeout:(NSTimeInterval)timeout tag:(long)tag
-{
-	[self readDataWithTimeout:timeout buffer:nil bufferOffset:0 maxLength:0 tag:tag];
-}
-
-- (void)readDataWithTimeout:(NSTimeInterval)timeout
-                     buffer:(NSMutableData *)buffer
-               bufferOffset:(NSUInteger)offset
-                        tag:(long)tag
-{
-	[self readDataWithTimeout:timeout buffer:buffer bufferOffset:offset maxLength:0 tag:tag];
-}
-
-- (void)readDataWithTimeout:(NSTimeInterval)timeout
-                     buffer:(NSMutableData *)buffer
-               bufferOffset:(NSUInteger)offset
-                  maxLength:(NSUInteger)length
-                        tag:(long)tag
-{
-	if (offset > [buffer length]) {
-		LogWarn(@"Cannot read: offset > [buffer length]");
-		return;
+	else
+	{
+		estimatedBytesAvailable = socketFDBytesAvailable;
+		
+		if (flags & kSocketSecure)
+		{
+			// There are 2 buffers to be aware of here.
+			// 
+			// We are using SecureTransport, a TLS/SSL security layer which sits atop TCP.
+			// We issue a read to the SecureTranport API, which in turn issues a read to our SSLReadFunction.
+			// Our SSLReadFunction then reads from the BSD socket and returns the encrypted data to SecureTransport.
+			// SecureTransport then decrypts the data, and finally returns the decrypted data back to us.
+			// 
+			// The first buffer is one we create.
+			// SecureTransport often requests small amounts of data.
+			// This has to do with the encypted packets that are coming across the TCP stream.
+			// But it's non-optimal to do a bunch of small reads from the BSD socket.
+			// So our SSLReadFunction reads all available data from the socket (optimizing the sys call)
+			// and may store excess in the sslPreBuffer.
+			
+			estimatedBytesAvailable += [sslPreBuffer availableBytes];
+			
+			// The second buffer is within SecureTransport.
+			// As mentioned earlier, there are encrypted packets coming across the TCP stream.
+			// SecureTransport needs the entire packet to decrypt it.
+			// But if the entire packet produces X bytes of decrypted data,
+			// and we only asked SecureTransport for X/2 bytes of data,
+			// it must store the extra X/2 bytes of decrypted data for the next read.
+			// 
+			// The SSLGetBufferedReadSize function will tell us the size of this internal buffer.
+			// From the documentation:
+			// 
+			// "This function does not block or cause any low-level read operations to occur."
+			
+			size_t sslInternalBufSize = 0;
+			SSLGetBufferedReadSize(sslContext, &sslInternalBufSize);
+			
+			estimatedBytesAvailable += sslInternalBufSize;
+		}
+		
+		hasBytesAvailable = (estimatedBytesAvailable > 0);
 	}
 	
-	GCDAsyncReadPacket *packet = [[GCDAsyncReadPacket alloc] initWithData:buffer
-	                                                          startOffset:offset
-	                                                            maxLength:length
-	                                                              timeout:timeout
-	                                                           readLength:0
-	                                                           terminator:nil
-	                                                                  tag:tag];
-	
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
+	if ((hasBytesAvailable == NO) && ([preBuffer availableBytes] == 0))
+	{
+		LogVerbose(@"No data available to read...");
 		
-		LogTrace();
+		// No data available to read.
 		
-		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		if (![self usingCFStreamForTLS])
 		{
-			[readQueue addObject:packet];
-			[self maybeDequeueRead];
+			// Need to wait for readSource to fire and notify us of
+			// available data in the socket's internal read buffer.
+			
+			[self resumeReadSource];
 		}
-	}});
-	
-	// Do not rely on the block being run in order to release the packet,
-	// as the queue might get released without the block completing.
-}
-
-- (void)readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout tag:(long)tag
-{
-	[self readDataToLength:length withTimeout:timeout buffer:nil bufferOffset:0 tag:tag];
-}
-
-- (void)readDataToLength:(NSUInteger)length
-             withTimeout:(NSTimeInterval)timeout
-                  buffer:(NSMutableData *)buffer
-            bufferOffset:(NSUInteger)offset
-                     tag:(long)tag
-{
-	if (length == 0) {
-		LogWarn(@"Cannot read: length == 0");
-		return;
-	}
-	if (offset > [buffer length]) {
-		LogWarn(@"Cannot read: offset > [buffer length]");
-		return;
+		return NO;
 	}
 	
-	GCDAsyncReadPacket *packet = [[GCDAsyncReadPacket alloc] initWithData:buffer
-	                                                          startOffset:offset
-	                                                            maxLength:0
-	                                                              timeout:timeout
-	                                                           readLength:length
-	                                                           terminator:nil
-	                                                                  tag:tag];
-	
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
+	if (flags & kStartingReadTLS)
+	{
+		LogVerbose(@"Waiting for SSL/TLS handshake to complete");
 		
-		LogTrace();
+		// The readQueue is waiting for SSL/TLS handshake to complete.
 		
-		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		if (flags & kStartingWriteTLS)
 		{
-			[readQueue addObject:packet];
-			[self maybeDequeueRead];
+			if ([self usingSecureTransportForTLS] && lastSSLHandshakeError == errSSLWouldBlock)
+			{
+				// We are in the process of a SSL Handshake.
+				// We were waiting for incoming data which has just arrived.
+				
+				[self ssl_continueSSLHandshake];
+			}
 		}
-	}});
-	
-	// Do not rely on the block being run in order to release the packet,
-	// as the queue might get released without the block completing.
-}
-
-- (void)readDataToData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag
-{
-	[self readDataToData:data withTimeout:timeout buffer:nil bufferOffset:0 maxLength:0 tag:tag];
-}
-
-- (void)readDataToData:(NSData *)data
-           withTimeout:(NSTimeInterval)timeout
-                buffer:(NSMutableData *)buffer
-          bufferOffset:(NSUInteger)offset
-                   tag:(long)tag
-{
-	[self readDataToData:data withTimeout:timeout buffer:buffer bufferOffset:offset maxLength:0 tag:tag];
-}
-
-- (void)readDataToData:(NSData *)data withTimeout:(NSTimeInterval)timeout maxLength:(NSUInteger)length tag:(long)tag
-{
-	[self readDataToData:data withTimeout:timeout buffer:nil bufferOffset:0 maxLength:length tag:tag];
-}
-
-- (void)readDataToData:(NSData *)data
-           withTimeout:(NSTimeInterval)timeout
-                buffer:(NSMutableData *)buffer
-          bufferOffset:(NSUInteger)offset
-             maxLength:(NSUInteger)maxLength
-                   tag:(long)tag
-{
-	if ([data length] == 0) {
-		LogWarn(@"Cannot read: [data length] == 0");
-		return;
-	}
-	if (offset > [buffer length]) {
-		LogWarn(@"Cannot read: offset > [buffer length]");
-		return;
+		else
+		{
+			// We are still waiting for the writeQueue to drain and start the SSL/TLS process.
+			// We now know data is available to read.
+			
+			if (![self usingCFStreamForTLS])
+			{
+				// Suspend the read source or else it will continue to fire nonstop.
+				
+				[self suspendReadSource];
+			}
+		}
+		
+		return NO;
 	}
-	if (maxLength > 0 && maxLength < [data length]) {
-		LogWarn(@"Cannot read: maxLength > 0 && maxLength < [data length]");
-		return;
+	
+	BOOL done        = NO;  // Completed read operation
+	NSError *error   = nil; // Error occured
+	
+	BOOL frameHeaderParsed = NO; // Parsed the length header of a framed read (read from socket)
+	
+	NSUInteger totalBytesReadForCurrentRead = 0;
+	
+	// 
+	// STEP 1 - READ FROM PREBUFFER
+	// 
+	
+	if ([preBuffer availableBytes] > 0)
+	{
+		totalBytesReadForCurrentRead += [self readFromPreBufferWithDone:&done error:&error];
 	}
 	
-	GCDAsyncReadPacket *packet = [[GCDAsyncReadPacket alloc] initWithData:buffer
-	                                                          startOffset:offset
-	                                                            maxLength:maxLength
-	                                                              timeout:timeout
-	                                                           readLength:0
-	                                                           terminator:data
-	                                                                  tag:tag];
+	// 
+	// STEP 2 - READ FROM SOCKET
+	// 
+	
+	BOOL socketEOF = (flags & kSocketHasReadEOF) ? YES : NO;  // Nothing more to read via socket (end of file)
+	BOOL waiting   = !done && !error && !socketEOF && !hasBytesAvailable; // Ran out of data, waiting for more
 	
-	dispatch_async(socketQueue, ^{ @autoreleasepool {
+	if (!done && !error && !socketEOF && hasBytesAvailable)
+	{
+		NSAssert(([preBuffer availableBytes] == 0), @"Invalid logic");
 		
-		LogTrace();
+		BOOL readIntoPreBuffer = NO;
+		uint8_t *buffer = NULL;
+		size_t bytesRead = 0;
+		size_t bytesSpilled = 0; // Bytes read into the prebuffer, after filling the packet's buffer (readv)
+		BOOL sliceFromPreBuffer = NO;
 		
-		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		if (flags & kSocketSecure)
 		{
-			[readQueue addObject:packet];
-			[self maybeDequeueRead];
+			if ([self usingCFStreamForTLS])
+			{
+				#if TARGET_OS_IPHONE
+				
+				// Using CFStream, rather than SecureTransport, for TLS
+				
+				NSUInteger defaultReadLength = readSizeEstimate;
+				
+				NSUInteger bytesToRead = [currentRead optimalReadLengthWithDefault:defaultReadLength
+				                                                   shouldPreBuffer:&readIntoPreBuffer];
+				
+				// Make sure we have enough room in the buffer for our read.
+				//
+				// We are either reading directly into the currentRead->buffer,
+				// or we're reading into the temporary preBuffer.
+				
+				if (readIntoPreBuffer)
+				{
+					if ([preBuffer ensureCapacityForWrite:bytesToRead])
+						buffer = [preBuffer writeBuffer];
+					else
+						error = [self preBufferAllocationError];
+				}
+				else
+				{
+					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
+					
+					buffer = (uint8_t *)[currentRead->buffer mutableBytes]
+					       + currentRead->startOffset
+					       + currentRead->bytesDone;
+				}
+				
+				if (error == nil)
+				{
+					// Read data into buffer
+					
+					CFIndex result = CFReadStreamRead(readStream, buffer, (CFIndex)bytesToRead);
+					LogVerbose(@"CFReadStreamRead(): result = %i", (int)result);
+					
+					if (result < 0)
+					{
+						error = (__bridge_transfer NSError *)CFReadStreamCopyError(readStream);
+					}
+					else if (result == 0)
+					{
+						socketEOF = YES;
+					}
+					else
+					{
+						waiting = YES;
+						bytesRead = (size_t)result;
+					}
+					
+					// We only know how many decrypted bytes were read.
+					// The actual number of bytes read was likely more due to the overhead of the encryption.
+					// So we reset our flag, and rely on the next callback to alert us of more data.
+					flags &= ~kSecureSocketHasBytesAvailable;
+				}
+				
+				#endif
+			}
+			else
+			{
+				// Using SecureTransport for TLS
+				//
+				// We know:
+				// - how many bytes are available on the socket
+				// - how many encrypted bytes are sitting in the sslPreBuffer
+				// - how many decypted bytes are sitting in the sslContext
+				//
+				// But we do NOT know:
+				// - how many encypted bytes are sitting in the sslContext
+				//
+				// So we play the regular game of using an upper bound instead.
+				// That is, what we typically receive per readable event,
+				// plus room for a full TLS record (16 KB) if there's already more than that available.
+				
+				NSUInteger defaultReadLength = readSizeEstimate;
+				
+				if (defaultReadLength < estimatedBytesAvailable) {
+					defaultReadLength = estimatedBytesAvailable + (1024 * 16);
+				}
+				
+				NSUInteger bytesToRead = [currentRead optimalReadLengthWithDefault:defaultReadLength
+				                                                   shouldPreBuffer:&readIntoPreBuffer];
+				
+				if (bytesToRead > SIZE_MAX) { // NSUInteger may be bigger than size_t
+					bytesToRead = SIZE_MAX;
+				}
+				
+				// Make sure we have enough room in the buffer for our read.
+				//
+				// We are either reading directly into the currentRead->buffer,
+				// or we're reading into the temporary preBuffer.
+				
+				if (readIntoPreBuffer)
+				{
+					if ([preBuffer ensureCapacityForWrite:bytesToRead])
+						buffer = [preBuffer writeBuffer];
+					else
+						error = [self preBufferAllocationError];
+				}
+				else
+				{
+					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
+					
+					buffer = (uint8_t *)[currentRead->buffer mutableBytes]
+					       + currentRead->startOffset
+					       + currentRead->bytesDone;
+				}
+				
+				if (error == nil)
+				{
+					// The documentation from Apple states:
+					// 
+					//     "a read operation might return errSSLWouldBlock,
+					//      indicating that less data than requested was actually transferred"
+					// 
+					// However, starting around 10.7, the function will sometimes return noErr,
+					// even if it didn't read as much data as requested. So we need to watch out for that.
+					
+					OSStatus result;
+					do
+					{
+						void *loop_buffer = buffer + bytesRead;
+						size_t loop_bytesToRead = (size_t)bytesToRead - bytesRead;
+						size_t loop_bytesRead = 0;
+						
+						result = SSLRead(sslContext, loop_buffer, loop_bytesToRead, &loop_bytesRead);
+						LogVerbose(@"read from secure socket = %u", (unsigned)loop_bytesRead);
+						
+						bytesRead += loop_bytesRead;
+						
+					} while ((result == noErr) && (bytesRead < bytesToRead));
+					
+					
+					if (result != noErr)
+					{
+						if (result == errSSLWouldBlock)
+							waiting = YES;
+						else
+						{
+							if (result == errSSLClosedGraceful || result == errSSLClosedAbort)
+							{
+								// We've reached the end of the stream.
+								// Handle this the same way we would an EOF from the socket.
+								socketEOF = YES;
+								sslErrCode = result;
+							}
+							else
+							{
+								error = [self sslError:result];
+							}
+						}
+						// It's possible that bytesRead > 0, even if the result was errSSLWouldBlock.
+						// This happens when the SSLRead function is able to read some data,
+						// but not the entire amount we requested.
+						
+						if (bytesRead <= 0)
+						{
+							bytesRead = 0;
+						}
+					}
+				}
+				
+				// Do not modify socketFDBytesAvailable.
+				// It will be updated via the SSLReadFunction().
+			}
 		}
-	}});
-	
-	// Do not rely on the block being run in order to release the packet,
-	// as the queue might get released without the block completing.
-}
-
-- (float)progressOfReadReturningTag:(long *)tagPtr bytesDone:(NSUInteger *)donePtr total:(NSUInteger *)totalPtr
-{
-	__block float result = 0.0F;
-	
-	dispatch_block_t block = ^{
-		
-		if (!currentRead || ![currentRead isKindOfClass:[GCDAsyncReadPacket class]])
+		else
 		{
-			// We're not reading anything right now.
+			// Normal socket operation
+			// 
+			// We read from the socket using a single readv() call with up to 2 buffers:
+			// 
+			// - The remaining space in the read packet's buffer, which is filled first.
+			// - The prebuffer, which receives any data beyond what the read packet can accept.
+			// 
+			// This allows us to drain everything the socket has available in one system call,
+			// while still reading directly into the packet's buffer whenever possible.
+			// 
+			// Zero-copy reads are the exception.
+			// Fresh reads go entirely into a prebuffer slab, so the result can be handed out as a slice of it.
 			
-			if (tagPtr != NULL)   *tagPtr = 0;
-			if (donePtr != NULL)  *donePtr = 0;
-			if (totalPtr != NULL) *totalPtr = 0;
+			NSUInteger bytesToRead;
 			
-			result = NAN;
-		}
-		else
-		{
-			// It's only possible to know the progress of our read if we're reading to a certain length.
-			// If we're reading to data, we of course have no idea when the data will arrive.
-			// If we're reading to timeout, then we have no idea when the next chunk of data will arrive.
+			if ((config & kZeroCopyReads) && currentRead->bufferOwner && (currentRead->bytesDone == 0))
+			{
+				bytesToRead = 0;
+				sliceFromPreBuffer = YES;
+			}
+			else
+			{
+				bytesToRead = [currentRead readLengthForScatterWithHint:estimatedBytesAvailable];
+			}
 			
-			NSUInteger done = currentRead->bytesDone;
-			NSUInteger total = currentRead->readLength;
+			// The kernel told us exactly how many bytes are available, so that's what we read.
+			// (The readSizeEstimate doesn't cap the read here. It only sizes the prebuffer segments,
+			// see updatePreBufferSegmentCapacity.)
+			// Anything that arrives in the meantime fires the readSource again.
 			
-			if (tagPtr != NULL)   *tagPtr = currentRead->tag;
-			if (donePtr != NULL)  *donePtr = done;
-			if (totalPtr != NULL) *totalPtr = total;
+			NSUInteger bytesToPreBuffer = estimatedBytesAvailable - bytesToRead;
 			
-			if (total > 0)
-				result = (float)done / (float)total;
-			else
-				result = 1.0F;
-		}
-	};
-	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
-	else
-		dispatch_sync(socketQueue, block);
-	
-	return result;
-}
-
-/**
- * This method starts a new read, if needed.
- * 
- * It is called when:
- * - a user requests a read
- * - after a read request has finished (to handle the next request)
- * - immediately after the socket opens to handle any pending requests
- * 
- * This method also handles auto-disconnect post read/write completion.
-**/
-- (void)maybeDequeueRead
-{
-	LogTrace();
-	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
-	
-	// If we're not currently processing a read AND we have an available read stream
-	if ((currentRead == nil) && (flags & kConnected))
-	{
-		if ([readQueue count] > 0)
-		{
-			// Dequeue the next object in the write queue
-			currentRead = [readQueue objectAtIndex:0];
-			[readQueue removeObjectAtIndex:0];
+			if (bytesToRead > SSIZE_MAX) { // The sum of the iov_len values must fit in an ssize_t (readv)
+				bytesToRead = SSIZE_MAX;
+			}
+			if (bytesToPreBuffer > (SSIZE_MAX - bytesToRead)) {
+				bytesToPreBuffer = (SSIZE_MAX - bytesToRead);
+			}
 			
+			// Make sure we have enough room in the buffers for our read.
 			
-			if ([currentRead isKindOfClass:[GCDAsyncSpecialPacket class]])
+			struct iovec iov[1 + GCDAsyncSocketPreBufferMaxReadVectors];
+			int iovcnt = 0;
+			
+			if (bytesToRead > 0)
 			{
-				LogVerbose(@"Dequeued GCDAsyncSpecialPacket");
+				[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
 				
-				// Attempt to start TLS
-				flags |= kStartingReadTLS;
+				buffer = (uint8_t *)[currentRead->buffer mutableBytes]
+				       + currentRead->startOffset
+				       + currentRead->bytesDone;
 				
-				// This method won't do anything unless both kStartingReadTLS and kStartingWriteTLS are set
-				[self maybeStartTLS];
+				iov[iovcnt].iov_base = buffer;
+				iov[iovcnt].iov_len  = (size_t)bytesToRead;
+				iovcnt++;
 			}
 			else
 			{
-				LogVerbose(@"Dequeued GCDAsyncReadPacket");
+				// Read type #3 - read up to a terminator
+				// 
+				// There is no room left in the read packet's buffer,
+				// so everything goes into the prebuffer, where we can search for the term.
+				// 
+				// Or this is a zero-copy read.
 				
-				// Setup read timer (if needed)
-				[self setupReadTimerWithTimeout:currentRead->timeout];
+				readIntoPreBuffer = YES;
+			}
+			
+			if (bytesToPreBuffer > 0)
+			{
+				// The prebuffer is made up of segments, each of which gets its own iovec.
+				// If there's more data than we have iovecs for, the rest will be read on the next pass.
 				
-				// Immediately read, if possible
-				[self doReadData];
+				size_t preBufferLength = (size_t)bytesToPreBuffer;
+				int preBufferVectorCount = -1;
+				
+				// Start a new segment (sized from the readSizeEstimate) if needed, so the data ends up contiguous.
+				// If this read is larger than the socket typically receives, whatever doesn't fit goes into
+				// further segments, and the read is assembled by copying as usual.
+				
+				if (!sliceFromPreBuffer ||
+				    [preBuffer ensureCapacityForWrite:MIN(preBufferLength, [preBuffer segmentCapacity])])
+				{
+					preBufferVectorCount = [preBuffer getWriteVectors:(iov + iovcnt)
+					                                            count:GCDAsyncSocketPreBufferMaxReadVectors
+					                                           length:&preBufferLength];
+				}
+				
+				if (preBufferVectorCount < 0)
+				{
+					error = [self preBufferAllocationError];
+				}
+				else
+				{
+					iovcnt += preBufferVectorCount;
+					bytesToPreBuffer = preBufferLength;
+				}
+			}
+			
+			if (error == nil)
+			{
+				// Read data into buffers
+				
+				int socketFD = (socket4FD == SOCKET_NULL) ? socket6FD : socket4FD;
+				
+				ssize_t result = readv(socketFD, iov, iovcnt);
+				LogVerbose(@"read from socket = %i", (int)result);
+				
+				if (result < 0)
+				{
+					if (errno == EWOULDBLOCK)
+						waiting = YES;
+					else
+						error = [self errnoErrorWithReason:@"Error in readv() function"];
+					
+					socketFDBytesAvailable = 0;
+				}
+				else if (result == 0)
+				{
+					socketEOF = YES;
+					socketFDBytesAvailable = 0;
+				}
+				else
+				{
+					size_t totalBytesRead = result;
+					
+					if (readIntoPreBuffer)
+					{
+						bytesRead = totalBytesRead;
+					}
+					else
+					{
+						// The packet's buffer is filled before any data goes into the prebuffer
+						
+						bytesRead = MIN(totalBytesRead, (size_t)bytesToRead);
+						bytesSpilled = totalBytesRead - bytesRead;
+					}
+					
+					if (totalBytesRead < (bytesToRead + bytesToPreBuffer))
+					{
+						// The read returned less data than requested.
+						// This means socketFDBytesAvailable was a bit off due to timing,
+						// because we read from the socket right when the readSource event was firing.
+						socketFDBytesAvailable = 0;
+					}
+					else
+					{
+						if (socketFDBytesAvailable <= totalBytesRead)
+							socketFDBytesAvailable = 0;
+						else
+							socketFDBytesAvailable -= totalBytesRead;
+					}
+					
+					if (socketFDBytesAvailable == 0)
+					{
+						waiting = YES;
+					}
+				}
 			}
 		}
-		else if (flags & kDisconnectAfterReads)
+		
+		if ((bytesRead > 0) && sliceFromPreBuffer)
 		{
-			if (flags & kDisconnectAfterWrites)
+			// Zero-copy read.
+			// All the data went into the prebuffer, so we handle it just like data that was already there.
+			
+			[preBuffer didWrite:bytesRead];
+			
+			totalBytesReadForCurrentRead += [self readFromPreBufferWithDone:&done error:&error];
+		}
+		else if (bytesRead > 0)
+		{
+			// Check to see if the read operation is done
+			
+			if (currentRead->readLength > 0)
+			{
+				// Read type #2 - read a specific length of data
+				// 
+				// Note: We should never be using a prebuffer when we're reading a specific length of data.
+				
+				NSAssert(readIntoPreBuffer == NO, @"Invalid logic");
+				
+				currentRead->bytesDone += bytesRead;
+				totalBytesReadForCurrentRead += bytesRead;
+				
+				if (bytesSpilled > 0)
+				{
+					// We read past the end of this read, and the extra data went directly into the prebuffer.
+					// It will be used by the next read.
+					
+					[preBuffer didWrite:bytesSpilled];
+					LogVerbose(@"read data into preBuffer - preBuffer.length = %zu", [preBuffer availableBytes]);
+				}
+				
+				BOOL headerWasParsed = currentRead->headerParsed;
+				
+				done = [self isCurrentReadOfLengthDone:&error];
+				
+				if (!done && !error && (currentRead->headerParsed != headerWasParsed))
+				{
+					// We just completed the length header of a framed read.
+					// Some (or all) of the payload may have been read into the prebuffer along with it.
+					
+					frameHeaderParsed = YES;
+					
+					if ([preBuffer availableBytes] > 0)
+					{
+						totalBytesReadForCurrentRead += [self readFromPreBufferWithDone:&done error:&error];
+					}
+				}
+			}
+			else if (currentRead->term != nil)
 			{
-				if (([writeQueue count] == 0) && (currentWrite == nil))
+				// Read type #3 - read up to a terminator
+				
+				if (readIntoPreBuffer)
 				{
-					[self closeWithError:nil];
+					// We just read a big chunk of data into the preBuffer
+					
+					[preBuffer didWrite:bytesRead];
+					LogVerbose(@"read data into preBuffer - preBuffer.length = %zu", [preBuffer availableBytes]);
+					
+					// Search for the terminating sequence
+					
+					NSUInteger bytesToCopy = [currentRead readLengthForTermWithPreBuffer:preBuffer found:&done];
+					LogVerbose(@"copying %lu bytes from preBuffer", (unsigned long)bytesToCopy);
+					
+					// Ensure there's room on the read packet's buffer
+					
+					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToCopy];
+					
+					// Copy bytes from prebuffer into read buffer
+					
+					uint8_t *readBuf = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset
+					                                                                 + currentRead->bytesDone;
+					
+					// (This also removes the copied bytes from the prebuffer)
+					
+					[preBuffer readBytes:readBuf length:bytesToCopy];
+					LogVerbose(@"preBuffer.length = %zu", [preBuffer availableBytes]);
+					
+					// Update totals
+					currentRead->bytesDone += bytesToCopy;
+					totalBytesReadForCurrentRead += bytesToCopy;
+					
+					// Our 'done' variable was updated via the readLengthForTermWithPreBuffer:found: method above
+				}
+				else
+				{
+					// We just read a big chunk of data directly into the packet's buffer.
+					// We need to move any overflow into the prebuffer.
+					
+					NSInteger overflow = [currentRead searchForTermAfterPreBuffering:bytesRead];
+					
+					if (overflow == 0)
+					{
+						// Perfect match!
+						// Every byte we read stays in the read buffer,
+						// and the last byte we read was the last byte of the term.
+						
+						currentRead->bytesDone += bytesRead;
+						totalBytesReadForCurrentRead += bytesRead;
+						done = YES;
+						
+						if (bytesSpilled > 0)
+						{
+							// Any data that went into the prebuffer belongs to the next read.
+							[preBuffer didWrite:bytesSpilled];
+						}
+					}
+					else if (overflow > 0)
+					{
+						// The term was found within the data that we read,
+						// and there are extra bytes that extend past the end of the term.
+						// We need to move these excess bytes out of the read packet and into the prebuffer.
+						// 
+						// If the socket read also spilled data into the prebuffer,
+						// the excess bytes need to go in front of it, as they came first.
+						
+						NSInteger underflow = bytesRead - overflow;
+						
+						// Copy excess data into preBuffer
+						
+						LogVerbose(@"copying %ld overflow bytes into preBuffer", (long)overflow);
+						
+						if (bytesSpilled > 0)
+						{
+							[preBuffer didWrite:bytesSpilled];
+						}
+						
+						uint8_t *overflowBuffer = buffer + underflow;
+						
+						if (![preBuffer prependBytes:overflowBuffer length:overflow])
+						{
+							// The read itself is complete, but the bytes after it are lost.
+							error = [self preBufferAllocationError];
+						}
+						
+						LogVerbose(@"preBuffer.length = %zu", [preBuffer availableBytes]);
+						
+						// Note: The completeCurrentRead method will trim the buffer for us.
+						
+						currentRead->bytesDone += underflow;
+						totalBytesReadForCurrentRead += underflow;
+						done = YES;
+					}
+					else
+					{
+						// The term was not found within the data that we read.
+						
+						currentRead->bytesDone += bytesRead;
+						totalBytesReadForCurrentRead += bytesRead;
+						done = NO;
+						
+						if (bytesSpilled > 0)
+						{
+							// The rest of the data went into the prebuffer.
+							// Continue searching for the term there.
+							
+							[preBuffer didWrite:bytesSpilled];
+							LogVerbose(@"read data into preBuffer - preBuffer.length = %zu", [preBuffer availableBytes]);
+							
+							NSUInteger bytesToCopy = [currentRead readLengthForTermWithPreBuffer:preBuffer found:&done];
+							LogVerbose(@"copying %lu bytes from preBuffer", (unsigned long)bytesToCopy);
+							
+							[currentRead ensureCapacityForAdditionalDataOfLength:bytesToCopy];
+							
+							uint8_t *readBuf = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset
+							                                                                 + currentRead->bytesDone;
+							
+							[preBuffer readBytes:readBuf length:bytesToCopy];
+							LogVerbose(@"preBuffer.length = %zu", [preBuffer availableBytes]);
+							
+							currentRead->bytesDone += bytesToCopy;
+							totalBytesReadForCurrentRead += bytesToCopy;
+						}
+					}
+				}
+				
+				if (!done && currentRead->maxLength > 0)
+				{
+					// We're not done and there's a set maxLength.
+					// Have we reached that maxLength yet?
+					
+					if (currentRead->bytesDone >= currentRead->maxLength)
+					{
+						error = [self readMaxedOutError];
+					}
 				}
 			}
 			else
 			{
-				[self closeWithError:nil];
-			}
-		}
-		else if (flags & kSocketSecure)
-		{
-			[self flushSSLBuffers];
-			
-			// Edge case:
-			// 
-			// We just drained all data from the ssl buffers,
-			// and all known data from the socket (socketFDBytesAvailable).
-			// 
-			// If we didn't get any data from this process,
-			// then we may have reached the end of the TCP stream.
-			// 
-			// Be sure callbacks are enabled so we're notified about a disconnection.
-			
-			if ([preBuffer availableBytes] == 0)
-			{
-				if ([self usingCFStreamForTLS]) {
-					// Callbacks never disabled
+				// Read type #1 - read all available data
+				
+				if (readIntoPreBuffer)
+				{
+					// We just read a chunk of data into the preBuffer
+					
+					[preBuffer didWrite:bytesRead];
+					
+					// Now copy the data into the read packet.
+					// 
+					// Recall that we didn't read directly into the packet's buffer to avoid
+					// over-allocating memory since we had no clue how much data was available to be read.
+					// 
+					// Ensure there's room on the read packet's buffer
+					
+					[currentRead ensureCapacityForAdditionalDataOfLength:bytesRead];
+					
+					// Copy bytes from prebuffer into read buffer
+					
+					uint8_t *readBuf = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset
+					                                                                 + currentRead->bytesDone;
+					
+					// (This also removes the copied bytes from the prebuffer)
+					
+					[preBuffer readBytes:readBuf length:bytesRead];
+					
+					// Update totals
+					currentRead->bytesDone += bytesRead;
+					totalBytesReadForCurrentRead += bytesRead;
 				}
-				else {
-					[self resumeReadSource];
+				else
+				{
+					currentRead->bytesDone += bytesRead;
+					totalBytesReadForCurrentRead += bytesRead;
+					
+					if (bytesSpilled > 0)
+					{
+						// We hit the maxLength, and the extra data went directly into the prebuffer.
+						// It will be used by the next read.
+						
+						[preBuffer didWrite:bytesSpilled];
+					}
 				}
+				
+				done = YES;
 			}
-		}
-	}
-}
-
-- (void)flushSSLBuffers
-{
-	LogTrace();
+			
+		} // if (bytesRead > 0)
+		
+	} // if (!done && !error && !socketEOF && hasBytesAvailable)
 	
-	NSAssert((flags & kSocketSecure), @"Cannot flush ssl buffers on non-secure socket");
 	
-	if ([preBuffer availableBytes] > 0)
+	if (!done && currentRead->readLength == 0 && currentRead->term == nil)
 	{
-		// Only flush the ssl buffers if the prebuffer is empty.
-		// This is to avoid growing the prebuffer inifinitely large.
+		// Read type #1 - read all available data
+		// 
+		// We might arrive here if we read data from the prebuffer but not from the socket.
 		
-		return;
+		done = (totalBytesReadForCurrentRead > 0);
 	}
 	
-	#if TARGET_OS_IPHONE
+	// Check to see if we're done, or if we've made progress
 	
-	if ([self usingCFStreamForTLS])
+	BOOL rearmed = NO; // Completed a standing read, which is ready to go again
+	
+	if (done)
 	{
-		if ((flags & kSecureSocketHasBytesAvailable) && CFReadStreamHasBytesAvailable(readStream))
+		[self completeCurrentRead];
+		
+		if (currentRead)
 		{
-			LogVerbose(@"%@ - Flushing ssl buffers into prebuffer...", THIS_METHOD);
-			
-			CFIndex defaultBytesToRead = (1024 * 4);
-			
-			[preBuffer ensureCapacityForWrite:defaultBytesToRead];
-			
-			uint8_t *buffer = [preBuffer writeBuffer];
-			
-			CFIndex result = CFReadStreamRead(readStream, buffer, defaultBytesToRead);
-			LogVerbose(@"%@ - CFReadStreamRead(): result = %i", THIS_METHOD, (int)result);
-			
-			if (result > 0)
-			{
-				[preBuffer didWrite:result];
-			}
-			
-			flags &= ~kSecureSocketHasBytesAvailable;
+			rearmed = YES;
+		}
+		else if (!error && (!socketEOF || [preBuffer availableBytes] > 0))
+		{
+			[self maybeDequeueRead];
 		}
-		
-		return;
 	}
-	
-	#endif
-	
-	__block NSUInteger estimatedBytesAvailable = 0;
-	
-	dispatch_block_t updateEstimatedBytesAvailable = ^{
-		
-		// Figure out if there is any data available to be read
-		// 
-		// socketFDBytesAvailable        <- Number of encrypted bytes we haven't read from the bsd socket
-		// [sslPreBuffer availableBytes] <- Number of encrypted bytes we've buffered from bsd socket
-		// sslInternalBufSize            <- Number of decrypted bytes SecureTransport has buffered
-		// 
-		// We call the variable "estimated" because we don't know how many decrypted bytes we'll get
-		// from the encrypted bytes in the sslPreBuffer.
-		// However, we do know this is an upper bound on the estimation.
-		
-		estimatedBytesAvailable = socketFDBytesAvailable + [sslPreBuffer availableBytes];
-		
-		size_t sslInternalBufSize = 0;
-		SSLGetBufferedReadSize(sslContext, &sslInternalBufSize);
+	else if (totalBytesReadForCurrentRead > 0)
+	{
+		// We're not done read type #2 or #3 yet, but we have read in some bytes
+
+		__strong id theDelegate = delegate;
 		
-		estimatedBytesAvailable += sslInternalBufSize;
-	};
+		if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didReadPartialDataOfLength:tag:)])
+		{
+			long theReadTag = currentRead->tag;
+			
+			[self notifyDelegateWithBlock:^{ @autoreleasepool {
+				
+				[theDelegate socket:self didReadPartialDataOfLength:totalBytesReadForCurrentRead tag:theReadTag];
+			}}];
+		}
+	}
 	
-	updateEstimatedBytesAvailable();
+	// Check for errors
 	
-	if (estimatedBytesAvailable > 0)
+	if (error)
 	{
-		LogVerbose(@"%@ - Flushing ssl buffers into prebuffer...", THIS_METHOD);
-		
-		BOOL done = NO;
-		do
+		[self closeWithError:error];
+	}
+	else if (socketEOF)
+	{
+		[self doReadEOF];
+	}
+	else if (waiting)
+	{
+		if (![self usingCFStreamForTLS])
 		{
-			LogVerbose(@"%@ - estimatedBytesAvailable = %lu", THIS_METHOD, (unsigned long)estimatedBytesAvailable);
-			
-			// Make sure there's enough room in the prebuffer
-			
-			[preBuffer ensureCapacityForWrite:estimatedBytesAvailable];
-			
-			// Read data into prebuffer
-			
-			uint8_t *buffer = [preBuffer writeBuffer];
-			size_t bytesRead = 0;
-			
-			OSStatus result = SSLRead(sslContext, buffer, (size_t)estimatedBytesAvailable, &bytesRead);
-			LogVerbose(@"%@ - read from secure socket = %u", THIS_METHOD, (unsigned)bytesRead);
-			
-			if (bytesRead > 0)
-			{
-				[preBuffer didWrite:bytesRead];
-			}
-			
-			LogVerbose(@"%@ - prebuffer.length = %zu", THIS_METHOD, [preBuffer availableBytes]);
-			
-			if (result != noErr)
-			{
-				done = YES;
-			}
-			else
-			{
-				updateEstimatedBytesAvailable();
-			}
-			
-		} while (!done && estimatedBytesAvailable > 0);
+			// Monitor the socket for readability (if we're not already doing so)
+			[self resumeReadSource];
+		}
+	}
+	else if (frameHeaderParsed && !done)
+	{
+		// We only read the length header of a framed read, but there's more data available right now.
+		// (Possibly decrypted data buffered within the SSL layer, which won't trigger the readSource.)
+		// So continue with the payload.
+		
+		return YES;
 	}
+	
+	// The EOF handling above may have closed the socket, which ends the standing read
+	return (rearmed && !error && (currentRead != nil));
 }
 
-- (void)doReadData
+- (void)doReadEOF
 {
 	LogTrace();
 	
-	// This method is called on the socketQueue.
-	// It might be called directly, or via the readSource when data is available to be read.
+	// This method may be called more than once.
+	// If the EOF is read while there is still data in the preBuffer,
+	// then this method may be called continually after invocations of doReadData to see if it's time to disconnect.
 	
-	if ((currentRead == nil) || (flags & kReadsPaused))
+	flags |= kSocketHasReadEOF;
+	
+	if (flags & kSocketSecure)
 	{
-		LogVerbose(@"No currentRead or kReadsPaused");
-		
-		// Unable to read at this time
-		
-		if (flags & kSocketSecure)
-		{
-			// Here's the situation:
-			// 
-			// We have an established secure connection.
-			// There may not be a currentRead, but there might be encrypted data sitting around for us.
-			// When the user does get around to issuing a read, that encrypted data will need to be decrypted.
-			// 
-			// So why make the user wait?
-			// We might as well get a head start on decrypting some data now.
-			// 
-			// The other reason we do this has to do with detecting a socket disconnection.
-			// The SSL/TLS protocol has it's own disconnection handshake.
-			// So when a secure socket is closed, a "goodbye" packet comes across the wire.
-			// We want to make sure we read the "goodbye" packet so we can properly detect the TCP disconnection.
-			
-			[self flushSSLBuffers];
-		}
+		// If the SSL layer has any buffered data, flush it into the preBuffer now.
 		
-		if ([self usingCFStreamForTLS])
-		{
-			// CFReadStream only fires once when there is available data.
-			// It won't fire again until we've invoked CFReadStreamRead.
-		}
-		else
-		{
-			// If the readSource is firing, we need to pause it
-			// or else it will continue to fire over and over again.
-			// 
-			// If the readSource is not firing,
-			// we want it to continue monitoring the socket.
-			
-			if (socketFDBytesAvailable > 0)
-			{
-				[self suspendReadSource];
-			}
-		}
-		return;
+		[self flushSSLBuffers];
 	}
 	
-	BOOL hasBytesAvailable = NO;
-	unsigned long estimatedBytesAvailable = 0;
-	
-	if ([self usingCFStreamForTLS])
+	BOOL shouldDisconnect = NO;
+	NSError *error = nil;
+	
+	if ((flags & kStartingReadTLS) || (flags & kStartingWriteTLS))
 	{
-		#if TARGET_OS_IPHONE
+		// We received an EOF during or prior to startTLS.
+		// The SSL/TLS handshake is now impossible, so this is an unrecoverable situation.
 		
-		// Requested CFStream, rather than SecureTransport, for TLS (via GCDAsyncSocketUseCFStreamForTLS)
+		shouldDisconnect = YES;
 		
-		estimatedBytesAvailable = 0;
-		if ((flags & kSecureSocketHasBytesAvailable) && CFReadStreamHasBytesAvailable(readStream))
-			hasBytesAvailable = YES;
-		else
-			hasBytesAvailable = NO;
+		if ([self usingSecureTransportForTLS])
+		{
+			error = [self sslError:errSSLClosedAbort];
+		}
+	}
+	else if (flags & kReadStreamClosed)
+	{
+		// The preBuffer has already been drained.
+		// The config allows half-duplex connections.
+		// We've previously checked the socket, and it appeared writeable.
+		// So we marked the read stream as closed and notified the delegate.
+		// 
+		// As per the half-duplex contract, the socket will be closed when a write fails,
+		// or when the socket is manually closed.
 		
-		#endif
+		shouldDisconnect = NO;
 	}
-	else
+	else if ([preBuffer availableBytes] > 0)
 	{
-		estimatedBytesAvailable = socketFDBytesAvailable;
+		LogVerbose(@"Socket reached EOF, but there is still data available in prebuffer");
 		
-		if (flags & kSocketSecure)
-		{
-			// There are 2 buffers to be aware of here.
-			// 
-			// We are using SecureTransport, a TLS/SSL security layer which sits atop TCP.
-			// We issue a read to the SecureTranport API, which in turn issues a read to our SSLReadFunction.
-			// Our SSLReadFunction then reads from the BSD socket and returns the encrypted data to SecureTransport.
-			// SecureTransport then decrypts the data, and finally returns the decrypted data back to us.
-			// 
-			// The first buffer is one we create.
-			// SecureTransport often requests small amounts of data.
-			// This has to do with the encypted packets that are coming across the TCP stream.
-			// But it's non-optimal to do a bunch of small reads from the BSD socket.
-			// So our SSLReadFunction reads all available data from the socket (optimizing the sys call)
-			// and may store excess in the sslPreBuffer.
-			
-			estimatedBytesAvailable += [sslPreBuffer availableBytes];
-			
-			// The second buffer is within SecureTransport.
-			// As mentioned earlier, there are encrypted packets coming across the TCP stream.
-			// SecureTransport needs the entire packet to decrypt it.
-			// But if the entire packet produces X bytes of decrypted data,
-			// and we only asked SecureTransport for X/2 bytes of data,
-			// it must store the extra X/2 bytes of decrypted data for the next read.
-			// 
-			// The SSLGetBufferedReadSize function will tell us the size of this internal buffer.
-			// From the documentation:
-			// 
-			// "This function does not block or cause any low-level read operations to occur."
-			
-			size_t sslInternalBufSize = 0;
-			SSLGetBufferedReadSize(sslContext, &sslInternalBufSize);
-			
-			estimatedBytesAvailable += sslInternalBufSize;
-		}
+		// Although we won't be able to read any more data from the socket,
+		// there is existing data that has been prebuffered that we can read.
 		
-		hasBytesAvailable = (estimatedBytesAvailable > 0);
+		shouldDisconnect = NO;
 	}
-	
-	if ((hasBytesAvailable == NO) && ([preBuffer availableBytes] == 0))
+	else if (config & kAllowHalfDuplexConnection)
 	{
-		LogVerbose(@"No data available to read...");
+		// We just received an EOF (end of file) from the socket's read stream.
+		// This means the remote end of the socket (the peer we're connected to)
+		// has explicitly stated that it will not be sending us any more data.
+		// 
+		// Query the socket to see if it is still writeable. (Perhaps the peer will continue reading data from us)
 		
-		// No data available to read.
+		int socketFD = (socket4FD == SOCKET_NULL) ? socket6FD : socket4FD;
 		
-		if (![self usingCFStreamForTLS])
+		struct pollfd pfd[1];
+		pfd[0].fd = socketFD;
+		pfd[0].events = POLLOUT;
+		pfd[0].revents = 0;
+		
+		poll(pfd, 1, 0);
+		
+		if (pfd[0].revents & POLLOUT)
 		{
-			// Need to wait for readSource to fire and notify us of
-			// available data in the socket's internal read buffer.
+			// Socket appears to still be writeable
 			
-			[self resumeReadSource];
+			shouldDisconnect = NO;
+			flags |= kReadStreamClosed;
+			
+			// Notify the delegate that we're going half-duplex
+			
+			__strong id theDelegate = delegate;
+
+			if (delegateQueue && [theDelegate respondsToSelector:@selector(socketDidCloseReadStream:)])
+			{
+				[self notifyDelegateWithBlock:^{ @autoreleasepool {
+					
+					[theDelegate socketDidCloseReadStream:self];
+				}}];
+			}
 		}
-		return;
+		else
+		{
+			shouldDisconnect = YES;
+		}
+	}
+	else
+	{
+		shouldDisconnect = YES;
 	}
 	
-	if (flags & kStartingReadTLS)
+	
+	if (shouldDisconnect)
 	{
-		LogVerbose(@"Waiting for SSL/TLS handshake to complete");
-		
-		// The readQueue is waiting for SSL/TLS handshake to complete.
-		
-		if (flags & kStartingWriteTLS)
+		if (error == nil)
 		{
-			if ([self usingSecureTransportForTLS] && lastSSLHandshakeError == errSSLWouldBlock)
+			if ([self usingSecureTransportForTLS])
 			{
-				// We are in the process of a SSL Handshake.
-				// We were waiting for incoming data which has just arrived.
-				
-				[self ssl_continueSSLHandshake];
+				if (sslErrCode != noErr && sslErrCode != errSSLClosedGraceful)
+				{
+					error = [self sslError:sslErrCode];
+				}
+				else
+				{
+					error = [self connectionClosedError];
+				}
+			}
+			else
+			{
+				error = [self connectionClosedError];
 			}
 		}
-		else
+		[self closeWithError:error];
+	}
+	else
+	{
+		if (![self usingCFStreamForTLS])
 		{
-			// We are still waiting for the writeQueue to drain and start the SSL/TLS process.
-			// We now know data is available to read.
+			// Suspend the read source (if needed)
 			
-			if (![self usingCFStreamForTLS])
-			{
-				// Suspend the read source or else it will continue to fire nonstop.
-				
-				[self suspendReadSource];
-			}
+			[self suspendReadSource];
 		}
+	}
+}
+
+/**
+ * Batched completions are delivered once the socketQueue is done with whatever it's doing right now,
+ * e.g. processing a readable event that completed a bunch of small reads from the prebuffer.
+ * Any other delegate callback in the meantime delivers them sooner (see notifyDelegateWithBlock:).
+**/
+- (void)scheduleCompletionBatchFlush
+{
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
 		
-		return;
+		[self flushCompletionBatches];
+	}});
+}
+
+/**
+ * Delivers the batched read and write completions (if any) to the delegate,
+ * via socket:didReadDataBatch:withTags: and socket:didWriteDataWithTags:.
+**/
+- (void)flushCompletionBatches
+{
+	NSArray *readTags = completedReadTags;
+	NSArray *readResults = completedReadResults;
+	NSArray *writeTags = completedWriteTags;
+	
+	// Taken up front, as notifyDelegateWithBlock: (below) flushes any batches it finds
+	completedReadTags = nil;
+	completedReadResults = nil;
+	completedWriteTags = nil;
+	
+	__strong id theDelegate = delegate;
+	
+	if (readTags && delegateQueue && [theDelegate respondsToSelector:@selector(socket:didReadDataBatch:withTags:)])
+	{
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
+			
+			[theDelegate socket:self didReadDataBatch:readResults withTags:readTags];
+		}}];
 	}
 	
-	BOOL done        = NO;  // Completed read operation
-	NSError *error   = nil; // Error occured
+	if (writeTags && delegateQueue && [theDelegate respondsToSelector:@selector(socket:didWriteDataWithTags:)])
+	{
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
+			
+			[theDelegate socket:self didWriteDataWithTags:writeTags];
+		}}];
+	}
+}
+
+- (void)completeCurrentRead
+{
+	LogTrace();
 	
-	NSUInteger totalBytesReadForCurrentRead = 0;
+	NSAssert(currentRead, @"Trying to complete current read when there is no current read.");
 	
-	// 
-	// STEP 1 - READ FROM PREBUFFER
-	// 
 	
-	if ([preBuffer availableBytes] > 0)
+	NSData *result = nil;
+	
+	if (currentRead->slice)
 	{
-		// There are 3 types of read packets:
-		// 
-		// 1) Read all available data.
-		// 2) Read a specific length of data.
-		// 3) Read up to a particular terminator.
+		// Zero-copy read.
+		// The data was never copied out of the prebuffer segment it was read into.
 		
-		NSUInteger bytesToCopy;
+		result = currentRead->slice;
+	}
+	else if (currentRead->bufferOwner)
+	{
+		// We created the buffer on behalf of the user.
+		// Trim our buffer to be the proper size.
+		[currentRead->buffer setLength:currentRead->bytesDone];
 		
-		if (currentRead->term != nil)
+		if (currentRead->standing)
 		{
-			// Read type #3 - read up to a terminator
+			// The standing read re-arms with a fresh buffer, so the result can simply take this one
 			
-			bytesToCopy = [currentRead readLengthForTermWithPreBuffer:preBuffer found:&done];
+			result = currentRead->buffer;
 		}
 		else
 		{
-			// Read type #1 or #2
+			// The result doesn't own the bytes, so it keeps the buffer alive instead.
+			// Once the result is released, the (recycled) packet reads into the buffer again.
 			
-			bytesToCopy = [currentRead readLengthForNonTermWithHint:[preBuffer availableBytes]];
-		}
-		
-		// Make sure we have enough room in the buffer for our read.
-		
-		[currentRead ensureCapacityForAdditionalDataOfLength:bytesToCopy];
-		
-		// Copy bytes from prebuffer into packet buffer
-		
-		uint8_t *buffer = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset +
-		                                                                  currentRead->bytesDone;
-		
-		memcpy(buffer, [preBuffer readBuffer], bytesToCopy);
-		
-		// Remove the copied bytes from the preBuffer
-		[preBuffer didRead:bytesToCopy];
-		
-		LogVerbose(@"copied(%lu) preBufferLength(%zu)", (unsigned long)bytesToCopy, [preBuffer availableBytes]);
-		
-		// Update totals
-		
-		currentRead->bytesDone += bytesToCopy;
-		totalBytesReadForCurrentRead += bytesToCopy;
-		
-		// Check to see if the read operation is done
-		
-		if (currentRead->readLength > 0)
-		{
-			// Read type #2 - read a specific length of data
+			NSMutableData *theBuffer = currentRead->buffer;
+			
+			result = [[NSData alloc] initWithBytesNoCopy:[theBuffer mutableBytes]
+			                                      length:currentRead->bytesDone
+			                                 deallocator:^(void *bytes, NSUInteger len) {
+				
+				(void)theBuffer;
+			}];
 			
-			done = (currentRead->bytesDone == currentRead->readLength);
+			currentRead->ownedBufferResult = result;
 		}
-		else if (currentRead->term != nil)
+	}
+	else
+	{
+		// We did NOT create the buffer.
+		// The buffer is owned by the caller.
+		// Only trim the buffer if we had to increase its size.
+		
+		if ([currentRead->buffer length] > currentRead->originalBufferLength)
 		{
-			// Read type #3 - read up to a terminator
+			NSUInteger readSize = currentRead->startOffset + currentRead->bytesDone;
+			NSUInteger origSize = currentRead->originalBufferLength;
 			
-			// Our 'done' variable was updated via the readLengthForTermWithPreBuffer:found: method
+			NSUInteger buffSize = MAX(readSize, origSize);
 			
-			if (!done && currentRead->maxLength > 0)
-			{
-				// We're not done and there's a set maxLength.
-				// Have we reached that maxLength yet?
-				
-				if (currentRead->bytesDone >= currentRead->maxLength)
-				{
-					error = [self readMaxedOutError];
-				}
-			}
+			[currentRead->buffer setLength:buffSize];
 		}
-		else
+		
+		uint8_t *buffer = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset;
+		
+		// The result doesn't own the bytes, so it keeps the buffer alive instead (the packet gets recycled)
+		NSMutableData *theBuffer = currentRead->buffer;
+		
+		result = [[NSData alloc] initWithBytesNoCopy:buffer
+		                                      length:currentRead->bytesDone
+		                                 deallocator:^(void *bytes, NSUInteger len) {
+			
+			(void)theBuffer;
+		}];
+	}
+	
+	__strong id theDelegate = delegate;
+
+	if (delegateQueue && currentRead->termMatchers &&
+	    [theDelegate respondsToSelector:@selector(socket:didReadData:toTerminatorAtIndex:withTag:)])
+	{
+		NSUInteger theTermIndex = currentRead->matchedTermIndex;
+		long theReadTag = currentRead->tag;
+		
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
+			
+			[theDelegate socket:self didReadData:result toTerminatorAtIndex:theTermIndex withTag:theReadTag];
+		}}];
+	}
+	else if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didReadDataBatch:withTags:)])
+	{
+		// The delegate prefers to get all the reads completed during this pass on the socketQueue at once.
+		
+		if (completedReadTags == nil)
 		{
-			// Read type #1 - read all available data
-			// 
-			// We're done as soon as
-			// - we've read all available data (in prebuffer and socket)
-			// - we've read the maxLength of read packet.
+			completedReadTags = [[NSMutableArray alloc] init];
+			completedReadResults = [[NSMutableArray alloc] init];
 			
-			done = ((currentRead->maxLength > 0) && (currentRead->bytesDone == currentRead->maxLength));
+			[self scheduleCompletionBatchFlush];
 		}
 		
+		[completedReadTags addObject:@(currentRead->tag)];
+		[completedReadResults addObject:result];
+	}
+	else if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didReadData:withTag:)])
+	{
+		long theReadTag = currentRead->tag;
+		
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
+			
+			[theDelegate socket:self didReadData:result withTag:theReadTag];
+		}}];
 	}
 	
-	// 
-	// STEP 2 - READ FROM SOCKET
-	// 
-	
-	BOOL socketEOF = (flags & kSocketHasReadEOF) ? YES : NO;  // Nothing more to read via socket (end of file)
-	BOOL waiting   = !done && !error && !socketEOF && !hasBytesAvailable; // Ran out of data, waiting for more
-	
-	if (!done && !error && !socketEOF && hasBytesAvailable)
+	if (currentRead->standing)
 	{
-		NSAssert(([preBuffer availableBytes] == 0), @"Invalid logic");
+		// Leave the read in place for the next frame, with a fresh timeout on the same timer
 		
-		BOOL readIntoPreBuffer = NO;
-		uint8_t *buffer = NULL;
-		size_t bytesRead = 0;
+		[currentRead rearm];
+		[self collectAllocationsOfReadPacket:currentRead];
 		
-		if (flags & kSocketSecure)
+		if (currentRead->timeout >= 0.0)
 		{
-			if ([self usingCFStreamForTLS])
-			{
-				#if TARGET_OS_IPHONE
-				
-				// Using CFStream, rather than SecureTransport, for TLS
-				
-				NSUInteger defaultReadLength = (1024 * 32);
-				
-				NSUInteger bytesToRead = [currentRead optimalReadLengthWithDefault:defaultReadLength
-				                                                   shouldPreBuffer:&readIntoPreBuffer];
-				
-				// Make sure we have enough room in the buffer for our read.
-				//
-				// We are either reading directly into the currentRead->buffer,
-				// or we're reading into the temporary preBuffer.
-				
-				if (readIntoPreBuffer)
-				{
-					[preBuffer ensureCapacityForWrite:bytesToRead];
-					
-					buffer = [preBuffer writeBuffer];
-				}
-				else
-				{
-					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
-					
-					buffer = (uint8_t *)[currentRead->buffer mutableBytes]
-					       + currentRead->startOffset
-					       + currentRead->bytesDone;
-				}
-				
-				// Read data into buffer
-				
-				CFIndex result = CFReadStreamRead(readStream, buffer, (CFIndex)bytesToRead);
-				LogVerbose(@"CFReadStreamRead(): result = %i", (int)result);
-				
-				if (result < 0)
-				{
-					error = (__bridge_transfer NSError *)CFReadStreamCopyError(readStream);
-				}
-				else if (result == 0)
-				{
-					socketEOF = YES;
-				}
-				else
-				{
-					waiting = YES;
-					bytesRead = (size_t)result;
-				}
-				
-				// We only know how many decrypted bytes were read.
-				// The actual number of bytes read was likely more due to the overhead of the encryption.
-				// So we reset our flag, and rely on the next callback to alert us of more data.
-				flags &= ~kSecureSocketHasBytesAvailable;
-				
-				#endif
-			}
-			else
-			{
-				// Using SecureTransport for TLS
-				//
-				// We know:
-				// - how many bytes are available on the socket
-				// - how many encrypted bytes are sitting in the sslPreBuffer
-				// - how many decypted bytes are sitting in the sslContext
-				//
-				// But we do NOT know:
-				// - how many encypted bytes are sitting in the sslContext
-				//
-				// So we play the regular game of using an upper bound instead.
-				
-				NSUInteger defaultReadLength = (1024 * 32);
-				
-				if (defaultReadLength < estimatedBytesAvailable) {
-					defaultReadLength = estimatedBytesAvailable + (1024 * 16);
-				}
-				
-				NSUInteger bytesToRead = [currentRead optimalReadLengthWithDefault:defaultReadLength
-				                                                   shouldPreBuffer:&readIntoPreBuffer];
-				
-				if (bytesToRead > SIZE_MAX) { // NSUInteger may be bigger than size_t
-					bytesToRead = SIZE_MAX;
-				}
-				
-				// Make sure we have enough room in the buffer for our read.
-				//
-				// We are either reading directly into the currentRead->buffer,
-				// or we're reading into the temporary preBuffer.
-				
-				if (readIntoPreBuffer)
-				{
-					[preBuffer ensureCapacityForWrite:bytesToRead];
-					
-					buffer = [preBuffer writeBuffer];
-				}
-				else
-				{
-					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
-					
-					buffer = (uint8_t *)[currentRead->buffer mutableBytes]
-					       + currentRead->startOffset
-					       + currentRead->bytesDone;
-				}
-				
-				// The documentation from Apple states:
-				// 
-				//     "a read operation might return errSSLWouldBlock,
-				//      indicating that less data than requested was actually transferred"
-				// 
-				// However, starting around 10.7, the function will sometimes return noErr,
-				// even if it didn't read as much data as requested. So we need to watch out for that.
-				
-				OSStatus result;
-				do
-				{
-					void *loop_buffer = buffer + bytesRead;
-					size_t loop_bytesToRead = (size_t)bytesToRead - bytesRead;
-					size_t loop_bytesRead = 0;
-					
-					result = SSLRead(sslContext, loop_buffer, loop_bytesToRead, &loop_bytesRead);
-					LogVerbose(@"read from secure socket = %u", (unsigned)loop_bytesRead);
-					
-					bytesRead += loop_bytesRead;
-					
-				} while ((result == noErr) && (bytesRead < bytesToRead));
-				
-				
-				if (result != noErr)
-				{
-					if (result == errSSLWouldBlock)
-						waiting = YES;
-					else
-					{
-						if (result == errSSLClosedGraceful || result == errSSLClosedAbort)
-						{
-							// We've reached the end of the stream.
-							// Handle this the same way we would an EOF from the socket.
-							socketEOF = YES;
-							sslErrCode = result;
-						}
-						else
-						{
-							error = [self sslError:result];
-						}
-					}
-					// It's possible that bytesRead > 0, even if the result was errSSLWouldBlock.
-					// This happens when the SSLRead function is able to read some data,
-					// but not the entire amount we requested.
-					
-					if (bytesRead <= 0)
-					{
-						bytesRead = 0;
-					}
-				}
-				
-				// Do not modify socketFDBytesAvailable.
-				// It will be updated via the SSLReadFunction().
-			}
+			[readTimer armWithInterval:currentRead->timeout];
 		}
-		else
+	}
+	else
+	{
+		[self recycleReadPacket:currentRead];
+		[self endCurrentRead];
+	}
+}
+
+- (void)endCurrentRead
+{
+	[readTimer disarm];
+	
+	currentRead = nil;
+}
+
+- (void)setupReadTimerWithTimeout:(NSTimeInterval)timeout
+{
+	if (timeout >= 0.0)
+	{
+		if ((readTimer == nil) || (readTimer->wheel != timingWheel))
 		{
-			// Normal socket operation
-			
-			NSUInteger bytesToRead;
+			[readTimer disarm];
 			
-			// There are 3 types of read packets:
-			//
-			// 1) Read all available data.
-			// 2) Read a specific length of data.
-			// 3) Read up to a particular terminator.
+			__weak GCDAsyncSocket *weakSelf = self;
 			
-			if (currentRead->term != nil)
-			{
-				// Read type #3 - read up to a terminator
+			readTimer = [timingWheel timeoutWithQueue:socketQueue handler:^{ @autoreleasepool {
+			#pragma clang diagnostic push
+			#pragma clang diagnostic warning "-Wimplicit-retain-self"
 				
-				bytesToRead = [currentRead readLengthForTermWithHint:estimatedBytesAvailable
-				                                     shouldPreBuffer:&readIntoPreBuffer];
-			}
-			else
-			{
-				// Read type #1 or #2
+				__strong GCDAsyncSocket *strongSelf = weakSelf;
+				if (strongSelf == nil) return_from_block;
 				
-				bytesToRead = [currentRead readLengthForNonTermWithHint:estimatedBytesAvailable];
-			}
+				[strongSelf doReadTimeout];
+				
+			#pragma clang diagnostic pop
+			}}];
+		}
+		
+		[readTimer armWithInterval:timeout];
+	}
+}
+
+- (void)doReadTimeout
+{
+	// This is a little bit tricky.
+	// Ideally we'd like to synchronously query the delegate about a timeout extension.
+	// But if we do so synchronously we risk a possible deadlock.
+	// So instead we have to do so asynchronously, and callback to ourselves from within the delegate block.
+	
+	flags |= kReadsPaused;
+	
+	__strong id theDelegate = delegate;
+
+	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:shouldTimeoutReadWithTag:elapsed:bytesDone:)])
+	{
+		// Packets are recycled, so don't touch the packet from the delegateQueue
+		long theTag = currentRead->tag;
+		NSTimeInterval theElapsed = currentRead->timeout;
+		NSUInteger theBytesDone = currentRead->bytesDone;
+		
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
 			
-			if (bytesToRead > SIZE_MAX) { // NSUInteger may be bigger than size_t (read param 3)
-				bytesToRead = SIZE_MAX;
-			}
+			NSTimeInterval timeoutExtension = 0.0;
 			
-			// Make sure we have enough room in the buffer for our read.
-			//
-			// We are either reading directly into the currentRead->buffer,
-			// or we're reading into the temporary preBuffer.
+			timeoutExtension = [theDelegate socket:self shouldTimeoutReadWithTag:theTag
+			                                                             elapsed:theElapsed
+			                                                           bytesDone:theBytesDone];
 			
-			if (readIntoPreBuffer)
-			{
-				[preBuffer ensureCapacityForWrite:bytesToRead];
-				
-				buffer = [preBuffer writeBuffer];
-			}
-			else
-			{
-				[currentRead ensureCapacityForAdditionalDataOfLength:bytesToRead];
+			dispatch_async(socketQueue, ^{ @autoreleasepool {
 				
-				buffer = (uint8_t *)[currentRead->buffer mutableBytes]
-				       + currentRead->startOffset
-				       + currentRead->bytesDone;
-			}
-			
-			// Read data into buffer
-			
-			int socketFD = (socket4FD == SOCKET_NULL) ? socket6FD : socket4FD;
+				[self doReadTimeoutWithExtension:timeoutExtension];
+			}});
+		}}];
+	}
+	else
+	{
+		[self doReadTimeoutWithExtension:0.0];
+	}
+}
+
+- (void)doReadTimeoutWithExtension:(NSTimeInterval)timeoutExtension
+{
+	if (currentRead)
+	{
+		if (timeoutExtension > 0.0)
+		{
+			currentRead->timeout += timeoutExtension;
 			
-			ssize_t result = read(socketFD, buffer, (size_t)bytesToRead);
-			LogVerbose(@"read from socket = %i", (int)result);
+			// Reschedule the timer
+			[readTimer armWithInterval:timeoutExtension];
 			
-			if (result < 0)
-			{
-				if (errno == EWOULDBLOCK)
-					waiting = YES;
-				else
-					error = [self errnoErrorWithReason:@"Error in read() function"];
-				
-				socketFDBytesAvailable = 0;
-			}
-			else if (result == 0)
-			{
-				socketEOF = YES;
-				socketFDBytesAvailable = 0;
-			}
-			else
-			{
-				bytesRead = result;
-				
-				if (bytesRead < bytesToRead)
-				{
-					// The read returned less data than requested.
-					// This means socketFDBytesAvailable was a bit off due to timing,
-					// because we read from the socket right when the readSource event was firing.
-					socketFDBytesAvailable = 0;
-				}
-				else
-				{
-					if (socketFDBytesAvailable <= bytesRead)
-						socketFDBytesAvailable = 0;
-					else
-						socketFDBytesAvailable -= bytesRead;
-				}
-				
-				if (socketFDBytesAvailable == 0)
-				{
-					waiting = YES;
-				}
-			}
+			// Unpause reads, and continue
+			flags &= ~kReadsPaused;
+			[self doReadData];
+		}
+		else
+		{
+			LogVerbose(@"ReadTimeout");
+			
+			[self closeWithError:[self readTimeoutError]];
 		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Writing
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag
+{
+	[self writeData:data withTimeout:timeout tag:tag priority:GCDAsyncSocketWritePriorityNormal];
+}
+
+- (void)writeData:(NSData *)data
+      withTimeout:(NSTimeInterval)timeout
+              tag:(long)tag
+         priority:(GCDAsyncSocketWritePriority)priority
+{
+	if ([data length] == 0) return;
+	
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		LogTrace();
 		
-		if (bytesRead > 0)
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
 		{
-			// Check to see if the read operation is done
+			GCDAsyncWritePacket *packet = [self writePacketWithData:data timeout:timeout tag:tag];
 			
-			if (currentRead->readLength > 0)
-			{
-				// Read type #2 - read a specific length of data
-				// 
-				// Note: We should never be using a prebuffer when we're reading a specific length of data.
-				
-				NSAssert(readIntoPreBuffer == NO, @"Invalid logic");
-				
-				currentRead->bytesDone += bytesRead;
-				totalBytesReadForCurrentRead += bytesRead;
-				
-				done = (currentRead->bytesDone == currentRead->readLength);
-			}
-			else if (currentRead->term != nil)
+			// A write queued after startTLS must not overtake it,
+			// so while the startTLS packet is still waiting in the write queue, every write joins it there.
+			
+			BOOL tlsQueued = (flags & kQueuedTLS) && !(flags & (kStartingWriteTLS | kSocketSecure));
+			
+			if ((priority == GCDAsyncSocketWritePriorityHigh) && !tlsQueued)
 			{
-				// Read type #3 - read up to a terminator
-				
-				if (readIntoPreBuffer)
-				{
-					// We just read a big chunk of data into the preBuffer
-					
-					[preBuffer didWrite:bytesRead];
-					LogVerbose(@"read data into preBuffer - preBuffer.length = %zu", [preBuffer availableBytes]);
-					
-					// Search for the terminating sequence
-					
-					NSUInteger bytesToCopy = [currentRead readLengthForTermWithPreBuffer:preBuffer found:&done];
-					LogVerbose(@"copying %lu bytes from preBuffer", (unsigned long)bytesToCopy);
-					
-					// Ensure there's room on the read packet's buffer
-					
-					[currentRead ensureCapacityForAdditionalDataOfLength:bytesToCopy];
-					
-					// Copy bytes from prebuffer into read buffer
-					
-					uint8_t *readBuf = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset
-					                                                                 + currentRead->bytesDone;
-					
-					memcpy(readBuf, [preBuffer readBuffer], bytesToCopy);
-					
-					// Remove the copied bytes from the prebuffer
-					[preBuffer didRead:bytesToCopy];
-					LogVerbose(@"preBuffer.length = %zu", [preBuffer availableBytes]);
-					
-					// Update totals
-					currentRead->bytesDone += bytesToCopy;
-					totalBytesReadForCurrentRead += bytesToCopy;
-					
-					// Our 'done' variable was updated via the readLengthForTermWithPreBuffer:found: method above
-				}
-				else
-				{
-					// We just read a big chunk of data directly into the packet's buffer.
-					// We need to move any overflow into the prebuffer.
-					
-					NSInteger overflow = [currentRead searchForTermAfterPreBuffering:bytesRead];
-					
-					if (overflow == 0)
-					{
-						// Perfect match!
-						// Every byte we read stays in the read buffer,
-						// and the last byte we read was the last byte of the term.
-						
-						currentRead->bytesDone += bytesRead;
-						totalBytesReadForCurrentRead += bytesRead;
-						done = YES;
-					}
-					else if (overflow > 0)
-					{
-						// The term was found within the data that we read,
-						// and there are extra bytes that extend past the end of the term.
-						// We need to move these excess bytes out of the read packet and into the prebuffer.
-						
-						NSInteger underflow = bytesRead - overflow;
-						
-						// Copy excess data into preBuffer
-						
-						LogVerbose(@"copying %ld overflow bytes into preBuffer", (long)overflow);
-						[preBuffer ensureCapacityForWrite:overflow];
-						
-						uint8_t *overflowBuffer = buffer + underflow;
-						memcpy([preBuffer writeBuffer], overflowBuffer, overflow);
-						
-						[preBuffer didWrite:overflow];
-						LogVerbose(@"preBuffer.length = %zu", [preBuffer availableBytes]);
-						
-						// Note: The completeCurrentRead method will trim the buffer for us.
-						
-						currentRead->bytesDone += underflow;
-						totalBytesReadForCurrentRead += underflow;
-						done = YES;
-					}
-					else
-					{
-						// The term was not found within the data that we read.
-						
-						currentRead->bytesDone += bytesRead;
-						totalBytesReadForCurrentRead += bytesRead;
-						done = NO;
-					}
-				}
-				
-				if (!done && currentRead->maxLength > 0)
-				{
-					// We're not done and there's a set maxLength.
-					// Have we reached that maxLength yet?
-					
-					if (currentRead->bytesDone >= currentRead->maxLength)
-					{
-						error = [self readMaxedOutError];
-					}
-				}
+				packet->highPriority = YES;
+				[priorityWriteQueue addObject:packet];
 			}
 			else
 			{
-				// Read type #1 - read all available data
-				
-				if (readIntoPreBuffer)
-				{
-					// We just read a chunk of data into the preBuffer
-					
-					[preBuffer didWrite:bytesRead];
-					
-					// Now copy the data into the read packet.
-					// 
-					// Recall that we didn't read directly into the packet's buffer to avoid
-					// over-allocating memory since we had no clue how much data was available to be read.
-					// 
-					// Ensure there's room on the read packet's buffer
-					
-					[currentRead ensureCapacityForAdditionalDataOfLength:bytesRead];
-					
-					// Copy bytes from prebuffer into read buffer
-					
-					uint8_t *readBuf = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset
-					                                                                 + currentRead->bytesDone;
-					
-					memcpy(readBuf, [preBuffer readBuffer], bytesRead);
-					
-					// Remove the copied bytes from the prebuffer
-					[preBuffer didRead:bytesRead];
-					
-					// Update totals
-					currentRead->bytesDone += bytesRead;
-					totalBytesReadForCurrentRead += bytesRead;
-				}
-				else
-				{
-					currentRead->bytesDone += bytesRead;
-					totalBytesReadForCurrentRead += bytesRead;
-				}
-				
-				done = YES;
+				[writeQueue addObject:packet];
 			}
 			
-		} // if (bytesRead > 0)
-		
-	} // if (!done && !error && !socketEOF && hasBytesAvailable)
+			[self didQueueWriteBytes:[packet length]];
+			[self maybeDequeueWrite];
+		}
+	}});
+}
+
++ (void)writeData:(NSData *)data
+        toSockets:(NSArray *)sockets
+      withTimeout:(NSTimeInterval)timeout
+              tag:(long)tag
+  completionQueue:(dispatch_queue_t)completionQueue
+completionHandler:(void (^)(NSUInteger writtenCount, NSUInteger failedCount))completionHandler
+{
+	if ([data length] == 0) return;
 	
+	// Every socket writes the same immutable buffer.
+	// (If the given data is mutable, this is the one and only copy.)
+	NSData *sharedData = [data copy];
 	
-	if (!done && currentRead->readLength == 0 && currentRead->term == nil)
+	if ([sockets count] == 0)
 	{
-		// Read type #1 - read all available data
-		// 
-		// We might arrive here if we read data from the prebuffer but not from the socket.
+		// Nothing to wait for
 		
-		done = (totalBytesReadForCurrentRead > 0);
+		if (completionHandler)
+		{
+			dispatch_async(completionQueue ? completionQueue : dispatch_get_main_queue(), ^{ @autoreleasepool {
+				
+				completionHandler(0, 0);
+			}});
+		}
+		return;
 	}
 	
-	// Check to see if we're done, or if we've made progress
+	GCDAsyncSocketBroadcast *broadcast = [[GCDAsyncSocketBroadcast alloc] initWithCount:[sockets count]
+	                                                                    completionQueue:completionQueue
+	                                                                  completionHandler:completionHandler];
 	
-	if (done)
+	// Group the sockets by socketQueue, so sockets sharing a queue are all handled by a single block
+	
+	NSMutableDictionary *groups = [NSMutableDictionary dictionary];
+	
+	for (GCDAsyncSocket *sock in sockets)
 	{
-		[self completeCurrentRead];
+		NSNumber *key = @((uintptr_t)sock->socketQueue);
+		NSMutableArray *group = [groups objectForKey:key];
 		
-		if (!error && (!socketEOF || [preBuffer availableBytes] > 0))
+		if (group == nil)
 		{
-			[self maybeDequeueRead];
+			group = [NSMutableArray array];
+			[groups setObject:group forKey:key];
 		}
+		
+		[group addObject:sock];
 	}
-	else if (totalBytesReadForCurrentRead > 0)
+	
+	for (NSArray *group in [groups objectEnumerator])
 	{
-		// We're not done read type #2 or #3 yet, but we have read in some bytes
-
-		__strong id theDelegate = delegate;
+		GCDAsyncSocket *firstSocket = [group objectAtIndex:0];
 		
-		if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didReadPartialDataOfLength:tag:)])
-		{
-			long theReadTag = currentRead->tag;
+		dispatch_async(firstSocket->socketQueue, ^{ @autoreleasepool {
 			
-			dispatch_async(delegateQueue, ^{ @autoreleasepool {
-				
-				[theDelegate socket:self didReadPartialDataOfLength:totalBytesReadForCurrentRead tag:theReadTag];
-			}});
-		}
+			for (GCDAsyncSocket *sock in group)
+			{
+				[sock queueBroadcastWriteOfData:sharedData withTimeout:timeout tag:tag broadcast:broadcast];
+			}
+		}});
 	}
+}
+
+- (void)queueBroadcastWriteOfData:(NSData *)data
+                      withTimeout:(NSTimeInterval)timeout
+                              tag:(long)tag
+                        broadcast:(GCDAsyncSocketBroadcast *)broadcast
+{
+	LogTrace();
+	NSAssert(dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey), @"Must be dispatched on socketQueue");
 	
-	// Check for errors
-	
-	if (error)
+	if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
 	{
-		[self closeWithError:error];
+		GCDAsyncWritePacket *packet = [self writePacketWithData:data timeout:timeout tag:tag];
+		packet->broadcast = broadcast;
+		
+		[writeQueue addObject:packet];
+		[self didQueueWriteBytes:[packet length]];
+		[self maybeDequeueWrite];
 	}
-	else if (socketEOF)
+	else
 	{
-		[self doReadEOF];
+		[broadcast completeWithSuccess:NO];
 	}
-	else if (waiting)
+}
+
+- (void)writeDataSegments:(NSArray *)segments withTimeout:(NSTimeInterval)timeout tag:(long)tag
+{
+	// Empty segments would only waste an iovec, so they're dropped here
+	
+	NSMutableArray *theSegments = [[NSMutableArray alloc] initWithCapacity:[segments count]];
+	NSUInteger length = 0;
+	
+	for (NSData *segment in segments)
 	{
-		if (![self usingCFStreamForTLS])
+		NSUInteger segmentLength = [segment length];
+		
+		if (segmentLength > (NSUIntegerMax - length))
 		{
-			// Monitor the socket for readability (if we're not already doing so)
-			[self resumeReadSource];
+			LogWarn(@"Cannot write: total length of segments overflows");
+			return;
+		}
+		
+		if (segmentLength > 0)
+		{
+			[theSegments addObject:segment]; // Retain not copy. For performance as documented in header file.
+			length += segmentLength;
 		}
 	}
 	
-	// Do not add any code here without first adding return statements in the error cases above.
-}
-
-- (void)doReadEOF
-{
-	LogTrace();
+	if (length == 0) return;
 	
-	// This method may be called more than once.
-	// If the EOF is read while there is still data in the preBuffer,
-	// then this method may be called continually after invocations of doReadData to see if it's time to disconnect.
+	GCDAsyncSegmentedWritePacket *packet = [[GCDAsyncSegmentedWritePacket alloc] initWithSegments:theSegments
+	                                                                                       length:length
+	                                                                                      timeout:timeout
+	                                                                                          tag:tag];
 	
-	flags |= kSocketHasReadEOF;
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		{
+			[writeQueue addObject:packet];
+			[self didQueueWriteBytes:[packet length]];
+			[self maybeDequeueWrite];
+		}
+	}});
 	
-	if (flags & kSocketSecure)
+	// Do not rely on the block being run in order to release the packet,
+	// as the queue might get released without the block completing.
+}
+
+- (BOOL)writeFileAtPath:(NSString *)path
+                 offset:(unsigned long long)offset
+                 length:(NSUInteger)length
+            withTimeout:(NSTimeInterval)timeout
+                    tag:(long)tag
+                  error:(NSError **)errPtr
+{
+	int fd = open([path fileSystemRepresentation], O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
 	{
-		// If the SSL layer has any buffered data, flush it into the preBuffer now.
+		if (errPtr)
+			*errPtr = [self errnoErrorWithReason:@"Error in open() function"];
 		
-		[self flushSSLBuffers];
+		return NO;
 	}
 	
-	BOOL shouldDisconnect = NO;
-	NSError *error = nil;
-	
-	if ((flags & kStartingReadTLS) || (flags & kStartingWriteTLS))
+	struct stat st;
+	if (fstat(fd, &st) < 0)
 	{
-		// We received an EOF during or prior to startTLS.
-		// The SSL/TLS handshake is now impossible, so this is an unrecoverable situation.
-		
-		shouldDisconnect = YES;
+		if (errPtr)
+			*errPtr = [self errnoErrorWithReason:@"Error in fstat() function"];
 		
-		if ([self usingSecureTransportForTLS])
-		{
-			error = [self sslError:errSSLClosedAbort];
-		}
+		close(fd);
+		return NO;
 	}
-	else if (flags & kReadStreamClosed)
+	
+	if (!S_ISREG(st.st_mode))
 	{
-		// The preBuffer has already been drained.
-		// The config allows half-duplex connections.
-		// We've previously checked the socket, and it appeared writeable.
-		// So we marked the read stream as closed and notified the delegate.
-		// 
-		// As per the half-duplex contract, the socket will be closed when a write fails,
-		// or when the socket is manually closed.
+		if (errPtr)
+			*errPtr = [self badParamError:@"Not a regular file."];
 		
-		shouldDisconnect = NO;
+		close(fd);
+		return NO;
 	}
-	else if ([preBuffer availableBytes] > 0)
+	
+	unsigned long long fileSize = (unsigned long long)st.st_size;
+	
+	if (offset > fileSize)
 	{
-		LogVerbose(@"Socket reached EOF, but there is still data available in prebuffer");
-		
-		// Although we won't be able to read any more data from the socket,
-		// there is existing data that has been prebuffered that we can read.
+		if (errPtr)
+			*errPtr = [self badParamError:@"Offset is beyond the end of the file."];
 		
-		shouldDisconnect = NO;
+		close(fd);
+		return NO;
 	}
-	else if (config & kAllowHalfDuplexConnection)
+	if (length == 0)
 	{
-		// We just received an EOF (end of file) from the socket's read stream.
-		// This means the remote end of the socket (the peer we're connected to)
-		// has explicitly stated that it will not be sending us any more data.
-		// 
-		// Query the socket to see if it is still writeable. (Perhaps the peer will continue reading data from us)
-		
-		int socketFD = (socket4FD == SOCKET_NULL) ? socket6FD : socket4FD;
+		length = (NSUInteger)MIN((fileSize - offset), NSUIntegerMax);
+	}
+	if ((length == 0) || (length > (fileSize - offset)))
+	{
+		if (errPtr)
+			*errPtr = [self badParamError:@"Range is empty, or extends beyond the end of the file."];
 		
-		struct pollfd pfd[1];
-		pfd[0].fd = socketFD;
-		pfd[0].events = POLLOUT;
-		pfd[0].revents = 0;
+		close(fd);
+		return NO;
+	}
+	
+	// The packet owns the file descriptor from here on, and closes it when it's deallocated
+	
+	GCDAsyncFileWritePacket *packet = [[GCDAsyncFileWritePacket alloc] initWithFileDescriptor:fd
+	                                                                                   offset:(off_t)offset
+	                                                                                   length:length
+	                                                                                  timeout:timeout
+	                                                                                      tag:tag];
+	
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
 		
-		poll(pfd, 1, 0);
+		LogTrace();
 		
-		if (pfd[0].revents & POLLOUT)
-		{
-			// Socket appears to still be writeable
-			
-			shouldDisconnect = NO;
-			flags |= kReadStreamClosed;
-			
-			// Notify the delegate that we're going half-duplex
-			
-			__strong id theDelegate = delegate;
-
-			if (delegateQueue && [theDelegate respondsToSelector:@selector(socketDidCloseReadStream:)])
-			{
-				dispatch_async(delegateQueue, ^{ @autoreleasepool {
-					
-					[theDelegate socketDidCloseReadStream:self];
-				}});
-			}
-		}
-		else
+		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
 		{
-			shouldDisconnect = YES;
+			[writeQueue addObject:packet];
+			[self didQueueWriteBytes:[packet length]];
+			[self maybeDequeueWrite];
 		}
-	}
-	else
-	{
-		shouldDisconnect = YES;
-	}
+	}});
 	
+	// Do not rely on the block being run in order to release the packet,
+	// as the queue might get released without the block completing.
 	
-	if (shouldDisconnect)
+	return YES;
+}
+
+- (NSUInteger)queuedWriteBytes
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		if (error == nil)
-		{
-			if ([self usingSecureTransportForTLS])
-			{
-				if (sslErrCode != noErr && sslErrCode != errSSLClosedGraceful)
-				{
-					error = [self sslError:sslErrCode];
-				}
-				else
-				{
-					error = [self connectionClosedError];
-				}
-			}
-			else
-			{
-				error = [self connectionClosedError];
-			}
-		}
-		[self closeWithError:error];
+		return queuedWriteBytes;
 	}
 	else
 	{
-		if (![self usingCFStreamForTLS])
-		{
-			// Suspend the read source (if needed)
-			
-			[self suspendReadSource];
-		}
+		__block NSUInteger result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = queuedWriteBytes;
+		});
+		
+		return result;
 	}
 }
 
-- (void)completeCurrentRead
+- (NSUInteger)writeQueueHighWatermark
 {
-	LogTrace();
-	
-	NSAssert(currentRead, @"Trying to complete current read when there is no current read.");
-	
-	
-	NSData *result = nil;
-	
-	if (currentRead->bufferOwner)
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		// We created the buffer on behalf of the user.
-		// Trim our buffer to be the proper size.
-		[currentRead->buffer setLength:currentRead->bytesDone];
-		
-		result = currentRead->buffer;
+		return writeQueueHighWatermark;
 	}
 	else
 	{
-		// We did NOT create the buffer.
-		// The buffer is owned by the caller.
-		// Only trim the buffer if we had to increase its size.
+		__block NSUInteger result;
 		
-		if ([currentRead->buffer length] > currentRead->originalBufferLength)
+		dispatch_sync(socketQueue, ^{
+			result = writeQueueHighWatermark;
+		});
+		
+		return result;
+	}
+}
+
+- (void)setWriteQueueHighWatermark:(NSUInteger)watermark
+{
+	dispatch_block_t block = ^{
+		
+		writeQueueHighWatermark = watermark;
+		
+		if ((watermark > 0) && (writeQueueLowWatermark > watermark))
 		{
-			NSUInteger readSize = currentRead->startOffset + currentRead->bytesDone;
-			NSUInteger origSize = currentRead->originalBufferLength;
-			
-			NSUInteger buffSize = MAX(readSize, origSize);
+			LogWarn(@"Lowering writeQueueLowWatermark (%lu) to the new writeQueueHighWatermark (%lu)",
+			        (unsigned long)writeQueueLowWatermark, (unsigned long)watermark);
 			
-			[currentRead->buffer setLength:buffSize];
+			writeQueueLowWatermark = watermark;
 		}
 		
-		uint8_t *buffer = (uint8_t *)[currentRead->buffer mutableBytes] + currentRead->startOffset;
-		
-		result = [NSData dataWithBytesNoCopy:buffer length:currentRead->bytesDone freeWhenDone:NO];
-	}
+		[self checkWriteQueueWatermarks];
+	};
 	
-	__strong id theDelegate = delegate;
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
 
-	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didReadData:withTag:)])
+- (NSUInteger)writeQueueLowWatermark
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return writeQueueLowWatermark;
+	}
+	else
 	{
-		GCDAsyncReadPacket *theRead = currentRead; // Ensure currentRead retained since result may not own buffer
+		__block NSUInteger result;
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
-			
-			[theDelegate socket:self didReadData:result withTag:theRead->tag];
-		}});
+		dispatch_sync(socketQueue, ^{
+			result = writeQueueLowWatermark;
+		});
+		
+		return result;
 	}
-	
-	[self endCurrentRead];
 }
 
-- (void)endCurrentRead
+- (void)setWriteQueueLowWatermark:(NSUInteger)watermark
 {
-	if (readTimer)
-	{
-		dispatch_source_cancel(readTimer);
-		readTimer = NULL;
-	}
+	dispatch_block_t block = ^{
+		
+		if ((writeQueueHighWatermark > 0) && (watermark > writeQueueHighWatermark))
+		{
+			LogWarn(@"writeQueueLowWatermark (%lu) exceeds writeQueueHighWatermark (%lu), using the latter",
+			        (unsigned long)watermark, (unsigned long)writeQueueHighWatermark);
+			
+			writeQueueLowWatermark = writeQueueHighWatermark;
+		}
+		else
+		{
+			writeQueueLowWatermark = watermark;
+		}
+		
+		[self checkWriteQueueWatermarks];
+	};
 	
-	currentRead = nil;
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
 }
 
-- (void)setupReadTimerWithTimeout:(NSTimeInterval)timeout
+- (NSUInteger)writeSplitLength
 {
-	if (timeout >= 0.0)
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
-		readTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, socketQueue);
-		
-		__weak GCDAsyncSocket *weakSelf = self;
-		
-		dispatch_source_set_event_handler(readTimer, ^{ @autoreleasepool {
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
-			
-			__strong GCDAsyncSocket *strongSelf = weakSelf;
-			if (strongSelf == nil) return_from_block;
-			
-			[strongSelf doReadTimeout];
-			
-		#pragma clang diagnostic pop
-		}});
+		return writeSplitLength;
+	}
+	else
+	{
+		__block NSUInteger result;
 		
-		#if !OS_OBJECT_USE_OBJC
-		dispatch_source_t theReadTimer = readTimer;
-		dispatch_source_set_cancel_handler(readTimer, ^{
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
-			
-			LogVerbose(@"dispatch_release(readTimer)");
-			dispatch_release(theReadTimer);
-			
-		#pragma clang diagnostic pop
+		dispatch_sync(socketQueue, ^{
+			result = writeSplitLength;
 		});
-		#endif
-		
-		dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
 		
-		dispatch_source_set_timer(readTimer, tt, DISPATCH_TIME_FOREVER, 0);
-		dispatch_resume(readTimer);
+		return result;
 	}
 }
 
-- (void)doReadTimeout
+- (void)setWriteSplitLength:(NSUInteger)length
 {
-	// This is a little bit tricky.
-	// Ideally we'd like to synchronously query the delegate about a timeout extension.
-	// But if we do so synchronously we risk a possible deadlock.
-	// So instead we have to do so asynchronously, and callback to ourselves from within the delegate block.
+	dispatch_block_t block = ^{
+		
+		writeSplitLength = length;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+/**
+ * Accounts for newly queued write data.
+**/
+- (void)didQueueWriteBytes:(NSUInteger)length
+{
+	queuedWriteBytes += length;
+	
+	[self checkWriteQueueWatermarks];
+}
+
+/**
+ * Accounts for write data that was handed to the socket.
+**/
+- (void)didSendWriteBytes:(NSUInteger)length
+{
+	queuedWriteBytes -= MIN(length, queuedWriteBytes);
 	
-	flags |= kReadsPaused;
+	[self checkWriteQueueWatermarks];
+}
+
+/**
+ * Notifies the delegate when the queued write data crosses the high or low watermark.
+ * 
+ * The two notifications alternate. After exceeding the high watermark,
+ * the delegate hears nothing more until the queue drains to (or below) the low watermark, and vice versa.
+ * Disabling the watermarks while above the high watermark counts as draining,
+ * so a producer that paused on the high watermark isn't left waiting.
+**/
+- (void)checkWriteQueueWatermarks
+{
+	if ((writeQueueHighWatermark == 0) && !(flags & kWriteQueueAboveHighWatermark))
+	{
+		// Watermarks are disabled
+		return;
+	}
 	
 	__strong id theDelegate = delegate;
-
-	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:shouldTimeoutReadWithTag:elapsed:bytesDone:)])
+	
+	if (!(flags & kWriteQueueAboveHighWatermark))
 	{
-		GCDAsyncReadPacket *theRead = currentRead;
-		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
-			
-			NSTimeInterval timeoutExtension = 0.0;
-			
-			timeoutExtension = [theDelegate socket:self shouldTimeoutReadWithTag:theRead->tag
-			                                                             elapsed:theRead->timeout
-			                                                           bytesDone:theRead->bytesDone];
+		if (queuedWriteBytes > writeQueueHighWatermark)
+		{
+			flags |= kWriteQueueAboveHighWatermark;
 			
-			dispatch_async(socketQueue, ^{ @autoreleasepool {
+			if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:writeQueueDidExceedHighWatermark:)])
+			{
+				NSUInteger theQueuedWriteBytes = queuedWriteBytes;
 				
-				[self doReadTimeoutWithExtension:timeoutExtension];
-			}});
-		}});
+				[self notifyDelegateWithBlock:^{ @autoreleasepool {
+					
+					[theDelegate socket:self writeQueueDidExceedHighWatermark:theQueuedWriteBytes];
+				}}];
+			}
+		}
 	}
 	else
 	{
-		[self doReadTimeoutWithExtension:0.0];
-	}
-}
-
-- (void)doReadTimeoutWithExtension:(NSTimeInterval)timeoutExtension
-{
-	if (currentRead)
-	{
-		if (timeoutExtension > 0.0)
-		{
-			currentRead->timeout += timeoutExtension;
-			
-			// Reschedule the timer
-			dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeoutExtension * NSEC_PER_SEC));
-			dispatch_source_set_timer(readTimer, tt, DISPATCH_TIME_FOREVER, 0);
-			
-			// Unpause reads, and continue
-			flags &= ~kReadsPaused;
-			[self doReadData];
-		}
-		else
+		if ((writeQueueHighWatermark == 0) || (queuedWriteBytes <= writeQueueLowWatermark))
 		{
-			LogVerbose(@"ReadTimeout");
+			flags &= ~kWriteQueueAboveHighWatermark;
 			
-			[self closeWithError:[self readTimeoutError]];
+			if (delegateQueue && [theDelegate respondsToSelector:@selector(socketWriteQueueDidDrainBelowLowWatermark:)])
+			{
+				[self notifyDelegateWithBlock:^{ @autoreleasepool {
+					
+					[theDelegate socketWriteQueueDidDrainBelowLowWatermark:self];
+				}}];
+			}
 		}
 	}
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Writing
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+- (void)beginWriteBatch
+{
+	dispatch_async(socketQueue, ^{ @autoreleasepool {
+		
+		LogTrace();
+		
+		writeBatchDepth++;
+	}});
+}
 
-- (void)writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag
+- (void)endWriteBatch
 {
-	if ([data length] == 0) return;
-	
-	GCDAsyncWritePacket *packet = [[GCDAsyncWritePacket alloc] initWithData:data timeout:timeout tag:tag];
-	
 	dispatch_async(socketQueue, ^{ @autoreleasepool {
 		
 		LogTrace();
 		
-		if ((flags & kSocketStarted) && !(flags & kForbidReadsWrites))
+		if (writeBatchDepth == 0)
 		{
-			[writeQueue addObject:packet];
+			LogWarn(@"endWriteBatch called without matching beginWriteBatch");
+			return_from_block;
+		}
+		
+		writeBatchDepth--;
+		
+		if (writeBatchDepth == 0)
+		{
+			// Everything written during the batch goes out together (see doWriteData)
 			[self maybeDequeueWrite];
 		}
 	}});
-	
-	// Do not rely on the block being run in order to release the packet,
-	// as the queue might get released without the block completing.
 }
 
 - (float)progressOfWriteReturningTag:(long *)tagPtr bytesDone:(NSUInteger *)donePtr total:(NSUInteger *)totalPtr
@@ -5179,7 +9783,7 @@ enum GCDAsyncSocketConfig
 		else
 		{
 			NSUInteger done = currentWrite->bytesDone;
-			NSUInteger total = [currentWrite->buffer length];
+			NSUInteger total = [currentWrite length];
 			
 			if (tagPtr != NULL)   *tagPtr = currentWrite->tag;
 			if (donePtr != NULL)  *donePtr = done;
@@ -5197,6 +9801,83 @@ enum GCDAsyncSocketConfig
 	return result;
 }
 
+/**
+ * Returns a packet for a new write, recycling a completed one if possible.
+**/
+- (GCDAsyncWritePacket *)writePacketWithData:(NSData *)data timeout:(NSTimeInterval)timeout tag:(long)tag
+{
+	GCDAsyncWritePacket *packet = [freeWritePackets removeFirstObject];
+	
+	if (packet)
+	{
+		[packet setupWithData:data timeout:timeout tag:tag];
+	}
+	else
+	{
+		packet = [[GCDAsyncWritePacket alloc] initWithData:data timeout:timeout tag:tag];
+		
+		packetAllocationCount++;
+	}
+	
+	return packet;
+}
+
+/**
+ * Keeps a completed packet around for reuse by a future write.
+ * File writes aren't recycled, as they own a file descriptor (and possibly a mapping).
+**/
+- (void)recycleWritePacket:(GCDAsyncWritePacket *)packet
+{
+	if (([packet class] == [GCDAsyncWritePacket class]) && ([freeWritePackets count] < GCDAsyncSocketPacketPoolLimit))
+	{
+		[packet clear];
+		[freeWritePackets addObject:packet];
+	}
+}
+
+/**
+ * Returns the queue the next write comes from.
+ * High priority writes go ahead of any normal priority writes that haven't started yet.
+**/
+- (GCDAsyncSocketPacketQueue *)nextWriteQueue
+{
+	return ([priorityWriteQueue count] > 0) ? priorityWriteQueue : writeQueue;
+}
+
+/**
+ * Returns how many bytes of the current write may be written before it has to make way
+ * for the high priority writes waiting behind it (see writeSplitLength).
+**/
+- (NSUInteger)bytesUntilWriteSplit
+{
+	if ((writeSplitLength == 0) || currentWrite->highPriority || ([priorityWriteQueue count] == 0))
+	{
+		return NSUIntegerMax;
+	}
+	
+	return writeSplitLength - (currentWrite->bytesDone % writeSplitLength);
+}
+
+/**
+ * Puts the current (normal priority) write back at the head of the write queue,
+ * so the high priority writes waiting behind it go out first.
+ * The write picks up where it left off once they're done.
+**/
+- (void)yieldCurrentWrite
+{
+	LogVerbose(@"Yielding current write to high priority writes");
+	
+	GCDAsyncWritePacket *packet = currentWrite;
+	
+	[self endCurrentWrite];
+	[writeQueue addObjectToFront:packet];
+	
+	dispatch_async(socketQueue, ^{ @autoreleasepool{
+		
+		[self maybeDequeueWrite];
+	}});
+}
+
 /**
  * Conditionally starts a new write.
  * 
@@ -5216,11 +9897,20 @@ enum GCDAsyncSocketConfig
 	// If we're not currently processing a write AND we have an available write stream
 	if ((currentWrite == nil) && (flags & kConnected))
 	{
-		if ([writeQueue count] > 0)
+		if ((writeBatchDepth > 0) && !(flags & kDisconnectAfterWrites))
 		{
-			// Dequeue the next object in the write queue
-			currentWrite = [writeQueue objectAtIndex:0];
-			[writeQueue removeObjectAtIndex:0];
+			// Hold on to the writes until the batch ends.
+			// They'll then be written with as few system calls (and segments) as possible.
+			// 
+			// No more writes can be queued once we're set to disconnect after writing,
+			// so there's nothing left to batch, and the batch would only keep the socket from closing.
+			
+			LogVerbose(@"Holding writes until end of write batch");
+		}
+		else if (([priorityWriteQueue count] > 0) || ([writeQueue count] > 0))
+		{
+			// Dequeue the next object in the write queue (high priority writes first)
+			currentWrite = [[self nextWriteQueue] removeFirstObject];
 			
 			
 			if ([currentWrite isKindOfClass:[GCDAsyncSpecialPacket class]])
@@ -5344,6 +10034,46 @@ enum GCDAsyncSocketConfig
 	BOOL waiting = NO;
 	NSError *error = nil;
 	size_t bytesWritten = 0;
+	size_t coalescedBytesWritten = 0; // Bytes written for the packets queued up behind the current write
+	
+	// If high priority writes are waiting, stop at the next split point (if any) to let them through
+	NSUInteger bytesUntilSplit = [self bytesUntilWriteSplit];
+	
+	GCDAsyncFileWritePacket *fileWrite = nil;
+	
+	if ([currentWrite isKindOfClass:[GCDAsyncFileWritePacket class]])
+	{
+		fileWrite = (GCDAsyncFileWritePacket *)currentWrite;
+		
+		if ((flags & kSocketSecure) && (fileWrite->buffer == nil))
+		{
+			// The file has to go through the SSL/TLS layer, so write it from a memory mapping instead.
+			// The mapping mustn't extend past the end of the file, which may have shrunk since the write was queued.
+			
+			if (![fileWrite fileCoversRange])
+			{
+				[self closeWithError:[self otherError:@"File ended before the entire write was sent"]];
+				return;
+			}
+			
+			if (![fileWrite mapFile])
+			{
+				[self closeWithError:[self errnoErrorWithReason:@"Error in mmap() function"]];
+				return;
+			}
+		}
+	}
+	else if ((flags & kSocketSecure) && [currentWrite isKindOfClass:[GCDAsyncSegmentedWritePacket class]])
+	{
+		GCDAsyncSegmentedWritePacket *segmentedWrite = (GCDAsyncSegmentedWritePacket *)currentWrite;
+		
+		if (segmentedWrite->buffer == nil)
+		{
+			// The SSL/TLS layer only takes a single buffer at a time
+			
+			[segmentedWrite flatten];
+		}
+	}
 	
 	if (flags & kSocketSecure)
 	{
@@ -5357,7 +10087,7 @@ enum GCDAsyncSocketConfig
 			
 			const uint8_t *buffer = (const uint8_t *)[currentWrite->buffer bytes] + currentWrite->bytesDone;
 			
-			NSUInteger bytesToWrite = [currentWrite->buffer length] - currentWrite->bytesDone;
+			NSUInteger bytesToWrite = MIN([currentWrite->buffer length] - currentWrite->bytesDone, bytesUntilSplit);
 			
 			if (bytesToWrite > SIZE_MAX) // NSUInteger may be bigger than size_t (write param 3)
 			{
@@ -5448,6 +10178,11 @@ enum GCDAsyncSocketConfig
 						// We've written all data for the current write.
 						hasNewDataToWrite = NO;
 					}
+					else if (bytesWritten == bytesUntilSplit)
+					{
+						// We've reached a split point, and high priority writes are waiting.
+						hasNewDataToWrite = NO;
+					}
 				}
 				else
 				{
@@ -5473,6 +10208,11 @@ enum GCDAsyncSocketConfig
 				
 				NSUInteger bytesToWrite = [currentWrite->buffer length] - currentWrite->bytesDone - bytesWritten;
 				
+				if ((bytesWritten < bytesUntilSplit) && (bytesToWrite > (bytesUntilSplit - bytesWritten)))
+				{
+					bytesToWrite = bytesUntilSplit - bytesWritten;
+				}
+				
 				if (bytesToWrite > SIZE_MAX) // NSUInteger may be bigger than size_t (write param 3)
 				{
 					bytesToWrite = SIZE_MAX;
@@ -5517,25 +10257,109 @@ enum GCDAsyncSocketConfig
 			} // if (hasNewDataToWrite)
 		}
 	}
+	else if (fileWrite)
+	{
+		// 
+		// Writing a file directly over raw socket
+		// 
+		// The kernel sends the file straight from the file system cache.
+		
+		int socketFD = (socket4FD == SOCKET_NULL) ? socket6FD : socket4FD;
+		
+		off_t offset = fileWrite->fileOffset + (off_t)fileWrite->bytesDone;
+		off_t len = (off_t)MIN(fileWrite->fileLength - fileWrite->bytesDone, bytesUntilSplit);
+		
+		// On return, len is the number of bytes sent, even if sendfile() fails.
+		
+		int result = sendfile(fileWrite->fileFD, socketFD, offset, &len, NULL, 0);
+		LogVerbose(@"sendfile to socket = %lld", (long long)len);
+		
+		if (result < 0)
+		{
+			if (errno == EWOULDBLOCK)
+			{
+				waiting = YES;
+			}
+			else if (errno != EINTR)
+			{
+				error = [self errnoErrorWithReason:@"Error in sendfile() function"];
+			}
+		}
+		else if (len == 0)
+		{
+			// Nothing sent, and no error. So the file is shorter than it was when the write was queued.
+			
+			error = [self otherError:@"File ended before the entire write was sent"];
+		}
+		
+		bytesWritten = (size_t)len;
+	}
 	else
 	{
 		// 
 		// Writing data directly over raw socket
 		// 
+		// The current write is coalesced with the writes queued up behind it (up to the next startTLS),
+		// so many small writes go out with a single writev() call.
+		// If high priority writes are waiting, those are the ones coalesced.
 		
 		int socketFD = (socket4FD == SOCKET_NULL) ? socket6FD : socket4FD;
 		
-		const uint8_t *buffer = (const uint8_t *)[currentWrite->buffer bytes] + currentWrite->bytesDone;
+		// A segmented write hands all of its (remaining) segments to writev(), so they're never concatenated.
 		
-		NSUInteger bytesToWrite = [currentWrite->buffer length] - currentWrite->bytesDone;
+		NSUInteger bytesRemaining = [currentWrite length] - currentWrite->bytesDone;
 		
-		if (bytesToWrite > SIZE_MAX) // NSUInteger may be bigger than size_t (write param 3)
+		// The sum of the iov_len values must fit in an ssize_t (writev)
+		NSUInteger maxBytesToWrite = MIN(bytesUntilSplit, (NSUInteger)SSIZE_MAX);
+		
+		struct iovec iov[IOV_MAX];
+		int iovcnt = 0;
+		
+		NSUInteger bytesToWrite = [currentWrite getVectors:iov
+		                                             count:&iovcnt
+		                                          maxCount:IOV_MAX
+		                                        fromOffset:currentWrite->bytesDone
+		                                         maxLength:maxBytesToWrite];
+		
+		// Only a write that goes out in its entirety can have other writes coalesced behind it
+		BOOL canCoalesce = (bytesToWrite == bytesRemaining);
+		
+		size_t totalBytesToWrite = (size_t)bytesToWrite;
+		
+		GCDAsyncSocketPacketQueue *queue = [self nextWriteQueue];
+		NSUInteger queuedWriteCount = [queue count];
+		
+		for (NSUInteger i = 0; i < queuedWriteCount; i++)
 		{
-			bytesToWrite = SIZE_MAX;
+			GCDAsyncWritePacket *packet = [queue objectAtIndex:i];
+			
+			if (!canCoalesce || (iovcnt == IOV_MAX) || [packet isKindOfClass:[GCDAsyncSpecialPacket class]]
+			                                       || [packet isKindOfClass:[GCDAsyncFileWritePacket class]])
+			{
+				break;
+			}
+			
+			NSUInteger packetLength = [packet length];
+			
+			int packetVectorCount = 0;
+			NSUInteger packetBytes = [packet getVectors:(iov + iovcnt)
+			                                      count:&packetVectorCount
+			                                   maxCount:(IOV_MAX - iovcnt)
+			                                 fromOffset:0
+			                                  maxLength:(SSIZE_MAX - totalBytesToWrite)];
+			
+			if (packetBytes < packetLength)
+			{
+				// Only whole packets are coalesced
+				break;
+			}
+			
+			iovcnt += packetVectorCount;
+			totalBytesToWrite += packetLength;
 		}
 		
-		ssize_t result = write(socketFD, buffer, (size_t)bytesToWrite);
-		LogVerbose(@"wrote to socket = %zd", result);
+		ssize_t result = writev(socketFD, iov, iovcnt);
+		LogVerbose(@"wrote to socket = %zd (%d vectors)", result, iovcnt);
 		
 		// Check results
 		if (result < 0)
@@ -5546,9 +10370,16 @@ enum GCDAsyncSocketConfig
 			}
 			else
 			{
-				error = [self errnoErrorWithReason:@"Error in write() function"];
+				error = [self errnoErrorWithReason:@"Error in writev() function"];
 			}
 		}
+		else if ((size_t)result > bytesToWrite)
+		{
+			// We also wrote (some of) the packets queued up behind the current write
+			
+			bytesWritten = (size_t)bytesToWrite;
+			coalescedBytesWritten = (size_t)result - bytesWritten;
+		}
 		else
 		{
 			bytesWritten = result;
@@ -5578,6 +10409,11 @@ enum GCDAsyncSocketConfig
 	
 	BOOL done = NO;
 	
+	if ((bytesWritten + coalescedBytesWritten) > 0)
+	{
+		[self didSendWriteBytes:(bytesWritten + coalescedBytesWritten)];
+	}
+	
 	if (bytesWritten > 0)
 	{
 		// Update total amount read for the current write
@@ -5585,13 +10421,18 @@ enum GCDAsyncSocketConfig
 		LogVerbose(@"currentWrite->bytesDone = %lu", (unsigned long)currentWrite->bytesDone);
 		
 		// Is packet done?
-		done = (currentWrite->bytesDone == [currentWrite->buffer length]);
+		done = (currentWrite->bytesDone == [currentWrite length]);
 	}
 	
 	if (done)
 	{
 		[self completeCurrentWrite];
 		
+		if (coalescedBytesWritten > 0)
+		{
+			[self completeCoalescedWritesOfLength:coalescedBytesWritten];
+		}
+		
 		if (!error)
 		{
 			dispatch_async(socketQueue, ^{ @autoreleasepool{
@@ -5604,8 +10445,13 @@ enum GCDAsyncSocketConfig
 	{
 		// We were unable to finish writing the data,
 		// so we're waiting for another callback to notify us of available space in the lower-level output buffer.
+		// 
+		// Unless we stopped at a split point to let high priority writes through,
+		// in which case the current write makes way for them.
+		
+		BOOL yield = !error && (bytesWritten > 0) && (bytesWritten == bytesUntilSplit) && (sslWriteCachedLength == 0);
 		
-		if (!waiting && !error)
+		if (!waiting && !error && !yield)
 		{
 			// This would be the case if our write was able to accept some data, but not all of it.
 			
@@ -5615,34 +10461,93 @@ enum GCDAsyncSocketConfig
 			{
 				[self resumeWriteSource];
 			}
-		}
-		
-		if (bytesWritten > 0)
-		{
-			// We're not done with the entire write, but we have written some bytes
+		}
+		
+		if (bytesWritten > 0)
+		{
+			// We're not done with the entire write, but we have written some bytes
+			
+			__strong id theDelegate = delegate;
+
+			if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didWritePartialDataOfLength:tag:)])
+			{
+				long theWriteTag = currentWrite->tag;
+				
+				[self notifyDelegateWithBlock:^{ @autoreleasepool {
+					
+					[theDelegate socket:self didWritePartialDataOfLength:bytesWritten tag:theWriteTag];
+				}}];
+			}
+		}
+		
+		if (yield)
+		{
+			[self yieldCurrentWrite];
+		}
+	}
+	
+	// Check for errors
+	
+	if (error)
+	{
+		[self closeWithError:error];
+	}
+	
+	// Do not add any code here without first adding a return statement in the error case above.
+}
+
+/**
+ * Called after the current write was completed by a writev() call that also wrote (some of) the packets
+ * queued up behind it. The given length is the number of bytes written for those packets.
+ * 
+ * Each packet that was written in full is completed, just as if it had been written on its own.
+ * If the last of them was only partially written, it becomes the current write,
+ * and we wait for the socket to accept more data.
+**/
+- (void)completeCoalescedWritesOfLength:(size_t)length
+{
+	while (length > 0)
+	{
+		currentWrite = [[self nextWriteQueue] removeFirstObject];
+		
+		NSUInteger packetLength = [currentWrite length];
+		size_t bytesWritten = (size_t)MIN(length, packetLength);
+		
+		currentWrite->bytesDone = bytesWritten;
+		length -= bytesWritten;
+		
+		if (currentWrite->bytesDone == packetLength)
+		{
+			[self completeCurrentWrite];
+		}
+		else
+		{
+			LogVerbose(@"currentWrite->bytesDone = %lu", (unsigned long)currentWrite->bytesDone);
+			
+			[self setupWriteTimerWithTimeout:currentWrite->timeout];
+			
+			// The socket didn't accept all the data, so wait for it to notify us of available space.
+			
+			flags &= ~kSocketCanAcceptBytes;
+			
+			if (![self usingCFStreamForTLS])
+			{
+				[self resumeWriteSource];
+			}
 			
 			__strong id theDelegate = delegate;
-
+			
 			if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didWritePartialDataOfLength:tag:)])
 			{
 				long theWriteTag = currentWrite->tag;
 				
-				dispatch_async(delegateQueue, ^{ @autoreleasepool {
+				[self notifyDelegateWithBlock:^{ @autoreleasepool {
 					
 					[theDelegate socket:self didWritePartialDataOfLength:bytesWritten tag:theWriteTag];
-				}});
+				}}];
 			}
 		}
 	}
-	
-	// Check for errors
-	
-	if (error)
-	{
-		[self closeWithError:[self errnoErrorWithReason:@"Error in write() function"]];
-	}
-	
-	// Do not add any code here without first adding a return statement in the error case above.
 }
 
 - (void)completeCurrentWrite
@@ -5651,29 +10556,40 @@ enum GCDAsyncSocketConfig
 	
 	NSAssert(currentWrite, @"Trying to complete current write when there is no current write.");
 	
-
 	__strong id theDelegate = delegate;
 	
-	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didWriteDataWithTag:)])
+	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didWriteDataWithTags:)])
+	{
+		// The delegate prefers to get all the writes completed during this pass on the socketQueue at once.
+		
+		if (completedWriteTags == nil)
+		{
+			completedWriteTags = [[NSMutableArray alloc] init];
+			
+			[self scheduleCompletionBatchFlush];
+		}
+		
+		[completedWriteTags addObject:@(currentWrite->tag)];
+	}
+	else if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didWriteDataWithTag:)])
 	{
 		long theWriteTag = currentWrite->tag;
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
 			
 			[theDelegate socket:self didWriteDataWithTag:theWriteTag];
-		}});
+		}}];
 	}
 	
+	[currentWrite->broadcast completeWithSuccess:YES];
+	
+	[self recycleWritePacket:currentWrite];
 	[self endCurrentWrite];
 }
 
 - (void)endCurrentWrite
 {
-	if (writeTimer)
-	{
-		dispatch_source_cancel(writeTimer);
-		writeTimer = NULL;
-	}
+	[writeTimer disarm];
 	
 	currentWrite = nil;
 }
@@ -5682,39 +10598,26 @@ enum GCDAsyncSocketConfig
 {
 	if (timeout >= 0.0)
 	{
-		writeTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, socketQueue);
-		
-		__weak GCDAsyncSocket *weakSelf = self;
-		
-		dispatch_source_set_event_handler(writeTimer, ^{ @autoreleasepool {
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
-			
-			__strong GCDAsyncSocket *strongSelf = weakSelf;
-			if (strongSelf == nil) return_from_block;
-			
-			[strongSelf doWriteTimeout];
-			
-		#pragma clang diagnostic pop
-		}});
-		
-		#if !OS_OBJECT_USE_OBJC
-		dispatch_source_t theWriteTimer = writeTimer;
-		dispatch_source_set_cancel_handler(writeTimer, ^{
-		#pragma clang diagnostic push
-		#pragma clang diagnostic warning "-Wimplicit-retain-self"
+		if ((writeTimer == nil) || (writeTimer->wheel != timingWheel))
+		{
+			[writeTimer disarm];
 			
-			LogVerbose(@"dispatch_release(writeTimer)");
-			dispatch_release(theWriteTimer);
+			__weak GCDAsyncSocket *weakSelf = self;
 			
-		#pragma clang diagnostic pop
-		});
-		#endif
-		
-		dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
+			writeTimer = [timingWheel timeoutWithQueue:socketQueue handler:^{ @autoreleasepool {
+			#pragma clang diagnostic push
+			#pragma clang diagnostic warning "-Wimplicit-retain-self"
+				
+				__strong GCDAsyncSocket *strongSelf = weakSelf;
+				if (strongSelf == nil) return_from_block;
+				
+				[strongSelf doWriteTimeout];
+				
+			#pragma clang diagnostic pop
+			}}];
+		}
 		
-		dispatch_source_set_timer(writeTimer, tt, DISPATCH_TIME_FOREVER, 0);
-		dispatch_resume(writeTimer);
+		[writeTimer armWithInterval:timeout];
 	}
 }
 
@@ -5731,21 +10634,24 @@ enum GCDAsyncSocketConfig
 
 	if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:shouldTimeoutWriteWithTag:elapsed:bytesDone:)])
 	{
-		GCDAsyncWritePacket *theWrite = currentWrite;
+		// Packets are recycled, so don't touch the packet from the delegateQueue
+		long theTag = currentWrite->tag;
+		NSTimeInterval theElapsed = currentWrite->timeout;
+		NSUInteger theBytesDone = currentWrite->bytesDone;
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
 			
 			NSTimeInterval timeoutExtension = 0.0;
 			
-			timeoutExtension = [theDelegate socket:self shouldTimeoutWriteWithTag:theWrite->tag
-			                                                              elapsed:theWrite->timeout
-			                                                            bytesDone:theWrite->bytesDone];
+			timeoutExtension = [theDelegate socket:self shouldTimeoutWriteWithTag:theTag
+			                                                              elapsed:theElapsed
+			                                                            bytesDone:theBytesDone];
 			
 			dispatch_async(socketQueue, ^{ @autoreleasepool {
 				
 				[self doWriteTimeoutWithExtension:timeoutExtension];
 			}});
-		}});
+		}}];
 	}
 	else
 	{
@@ -5762,8 +10668,7 @@ enum GCDAsyncSocketConfig
 			currentWrite->timeout += timeoutExtension;
 			
 			// Reschedule the timer
-			dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeoutExtension * NSEC_PER_SEC));
-			dispatch_source_set_timer(writeTimer, tt, DISPATCH_TIME_FOREVER, 0);
+			[writeTimer armWithInterval:timeoutExtension];
 			
 			// Unpause writes, and continue
 			flags &= ~kWritesPaused;
@@ -5900,8 +10805,7 @@ enum GCDAsyncSocketConfig
 		
 		LogVerbose(@"%@: Copying %zu bytes from sslPreBuffer", THIS_METHOD, bytesToCopy);
 		
-		memcpy(buffer, [sslPreBuffer readBuffer], bytesToCopy);
-		[sslPreBuffer didRead:bytesToCopy];
+		[sslPreBuffer readBytes:buffer length:bytesToCopy];
 		
 		LogVerbose(@"%@: sslPreBuffer.length = %zu", THIS_METHOD, [sslPreBuffer availableBytes]);
 		
@@ -5934,11 +10838,13 @@ enum GCDAsyncSocketConfig
 			
 			LogVerbose(@"%@: Reading into sslPreBuffer...", THIS_METHOD);
 			
-			[sslPreBuffer ensureCapacityForWrite:socketFDBytesAvailable];
-			
 			readIntoPreBuffer = YES;
 			bytesToRead = (size_t)socketFDBytesAvailable;
-			buf = [sslPreBuffer writeBuffer];
+			
+			if ([sslPreBuffer ensureCapacityForWrite:socketFDBytesAvailable])
+				buf = [sslPreBuffer writeBuffer];
+			else
+				buf = NULL;
 		}
 		else
 		{
@@ -5951,8 +10857,23 @@ enum GCDAsyncSocketConfig
 			buf = (uint8_t *)buffer + totalBytesRead;
 		}
 		
-		ssize_t result = read(socketFD, buf, bytesToRead);
-		LogVerbose(@"%@: read from socket = %zd", THIS_METHOD, result);
+		ssize_t result;
+		
+		if (buf)
+		{
+			result = read(socketFD, buf, bytesToRead);
+			LogVerbose(@"%@: read from socket = %zd", THIS_METHOD, result);
+		}
+		else
+		{
+			// The sslPreBuffer couldn't allocate a segment.
+			// Fail the read, so SecureTransport reports an error and the socket is closed.
+			
+			LogVerbose(@"%@: sslPreBuffer allocation failed", THIS_METHOD);
+			
+			errno = ENOMEM;
+			result = -1;
+		}
 		
 		if (result < 0)
 		{
@@ -5989,8 +10910,7 @@ enum GCDAsyncSocketConfig
 				
 				LogVerbose(@"%@: Copying %zu bytes out of sslPreBuffer", THIS_METHOD, bytesToCopy);
 				
-				memcpy((uint8_t *)buffer + totalBytesRead, [sslPreBuffer readBuffer], bytesToCopy);
-				[sslPreBuffer didRead:bytesToCopy];
+				[sslPreBuffer readBytes:((uint8_t *)buffer + totalBytesRead) length:bytesToCopy];
 				
 				totalBytesRead += bytesToCopy;
 				totalBytesLeftToBeRead -= bytesToCopy;
@@ -6510,16 +11430,19 @@ static OSStatus SSLWriteFunction(SSLConnectionRef connection, const void *data,
 	// Any data in the preBuffer needs to be moved into the sslPreBuffer,
 	// as this data is now part of the secure read stream.
 	
-	sslPreBuffer = [[GCDAsyncSocketPreBuffer alloc] initWithCapacity:(1024 * 4)];
+	sslPreBuffer = [[GCDAsyncSocketPreBuffer alloc] init];
 	
 	size_t preBufferLength  = [preBuffer availableBytes];
 	
 	if (preBufferLength > 0)
 	{
-		[sslPreBuffer ensureCapacityForWrite:preBufferLength];
+		if (![sslPreBuffer ensureCapacityForWrite:preBufferLength])
+		{
+			[self closeWithError:[self preBufferAllocationError]];
+			return;
+		}
 		
-		memcpy([sslPreBuffer writeBuffer], [preBuffer readBuffer], preBufferLength);
-		[preBuffer didRead:preBufferLength];
+		[preBuffer readBytes:[sslPreBuffer writeBuffer] length:preBufferLength];
 		[sslPreBuffer didWrite:preBufferLength];
 	}
 	
@@ -6557,10 +11480,10 @@ static OSStatus SSLWriteFunction(SSLConnectionRef connection, const void *data,
 
 		if (delegateQueue && [theDelegate respondsToSelector:@selector(socketDidSecure:)])
 		{
-			dispatch_async(delegateQueue, ^{ @autoreleasepool {
+			[self notifyDelegateWithBlock:^{ @autoreleasepool {
 				
 				[theDelegate socketDidSecure:self];
-			}});
+			}}];
 		}
 		
 		[self endCurrentRead];
@@ -6611,10 +11534,10 @@ static OSStatus SSLWriteFunction(SSLConnectionRef connection, const void *data,
 		
 		if (delegateQueue && [theDelegate respondsToSelector:@selector(socket:didReceiveTrust:completionHandler:)])
 		{
-			dispatch_async(delegateQueue, ^{ @autoreleasepool {
+			[self notifyDelegateWithBlock:^{ @autoreleasepool {
 			
 				[theDelegate socket:self didReceiveTrust:trust completionHandler:comletionHandler];
-			}});
+			}}];
 		}
 		else
 		{
@@ -6695,10 +11618,10 @@ static OSStatus SSLWriteFunction(SSLConnectionRef connection, const void *data,
 
 		if (delegateQueue && [theDelegate respondsToSelector:@selector(socketDidSecure:)])
 		{
-			dispatch_async(delegateQueue, ^{ @autoreleasepool {
+			[self notifyDelegateWithBlock:^{ @autoreleasepool {
 				
 				[theDelegate socketDidSecure:self];
-			}});
+			}}];
 		}
 		
 		[self endCurrentRead];
@@ -7288,6 +12211,238 @@ static void CFWriteStreamCallback (CFWriteStreamRef stream, CFStreamEventType ty
 		dispatch_async(socketQueue, block);
 }
 
+/**
+ * See header file for big discussion of this method.
+**/
+- (BOOL)isZeroCopyReadsEnabled
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return ((config & kZeroCopyReads) != 0);
+	}
+	else
+	{
+		__block BOOL result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = ((config & kZeroCopyReads) != 0);
+		});
+		
+		return result;
+	}
+}
+
+/**
+ * See header file for big discussion of this method.
+**/
+- (void)setZeroCopyReadsEnabled:(BOOL)flag
+{
+	dispatch_block_t block = ^{
+		
+		if (flag)
+			config |= kZeroCopyReads;
+		else
+			config &= ~kZeroCopyReads;
+		
+		[self updatePreBufferSegmentCapacity];
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+
+- (NSUInteger)readAheadLimit
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return readAheadLimit;
+	}
+	else
+	{
+		__block NSUInteger result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = readAheadLimit;
+		});
+		
+		return result;
+	}
+}
+
+- (void)setReadAheadLimit:(NSUInteger)limit
+{
+	dispatch_block_t block = ^{
+		
+		readAheadLimit = limit;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (GCDAsyncSocketEventBackend)eventBackend
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return eventBackend;
+	}
+	else
+	{
+		__block GCDAsyncSocketEventBackend result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = eventBackend;
+		});
+		
+		return result;
+	}
+}
+
+- (void)setEventBackend:(GCDAsyncSocketEventBackend)backend
+{
+	dispatch_block_t block = ^{
+		
+		// Takes effect for the next connection
+		eventBackend = backend;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
++ (void)setEventLoopThreadCount:(NSUInteger)count
+{
+	GCDAsyncSocketEventLoopThreadCount = count;
+}
+
+- (GCDAsyncSocketQueuePoolAssignment)socketQueuePoolAssignment
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return socketQueuePoolAssignment;
+	}
+	else
+	{
+		__block GCDAsyncSocketQueuePoolAssignment result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = socketQueuePoolAssignment;
+		});
+		
+		return result;
+	}
+}
+
+- (void)setSocketQueuePoolAssignment:(GCDAsyncSocketQueuePoolAssignment)assignment
+{
+	dispatch_block_t block = ^{
+		socketQueuePoolAssignment = assignment;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (NSUInteger)socketQueuePoolSize
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return socketQueuePoolSize;
+	}
+	else
+	{
+		__block NSUInteger result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = socketQueuePoolSize;
+		});
+		
+		return result;
+	}
+}
+
+- (void)setSocketQueuePoolSize:(NSUInteger)size
+{
+	dispatch_block_t block = ^{
+		
+		if (size != socketQueuePoolSize)
+		{
+			socketQueuePoolSize = size;
+			
+			// Sockets accepted from here on get a new pool of the new size.
+			// The old pool lives on as long as the sockets using it.
+			if (socketQueuePoolIndex == NSNotFound)
+				socketQueuePool = nil;
+		}
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
+- (NSArray *)socketQueuePoolLoads
+{
+	__block NSArray *result = nil;
+	
+	dispatch_block_t block = ^{
+		
+		// Only the listening socket's own pool (not the one an accepted socket came from)
+		if (socketQueuePoolIndex == NSNotFound)
+			result = [socketQueuePool loads];
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result ?: @[];
+}
+
+- (GCDAsyncSocketTimingWheel *)timingWheel
+{
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	{
+		return timingWheel;
+	}
+	else
+	{
+		__block GCDAsyncSocketTimingWheel *result;
+		
+		dispatch_sync(socketQueue, ^{
+			result = timingWheel;
+		});
+		
+		return result;
+	}
+}
+
+- (void)setTimingWheel:(GCDAsyncSocketTimingWheel *)wheel
+{
+	if (wheel == nil) wheel = [GCDAsyncSocketTimingWheel sharedTimingWheel];
+	
+	dispatch_block_t block = ^{
+		
+		// The timers are moved over to the new wheel the next time they're armed
+		timingWheel = wheel;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
 
 /**
  * See header file for big discussion of this method.
@@ -197,6 +197,23 @@ typedef BOOL (^GCDAsyncUdpSocketSendFilterBlock)(NSData *data, NSData *address,
 - (uint32_t)maxReceiveIPv6BufferSize;
 - (void)setMaxReceiveIPv6BufferSize:(uint32_t)max;
 
+/**
+ * Normally every delegate method is invoked asynchronously on the delegateQueue,
+ * which costs a block copy and a trip through the queue per callback.
+ * 
+ * If the delegateQueue is the socketQueue (as passed to initWithDelegate:delegateQueue:socketQueue:),
+ * delegate methods are instead invoked directly on the socketQueue.
+ * Enabling directDelegateDispatch does the same regardless of the delegateQueue.
+ * 
+ * It's safe to send, receive and close from within such a delegate method:
+ * sends and receives are queued up (as always), and a close takes effect
+ * as soon as the socket is done with whatever it was in the middle of.
+ * 
+ * The default value is NO.
+**/
+- (BOOL)directDelegateDispatch;
+- (void)setDirectDelegateDispatch:(BOOL)flag;
+
 /**
  * User data allows you to associate arbitrary information with the socket.
  * This data is not used internally in any way.
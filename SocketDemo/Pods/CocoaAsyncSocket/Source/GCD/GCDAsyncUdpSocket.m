@@ -9,6 +9,7 @@
 //
 
 #import "GCDAsyncUdpSocket.h"
+#import "GCDAsyncSocket.h" // GCDAsyncSocketTimingWheel
 
 #if ! __has_feature(objc_arc)
 #warning This file must be compiled with ARC. Use -fobjc-arc flag (or convert project to ARC).
@@ -130,6 +131,7 @@ enum GCDAsyncUdpSocketFlags
 #if TARGET_OS_IPHONE
 	kAddedStreamListener     = 1 << 17,  // If set, CFStreams have been added to listener thread
 #endif
+	kDealloc                 = 1 << 18,  // If set, the socket is being deallocated
 };
 
 enum GCDAsyncUdpSocketConfig
@@ -138,6 +140,7 @@ enum GCDAsyncUdpSocketConfig
 	kIPv6Disabled  = 1 << 1,  // If set, IPv6 is disabled
 	kPreferIPv4    = 1 << 2,  // If set, IPv4 is preferred over IPv6
 	kPreferIPv6    = 1 << 3,  // If set, IPv6 is preferred over IPv4
+	kDirectDelegateDispatch = 1 << 4,  // If set, delegate methods are invoked directly on the socketQueue
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -176,7 +179,7 @@ enum GCDAsyncUdpSocketConfig
 	dispatch_source_t send6Source;
 	dispatch_source_t receive4Source;
 	dispatch_source_t receive6Source;
-	dispatch_source_t sendTimer;
+	GCDAsyncSocketTimeout *sendTimer;
 	
 	GCDAsyncUdpSendPacket *currentSend;
 	NSMutableArray *sendQueue;
@@ -201,6 +204,8 @@ enum GCDAsyncUdpSocketConfig
 
 	void *IsOnSocketQueueOrTargetQueueKey;    
 	
+	NSUInteger directDelegateDepth; // Number of delegate methods being invoked directly on the socketQueue right now
+	
 #if TARGET_OS_IPHONE
 	CFStreamClientContext streamContext;
 	CFReadStreamRef readStream4;
@@ -441,6 +446,10 @@ enum GCDAsyncUdpSocketConfig
 	[[NSNotificationCenter defaultCenter] removeObserver:self];
 #endif
 	
+	// Set dealloc flag.
+	// This is used by notifyDelegateWithBlock: to ensure we don't accidentally retain ourself.
+	flags |= kDealloc;
+	
 	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
 	{
 		[self closeWithError:nil];
@@ -898,10 +907,76 @@ enum GCDAsyncUdpSocketConfig
 		dispatch_async(socketQueue, block);
 }
 
+- (BOOL)directDelegateDispatch
+{
+	__block BOOL result = NO;
+	
+	dispatch_block_t block = ^{
+		
+		result = (config & kDirectDelegateDispatch) ? YES : NO;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_sync(socketQueue, block);
+	
+	return result;
+}
+
+- (void)setDirectDelegateDispatch:(BOOL)flag
+{
+	dispatch_block_t block = ^{
+		
+		LogVerbose(@"%@ %@", THIS_METHOD, (flag ? @"YES" : @"NO"));
+		
+		if (flag)
+			config |= kDirectDelegateDispatch;
+		else
+			config &= ~kDirectDelegateDispatch;
+	};
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+		block();
+	else
+		dispatch_async(socketQueue, block);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Delegate Helpers
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Invokes the given block, which calls a delegate method, on the delegateQueue.
+ * 
+ * If the delegateQueue is the socketQueue, or directDelegateDispatch is set,
+ * the block is invoked right here on the socketQueue instead.
+ * That saves copying the block, and a trip through the queue.
+**/
+- (void)notifyDelegateWithBlock:(dispatch_block_t)block
+{
+	BOOL direct = ((config & kDirectDelegateDispatch) || (delegateQueue == socketQueue)) &&
+	              dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey);
+	
+	if (!direct)
+	{
+		dispatch_async(delegateQueue, block);
+		return;
+	}
+	
+	if (!(flags & kDealloc))
+	{
+		// The delegate may let go of its last reference to us,
+		// but we're in the middle of something, so stick around until the socketQueue is done with it.
+		__autoreleasing GCDAsyncUdpSocket *keepAlive = self;
+		(void)keepAlive;
+	}
+	
+	directDelegateDepth++;
+	block();
+	directDelegateDepth--;
+}
+
 - (void)notifyDidConnectToAddress:(NSData *)anAddress
 {
 	LogTrace();
@@ -911,10 +986,10 @@ enum GCDAsyncUdpSocketConfig
 		id theDelegate = delegate;
 		NSData *address = [anAddress copy]; // In case param is NSMutableData
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
 			
 			[theDelegate udpSocket:self didConnectToAddress:address];
-		}});
+		}}];
 	}
 }
 
@@ -926,10 +1001,10 @@ enum GCDAsyncUdpSocketConfig
 	{
 		id theDelegate = delegate;
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
 			
 			[theDelegate udpSocket:self didNotConnect:error];
-		}});
+		}}];
 	}
 }
 
@@ -941,10 +1016,10 @@ enum GCDAsyncUdpSocketConfig
 	{
 		id theDelegate = delegate;
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
 			
 			[theDelegate udpSocket:self didSendDataWithTag:tag];
-		}});
+		}}];
 	}
 }
 
@@ -956,10 +1031,10 @@ enum GCDAsyncUdpSocketConfig
 	{
 		id theDelegate = delegate;
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
 			
 			[theDelegate udpSocket:self didNotSendDataWithTag:tag dueToError:error];
-		}});
+		}}];
 	}
 }
 
@@ -973,10 +1048,10 @@ enum GCDAsyncUdpSocketConfig
 	{
 		id theDelegate = delegate;
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
 			
 			[theDelegate udpSocket:self didReceiveData:data fromAddress:address withFilterContext:context];
-		}});
+		}}];
 	}
 }
 
@@ -988,10 +1063,10 @@ enum GCDAsyncUdpSocketConfig
 	{
 		id theDelegate = delegate;
 		
-		dispatch_async(delegateQueue, ^{ @autoreleasepool {
+		[self notifyDelegateWithBlock:^{ @autoreleasepool {
 			
 			[theDelegate udpSocketDidClose:self withError:error];
-		}});
+		}}];
 	}
 }
 
@@ -3964,7 +4039,7 @@ enum GCDAsyncUdpSocketConfig
 			[self resumeSend6Source];
 		}
 		
-		if ((sendTimer == NULL) && (currentSend->timeout >= 0.0))
+		if (![sendTimer isArmed] && (currentSend->timeout >= 0.0))
 		{
 			// Unable to send packet right away.
 			// Start timer to timeout the send operation.
@@ -3989,14 +4064,7 @@ enum GCDAsyncUdpSocketConfig
 **/
 - (void)endCurrentSend
 {
-	if (sendTimer)
-	{
-		dispatch_source_cancel(sendTimer);
-		#if !OS_OBJECT_USE_OBJC
-		dispatch_release(sendTimer);
-		#endif
-		sendTimer = NULL;
-	}
+	[sendTimer disarm];
 	
 	currentSend = nil;
 }
@@ -4019,22 +4087,28 @@ enum GCDAsyncUdpSocketConfig
 **/
 - (void)setupSendTimerWithTimeout:(NSTimeInterval)timeout
 {
-	NSAssert(sendTimer == NULL, @"Invalid logic");
+	NSAssert(![sendTimer isArmed], @"Invalid logic");
 	NSAssert(timeout >= 0.0, @"Invalid logic");
 	
 	LogTrace();
 	
-	sendTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, socketQueue);
-	
-	dispatch_source_set_event_handler(sendTimer, ^{ @autoreleasepool {
+	if (sendTimer == nil)
+	{
+		// The timeout lives on the shared timing wheel, rather than on a dispatch timer of its own.
+		// It's created once, and re-armed for each send that needs it.
 		
-		[self doSendTimeout];
-	}});
-	
-	dispatch_time_t tt = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC));
+		__weak GCDAsyncUdpSocket *weakSelf = self;
+		
+		sendTimer = [[GCDAsyncSocketTimingWheel sharedTimingWheel] timeoutWithQueue:socketQueue handler:^{ @autoreleasepool {
+			
+			__strong GCDAsyncUdpSocket *strongSelf = weakSelf;
+			if (strongSelf == nil) return_from_block;
+			
+			[strongSelf doSendTimeout];
+		}}];
+	}
 	
-	dispatch_source_set_timer(sendTimer, tt, DISPATCH_TIME_FOREVER, 0);
-	dispatch_resume(sendTimer);
+	[sendTimer armWithInterval:timeout];
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -4413,22 +4487,18 @@ enum GCDAsyncUdpSocketConfig
 							
 							if (allowed)
 							{
+								// The delegate is about to be notified,
+								// so our receive once operation has completed.
+								// (Cleared beforehand, as a delegate method invoked directly may ask to receive once more.)
+								flags &= ~kReceiveOnce;
+								
 								[self notifyDidReceiveData:data fromAddress:addr withFilterContext:filterContext];
 							}
 							else
 							{
 								LogVerbose(@"received packet silently dropped by receiveFilter");
-							}
-							
-							if (flags & kReceiveOnce)
-							{
-								if (allowed)
-								{
-									// The delegate has been notified,
-									// so our receive once operation has completed.
-									flags &= ~kReceiveOnce;
-								}
-								else if (pendingFilterOperations == 0)
+								
+								if ((flags & kReceiveOnce) && (pendingFilterOperations == 0))
 								{
 									// All pending filter operations have completed,
 									// and none were allowed through.
@@ -4448,6 +4518,8 @@ enum GCDAsyncUdpSocketConfig
 					
 					if (allowed)
 					{
+						flags &= ~kReceiveOnce; // See below
+						
 						[self notifyDidReceiveData:data fromAddress:addr withFilterContext:filterContext];
 						notifiedDelegate = YES;
 					}
@@ -4460,6 +4532,8 @@ enum GCDAsyncUdpSocketConfig
 			}
 			else // if (!receiveFilterBlock || !receiveFilterQueue)
 			{
+				flags &= ~kReceiveOnce; // See below
+				
 				[self notifyDidReceiveData:data fromAddress:addr withFilterContext:nil];
 				notifiedDelegate = YES;
 			}
@@ -4495,7 +4569,8 @@ enum GCDAsyncUdpSocketConfig
 			{
 				// The delegate has been notified (no set filter).
 				// So our receive once operation has completed.
-				flags &= ~kReceiveOnce;
+				// Its flag was cleared before notifying the delegate though,
+				// since a delegate method invoked directly may have asked to receive once more already.
 			}
 			else if (ignored)
 			{
@@ -4541,7 +4616,7 @@ enum GCDAsyncUdpSocketConfig
 	[self closeSockets];
 	
 	// Clear all flags (config remains as is)
-	flags = 0;
+	flags &= kDealloc; // Still needed by notifyDelegateWithBlock: below
 	
 	if (shouldCallDelegate)
 	{
@@ -4559,7 +4634,18 @@ enum GCDAsyncUdpSocketConfig
 	}};
 	
 	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
-		block();
+	{
+		if (directDelegateDepth > 0)
+		{
+			// Invoked from a delegate method that's being invoked directly (see directDelegateDispatch).
+			// The socket is in the middle of something, so close as soon as that's done.
+			dispatch_async(socketQueue, block);
+		}
+		else
+		{
+			block();
+		}
+	}
 	else
 		dispatch_sync(socketQueue, block);
 }
@@ -4578,7 +4664,10 @@ enum GCDAsyncUdpSocketConfig
 		}
 	}};
 	
-	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey))
+	// If invoked from a delegate method that's being invoked directly (see directDelegateDispatch),
+	// the socket is in the middle of something, so wait for that to finish.
+	
+	if (dispatch_get_specific(IsOnSocketQueueOrTargetQueueKey) && (directDelegateDepth == 0))
 		block();
 	else
 		dispatch_async(socketQueue, block);
@@ -0,0 +1 @@
+../../../CocoaAsyncSocket/Source/GCD/GCDAsyncSocket+Testing.h
\ No newline at end of file
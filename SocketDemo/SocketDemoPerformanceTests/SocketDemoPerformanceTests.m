@@ -0,0 +1,325 @@
+//
+//  SocketDemoPerformanceTests.m
+//  SocketDemoPerformanceTests
+//
+//  Created by 蔡万鸿 on 15/11/15.
+//  Copyright © 2015年 黄花菜. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+#import <sys/resource.h>
+#import <sys/sysctl.h>
+#import "GCDAsyncSocket.h"
+
+#define SocketDemoEchoMessageLength 64
+#define SocketDemoEchoMaxPendingConnects 256
+
+#define SocketDemoEchoClientTag 0
+#define SocketDemoEchoServerTag 1
+
+/**
+ * Holds the given number of loopback connections open at once,
+ * and runs rounds in which every client sends a small message and waits for the server to echo it back.
+ * The point is to measure how the event backend behaves with many registered sockets,
+ * so all connections stay open for the duration of the benchmark.
+**/
+@interface SocketDemoEchoBenchmark : NSObject <GCDAsyncSocketDelegate>
+{
+    GCDAsyncSocketEventBackend eventBackend;
+    NSUInteger connectionCount;
+
+    dispatch_queue_t delegateQueue;
+    dispatch_semaphore_t semaphore;
+
+    GCDAsyncSocket *listenSocket;
+    NSMutableArray *serverSockets;
+    NSMutableArray *clientSockets;
+
+    NSUInteger startedCount;
+    NSUInteger connectedCount;
+    NSUInteger echoedCount;
+    NSUInteger failedCount;
+
+    NSData *message;
+}
+
+/**
+ * Returns the number of loopback connections this process can hold open at once,
+ * after raising the open file limit as far as it goes.
+**/
++ (NSUInteger)maxConnectionCount;
+
+- (instancetype)initWithEventBackend:(GCDAsyncSocketEventBackend)backend connectionCount:(NSUInteger)count;
+
+/**
+ * Opens all the connections. Returns NO if they could not be set up.
+**/
+- (BOOL)openConnections;
+
+/**
+ * Runs a single echo round over all the connections. Returns NO if it did not complete.
+**/
+- (BOOL)runRound;
+
+- (void)closeConnections;
+
+@end
+
+@implementation SocketDemoEchoBenchmark
+
++ (NSUInteger)maxConnectionCount
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return 0;
+
+    rlim_t wanted = limit.rlim_max;
+    if (wanted == RLIM_INFINITY || wanted > OPEN_MAX)
+        wanted = OPEN_MAX;
+
+    if (limit.rlim_cur < wanted)
+    {
+        limit.rlim_cur = wanted;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    // Each connection needs two descriptors. Leave some for everything else in the process.
+    NSUInteger descriptorCount = (limit.rlim_cur > 256) ? (NSUInteger)((limit.rlim_cur - 256) / 2) : 0;
+
+    // And since all connections share a source and destination address, each needs an ephemeral port
+    int first = 0, last = 0;
+    size_t size = sizeof(int);
+    NSUInteger portCount = NSUIntegerMax;
+
+    if (sysctlbyname("net.inet.ip.portrange.first", &first, &size, NULL, 0) == 0 &&
+        sysctlbyname("net.inet.ip.portrange.last", &last, &size, NULL, 0) == 0 && last > first)
+    {
+        portCount = (NSUInteger)(last - first);
+    }
+
+    return MIN(descriptorCount, portCount);
+}
+
+- (instancetype)initWithEventBackend:(GCDAsyncSocketEventBackend)backend connectionCount:(NSUInteger)count
+{
+    if ((self = [super init]))
+    {
+        eventBackend = backend;
+        connectionCount = count;
+
+        delegateQueue = dispatch_queue_create("SocketDemoEchoBenchmark", DISPATCH_QUEUE_SERIAL);
+        semaphore = dispatch_semaphore_create(0);
+
+        serverSockets = [[NSMutableArray alloc] initWithCapacity:count];
+        clientSockets = [[NSMutableArray alloc] initWithCapacity:count];
+
+        NSMutableData *data = [NSMutableData dataWithLength:SocketDemoEchoMessageLength];
+        arc4random_buf([data mutableBytes], [data length]);
+        message = data;
+    }
+    return self;
+}
+
+/**
+ * Keeps at most SocketDemoEchoMaxPendingConnects connects in flight, so the listen backlog never overflows.
+ * Must be invoked on the delegate queue.
+**/
+- (void)startConnects
+{
+    while (startedCount < connectionCount && (startedCount - connectedCount) < SocketDemoEchoMaxPendingConnects)
+    {
+        GCDAsyncSocket *clientSocket = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:delegateQueue];
+        clientSocket.eventBackend = eventBackend;
+        [clientSockets addObject:clientSocket];
+        startedCount++;
+
+        NSError *error = nil;
+        if (![clientSocket connectToHost:@"127.0.0.1" onPort:[listenSocket localPort] withTimeout:30.0 error:&error])
+        {
+            failedCount++;
+            dispatch_semaphore_signal(semaphore);
+            return;
+        }
+    }
+}
+
+- (void)checkConnected
+{
+    if (connectedCount == connectionCount && [serverSockets count] == connectionCount)
+        dispatch_semaphore_signal(semaphore);
+}
+
+- (BOOL)waitWithTimeout:(NSTimeInterval)timeout
+{
+    long result = dispatch_semaphore_wait(semaphore, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC)));
+
+    __block BOOL failed = NO;
+    dispatch_sync(delegateQueue, ^{
+        failed = (failedCount > 0);
+    });
+
+    return (result == 0) && !failed;
+}
+
+- (BOOL)openConnections
+{
+    listenSocket = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:delegateQueue];
+    listenSocket.eventBackend = eventBackend;
+
+    NSError *error = nil;
+    if (![listenSocket acceptOnInterface:@"127.0.0.1" port:0 error:&error])
+    {
+        NSLog(@"%@: Unable to listen: %@", [self class], error);
+        return NO;
+    }
+
+    dispatch_async(delegateQueue, ^{
+        [self startConnects];
+    });
+
+    if (![self waitWithTimeout:(60.0 + connectionCount / 1000)])
+    {
+        NSLog(@"%@: Unable to open %lu connections", [self class], (unsigned long)connectionCount);
+        return NO;
+    }
+
+    return YES;
+}
+
+- (BOOL)runRound
+{
+    dispatch_sync(delegateQueue, ^{
+
+        echoedCount = 0;
+        for (GCDAsyncSocket *clientSocket in clientSockets)
+        {
+            [clientSocket readDataToLength:SocketDemoEchoMessageLength withTimeout:30.0 tag:SocketDemoEchoClientTag];
+            [clientSocket writeData:message withTimeout:30.0 tag:0];
+        }
+    });
+
+    return [self waitWithTimeout:60.0];
+}
+
+- (void)closeConnections
+{
+    dispatch_sync(delegateQueue, ^{
+
+        for (GCDAsyncSocket *sock in clientSockets)
+            [sock setDelegate:nil];
+        for (GCDAsyncSocket *sock in serverSockets)
+            [sock setDelegate:nil];
+        [listenSocket setDelegate:nil];
+    });
+
+    [clientSockets makeObjectsPerformSelector:@selector(disconnect)];
+    [serverSockets makeObjectsPerformSelector:@selector(disconnect)];
+    [listenSocket disconnect];
+
+    [clientSockets removeAllObjects];
+    [serverSockets removeAllObjects];
+    listenSocket = nil;
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didAcceptNewSocket:(GCDAsyncSocket *)newSocket
+{
+    [serverSockets addObject:newSocket];
+    [newSocket readDataToLength:SocketDemoEchoMessageLength withTimeout:-1 tag:SocketDemoEchoServerTag];
+
+    [self checkConnected];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didConnectToHost:(NSString *)host port:(uint16_t)port
+{
+    connectedCount++;
+
+    [self startConnects];
+    [self checkConnected];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didReadData:(NSData *)data withTag:(long)tag
+{
+    if (tag == SocketDemoEchoClientTag)
+    {
+        // Client side: the echo arrived
+        if (++echoedCount == connectionCount)
+            dispatch_semaphore_signal(semaphore);
+    }
+    else
+    {
+        // Server side: echo it back, and wait for the next message
+        [sock writeData:data withTimeout:-1 tag:0];
+        [sock readDataToLength:SocketDemoEchoMessageLength withTimeout:-1 tag:SocketDemoEchoServerTag];
+    }
+}
+
+- (void)socketDidDisconnect:(GCDAsyncSocket *)sock withError:(NSError *)err
+{
+    if (err)
+    {
+        failedCount++;
+        dispatch_semaphore_signal(semaphore);
+    }
+}
+
+@end
+
+#pragma mark -
+
+/**
+ * Measures echo rounds over many open connections, with each event backend.
+ * These take a long time, and need far more descriptors (and ports) than the defaults allow,
+ * which is why they're in a target of their own, rather than in SocketDemoTests.
+**/
+@interface SocketDemoPerformanceTests : XCTestCase
+
+@end
+
+@implementation SocketDemoPerformanceTests
+
+- (void)measureEchoRoundWithEventBackend:(GCDAsyncSocketEventBackend)backend connectionCount:(NSUInteger)count
+{
+    NSUInteger maxCount = [SocketDemoEchoBenchmark maxConnectionCount];
+
+    // e.g. 100k loopback connections need more ephemeral ports than the default range has
+    XCTSkipIf(count > maxCount, @"Can't hold %lu connections open (limit is %lu)",
+              (unsigned long)count, (unsigned long)maxCount);
+
+    SocketDemoEchoBenchmark *benchmark = [[SocketDemoEchoBenchmark alloc] initWithEventBackend:backend connectionCount:count];
+
+    if (![benchmark openConnections])
+    {
+        XCTFail(@"Unable to open %lu connections", (unsigned long)count);
+        [benchmark closeConnections];
+        return;
+    }
+
+    [self measureBlock:^{
+        XCTAssertTrue([benchmark runRound]);
+    }];
+
+    [benchmark closeConnections];
+}
+
+- (void)testEchoRoundWith10kConnectionsOnDispatchSources
+{
+    [self measureEchoRoundWithEventBackend:GCDAsyncSocketEventBackendDispatchSources connectionCount:10000];
+}
+
+- (void)testEchoRoundWith10kConnectionsOnEventLoop
+{
+    [self measureEchoRoundWithEventBackend:GCDAsyncSocketEventBackendEventLoop connectionCount:10000];
+}
+
+- (void)testEchoRoundWith100kConnectionsOnDispatchSources
+{
+    [self measureEchoRoundWithEventBackend:GCDAsyncSocketEventBackendDispatchSources connectionCount:100000];
+}
+
+- (void)testEchoRoundWith100kConnectionsOnEventLoop
+{
+    [self measureEchoRoundWithEventBackend:GCDAsyncSocketEventBackendEventLoop connectionCount:100000];
+}
+
+@end
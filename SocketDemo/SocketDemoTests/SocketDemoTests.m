@@ -7,6 +7,114 @@
 //
 
 #import <XCTest/XCTest.h>
+#import <sys/socket.h>
+#import <sys/ioctl.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+#import "GCDAsyncSocket.h"
+#import "GCDAsyncSocket+Testing.h"
+
+/**
+ * Splits the given data into frames ending with the given term,
+ * by comparing the term at every position one byte at a time.
+ * This is how GCDAsyncSocket searched for terms before the search was vectorized,
+ * and serves as the reference for the term read tests.
+**/
+static NSArray * SplitDataWithTerm(NSData *data, NSData *term)
+{
+    NSMutableArray *frames = [NSMutableArray array];
+
+    const uint8_t *bytes = [data bytes];
+    NSUInteger length = [data length];
+    NSUInteger termLength = [term length];
+
+    NSUInteger frameStart = 0;
+    NSUInteger i = 0;
+
+    while (i + termLength <= length)
+    {
+        if (memcmp(bytes + i, [term bytes], termLength) == 0)
+        {
+            NSRange range = NSMakeRange(frameStart, (i + termLength - frameStart));
+            [frames addObject:[data subdataWithRange:range]];
+
+            i += termLength;
+            frameStart = i;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    return frames;
+}
+
+/**
+ * Splits the given data into frames ending with any of the given terms.
+ * A frame ends at the first position where any of the terms ends,
+ * and if several terms end there, with the longest of them.
+ * The index of the term ending each frame is added to the given array.
+**/
+static NSArray * SplitDataWithTerms(NSData *data, NSArray *terms, NSMutableArray *termIndexes)
+{
+    NSMutableArray *frames = [NSMutableArray array];
+
+    const uint8_t *bytes = [data bytes];
+    NSUInteger length = [data length];
+
+    NSUInteger frameStart = 0;
+
+    for (NSUInteger end = 1; end <= length; end++)
+    {
+        NSInteger matchedIndex = -1;
+        NSUInteger matchedLength = 0;
+
+        for (NSUInteger t = 0; t < [terms count]; t++)
+        {
+            NSData *aTerm = [terms objectAtIndex:t];
+            NSUInteger termLength = [aTerm length];
+
+            if ((end - frameStart) >= termLength && termLength > matchedLength &&
+                memcmp(bytes + end - termLength, [aTerm bytes], termLength) == 0)
+            {
+                matchedIndex = t;
+                matchedLength = termLength;
+            }
+        }
+
+        if (matchedIndex >= 0)
+        {
+            [frames addObject:[data subdataWithRange:NSMakeRange(frameStart, (end - frameStart))]];
+            [termIndexes addObject:@(matchedIndex)];
+
+            frameStart = end;
+        }
+    }
+
+    return frames;
+}
+
+/**
+ * Splits the data into chunks of the given length (the last one may be shorter).
+**/
+static NSArray * SplitDataIntoChunks(NSData *data, NSUInteger chunkLength)
+{
+    NSMutableArray *chunks = [NSMutableArray array];
+
+    NSUInteger offset = 0;
+    while (offset < [data length])
+    {
+        NSUInteger length = MIN(chunkLength, [data length] - offset);
+
+        [chunks addObject:[data subdataWithRange:NSMakeRange(offset, length)]];
+        offset += length;
+    }
+
+    return chunks;
+}
+
+#pragma mark -
 
 @interface SocketDemoTests : XCTestCase
 
@@ -37,3 +145,1822 @@
 }
 
 @end
+
+#pragma mark -
+
+/**
+ * Base class for the tests that send a stream over a loopback connection and read it back.
+ *
+ * The client socket writes the stream once connected, and the accepted (server) socket reads it back,
+ * one frame at a time, until it has as many frames as expectedFrames.
+ * Subclasses override the hooks below to choose how the stream is written and read,
+ * and may implement further delegate methods.
+**/
+@interface SocketDemoConnectionTestCase : XCTestCase <GCDAsyncSocketDelegate>
+{
+    GCDAsyncSocket *listenSocket;
+    GCDAsyncSocket *serverSocket;
+    GCDAsyncSocket *clientSocket;
+
+    NSData *stream;
+    NSArray *expectedFrames;
+    NSMutableArray *receivedFrames;
+
+    XCTestExpectation *readsExpectation;
+}
+
+/**
+ * Opens the loopback connection, and waits for readsExpectation (and any other expectations of the test).
+**/
+- (void)connectAndWaitForExpectations;
+
+/**
+ * Invoked for the listening socket and the client socket before they listen or connect.
+ * Accepted sockets inherit most settings from the listening socket.
+ * The default implementation does nothing.
+**/
+- (void)configureSocket:(GCDAsyncSocket *)sock;
+
+/**
+ * Writes the stream once the client socket is connected.
+ * The default implementation writes it in small, irregular chunks,
+ * so frames (and their terms or headers) frequently straddle the boundary between socket reads.
+**/
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock;
+
+/**
+ * Issues the read for the next frame on the accepted socket.
+ * The default implementation reads the whole stream at once.
+**/
+- (void)readNextFrameFromSocket:(GCDAsyncSocket *)sock;
+
+@end
+
+@implementation SocketDemoConnectionTestCase
+
+- (void)tearDown
+{
+    [clientSocket disconnect];
+    [serverSocket disconnect];
+    [listenSocket disconnect];
+
+    clientSocket = nil;
+    serverSocket = nil;
+    listenSocket = nil;
+
+    [super tearDown];
+}
+
+- (void)connectAndWaitForExpectations
+{
+    receivedFrames = [NSMutableArray arrayWithCapacity:[expectedFrames count]];
+    readsExpectation = [self expectationWithDescription:@"reads"];
+
+    listenSocket = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:dispatch_get_main_queue()];
+    clientSocket = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:dispatch_get_main_queue()];
+
+    [self configureSocket:listenSocket];
+    [self configureSocket:clientSocket];
+
+    NSError *error = nil;
+    XCTAssertTrue([listenSocket acceptOnInterface:@"localhost" port:0 error:&error], @"%@", error);
+    XCTAssertTrue([clientSocket connectToHost:@"localhost" onPort:[listenSocket localPort] error:&error], @"%@", error);
+
+    [self waitForExpectationsWithTimeout:30.0 handler:nil];
+}
+
+- (void)configureSocket:(GCDAsyncSocket *)sock
+{
+    // Override me
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    NSUInteger offset = 0;
+    while (offset < [stream length])
+    {
+        NSUInteger chunkLength = MIN((1 + arc4random_uniform(4096)), ([stream length] - offset));
+
+        [sock writeData:[stream subdataWithRange:NSMakeRange(offset, chunkLength)] withTimeout:-1 tag:0];
+        offset += chunkLength;
+    }
+}
+
+- (void)readNextFrameFromSocket:(GCDAsyncSocket *)sock
+{
+    [sock readDataToLength:[stream length] withTimeout:-1 tag:0];
+}
+
+#pragma mark GCDAsyncSocketDelegate
+
+- (void)socket:(GCDAsyncSocket *)sock didAcceptNewSocket:(GCDAsyncSocket *)newSocket
+{
+    serverSocket = newSocket;
+    [self readNextFrameFromSocket:serverSocket];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didConnectToHost:(NSString *)host port:(uint16_t)port
+{
+    [self writeStreamToSocket:sock];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didReadData:(NSData *)data withTag:(long)tag
+{
+    [receivedFrames addObject:data];
+
+    if ([receivedFrames count] < [expectedFrames count])
+        [self readNextFrameFromSocket:sock];
+    else
+        [readsExpectation fulfill];
+}
+
+@end
+
+#pragma mark -
+
+@interface SocketDemoTermReadTests : SocketDemoConnectionTestCase
+{
+    NSData *term;
+
+    NSUInteger firstReadBufferLength;
+    NSArray *chunks;
+
+    BOOL trackAllocations;
+    NSUInteger midpointAllocationCount;
+    NSUInteger finalAllocationCount;
+}
+
+@end
+
+@implementation SocketDemoTermReadTests
+
+/**
+ * Generates a stream out of a small alphabet (which includes the bytes of the term),
+ * so the term, and partial matches of it, show up frequently and at every alignment.
+ * The stream always ends with the term.
+**/
+- (NSData *)randomStreamWithLength:(NSUInteger)length term:(NSData *)aTerm
+{
+    NSMutableData *data = [NSMutableData dataWithLength:length];
+    uint8_t *bytes = [data mutableBytes];
+
+    const uint8_t *termBytes = [aTerm bytes];
+    NSUInteger termLength = [aTerm length];
+
+    for (NSUInteger i = 0; i < length; i++)
+    {
+        if (arc4random_uniform(4) == 0)
+            bytes[i] = termBytes[arc4random_uniform((uint32_t)termLength)];
+        else
+            bytes[i] = 'a' + arc4random_uniform(3);
+
+        if ((arc4random_uniform(64) == 0) && (i + termLength <= length))
+        {
+            memcpy(bytes + i, termBytes, termLength);
+            i += termLength - 1;
+        }
+    }
+
+    [data appendData:aTerm];
+    return data;
+}
+
+- (void)verifyTermReadsWithTerm:(NSData *)aTerm streamLength:(NSUInteger)length
+{
+    term = aTerm;
+    stream = [self randomStreamWithLength:length term:aTerm];
+    expectedFrames = SplitDataWithTerm(stream, term);
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+}
+
+- (void)testTermReadsMatchReferenceSearchForCRLF
+{
+    [self verifyTermReadsWithTerm:[GCDAsyncSocket CRLFData] streamLength:(1024 * 256)];
+}
+
+- (void)testTermReadsMatchReferenceSearchForDoubleCRLF
+{
+    [self verifyTermReadsWithTerm:[@"\r\n\r\n" dataUsingEncoding:NSUTF8StringEncoding] streamLength:(1024 * 256)];
+}
+
+- (void)testTermReadsMatchReferenceSearchForSingleByte
+{
+    [self verifyTermReadsWithTerm:[GCDAsyncSocket LFData] streamLength:(1024 * 64)];
+}
+
+- (void)testTermReadsMatchReferenceSearchForLongBoundary
+{
+    NSString *boundary = [@"\r\n--" stringByPaddingToLength:74 withString:@"-boundary" startingAtIndex:0];
+
+    [self verifyTermReadsWithTerm:[boundary dataUsingEncoding:NSUTF8StringEncoding] streamLength:(1024 * 256)];
+}
+
+#pragma mark Split Terms
+
+/**
+ * Returns the given number of random lowercase letters, which never contain the terms used here.
+**/
+- (NSMutableData *)lettersWithLength:(NSUInteger)length
+{
+    NSMutableData *data = [NSMutableData dataWithLength:length];
+    uint8_t *bytes = [data mutableBytes];
+
+    for (NSUInteger i = 0; i < length; i++)
+        bytes[i] = 'a' + arc4random_uniform(26);
+
+    return data;
+}
+
+/**
+ * The first read gets a buffer with room for exactly bufferLength bytes.
+ * Everything is available by the time it's issued, so a single readv() fills the buffer,
+ * and puts the rest in the prebuffer. The term of the first frame ends the given number of bytes past the buffer.
+**/
+- (void)verifyTermSplitAcrossReadBuffer:(NSUInteger)bytesPastBuffer
+{
+    NSUInteger bufferLength = 1000;
+
+    term = [@"\r\n\r\n" dataUsingEncoding:NSUTF8StringEncoding];
+    firstReadBufferLength = bufferLength;
+
+    NSMutableData *data = [self lettersWithLength:(bufferLength + bytesPastBuffer - [term length])];
+    [data appendData:term];
+    [data appendData:[self lettersWithLength:100]];
+    [data appendData:term];
+
+    stream = data;
+    expectedFrames = SplitDataWithTerm(stream, term);
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+}
+
+- (void)testTermSplitAcrossReadBufferAndPreBufferByOneByte
+{
+    [self verifyTermSplitAcrossReadBuffer:1];
+}
+
+- (void)testTermSplitAcrossReadBufferAndPreBufferByTwoBytes
+{
+    [self verifyTermSplitAcrossReadBuffer:2];
+}
+
+- (void)testTermSplitAcrossReadBufferAndPreBufferByThreeBytes
+{
+    [self verifyTermSplitAcrossReadBuffer:3];
+}
+
+- (void)testTermSplitAcrossPreBufferSegments
+{
+    // A term longer than a prebuffer segment (4 KB) always spans a segment boundary, however the data lines up
+    NSMutableData *longTerm = [NSMutableData dataWithLength:(1024 * 10)];
+    arc4random_buf([longTerm mutableBytes], [longTerm length]);
+    term = longTerm;
+
+    NSMutableData *data = [self lettersWithLength:100];
+    [data appendData:term];
+    [data appendData:[self lettersWithLength:5000]];
+    [data appendData:term];
+
+    stream = data;
+    expectedFrames = SplitDataWithTerm(stream, term);
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+}
+
+- (void)testTermMatchResumesAfterPartialMatch
+{
+    // Each chunk arrives on its own, so the search stops part way through the term and resumes with the next chunk.
+    // After "aa", another "a" has to fall back to a partial match of "aa" (not start over), for "aab" to be found.
+    term = [@"aab" dataUsingEncoding:NSUTF8StringEncoding];
+
+    NSArray *strings = @[ @"xyzaa", @"a", @"b", @"aa", @"ba", @"ab", @"a", @"a", @"a", @"b" ];
+
+    NSMutableArray *array = [NSMutableArray arrayWithCapacity:[strings count]];
+    NSMutableData *data = [NSMutableData data];
+
+    for (NSString *string in strings)
+    {
+        NSData *chunk = [string dataUsingEncoding:NSUTF8StringEncoding];
+
+        [array addObject:chunk];
+        [data appendData:chunk];
+    }
+
+    chunks = array;
+    stream = data;
+    expectedFrames = SplitDataWithTerm(stream, term);
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+}
+
+- (void)writeChunkAtIndex:(NSUInteger)index toSocket:(GCDAsyncSocket *)sock
+{
+    [sock writeData:chunks[index] withTimeout:-1 tag:0];
+
+    if (index + 1 < [chunks count])
+    {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(NSEC_PER_MSEC * 50)), dispatch_get_main_queue(), ^{
+            [self writeChunkAtIndex:(index + 1) toSocket:sock];
+        });
+    }
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    if (chunks)
+    {
+        // Write each chunk once the previous one has had time to arrive (and be searched)
+        [sock performBlock:^{
+            int on = 1;
+            setsockopt([sock socketFD], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }];
+        [self writeChunkAtIndex:0 toSocket:sock];
+    }
+    else if (firstReadBufferLength > 0)
+    {
+        [sock writeData:stream withTimeout:-1 tag:0];
+    }
+    else
+    {
+        [super writeStreamToSocket:sock];
+    }
+}
+
+#pragma mark Packet Recycling
+
+- (void)testSteadyStateReadsReusePackets
+{
+    trackAllocations = YES;
+
+    [self verifyTermReadsWithTerm:[GCDAsyncSocket CRLFData] streamLength:(1024 * 256)];
+
+    // Once the first reads have filled the packet pool, reads reuse the packets (along with their buffers and term matchers)
+    XCTAssertGreaterThan(midpointAllocationCount, 0);
+    XCTAssertEqual(finalAllocationCount, midpointAllocationCount);
+}
+
+- (void)readNextFrameFromSocket:(GCDAsyncSocket *)sock
+{
+    if ((firstReadBufferLength > 0) && ([receivedFrames count] == 0))
+    {
+        // Wait for all the data to arrive, so it's read in one go
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(NSEC_PER_MSEC * 200)), dispatch_get_main_queue(), ^{
+
+            NSMutableData *buffer = [NSMutableData dataWithLength:firstReadBufferLength];
+            [sock readDataToData:term withTimeout:-1 buffer:buffer bufferOffset:0 tag:0];
+        });
+        return;
+    }
+
+    [sock readDataToData:term withTimeout:-1 tag:0];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didReadData:(NSData *)data withTag:(long)tag
+{
+    if (trackAllocations)
+    {
+        if (([receivedFrames count] + 1) == ([expectedFrames count] / 2))
+            midpointAllocationCount = [sock packetAllocationCount];
+        else if (([receivedFrames count] + 1) == [expectedFrames count])
+            finalAllocationCount = [sock packetAllocationCount];
+
+        // Keep a copy, so the packet can read into its buffer again
+        data = [NSData dataWithData:data];
+    }
+
+    [super socket:sock didReadData:data withTag:tag];
+}
+
+@end
+
+#pragma mark -
+
+@interface SocketDemoMultiTermReadTests : SocketDemoConnectionTestCase
+{
+    NSArray *terms;
+    NSMutableArray *expectedTermIndexes;
+    NSMutableArray *receivedTermIndexes;
+
+    NSUInteger midpointAllocationCount;
+    NSUInteger finalAllocationCount;
+}
+
+@end
+
+@implementation SocketDemoMultiTermReadTests
+
+- (void)testAnyOfTermReadsMatchReferenceSearch
+{
+    terms = @[ [GCDAsyncSocket LFData], [GCDAsyncSocket CRLFData], [GCDAsyncSocket ZeroData] ];
+
+    // Records ending in any of the terms, with the bytes of the terms (but not the terms) sprinkled in between
+    NSMutableData *data = [NSMutableData data];
+    const char alphabet[] = { 'a', 'b', '\r' };
+
+    for (NSUInteger i = 0; i < 2048; i++)
+    {
+        NSUInteger recordLength = arc4random_uniform(64);
+        for (NSUInteger j = 0; j < recordLength; j++)
+        {
+            uint8_t byte = alphabet[arc4random_uniform(sizeof(alphabet))];
+            [data appendBytes:&byte length:1];
+        }
+        [data appendData:[terms objectAtIndex:arc4random_uniform((uint32_t)[terms count])]];
+    }
+
+    stream = data;
+    expectedTermIndexes = [NSMutableArray array];
+    expectedFrames = SplitDataWithTerms(stream, terms, expectedTermIndexes);
+    receivedTermIndexes = [NSMutableArray arrayWithCapacity:[expectedFrames count]];
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+    XCTAssertEqualObjects(receivedTermIndexes, expectedTermIndexes);
+
+    // Reads to the same terms reuse the packets along with their term matchers
+    XCTAssertGreaterThan(midpointAllocationCount, 0);
+    XCTAssertEqual(finalAllocationCount, midpointAllocationCount);
+}
+
+- (void)readNextFrameFromSocket:(GCDAsyncSocket *)sock
+{
+    [sock readDataToAnyOfData:terms withTimeout:-1 tag:0];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didReadData:(NSData *)data toTerminatorAtIndex:(NSUInteger)index withTag:(long)tag
+{
+    [receivedTermIndexes addObject:@(index)];
+
+    if (([receivedFrames count] + 1) == ([expectedFrames count] / 2))
+        midpointAllocationCount = [sock packetAllocationCount];
+    else if (([receivedFrames count] + 1) == [expectedFrames count])
+        finalAllocationCount = [sock packetAllocationCount];
+
+    // Keep a copy, so the packet can read into its buffer again
+    [self socket:sock didReadData:[NSData dataWithData:data] withTag:tag];
+}
+
+@end
+
+#pragma mark -
+
+#define SocketDemoZeroCopyFrameLength   1000
+#define SocketDemoZeroCopyFrameCount    4096
+#define SocketDemoZeroCopyKeptInterval  600
+
+@interface SocketDemoZeroCopyReadTests : SocketDemoConnectionTestCase
+{
+    NSMutableDictionary *keptSlices;
+}
+
+@end
+
+@implementation SocketDemoZeroCopyReadTests
+
+- (void)testSliceStaysValidAfterPreBufferIsReused
+{
+    NSMutableData *data = [NSMutableData dataWithLength:(SocketDemoZeroCopyFrameLength * SocketDemoZeroCopyFrameCount)];
+    arc4random_buf([data mutableBytes], [data length]);
+
+    stream = data;
+    expectedFrames = SplitDataIntoChunks(stream, SocketDemoZeroCopyFrameLength);
+
+    keptSlices = [NSMutableDictionary dictionary];
+
+    [self connectAndWaitForExpectations];
+
+    // Slabs nobody holds a slice of go back to the pool, and later reads fill them again.
+    // The slices held on to pin their slabs, so they must still have their original contents.
+    XCTAssertGreaterThan([keptSlices count], 1);
+
+    [keptSlices enumerateKeysAndObjectsUsingBlock:^(NSNumber *index, NSData *slice, BOOL *stop) {
+        XCTAssertEqualObjects(slice, expectedFrames[[index unsignedIntegerValue]], @"frame %@", index);
+    }];
+}
+
+- (void)readNextFrameFromSocket:(GCDAsyncSocket *)sock
+{
+    [sock readDataToLength:SocketDemoZeroCopyFrameLength withTimeout:-1 tag:0];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didAcceptNewSocket:(GCDAsyncSocket *)newSocket
+{
+    [newSocket setZeroCopyReadsEnabled:YES];
+
+    [super socket:sock didAcceptNewSocket:newSocket];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didReadData:(NSData *)data withTag:(long)tag
+{
+    NSUInteger index = [receivedFrames count];
+
+    XCTAssertEqualObjects(data, expectedFrames[index], @"frame %lu", (unsigned long)index);
+
+    // Hold on to a few slices, spread out so that most slabs are released (and reused) in between.
+    // The others are replaced with copies, so their slabs can go.
+    if ((index % SocketDemoZeroCopyKeptInterval) == 0)
+        keptSlices[@(index)] = data;
+
+    [super socket:sock didReadData:[NSData dataWithBytes:[data bytes] length:[data length]] withTag:tag];
+}
+
+@end
+
+#pragma mark -
+
+#define SocketDemoReadAheadLimit        (1024 * 64)
+#define SocketDemoReadAheadStreamLength (1024 * 112)
+
+/**
+ * Here the accepted socket writes the stream, and the client socket (which has read-ahead enabled) reads it.
+**/
+@interface SocketDemoReadAheadTests : SocketDemoConnectionTestCase
+{
+    NSUInteger pollCount;
+}
+
+@end
+
+@implementation SocketDemoReadAheadTests
+
+- (void)testReadAheadStopsAtLimitWithoutQueuedRead
+{
+    // Small enough to fit in the socket buffers, so whatever read-ahead leaves behind waits in the kernel
+    NSMutableData *data = [NSMutableData dataWithLength:SocketDemoReadAheadStreamLength];
+    arc4random_buf([data mutableBytes], [data length]);
+
+    stream = data;
+    expectedFrames = @[ stream ];
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+}
+
+- (void)configureSocket:(GCDAsyncSocket *)sock
+{
+    if (sock == clientSocket)
+        [sock setReadAheadLimit:SocketDemoReadAheadLimit];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didAcceptNewSocket:(GCDAsyncSocket *)newSocket
+{
+    serverSocket = newSocket;
+    [self writeStreamToSocket:serverSocket];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didConnectToHost:(NSString *)host port:(uint16_t)port
+{
+    // No read is queued until read-ahead has stopped
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    [sock writeData:stream withTimeout:-1 tag:0];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didWriteDataWithTag:(long)tag
+{
+    if (sock == serverSocket)
+        [self pollClientSocket];
+}
+
+/**
+ * Waits for the client socket to stop reading ahead.
+ * It should then have read exactly up to the limit, and left the rest of the stream in the kernel.
+**/
+- (void)pollClientSocket
+{
+    __block int bytesInKernel = -1;
+
+    [clientSocket performBlock:^{
+        ioctl([clientSocket socketFD], FIONREAD, &bytesInKernel);
+    }];
+
+    if ((bytesInKernel != (SocketDemoReadAheadStreamLength - SocketDemoReadAheadLimit)) && (++pollCount < 100))
+    {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(NSEC_PER_MSEC * 20)), dispatch_get_main_queue(), ^{
+            [self pollClientSocket];
+        });
+        return;
+    }
+
+    XCTAssertEqual(bytesInKernel, SocketDemoReadAheadStreamLength - SocketDemoReadAheadLimit);
+
+    [self readNextFrameFromSocket:clientSocket];
+}
+
+@end
+
+#pragma mark -
+
+/**
+ * Reads back a stream of frames with random payloads, each prefixed with a big-endian length header.
+ * Subclasses run the same tests with other socket settings.
+**/
+@interface SocketDemoFramedReadTests : SocketDemoConnectionTestCase
+{
+    NSUInteger headerSize;
+    BOOL standingReads;
+    NSError *disconnectError;
+}
+
+@end
+
+@implementation SocketDemoFramedReadTests
+
+- (void)verifyFramedReadsWithHeaderSize:(NSUInteger)size frameCount:(NSUInteger)frameCount
+{
+    headerSize = size;
+
+    NSMutableData *data = [NSMutableData data];
+    NSMutableArray *frames = [NSMutableArray arrayWithCapacity:frameCount];
+
+    for (NSUInteger i = 0; i < frameCount; i++)
+    {
+        // Mostly small frames, with the occasional empty or large one
+        NSUInteger payloadLength = arc4random_uniform(512);
+        if (arc4random_uniform(16) == 0)
+            payloadLength = 0;
+        else if (arc4random_uniform(16) == 0)
+            payloadLength = 1024 * (1 + arc4random_uniform(128));
+
+        NSMutableData *payload = [NSMutableData dataWithLength:payloadLength];
+        arc4random_buf([payload mutableBytes], payloadLength);
+
+        uint8_t header[8];
+        for (NSUInteger j = 0; j < size; j++)
+            header[j] = (uint8_t)(payloadLength >> (8 * (size - 1 - j)));
+
+        [data appendBytes:header length:size];
+        [data appendData:payload];
+        [frames addObject:payload];
+    }
+
+    stream = data;
+    expectedFrames = frames;
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+}
+
+- (void)testFramedReadsWithTwoByteHeader
+{
+    [self verifyFramedReadsWithHeaderSize:2 frameCount:512];
+}
+
+- (void)testFramedReadsWithFourByteHeader
+{
+    [self verifyFramedReadsWithHeaderSize:4 frameCount:512];
+}
+
+- (void)testFramedReadsWithEightByteHeader
+{
+    [self verifyFramedReadsWithHeaderSize:8 frameCount:512];
+}
+
+- (void)testStandingFramedReads
+{
+    standingReads = YES;
+    [self verifyFramedReadsWithHeaderSize:4 frameCount:512];
+}
+
+- (void)testOversizedFrameDisconnectsWithoutAllocating
+{
+    // Without a maxLength, a header claiming an (almost) 16 EB frame must not be taken at its word
+    headerSize = 8;
+
+    uint8_t header[8];
+    memset(header, 0xFF, sizeof(header));
+
+    stream = [NSData dataWithBytes:header length:sizeof(header)];
+    expectedFrames = @[ [NSNull null] ]; // Never arrives
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqual([receivedFrames count], 0);
+    XCTAssertEqualObjects([disconnectError domain], GCDAsyncSocketErrorDomain);
+    XCTAssertEqual([disconnectError code], GCDAsyncSocketReadMaxedOutError);
+}
+
+- (void)readNextFrameFromSocket:(GCDAsyncSocket *)sock
+{
+    if (standingReads)
+        [sock startStandingReadWithLengthHeaderOfSize:headerSize bigEndian:YES maxLength:0 withTimeout:-1 tag:0];
+    else
+        [sock readDataWithLengthHeaderOfSize:headerSize bigEndian:YES maxLength:0 withTimeout:-1 tag:0];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didReadData:(NSData *)data withTag:(long)tag
+{
+    if (!standingReads)
+    {
+        [super socket:sock didReadData:data withTag:tag];
+        return;
+    }
+
+    // A standing read re-arms itself
+    [receivedFrames addObject:data];
+
+    if ([receivedFrames count] == [expectedFrames count])
+    {
+        [sock stopStandingRead];
+        [readsExpectation fulfill];
+    }
+}
+
+- (void)socketDidDisconnect:(GCDAsyncSocket *)sock withError:(NSError *)err
+{
+    if (sock == serverSocket && [receivedFrames count] < [expectedFrames count])
+    {
+        disconnectError = err;
+        [readsExpectation fulfill];
+    }
+}
+
+@end
+
+#pragma mark -
+
+@interface SocketDemoDirectDelegateDispatchTests : SocketDemoFramedReadTests
+@end
+
+@implementation SocketDemoDirectDelegateDispatchTests
+
+- (void)configureSocket:(GCDAsyncSocket *)sock
+{
+    sock.directDelegateDispatch = YES;
+}
+
+@end
+
+#pragma mark -
+
+@interface SocketDemoEventLoopTests : SocketDemoFramedReadTests
+@end
+
+@implementation SocketDemoEventLoopTests
+
+- (void)configureSocket:(GCDAsyncSocket *)sock
+{
+    // Accepted sockets inherit the backend of the listening socket
+    sock.eventBackend = GCDAsyncSocketEventBackendEventLoop;
+}
+
+@end
+
+#pragma mark -
+
+/**
+ * The event loop backend's event source is private to GCDAsyncSocket.
+ * It's declared here so the tests can drive it directly,
+ * e.g. to register descriptors that the kqueue rejects.
+**/
+@interface GCDAsyncSocketEventSource : NSObject
+
+- (id)initWithFD:(int)socketFD
+           queue:(dispatch_queue_t)socketQueue
+     readHandler:(unsigned long (^)(unsigned long bytesAvailable))aReadHandler
+    writeHandler:(dispatch_block_t)aWriteHandler
+    errorHandler:(void (^)(int err))anErrorHandler;
+
+- (BOOL)activate;
+- (void)suspendRead;
+- (void)resumeReadWithBytesAvailable:(unsigned long)bytesAvailable;
+- (void)cancel;
+
+@end
+
+#define SocketDemoEventLoopConnectionCount 64
+#define SocketDemoEventLoopMessageLength   8
+
+#define SocketDemoEventLoopClientTag 0
+#define SocketDemoEventLoopServerTag 1
+
+@interface SocketDemoEventLoopSourceTests : XCTestCase <GCDAsyncSocketDelegate>
+{
+    GCDAsyncSocket *listenSocket;
+    NSMutableArray *clientSockets;
+    NSMutableArray *serverSockets;
+
+    NSData *message;
+    NSUInteger echoedCount;
+    XCTestExpectation *echoExpectation;
+}
+
+@end
+
+@implementation SocketDemoEventLoopSourceTests
+
+- (void)tearDown
+{
+    [clientSockets makeObjectsPerformSelector:@selector(disconnect)];
+    [serverSockets makeObjectsPerformSelector:@selector(disconnect)];
+    [listenSocket disconnect];
+
+    clientSockets = nil;
+    serverSockets = nil;
+    listenSocket = nil;
+
+    [super tearDown];
+}
+
+- (void)testBurstOfConnectionsRegistersWithEventLoop
+{
+    // All the sockets register at once, so their registrations are submitted to the kqueues in batches
+
+    NSMutableData *data = [NSMutableData dataWithLength:SocketDemoEventLoopMessageLength];
+    arc4random_buf([data mutableBytes], [data length]);
+    message = data;
+
+    clientSockets = [NSMutableArray arrayWithCapacity:SocketDemoEventLoopConnectionCount];
+    serverSockets = [NSMutableArray arrayWithCapacity:SocketDemoEventLoopConnectionCount];
+    echoExpectation = [self expectationWithDescription:@"echoes"];
+
+    listenSocket = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:dispatch_get_main_queue()];
+    listenSocket.eventBackend = GCDAsyncSocketEventBackendEventLoop;
+
+    NSError *error = nil;
+    XCTAssertTrue([listenSocket acceptOnInterface:@"localhost" port:0 error:&error], @"%@", error);
+
+    for (NSUInteger i = 0; i < SocketDemoEventLoopConnectionCount; i++)
+    {
+        GCDAsyncSocket *sock = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:dispatch_get_main_queue()];
+        sock.eventBackend = GCDAsyncSocketEventBackendEventLoop;
+
+        XCTAssertTrue([sock connectToHost:@"localhost" onPort:[listenSocket localPort] error:&error], @"%@", error);
+        [clientSockets addObject:sock];
+    }
+
+    [self waitForExpectationsWithTimeout:30.0 handler:nil];
+
+    XCTAssertEqual(echoedCount, SocketDemoEventLoopConnectionCount);
+}
+
+- (void)testEventLoopReportsRegistrationErrors
+{
+    // No such descriptor, so adding it to the kqueue fails with EBADF
+    int badFD = INT_MAX;
+
+    dispatch_queue_t queue = dispatch_queue_create("SocketDemoTests.eventSource", DISPATCH_QUEUE_SERIAL);
+    XCTestExpectation *expectation = [self expectationWithDescription:@"registration error"];
+    __block int reportedError = 0;
+
+    GCDAsyncSocketEventSource *source =
+        [[GCDAsyncSocketEventSource alloc] initWithFD:badFD
+                                                queue:queue
+                                          readHandler:^unsigned long (unsigned long bytesAvailable) { return 0; }
+                                         writeHandler:^{ }
+                                         errorHandler:^(int err) {
+
+            reportedError = err;
+            [expectation fulfill];
+        }];
+
+    __block BOOL activated = NO;
+    __block int activateError = 0;
+
+    dispatch_sync(queue, ^{
+        activated = [source activate];
+        activateError = errno;
+    });
+
+    if (activated)
+    {
+        // The registration was batched, and the error comes back through the event loop
+        [self waitForExpectationsWithTimeout:5.0 handler:nil];
+        XCTAssertEqual(reportedError, EBADF);
+    }
+    else
+    {
+        // The kqueue doesn't support batching, so the registration was submitted right away
+        [expectation fulfill];
+        [self waitForExpectationsWithTimeout:5.0 handler:nil];
+        XCTAssertEqual(activateError, EBADF);
+    }
+
+    dispatch_sync(queue, ^{
+        [source cancel];
+    });
+}
+
+- (void)testSuspendedSourceFiresAgainOnResume
+{
+    int fds[2];
+    XCTAssertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    const char bytes[] = "event";
+    const unsigned long length = sizeof(bytes) - 1;
+
+    dispatch_queue_t queue = dispatch_queue_create("SocketDemoTests.eventSource", DISPATCH_QUEUE_SERIAL);
+
+    __block NSUInteger fireCount = 0;
+    __block unsigned long firstBytesAvailable = 0;
+    __block XCTestExpectation *fireExpectation = [self expectationWithDescription:@"first fire"];
+    __block GCDAsyncSocketEventSource *source = nil;
+
+    source = [[GCDAsyncSocketEventSource alloc] initWithFD:fds[0]
+                                                     queue:queue
+                                               readHandler:^unsigned long (unsigned long bytesAvailable) {
+
+        if (++fireCount == 1)
+        {
+            // Like a socket without a read queued: leave the data where it is, and stop listening for now
+            firstBytesAvailable = bytesAvailable;
+            [source suspendRead];
+            [fireExpectation fulfill];
+
+            return bytesAvailable;
+        }
+
+        char buffer[16];
+        ssize_t result = read(fds[0], buffer, sizeof(buffer));
+        [fireExpectation fulfill];
+
+        return (result > 0 && (unsigned long)result < bytesAvailable) ? (bytesAvailable - result) : 0;
+    }
+                                              writeHandler:^{ }
+                                              errorHandler:^(int err) { }];
+
+    dispatch_sync(queue, ^{
+        XCTAssertTrue([source activate]);
+        [source resumeReadWithBytesAvailable:0];
+    });
+
+    XCTAssertEqual(write(fds[1], bytes, length), (ssize_t)length);
+
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+    XCTAssertEqual(firstBytesAvailable, length);
+
+    // While suspended, the data that's still there doesn't fire the source again
+    [NSThread sleepForTimeInterval:0.1];
+    dispatch_sync(queue, ^{
+        XCTAssertEqual(fireCount, 1);
+    });
+
+    // There won't be another edge for data that was already there, but resuming fires the source anyway
+    fireExpectation = [self expectationWithDescription:@"second fire"];
+
+    dispatch_sync(queue, ^{
+        [source resumeReadWithBytesAvailable:firstBytesAvailable];
+    });
+
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+
+    // The data was read, so that's the end of it
+    [NSThread sleepForTimeInterval:0.1];
+    dispatch_sync(queue, ^{
+        XCTAssertEqual(fireCount, 2);
+        [source cancel];
+    });
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+#pragma mark GCDAsyncSocketDelegate
+
+- (void)socket:(GCDAsyncSocket *)sock didAcceptNewSocket:(GCDAsyncSocket *)newSocket
+{
+    [serverSockets addObject:newSocket];
+    [newSocket readDataToLength:SocketDemoEventLoopMessageLength withTimeout:-1 tag:SocketDemoEventLoopServerTag];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didConnectToHost:(NSString *)host port:(uint16_t)port
+{
+    [sock readDataToLength:SocketDemoEventLoopMessageLength withTimeout:-1 tag:SocketDemoEventLoopClientTag];
+    [sock writeData:message withTimeout:-1 tag:0];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didReadData:(NSData *)data withTag:(long)tag
+{
+    if (tag == SocketDemoEventLoopServerTag)
+    {
+        [sock writeData:data withTimeout:-1 tag:0];
+        return;
+    }
+
+    XCTAssertEqualObjects(data, message);
+
+    if (++echoedCount == SocketDemoEventLoopConnectionCount)
+        [echoExpectation fulfill];
+}
+
+@end
+
+#pragma mark -
+
+/**
+ * How sockets on the event loop backend find out that the connection is going away.
+**/
+@interface SocketDemoEventLoopShutdownTests : SocketDemoConnectionTestCase
+{
+    BOOL closeWithoutWriting;
+    NSError *disconnectError;
+    XCTestExpectation *disconnectExpectation;
+}
+
+@end
+
+@implementation SocketDemoEventLoopShutdownTests
+
+- (void)testDataAheadOfEOFIsRead
+{
+    NSMutableData *data = [NSMutableData dataWithLength:(1024 * 64)];
+    arc4random_buf([data mutableBytes], [data length]);
+
+    stream = data;
+    expectedFrames = @[ stream ];
+
+    // The data is all read before the socket acts on the EOF behind it
+    disconnectExpectation = [self expectationWithDescription:@"disconnect"];
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+    XCTAssertEqual([disconnectError code], GCDAsyncSocketClosedError);
+}
+
+- (void)testPeerCloseEndsPendingRead
+{
+    closeWithoutWriting = YES;
+
+    stream = [NSData dataWithBytes:"x" length:1];
+    expectedFrames = @[ stream ]; // Never arrives
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqual([receivedFrames count], 0);
+    XCTAssertEqual([disconnectError code], GCDAsyncSocketClosedError);
+}
+
+- (void)configureSocket:(GCDAsyncSocket *)sock
+{
+    sock.eventBackend = GCDAsyncSocketEventBackendEventLoop;
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    if (closeWithoutWriting)
+    {
+        [sock disconnect];
+        return;
+    }
+
+    [sock writeData:stream withTimeout:-1 tag:0];
+    [sock disconnectAfterWriting];
+}
+
+- (void)socketDidDisconnect:(GCDAsyncSocket *)sock withError:(NSError *)err
+{
+    if (sock != serverSocket) return;
+
+    disconnectError = err;
+
+    if ([receivedFrames count] < [expectedFrames count])
+        [readsExpectation fulfill];
+
+    [disconnectExpectation fulfill];
+}
+
+@end
+
+#pragma mark -
+
+@interface SocketDemoFileWriteTests : SocketDemoConnectionTestCase
+{
+    NSString *filePath;
+    NSRange fileRange;
+}
+
+@end
+
+@implementation SocketDemoFileWriteTests
+
+- (void)tearDown
+{
+    if (filePath)
+        [[NSFileManager defaultManager] removeItemAtPath:filePath error:NULL];
+
+    [super tearDown];
+}
+
+- (void)testWriteFileRange
+{
+    NSMutableData *contents = [NSMutableData dataWithLength:(1024 * 1024 + 123)];
+    arc4random_buf([contents mutableBytes], [contents length]);
+
+    filePath = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+    XCTAssertTrue([contents writeToFile:filePath atomically:NO]);
+
+    // An unaligned range, so the memory mapping used by secure sockets would need adjusting as well
+    fileRange = NSMakeRange(4097, [contents length] - 4097 - 1000);
+
+    stream = [contents subdataWithRange:fileRange];
+    expectedFrames = @[ stream ];
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+}
+
+- (void)testWriteFileReportsBadRanges
+{
+    NSData *contents = [NSMutableData dataWithLength:100];
+
+    filePath = [NSTemporaryDirectory() stringByAppendingPathComponent:[[NSUUID UUID] UUIDString]];
+    XCTAssertTrue([contents writeToFile:filePath atomically:NO]);
+
+    GCDAsyncSocket *sock = [[GCDAsyncSocket alloc] initWithDelegate:nil delegateQueue:NULL];
+    NSError *error = nil;
+
+    XCTAssertFalse([sock writeFileAtPath:filePath offset:101 length:0 withTimeout:-1 tag:0 error:&error]);
+    XCTAssertEqual([error code], GCDAsyncSocketBadParamError);
+
+    error = nil;
+    XCTAssertFalse([sock writeFileAtPath:filePath offset:50 length:51 withTimeout:-1 tag:0 error:&error]);
+    XCTAssertEqual([error code], GCDAsyncSocketBadParamError);
+
+    error = nil;
+    XCTAssertFalse([sock writeFileAtPath:filePath offset:100 length:0 withTimeout:-1 tag:0 error:&error]);
+    XCTAssertEqual([error code], GCDAsyncSocketBadParamError);
+
+    error = nil;
+    XCTAssertFalse([sock writeFileAtPath:NSTemporaryDirectory() offset:0 length:0 withTimeout:-1 tag:0 error:&error]);
+    XCTAssertEqual([error code], GCDAsyncSocketBadParamError);
+
+    error = nil;
+    NSString *missingPath = [filePath stringByAppendingString:@".missing"];
+    XCTAssertFalse([sock writeFileAtPath:missingPath offset:0 length:0 withTimeout:-1 tag:0 error:&error]);
+    XCTAssertEqualObjects([error domain], NSPOSIXErrorDomain);
+    XCTAssertEqual([error code], ENOENT);
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    NSError *error = nil;
+    BOOL queued = [sock writeFileAtPath:filePath
+                                 offset:fileRange.location
+                                 length:fileRange.length
+                            withTimeout:-1
+                                    tag:0
+                                  error:&error];
+    XCTAssertTrue(queued, @"%@", error);
+}
+
+@end
+
+#pragma mark -
+
+@interface SocketDemoSegmentedWriteTests : SocketDemoConnectionTestCase
+{
+    NSArray *segments;
+}
+
+@end
+
+@implementation SocketDemoSegmentedWriteTests
+
+- (void)testWriteDataSegmentsAsSinglePacket
+{
+    // A large body, so the write can't be handed to the socket in one go and resumes part way through a segment
+    NSMutableData *header = [NSMutableData dataWithLength:16];
+    NSMutableData *body = [NSMutableData dataWithLength:(1024 * 1024 * 4 + 7)];
+    NSMutableData *trailer = [NSMutableData dataWithLength:5];
+    arc4random_buf([header mutableBytes], [header length]);
+    arc4random_buf([body mutableBytes], [body length]);
+    arc4random_buf([trailer mutableBytes], [trailer length]);
+
+    segments = @[ header, [NSData data], body, trailer ];
+
+    NSMutableData *data = [NSMutableData data];
+    for (NSData *segment in segments)
+        [data appendData:segment];
+
+    stream = data;
+    expectedFrames = @[ stream ];
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    [sock writeDataSegments:segments withTimeout:-1 tag:0];
+}
+
+@end
+
+#pragma mark -
+
+#define SocketDemoCoalescedWriteCount     8192
+#define SocketDemoCoalescedReadLength     (1024 * 64)
+#define SocketDemoCoalescedReadInterval   (NSEC_PER_MSEC * 10)
+
+@interface SocketDemoCoalescedWriteTests : SocketDemoConnectionTestCase
+{
+    NSArray *writes;
+    NSMutableArray *writtenTags;
+    XCTestExpectation *writesExpectation;
+}
+
+@end
+
+@implementation SocketDemoCoalescedWriteTests
+
+- (void)testSmallWritesToSlowReaderArriveInOrder
+{
+    // Many small writes of irregular length, adding up to far more than the socket buffer holds.
+    // So writev() keeps stopping part way through a packet, and the rest of the batch has to be picked up again.
+    NSMutableArray *array = [NSMutableArray arrayWithCapacity:SocketDemoCoalescedWriteCount];
+    NSMutableData *data = [NSMutableData data];
+
+    for (NSUInteger i = 0; i < SocketDemoCoalescedWriteCount; i++)
+    {
+        NSMutableData *write = [NSMutableData dataWithLength:(1 + arc4random_uniform(1024))];
+        arc4random_buf([write mutableBytes], [write length]);
+
+        [array addObject:write];
+        [data appendData:write];
+    }
+
+    writes = array;
+    stream = data;
+    expectedFrames = SplitDataIntoChunks(stream, SocketDemoCoalescedReadLength);
+
+    writtenTags = [NSMutableArray arrayWithCapacity:SocketDemoCoalescedWriteCount];
+    writesExpectation = [self expectationWithDescription:@"writes"];
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+
+    XCTAssertEqual([writtenTags count], (NSUInteger)SocketDemoCoalescedWriteCount);
+    for (NSUInteger i = 0; i < [writtenTags count]; i++)
+    {
+        XCTAssertEqual([writtenTags[i] longValue], (long)i);
+    }
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    [writes enumerateObjectsUsingBlock:^(NSData *write, NSUInteger idx, BOOL *stop) {
+        [sock writeData:write withTimeout:-1 tag:(long)idx];
+    }];
+}
+
+- (void)readNextFrameFromSocket:(GCDAsyncSocket *)sock
+{
+    // Read slowly, so the writer keeps running into a full socket buffer
+    NSUInteger length = [expectedFrames[[receivedFrames count]] length];
+
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, SocketDemoCoalescedReadInterval), dispatch_get_main_queue(), ^{
+        [sock readDataToLength:length withTimeout:-1 tag:0];
+    });
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didWriteDataWithTag:(long)tag
+{
+    [writtenTags addObject:@(tag)];
+
+    if ([writtenTags count] == SocketDemoCoalescedWriteCount)
+        [writesExpectation fulfill];
+}
+
+@end
+
+#pragma mark -
+
+@interface SocketDemoWriteBatchTests : SocketDemoConnectionTestCase
+{
+    NSData *firstWrite;
+    NSData *secondWrite;
+    BOOL leaveBatchOpen;
+    XCTestExpectation *disconnectExpectation;
+}
+
+@end
+
+@implementation SocketDemoWriteBatchTests
+
+- (void)setUpWrites
+{
+    NSMutableData *first = [NSMutableData dataWithLength:100];
+    NSMutableData *second = [NSMutableData dataWithLength:(1024 * 256)];
+    arc4random_buf([first mutableBytes], [first length]);
+    arc4random_buf([second mutableBytes], [second length]);
+
+    firstWrite = first;
+    secondWrite = second;
+
+    NSMutableData *data = [NSMutableData dataWithData:first];
+    [data appendData:second];
+
+    stream = data;
+    expectedFrames = @[ stream ];
+}
+
+- (void)testNestedBatchHoldsWritesUntilOutermostEnds
+{
+    [self setUpWrites];
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+}
+
+- (void)testDisconnectAfterWritingSendsWritesOfOpenBatch
+{
+    [self setUpWrites];
+
+    leaveBatchOpen = YES;
+    disconnectExpectation = [self expectationWithDescription:@"disconnect"];
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+}
+
+- (void)configureSocket:(GCDAsyncSocket *)sock
+{
+    [sock setNoDelay:YES];
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    [sock beginWriteBatch];
+    [sock beginWriteBatch];
+    [sock writeData:firstWrite withTimeout:-1 tag:0];
+    [sock endWriteBatch];
+
+    // Still inside the outer batch, so nothing has been handed to the socket
+    XCTAssertEqual([sock queuedWriteBytes], [firstWrite length]);
+
+    [sock writeData:secondWrite withTimeout:-1 tag:1];
+    XCTAssertEqual([sock queuedWriteBytes], [stream length]);
+
+    if (leaveBatchOpen)
+    {
+        // Must not wait for an endWriteBatch that never comes
+        [sock disconnectAfterWriting];
+    }
+    else
+    {
+        [sock endWriteBatch];
+    }
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didAcceptNewSocket:(GCDAsyncSocket *)newSocket
+{
+    // The accepted socket inherits noDelay, and it's applied to its descriptor
+    XCTAssertTrue([newSocket noDelay]);
+
+    __block int noDelay = 0;
+    [newSocket performBlock:^{
+        socklen_t length = sizeof(noDelay);
+        getsockopt([newSocket socketFD], IPPROTO_TCP, TCP_NODELAY, &noDelay, &length);
+    }];
+    XCTAssertNotEqual(noDelay, 0);
+
+    [super socket:sock didAcceptNewSocket:newSocket];
+}
+
+- (void)socketDidDisconnect:(GCDAsyncSocket *)sock withError:(NSError *)err
+{
+    if (sock != clientSocket) return;
+
+    XCTAssertNil(err);
+    [disconnectExpectation fulfill];
+}
+
+@end
+
+#pragma mark -
+
+#define SocketDemoWatermarkHigh  (1024 * 64)
+#define SocketDemoWatermarkLow   (1024 * 16)
+
+@interface SocketDemoWriteWatermarkTests : SocketDemoConnectionTestCase
+{
+    NSUInteger exceededCount;
+    NSUInteger drainedCount;
+    XCTestExpectation *watermarksExpectation;
+}
+
+@end
+
+@implementation SocketDemoWriteWatermarkTests
+
+- (void)testLowWatermarkNeverExceedsHighWatermark
+{
+    GCDAsyncSocket *sock = [[GCDAsyncSocket alloc] initWithDelegate:nil delegateQueue:NULL];
+
+    sock.writeQueueHighWatermark = 100;
+    sock.writeQueueLowWatermark = 200;
+    XCTAssertEqual(sock.writeQueueLowWatermark, 100);
+
+    sock.writeQueueLowWatermark = 50;
+    sock.writeQueueHighWatermark = 20;
+    XCTAssertEqual(sock.writeQueueLowWatermark, 20);
+
+    // With the watermarks disabled, there's nothing to check against
+    sock.writeQueueHighWatermark = 0;
+    sock.writeQueueLowWatermark = 500;
+    XCTAssertEqual(sock.writeQueueLowWatermark, 500);
+}
+
+- (void)testDisablingWatermarksEndsHighWatermarkState
+{
+    // Far more than the socket buffers hold, and nothing is read until the end,
+    // so the queue stays above the high watermark until the watermarks are disabled.
+    NSMutableData *data = [NSMutableData dataWithLength:(1024 * 1024 * 8)];
+    arc4random_buf([data mutableBytes], [data length]);
+
+    stream = data;
+    expectedFrames = @[ stream ];
+
+    watermarksExpectation = [self expectationWithDescription:@"watermarks"];
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+
+    // Exceeded, drained by disabling, exceeded again once re-enabled, then drained by reading
+    XCTAssertEqual(exceededCount, 2);
+    XCTAssertEqual(drainedCount, 2);
+}
+
+- (void)configureSocket:(GCDAsyncSocket *)sock
+{
+    sock.writeQueueHighWatermark = SocketDemoWatermarkHigh;
+    sock.writeQueueLowWatermark = SocketDemoWatermarkLow;
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    [sock writeData:stream withTimeout:-1 tag:0];
+}
+
+- (void)readNextFrameFromSocket:(GCDAsyncSocket *)sock
+{
+    // Nothing is read until the second time the high watermark is exceeded
+    if (exceededCount == 2)
+        [super readNextFrameFromSocket:sock];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock writeQueueDidExceedHighWatermark:(NSUInteger)queuedWriteBytes
+{
+    XCTAssertGreaterThan(queuedWriteBytes, SocketDemoWatermarkHigh);
+
+    if (++exceededCount == 1)
+    {
+        // Disabling the watermarks must end the high watermark state
+        sock.writeQueueHighWatermark = 0;
+    }
+    else
+    {
+        [self readNextFrameFromSocket:serverSocket];
+    }
+}
+
+- (void)socketWriteQueueDidDrainBelowLowWatermark:(GCDAsyncSocket *)sock
+{
+    if (++drainedCount == 1)
+    {
+        // And re-enabling them starts over, so the queue (still far above) exceeds the high watermark again
+        sock.writeQueueHighWatermark = SocketDemoWatermarkHigh;
+    }
+    else
+    {
+        [watermarksExpectation fulfill];
+    }
+}
+
+@end
+
+#pragma mark -
+
+#define SocketDemoPriorityFrameLength 4096
+
+@interface SocketDemoPriorityWriteTests : SocketDemoConnectionTestCase
+{
+    NSData *urgentFrame;
+}
+
+@end
+
+@implementation SocketDemoPriorityWriteTests
+
+- (void)testHighPriorityWriteInterleavesAtSplitPoint
+{
+    // Bulk data large enough that it can't all be handed to the socket before the urgent write is queued
+    NSMutableData *bulk = [NSMutableData dataWithLength:(SocketDemoPriorityFrameLength * 2048)];
+    memset([bulk mutableBytes], 'b', [bulk length]);
+
+    NSMutableData *urgent = [NSMutableData dataWithLength:SocketDemoPriorityFrameLength];
+    memset([urgent mutableBytes], 'u', [urgent length]);
+
+    stream = bulk;
+    urgentFrame = urgent;
+    expectedFrames = @[ [NSNull null] ]; // Just the one (combined) read
+
+    [self connectAndWaitForExpectations];
+
+    NSData *received = [receivedFrames firstObject];
+    XCTAssertEqual([received length], [bulk length] + [urgent length]);
+
+    // The urgent frame arrives whole, at a split point, ahead of the end of the bulk data
+    NSRange range = [received rangeOfData:urgent options:0 range:NSMakeRange(0, [received length])];
+    XCTAssertNotEqual(range.location, (NSUInteger)NSNotFound);
+    XCTAssertEqual(range.location % SocketDemoPriorityFrameLength, 0);
+    XCTAssertLessThan(range.location, [bulk length]);
+}
+
+- (void)configureSocket:(GCDAsyncSocket *)sock
+{
+    [sock setWriteSplitLength:SocketDemoPriorityFrameLength];
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    [sock writeData:stream withTimeout:-1 tag:0];
+    [sock writeData:urgentFrame withTimeout:-1 tag:1 priority:GCDAsyncSocketWritePriorityHigh];
+}
+
+- (void)readNextFrameFromSocket:(GCDAsyncSocket *)sock
+{
+    [sock readDataToLength:([stream length] + [urgentFrame length]) withTimeout:-1 tag:0];
+}
+
+@end
+
+#pragma mark -
+
+@interface SocketDemoBroadcastWriteTests : SocketDemoConnectionTestCase
+{
+    XCTestExpectation *broadcastExpectation;
+    NSUInteger broadcastWrittenCount;
+    NSUInteger broadcastFailedCount;
+}
+
+@end
+
+@implementation SocketDemoBroadcastWriteTests
+
+- (void)testBroadcastWriteReportsAggregateCompletion
+{
+    NSMutableData *data = [NSMutableData dataWithLength:(1024 * 64)];
+    arc4random_buf([data mutableBytes], [data length]);
+
+    stream = data;
+    expectedFrames = @[ stream ];
+
+    broadcastExpectation = [self expectationWithDescription:@"broadcast completion"];
+
+    [self connectAndWaitForExpectations];
+
+    // The connected socket wrote the data, the one that was never connected couldn't
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+    XCTAssertEqual(broadcastWrittenCount, 1);
+    XCTAssertEqual(broadcastFailedCount, 1);
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    GCDAsyncSocket *unconnectedSocket = [[GCDAsyncSocket alloc] initWithDelegate:nil delegateQueue:NULL];
+
+    [GCDAsyncSocket writeData:stream
+                    toSockets:@[ sock, unconnectedSocket ]
+                  withTimeout:-1
+                          tag:0
+              completionQueue:dispatch_get_main_queue()
+            completionHandler:^(NSUInteger writtenCount, NSUInteger failedCount) {
+
+        broadcastWrittenCount = writtenCount;
+        broadcastFailedCount = failedCount;
+        [broadcastExpectation fulfill];
+    }];
+}
+
+@end
+
+#pragma mark -
+
+#define SocketDemoBatchSmallFrameCount  64
+#define SocketDemoBatchSmallFrameLength 8
+#define SocketDemoBatchLargeFrameLength 4096
+
+@interface SocketDemoCompletionBatchTests : SocketDemoConnectionTestCase
+{
+    NSMutableArray *receivedTags;
+    NSUInteger partialCount;
+    BOOL partialOvertookBatch;
+}
+
+@end
+
+@implementation SocketDemoCompletionBatchTests
+
+- (void)testBatchedReadsAreDeliveredBeforeLaterPartialReads
+{
+    NSMutableData *data = [NSMutableData dataWithLength:(SocketDemoBatchSmallFrameCount * SocketDemoBatchSmallFrameLength +
+                                                         SocketDemoBatchLargeFrameLength)];
+    arc4random_buf([data mutableBytes], [data length]);
+
+    NSMutableArray *frames = [NSMutableArray arrayWithCapacity:(SocketDemoBatchSmallFrameCount + 1)];
+    NSMutableArray *tags = [NSMutableArray arrayWithCapacity:(SocketDemoBatchSmallFrameCount + 1)];
+
+    for (NSUInteger i = 0; i < SocketDemoBatchSmallFrameCount; i++)
+    {
+        [frames addObject:[data subdataWithRange:NSMakeRange(i * SocketDemoBatchSmallFrameLength, SocketDemoBatchSmallFrameLength)]];
+        [tags addObject:@(i)];
+    }
+    [frames addObject:[data subdataWithRange:NSMakeRange([data length] - SocketDemoBatchLargeFrameLength, SocketDemoBatchLargeFrameLength)]];
+    [tags addObject:@(SocketDemoBatchSmallFrameCount)];
+
+    stream = data;
+    expectedFrames = frames;
+    receivedTags = [NSMutableArray arrayWithCapacity:[tags count]];
+
+    [self connectAndWaitForExpectations];
+
+    XCTAssertEqualObjects(receivedFrames, expectedFrames);
+    XCTAssertEqualObjects(receivedTags, tags);
+
+    XCTAssertGreaterThan(partialCount, 0);
+    XCTAssertFalse(partialOvertookBatch);
+}
+
+- (void)writeStreamToSocket:(GCDAsyncSocket *)sock
+{
+    // All the small frames and the first half of the large one, then the rest a little later,
+    // so the large read reports progress right after the small reads have completed.
+
+    NSUInteger splitOffset = [stream length] - (SocketDemoBatchLargeFrameLength / 2);
+    NSData *rest = [stream subdataWithRange:NSMakeRange(splitOffset, [stream length] - splitOffset)];
+
+    [sock writeData:[stream subdataWithRange:NSMakeRange(0, splitOffset)] withTimeout:-1 tag:0];
+
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(0.1 * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        [sock writeData:rest withTimeout:-1 tag:0];
+    });
+}
+
+- (void)readNextFrameFromSocket:(GCDAsyncSocket *)sock
+{
+    // Queue up all the reads at once, tagged with their index
+    for (NSUInteger i = 0; i < [expectedFrames count]; i++)
+        [sock readDataToLength:[[expectedFrames objectAtIndex:i] length] withTimeout:-1 tag:i];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didReadDataBatch:(NSArray *)dataArray withTags:(NSArray *)tags
+{
+    [receivedFrames addObjectsFromArray:dataArray];
+    [receivedTags addObjectsFromArray:tags];
+
+    if ([receivedFrames count] == [expectedFrames count])
+        [readsExpectation fulfill];
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didReadPartialDataOfLength:(NSUInteger)partialLength tag:(long)tag
+{
+    partialCount++;
+
+    // All the reads ahead of this one have completed, so the delegate must have been told about them
+    if ([receivedTags count] != (NSUInteger)tag)
+        partialOvertookBatch = YES;
+}
+
+@end
+
+#pragma mark -
+
+@interface SocketDemoSocketQueuePoolTests : XCTestCase <GCDAsyncSocketDelegate>
+{
+    GCDAsyncSocket *listenSocket;
+
+    NSMutableArray *acceptedSockets;
+    NSUInteger expectedAcceptCount;
+    XCTestExpectation *acceptExpectation;
+}
+
+@end
+
+@implementation SocketDemoSocketQueuePoolTests
+
+- (void)tearDown
+{
+    [listenSocket disconnect];
+    listenSocket = nil;
+
+    [super tearDown];
+}
+
+- (void)testSocketQueuePoolSpreadsAcceptedSockets
+{
+    expectedAcceptCount = 6;
+    acceptedSockets = [NSMutableArray array];
+    acceptExpectation = [self expectationWithDescription:@"accepts"];
+
+    listenSocket = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:dispatch_get_main_queue()];
+    listenSocket.socketQueuePoolAssignment = GCDAsyncSocketQueuePoolAssignmentRoundRobin;
+    listenSocket.socketQueuePoolSize = 3;
+
+    NSError *error = nil;
+    XCTAssertTrue([listenSocket acceptOnInterface:@"localhost" port:0 error:&error], @"%@", error);
+
+    NSMutableArray *clientSockets = [NSMutableArray array];
+    for (NSUInteger i = 0; i < expectedAcceptCount; i++)
+    {
+        GCDAsyncSocket *sock = [[GCDAsyncSocket alloc] initWithDelegate:self delegateQueue:dispatch_get_main_queue()];
+        XCTAssertTrue([sock connectToHost:@"localhost" onPort:[listenSocket localPort] error:&error], @"%@", error);
+        [clientSockets addObject:sock];
+    }
+
+    [self waitForExpectationsWithTimeout:10.0 handler:nil];
+
+    XCTAssertEqualObjects([listenSocket socketQueuePoolLoads], (@[ @2, @2, @2 ]));
+
+    // Accepted sockets stop counting towards the load as soon as they're closed,
+    // even though the pending socketDidDisconnect:withError: callback still holds on to them
+    [[acceptedSockets lastObject] disconnect];
+    [acceptedSockets removeLastObject];
+
+    NSArray *loads = [listenSocket socketQueuePoolLoads];
+    XCTAssertEqual([[loads valueForKeyPath:@"@sum.self"] unsignedIntegerValue], 5u);
+
+    [clientSockets makeObjectsPerformSelector:@selector(disconnect)];
+    [acceptedSockets makeObjectsPerformSelector:@selector(disconnect)];
+    acceptedSockets = nil;
+}
+
+- (void)socket:(GCDAsyncSocket *)sock didAcceptNewSocket:(GCDAsyncSocket *)newSocket
+{
+    [acceptedSockets addObject:newSocket];
+    if ([acceptedSockets count] == expectedAcceptCount)
+        [acceptExpectation fulfill];
+}
+
+@end
+
+#pragma mark -
+
+@interface SocketDemoTimingWheelTests : XCTestCase
+@end
+
+@implementation SocketDemoTimingWheelTests
+
+- (void)testTimingWheelFiresArmedTimeoutsInOrder
+{
+    GCDAsyncSocketTimingWheel *wheel = [[GCDAsyncSocketTimingWheel alloc] initWithGranularity:0.01];
+    dispatch_queue_t queue = dispatch_queue_create("SocketDemoTests.timingWheel", DISPATCH_QUEUE_SERIAL);
+
+    NSMutableArray *fired = [NSMutableArray array];
+    XCTestExpectation *expectation = [self expectationWithDescription:@"timeouts"];
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    __block CFAbsoluteTime lastFireTime = 0;
+
+    GCDAsyncSocketTimeout *later = [wheel timeoutWithQueue:queue handler:^{
+        [fired addObject:@"later"];
+        lastFireTime = CFAbsoluteTimeGetCurrent();
+        [expectation fulfill];
+    }];
+    GCDAsyncSocketTimeout *sooner = [wheel timeoutWithQueue:queue handler:^{
+        [fired addObject:@"sooner"];
+    }];
+    GCDAsyncSocketTimeout *disarmed = [wheel timeoutWithQueue:queue handler:^{
+        [fired addObject:@"disarmed"];
+    }];
+
+    dispatch_sync(queue, ^{
+        [later armWithInterval:0.5];
+        [sooner armWithInterval:0.05];
+        [disarmed armWithInterval:0.1];
+        [disarmed disarm];
+    });
+
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+
+    dispatch_sync(queue, ^{
+        XCTAssertEqualObjects(fired, (@[ @"sooner", @"later" ]));
+        XCTAssertFalse([later isArmed]);
+    });
+
+    // Never early
+    XCTAssertGreaterThanOrEqual(lastFireTime - start, 0.5);
+}
+
+@end